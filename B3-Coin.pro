@@ -206,6 +206,9 @@ HEADERS += src/qt/bitcoingui.h \
     src/chainparams.h \
     src/chainparamsseeds.h \
     src/checkpoints.h \
+    src/blockfile.h \
+    src/checkqueue.h \
+    src/coins.h \
     src/compat.h \
     src/coincontrol.h \
     src/sync.h \
@@ -224,6 +227,12 @@ HEADERS += src/qt/bitcoingui.h \
     src/db.h \
     src/txdb.h \
     src/txmempool.h \
+    src/txorphanpool.h \
+    src/blockencodings.h \
+    src/headerchain.h \
+    src/blockcache.h \
+    src/bloom.h \
+    src/netstats.h \
     src/walletdb.h \
     src/script.h \
     src/init.h \
@@ -301,6 +310,12 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/version.cpp \
     src/sync.cpp \
     src/txmempool.cpp \
+    src/txorphanpool.cpp \
+    src/blockencodings.cpp \
+    src/headerchain.cpp \
+    src/blockcache.cpp \
+    src/bloom.cpp \
+    src/netstats.cpp \
     src/util.cpp \
     src/hash.cpp \
     src/netbase.cpp \
@@ -312,6 +327,8 @@ SOURCES += src/qt/bitcoin.cpp src/qt/bitcoingui.cpp \
     src/init.cpp \
     src/net.cpp \
     src/checkpoints.cpp \
+    src/blockfile.cpp \
+    src/coins.cpp \
     src/db.cpp \
     src/walletdb.cpp \
     src/qt/clientmodel.cpp \
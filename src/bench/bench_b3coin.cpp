@@ -0,0 +1,313 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Block template benchmark: builds a chain and a memory pool in a
+// temporary data directory and times CreateNewBlock, CheckBlock and
+// ConnectBlock(fJustCheck=true) on the result.
+//
+// Options:
+//   -txcount=<n>     transactions in the memory pool (default: 2000)
+//   -fanin=<n>       inputs per transaction (default: 2)
+//   -depth=<n>       length of the chains of dependent transactions (default: 4)
+//   -iterations=<n>  times each phase is run (default: 10)
+//   -par=<n>         script verification threads, 0 = none (default: 0)
+//
+
+#include "chainparams.h"
+#include "db.h"
+#include "main.h"
+#include "miner.h"
+#include "txdb.h"
+#include "txmempool.h"
+#include "util.h"
+#include "wallet.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/thread.hpp>
+
+using namespace std;
+
+// Every allocation the process makes is counted, including those of
+// LevelDB's background thread
+static uint64_t nAllocCount = 0;
+
+void* operator new(size_t nSize)
+{
+    __sync_fetch_and_add(&nAllocCount, 1);
+    void* p = malloc(nSize ? nSize : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t nSize)
+{
+    return operator new(nSize);
+}
+
+void operator delete(void* p) throw()
+{
+    free(p);
+}
+
+void operator delete[](void* p) throw()
+{
+    free(p);
+}
+
+class CPhaseTimer
+{
+public:
+    string strName;
+    vector<int64_t> vTimes;
+    vector<uint64_t> vAllocs;
+    int64_t nStart;
+    uint64_t nAllocStart;
+
+    CPhaseTimer(const string& strNameIn) : strName(strNameIn), nStart(0), nAllocStart(0) {}
+
+    void Start()
+    {
+        nAllocStart = nAllocCount;
+        nStart = GetTimeMicros();
+    }
+
+    void Stop()
+    {
+        vTimes.push_back(GetTimeMicros() - nStart);
+        vAllocs.push_back(nAllocCount - nAllocStart);
+    }
+
+    void Print() const
+    {
+        if (vTimes.empty())
+            return;
+        int64_t nMin = vTimes[0], nTotal = 0;
+        uint64_t nAllocTotal = 0;
+        for (unsigned int i = 0; i < vTimes.size(); i++)
+        {
+            nMin = min(nMin, vTimes[i]);
+            nTotal += vTimes[i];
+            nAllocTotal += vAllocs[i];
+        }
+        printf("%-24s %6u %12.3f %12.3f %12llu\n", strName.c_str(), (unsigned int)vTimes.size(),
+               nMin / 1000.0, nTotal / 1000.0 / vTimes.size(),
+               (unsigned long long)(nAllocTotal / vAllocs.size()));
+    }
+};
+
+// Write transactions paying to scriptPubKey into a block file and index
+// them as if they had been confirmed. The node can't mine a real chain
+// here in reasonable time, and nothing checks these transactions
+// themselves: only that their outputs exist on disk and are unspent.
+static bool WriteFundingBlock(const CScript& scriptPubKey, unsigned int nOutputs, vector<CTransaction>& vFundingRet)
+{
+    static const unsigned int FUNDING_OUTPUTS_PER_TX = 100;
+
+    CBlock block;
+    block.hashPrevBlock = pindexBest->GetBlockHash();
+    block.nTime = pindexBest->GetPastTimeLimit() + 1;
+    block.nBits = pindexBest->nBits;
+    block.vtx.resize(1);
+    block.vtx[0].nTime = block.nTime;
+    block.vtx[0].vin.resize(1);
+    block.vtx[0].vin[0].prevout.SetNull();
+    block.vtx[0].vin[0].scriptSig = CScript() << 0 << OP_0;
+    block.vtx[0].vout.resize(1);
+    block.vtx[0].vout[0].SetEmpty();
+
+    while (nOutputs > 0)
+    {
+        CTransaction tx;
+        tx.nTime = block.nTime;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        tx.vout.resize(min(nOutputs, FUNDING_OUTPUTS_PER_TX));
+        for (unsigned int i = 0; i < tx.vout.size(); i++)
+        {
+            tx.vout[i].scriptPubKey = scriptPubKey;
+            tx.vout[i].nValue = 10 * COIN;
+        }
+        nOutputs -= tx.vout.size();
+        block.vtx.push_back(tx);
+        vFundingRet.push_back(tx);
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    unsigned int nFile, nBlockPos;
+    if (!block.WriteToDisk(nFile, nBlockPos))
+        return false;
+
+    // Same layout ConnectBlock assumes
+    CTxDB txdb;
+    unsigned int nTxPos = nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(block.vtx.size());
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        if (!txdb.UpdateTxIndex(tx.GetHash(), CTxIndex(CDiskTxPos(nFile, nBlockPos, nTxPos), tx.vout.size())))
+            return false;
+        nTxPos += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+    }
+    return true;
+}
+
+// Fill the memory pool with nTxCount transactions of nFanIn inputs each, in
+// chains of nDepth where every transaction spends its parent's output
+static bool FillMempool(const CKeyStore& keystore, const CScript& scriptPubKey, const vector<CTransaction>& vFunding,
+                        int nTxCount, int nFanIn, int nDepth)
+{
+    unsigned int nFundingTx = 0, nFundingOut = 0;
+    CTransaction txParent;
+
+    LOCK(cs_main);
+    for (int n = 0; n < nTxCount; n++)
+    {
+        // Each input remembers the transaction it spends, for signing
+        vector<const CTransaction*> vFrom;
+        CTransaction tx;
+        if (n % nDepth != 0)
+        {
+            tx.vin.push_back(CTxIn(COutPoint(txParent.GetHash(), 0)));
+            vFrom.push_back(&txParent);
+        }
+        while ((int)tx.vin.size() < nFanIn)
+        {
+            const CTransaction& txFunding = vFunding[nFundingTx];
+            tx.vin.push_back(CTxIn(COutPoint(txFunding.GetHash(), nFundingOut)));
+            vFrom.push_back(&txFunding);
+            if (++nFundingOut == txFunding.vout.size())
+            {
+                nFundingTx++;
+                nFundingOut = 0;
+            }
+        }
+
+        int64_t nValueIn = 0;
+        for (unsigned int i = 0; i < tx.vin.size(); i++)
+            nValueIn += vFrom[i]->vout[tx.vin[i].prevout.n].nValue;
+        unsigned int nSizeEstimate = 200 * tx.vin.size() + 100;
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey = scriptPubKey;
+        tx.vout[0].nValue = nValueIn - 2 * (1 + nSizeEstimate / 1000) * MIN_TX_FEE;
+
+        for (unsigned int i = 0; i < tx.vin.size(); i++)
+            if (!SignSignature(keystore, *vFrom[i], tx, i))
+                return error("FillMempool() : SignSignature failed");
+
+        if (!AcceptToMemoryPool(mempool, tx, false, NULL))
+            return error("FillMempool() : transaction %d not accepted", n);
+        txParent = tx;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    ParseParameters(argc, argv);
+    int nTxCount = GetArg("-txcount", 2000);
+    int nFanIn = max((int)GetArg("-fanin", 2), 1);
+    int nDepth = max((int)GetArg("-depth", 4), 1);
+    int nIterations = max((int)GetArg("-iterations", 10), 1);
+    nScriptCheckThreads = min((int)GetArg("-par", 0), MAX_SCRIPTCHECK_THREADS);
+
+    boost::filesystem::path pathTemp = boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("bench_b3coin_%%%%%%%%");
+    boost::filesystem::create_directories(pathTemp);
+    mapArgs["-datadir"] = pathTemp.string();
+    fPrintToDebugLog = false;
+    SelectParams(CChainParams::REGTEST);
+
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nScriptCheckThreads - 1; i++)
+        threadGroup.create_thread(&ThreadScriptCheck);
+
+    int nRet = 1;
+    try
+    {
+        if (!bitdb.Open(GetDataDir()))
+            throw runtime_error("unable to open wallet environment");
+        if (!LoadBlockIndex())
+            throw runtime_error("LoadBlockIndex failed");
+
+        CWallet wallet("wallet.dat");
+        bool fFirstRun;
+        if (wallet.LoadWallet(fFirstRun) != DB_LOAD_OK)
+            throw runtime_error("LoadWallet failed");
+        CScript scriptPubKey;
+        scriptPubKey.SetDestination(wallet.GenerateNewKey().GetID());
+
+        printf("Building chain and memory pool: %d transactions, %d inputs each, chains of %d\n", nTxCount, nFanIn, nDepth);
+        int64_t nStart = GetTimeMillis();
+        vector<CTransaction> vFunding;
+        {
+            LOCK(cs_main);
+            if (!WriteFundingBlock(scriptPubKey, nTxCount * nFanIn, vFunding))
+                throw runtime_error("WriteFundingBlock failed");
+        }
+        if (!FillMempool(wallet, scriptPubKey, vFunding, nTxCount, nFanIn, nDepth))
+            throw runtime_error("FillMempool failed");
+        printf("Memory pool: %lu transactions, %llu bytes  %lldms\n\n", mempool.size(),
+               (unsigned long long)mempool.GetTotalTxSize(), (long long)(GetTimeMillis() - nStart));
+
+        // The first template is assembled from scratch, later ones come
+        // out of the template cache
+        CPhaseTimer timerAssembleCold("CreateNewBlock (cold)");
+        CPhaseTimer timerAssemble("CreateNewBlock");
+        CPhaseTimer timerCheck("CheckBlock");
+        CPhaseTimer timerConnect("ConnectBlock(fJustCheck)");
+        unsigned int nBlockTx = 0;
+        for (int i = 0; i < nIterations; i++)
+        {
+            CReserveKey reservekey(&wallet);
+            CPhaseTimer& timer = (i == 0 ? timerAssembleCold : timerAssemble);
+            timer.Start();
+            auto_ptr<CBlock> pblock(CreateNewBlock(reservekey));
+            timer.Stop();
+            if (!pblock.get())
+                throw runtime_error("CreateNewBlock failed");
+            pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+            nBlockTx = pblock->vtx.size();
+
+            timerCheck.Start();
+            bool fValid = pblock->CheckBlock(false, true, false, false);
+            timerCheck.Stop();
+            if (!fValid)
+                throw runtime_error("CheckBlock failed");
+
+            LOCK(cs_main);
+            uint256 hash = pblock->GetHash();
+            CBlockIndex indexDummy(0, 0, *pblock);
+            indexDummy.phashBlock = &hash;
+            indexDummy.pprev = pindexBest;
+            indexDummy.nHeight = pindexBest->nHeight + 1;
+            CTxDB txdb("r");
+
+            timerConnect.Start();
+            fValid = pblock->ConnectBlock(txdb, &indexDummy, true);
+            timerConnect.Stop();
+            if (!fValid)
+                throw runtime_error("ConnectBlock failed");
+        }
+
+        printf("Block template: %u transactions\n", nBlockTx);
+        printf("%-24s %6s %12s %12s %12s\n", "phase", "runs", "min ms", "avg ms", "allocs/run");
+        timerAssembleCold.Print();
+        timerAssemble.Print();
+        timerCheck.Print();
+        timerConnect.Print();
+        nRet = 0;
+    }
+    catch (std::exception& e) {
+        fprintf(stderr, "bench_b3coin: %s\n", e.what());
+    }
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+    bitdb.Flush(true);
+    boost::filesystem::remove_all(pathTemp);
+    return nRet;
+}
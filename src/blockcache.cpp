@@ -0,0 +1,39 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockcache.h"
+
+using namespace std;
+
+bool CBlockCache::Get(const uint256& hash, CSendBufferPtr& pdataRet)
+{
+    LOCK(cs);
+    CacheMap::iterator it = mapBlocks.find(hash);
+    if (it == mapBlocks.end())
+        return false;
+
+    lruBlocks.splice(lruBlocks.begin(), lruBlocks, it->second.second);
+    pdataRet = it->second.first;
+    return true;
+}
+
+void CBlockCache::Put(const uint256& hash, const CSendBufferPtr& pdata)
+{
+    LOCK(cs);
+    if (pdata->size() > nMaxSize || mapBlocks.count(hash))
+        return;
+
+    while (nTotalSize + pdata->size() > nMaxSize)
+    {
+        CacheMap::iterator it = mapBlocks.find(lruBlocks.back());
+        nTotalSize -= it->second.first->size();
+        mapBlocks.erase(it);
+        lruBlocks.pop_back();
+    }
+
+    lruBlocks.push_front(hash);
+    mapBlocks[hash] = make_pair(pdata, lruBlocks.begin());
+    nTotalSize += pdata->size();
+}
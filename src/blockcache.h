@@ -0,0 +1,59 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKCACHE_H
+#define BITCOIN_BLOCKCACHE_H
+
+#include "net.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <list>
+#include <map>
+
+/*
+ * CBlockCache keeps the messages of blocks recently sent to peers, ready to
+ * be queued again, so peers downloading the same stretch of the chain don't
+ * each cost a read from disk. It holds up to a total serialized size; the
+ * least recently used block goes first when it is over.
+ *
+ * Entries are shared with whoever is sending them, so an evicted block
+ * stays valid until they are done with it.
+ */
+class CBlockCache
+{
+private:
+    typedef std::list<uint256> LruList;
+    typedef std::map<uint256, std::pair<CSendBufferPtr, LruList::iterator> > CacheMap;
+
+    mutable CCriticalSection cs;
+    LruList lruBlocks; // most recently used first
+    CacheMap mapBlocks;
+    size_t nTotalSize;
+    size_t nMaxSize;
+
+public:
+    CBlockCache(size_t nMaxSizeIn) : nTotalSize(0), nMaxSize(nMaxSizeIn) {}
+
+    // Get block hash if it is cached, making it the most recently used
+    bool Get(const uint256& hash, CSendBufferPtr& pdataRet);
+
+    // Add block hash, evicting the least recently used blocks to make room.
+    // Blocks bigger than the whole cache aren't kept.
+    void Put(const uint256& hash, const CSendBufferPtr& pdata);
+
+    unsigned long size() const
+    {
+        LOCK(cs);
+        return mapBlocks.size();
+    }
+
+    size_t GetTotalSize() const
+    {
+        LOCK(cs);
+        return nTotalSize;
+    }
+};
+
+#endif /* BITCOIN_BLOCKCACHE_H */
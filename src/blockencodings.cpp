@@ -0,0 +1,144 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+#include "hash.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <boost/unordered_map.hpp>
+
+using namespace std;
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block) :
+    nNonce(GetRand(std::numeric_limits<uint64_t>::max())), header(block)
+{
+    header.vtx.clear();
+    FillShortTxIDSelector();
+
+    // The receiver can't have the coinbase, or the coinstake, in its pool
+    unsigned int nPrefilled = block.IsProofOfStake() ? 2 : 1;
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+    {
+        if (i < nPrefilled)
+        {
+            CPrefilledTransaction prefilled;
+            prefilled.nIndex = i;
+            prefilled.tx = block.vtx[i];
+            prefilledtxn.push_back(prefilled);
+        }
+        else
+            shorttxids.push_back(GetShortID(block.vtx[i].GetHash()));
+    }
+}
+
+// The short id key depends on the block and a nonce picked by the sender,
+// so nobody can make transactions collide with each other ahead of time
+void CBlockHeaderAndShortTxIDs::FillShortTxIDSelector() const
+{
+    uint256 hashBlock = header.GetHash();
+    uint256 hashSelector = Hash(BEGIN(hashBlock), END(hashBlock), BEGIN(nNonce), END(nNonce));
+    shorttxidk0 = hashSelector.Get64(0);
+    shorttxidk1 = hashSelector.Get64(1);
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const
+{
+    return SipHashUint256(shorttxidk0, shorttxidk1, txhash) & 0xffffffffffffULL;
+}
+
+ReadStatus CPartialBlock::Init(const CBlockHeaderAndShortTxIDs& cmpctblock, const CTxMemPool& pool)
+{
+    static const unsigned int nMinTxSize = ::GetSerializeSize(CTransaction(), SER_NETWORK, PROTOCOL_VERSION);
+    if (cmpctblock.header.IsNull() || cmpctblock.BlockTxCount() == 0 ||
+        cmpctblock.BlockTxCount() > MAX_BLOCK_SIZE / nMinTxSize)
+        return READ_STATUS_INVALID;
+
+    header = cmpctblock.header;
+    vtx.assign(cmpctblock.BlockTxCount(), CTransaction());
+    vHave.assign(cmpctblock.BlockTxCount(), false);
+
+    // Prefilled transactions come in order; the short ids fill the gaps
+    // between them
+    unsigned int nLastIndex = 0;
+    for (unsigned int i = 0; i < cmpctblock.prefilledtxn.size(); i++)
+    {
+        const CPrefilledTransaction& prefilled = cmpctblock.prefilledtxn[i];
+        if (prefilled.nIndex >= vtx.size() || (i > 0 && prefilled.nIndex <= nLastIndex) || prefilled.tx.IsNull())
+            return READ_STATUS_INVALID;
+        vtx[prefilled.nIndex] = prefilled.tx;
+        vHave[prefilled.nIndex] = true;
+        nLastIndex = prefilled.nIndex;
+    }
+
+    boost::unordered_map<uint64_t, unsigned int> mapShortIDs;
+    unsigned int nShortID = 0;
+    for (unsigned int i = 0; i < vtx.size(); i++)
+    {
+        if (vHave[i])
+            continue;
+        // Two transactions of the block with the same short id: the pool
+        // can't tell them apart
+        if (!mapShortIDs.insert(make_pair(cmpctblock.shorttxids[nShortID++], i)).second)
+            return READ_STATUS_FAILED;
+    }
+
+    // Transactions from the pool whose short id is taken twice are left
+    // for the peer to send
+    vector<bool> vCollision(vtx.size(), false);
+    {
+        LOCK(pool.cs);
+        for (map<uint256, CTxMemPoolEntry>::const_iterator mi = pool.mapTx.begin(); mi != pool.mapTx.end(); ++mi)
+        {
+            boost::unordered_map<uint64_t, unsigned int>::const_iterator it = mapShortIDs.find(cmpctblock.GetShortID(mi->first));
+            if (it == mapShortIDs.end())
+                continue;
+            unsigned int nIndex = it->second;
+            if (vHave[nIndex])
+            {
+                vHave[nIndex] = false;
+                vCollision[nIndex] = true;
+            }
+            else if (!vCollision[nIndex])
+            {
+                vtx[nIndex] = mi->second.GetTx();
+                vHave[nIndex] = true;
+            }
+        }
+    }
+
+    return READ_STATUS_OK;
+}
+
+void CPartialBlock::GetMissing(vector<unsigned int>& vIndexesRet) const
+{
+    for (unsigned int i = 0; i < vHave.size(); i++)
+        if (!vHave[i])
+            vIndexesRet.push_back(i);
+}
+
+ReadStatus CPartialBlock::FillBlock(CBlock& block, const vector<CTransaction>& vtxMissing) const
+{
+    block = header;
+    block.vtx = vtx;
+
+    unsigned int nMissing = 0;
+    for (unsigned int i = 0; i < vHave.size(); i++)
+    {
+        if (vHave[i])
+            continue;
+        if (nMissing == vtxMissing.size())
+            return READ_STATUS_INVALID;
+        block.vtx[i] = vtxMissing[nMissing++];
+    }
+    if (nMissing != vtxMissing.size())
+        return READ_STATUS_INVALID;
+
+    // A short id matching the wrong pool transaction shows up here
+    if (block.BuildMerkleTree() != header.hashMerkleRoot)
+        return READ_STATUS_FAILED;
+
+    return READ_STATUS_OK;
+}
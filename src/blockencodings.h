@@ -0,0 +1,155 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include "main.h"
+
+#include <vector>
+
+class CTxMemPool;
+
+/** A transaction sent in full in a compact block, with its position */
+class CPrefilledTransaction
+{
+public:
+    unsigned int nIndex;
+    CTransaction tx;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(VARINT(nIndex));
+        READWRITE(tx);
+    )
+};
+
+/** A block announced by its header, block signature and 6 byte short ids
+ * of its transactions, which the receiver is expected to have in its
+ * memory pool. The coinbase, and the coinstake of a proof-of-stake
+ * block, are always sent in full.
+ */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    uint64_t nNonce;
+    mutable uint64_t shorttxidk0, shorttxidk1;
+
+    void FillShortTxIDSelector() const;
+
+public:
+    static const int SHORTTXIDS_LENGTH = 6;
+
+    // Header fields and block signature; no transactions
+    CBlock header;
+    std::vector<uint64_t> shorttxids;
+    std::vector<CPrefilledTransaction> prefilledtxn;
+
+    CBlockHeaderAndShortTxIDs() : nNonce(0), shorttxidk0(0), shorttxidk1(0) {}
+    CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    size_t BlockTxCount() const { return shorttxids.size() + prefilledtxn.size(); }
+
+    IMPLEMENT_SERIALIZE
+    (
+        CBlockHeaderAndShortTxIDs* pthis = const_cast<CBlockHeaderAndShortTxIDs*>(this);
+        READWRITE(header.nVersion);
+        READWRITE(header.hashPrevBlock);
+        READWRITE(header.hashMerkleRoot);
+        READWRITE(header.nTime);
+        READWRITE(header.nBits);
+        READWRITE(header.nNonce);
+        READWRITE(header.vchBlockSig);
+        READWRITE(nNonce);
+
+        // Short ids go as one byte string, SHORTTXIDS_LENGTH bytes each
+        std::vector<unsigned char> vchShortTxIDs;
+        if (!fRead)
+        {
+            vchShortTxIDs.reserve(shorttxids.size() * SHORTTXIDS_LENGTH);
+            for (unsigned int i = 0; i < shorttxids.size(); i++)
+                for (int j = 0; j < SHORTTXIDS_LENGTH; j++)
+                    vchShortTxIDs.push_back((shorttxids[i] >> (8 * j)) & 0xff);
+        }
+        READWRITE(vchShortTxIDs);
+        if (fRead)
+        {
+            if (vchShortTxIDs.size() % SHORTTXIDS_LENGTH != 0)
+                throw std::ios_base::failure("CBlockHeaderAndShortTxIDs : bad short ids");
+            pthis->shorttxids.resize(vchShortTxIDs.size() / SHORTTXIDS_LENGTH);
+            for (unsigned int i = 0; i < pthis->shorttxids.size(); i++)
+            {
+                pthis->shorttxids[i] = 0;
+                for (int j = 0; j < SHORTTXIDS_LENGTH; j++)
+                    pthis->shorttxids[i] |= (uint64_t)vchShortTxIDs[i * SHORTTXIDS_LENGTH + j] << (8 * j);
+            }
+        }
+
+        READWRITE(prefilledtxn);
+        if (fRead)
+            pthis->FillShortTxIDSelector();
+    )
+};
+
+/** "getblocktxn": the transactions of a compact block the receiver couldn't find */
+class CBlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    std::vector<unsigned int> indexes;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(indexes);
+    )
+};
+
+/** "blocktxn": the answer to a CBlockTransactionsRequest, in the same order */
+class CBlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> txn;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(txn);
+    )
+};
+
+enum ReadStatus
+{
+    READ_STATUS_OK,
+    READ_STATUS_INVALID, // the peer sent something malformed
+    READ_STATUS_FAILED   // couldn't rebuild the block, ask for it in full
+};
+
+/** A block being rebuilt from a compact block, the memory pool and the
+ * transactions asked for with "getblocktxn"
+ */
+class CPartialBlock
+{
+private:
+    CBlock header;
+    std::vector<CTransaction> vtx;
+    std::vector<bool> vHave;
+
+public:
+    ReadStatus Init(const CBlockHeaderAndShortTxIDs& cmpctblock, const CTxMemPool& pool);
+
+    uint256 GetBlockHash() const { return header.GetHash(); }
+
+    // Positions of the transactions still missing
+    void GetMissing(std::vector<unsigned int>& vIndexesRet) const;
+
+    // Put the block together with vtxMissing in the positions GetMissing
+    // returned; fails if they don't add up to the block in the header
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtxMissing) const;
+};
+
+#endif // BITCOIN_BLOCKENCODINGS_H
@@ -0,0 +1,120 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfile.h"
+
+#include "chainparams.h"
+#include "main.h"
+#include "sync.h"
+#include "util.h"
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+static CCriticalSection cs_BlockFileMappings;
+static map<unsigned int, CBlockFileMappingPtr> mapBlockFileMappings;
+
+CBlockFileMapping::~CBlockFileMapping()
+{
+#ifndef WIN32
+    munmap((void*)pdata, nSize);
+#endif
+}
+
+bool MapBlockFile(unsigned int nFile, unsigned int nPos, CBlockFileMappingPtr& mappingRet, bool fRefresh)
+{
+#ifdef WIN32
+    return false;
+#else
+    if ((nFile < 1) || (nFile == (unsigned int) -1))
+        return false;
+
+    LOCK(cs_BlockFileMappings);
+    map<unsigned int, CBlockFileMappingPtr>::iterator mi = mapBlockFileMappings.find(nFile);
+    if (mi != mapBlockFileMappings.end() && nPos < mi->second->nSize && !fRefresh)
+    {
+        mappingRet = mi->second;
+        return true;
+    }
+
+    // Blocks are only ever appended, so a larger file is mapped again as a
+    // whole; readers still holding the old mapping keep it alive.
+    int fd = open(BlockFilePath(nFile).string().c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0 || (size_t)nPos >= (size_t)st.st_size)
+    {
+        close(fd);
+        return false;
+    }
+    size_t nSize = st.st_size;
+    if (mi != mapBlockFileMappings.end() && mi->second->nSize == nSize)
+    {
+        close(fd);
+        mappingRet = mi->second;
+        return true;
+    }
+
+    void* p = mmap(NULL, nSize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        LogPrint("db", "MapBlockFile() : mmap of blk%04u.dat failed: %s\n", nFile, strerror(errno));
+        return false;
+    }
+    mappingRet.reset(new CBlockFileMapping((const char*)p, nSize));
+    mapBlockFileMappings[nFile] = mappingRet;
+    return true;
+#endif
+}
+
+bool ReadRawBlockFromFile(unsigned int nFile, unsigned int nBlockPos, CDataStream& ssRet)
+{
+    // Blocks are written after the message start and their size
+    const unsigned int nHeaderSize = MESSAGE_START_SIZE + sizeof(unsigned int);
+    if (nBlockPos < nHeaderSize)
+        return false;
+    unsigned int nHeaderPos = nBlockPos - nHeaderSize;
+    char pchHeader[MESSAGE_START_SIZE + sizeof(unsigned int)];
+    unsigned int nSize;
+
+    CBlockFileMappingPtr mapping;
+    if (MapBlockFile(nFile, nBlockPos, mapping))
+    {
+        memcpy(pchHeader, mapping->pdata + nHeaderPos, nHeaderSize);
+        memcpy(&nSize, pchHeader + MESSAGE_START_SIZE, sizeof(nSize));
+        if (memcmp(pchHeader, Params().MessageStart(), MESSAGE_START_SIZE) != 0 || nSize == 0 || nSize > MAX_BLOCK_SIZE)
+            return false;
+        if ((size_t)nBlockPos + nSize > mapping->nSize &&
+            (!MapBlockFile(nFile, nBlockPos, mapping, true) || (size_t)nBlockPos + nSize > mapping->nSize))
+            return false;
+        ssRet.write(mapping->pdata + nBlockPos, nSize);
+        return true;
+    }
+
+    CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nHeaderPos, "rb"), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return false;
+    try {
+        filein.read(pchHeader, nHeaderSize);
+        memcpy(&nSize, pchHeader + MESSAGE_START_SIZE, sizeof(nSize));
+        if (memcmp(pchHeader, Params().MessageStart(), MESSAGE_START_SIZE) != 0 || nSize == 0 || nSize > MAX_BLOCK_SIZE)
+            return false;
+        vector<char> vch(nSize);
+        filein.read(&vch[0], nSize);
+        ssRet.write(&vch[0], nSize);
+    }
+    catch (std::exception &e) {
+        return error("%s() : I/O error", __PRETTY_FUNCTION__);
+    }
+    return true;
+}
@@ -0,0 +1,65 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOCKFILE_H
+#define BITCOIN_BLOCKFILE_H
+
+#include "serialize.h"
+#include "version.h"
+
+#include <boost/shared_ptr.hpp>
+
+/** A read-only memory mapping of one blk*.dat file. Mappings are shared
+    between readers and stay valid for as long as someone holds a reference,
+    even after the file has grown and been mapped again. */
+class CBlockFileMapping
+{
+public:
+    const char* pdata;
+    size_t nSize;
+
+    CBlockFileMapping(const char* pdataIn, size_t nSizeIn) : pdata(pdataIn), nSize(nSizeIn) {}
+    ~CBlockFileMapping();
+};
+
+typedef boost::shared_ptr<const CBlockFileMapping> CBlockFileMappingPtr;
+
+/** Get a mapping of blk<nFile>.dat that covers offset nPos. With fRefresh set
+    the file is mapped again if it grew since the current mapping was made.
+    Returns false if the file cannot be mapped, or memory mapping is not
+    available on this platform; callers then read through OpenBlockFile. */
+bool MapBlockFile(unsigned int nFile, unsigned int nPos, CBlockFileMappingPtr& mappingRet, bool fRefresh = false);
+
+/** Unserialize obj from offset nPos of blk<nFile>.dat, directly out of the
+    shared mapping of the file. Returns false if the file could not be mapped.
+    Throws std::ios_base::failure on truncated or malformed data. */
+template<typename T>
+bool ReadFromBlockFile(unsigned int nFile, unsigned int nPos, T& obj, int nType)
+{
+    CBlockFileMappingPtr mapping;
+    for (int nTry = 0; ; nTry++)
+    {
+        if (!MapBlockFile(nFile, nPos, mapping, nTry > 0))
+            return false;
+        CSpanReader reader(mapping->pdata + nPos, mapping->pdata + mapping->nSize, nType, CLIENT_VERSION);
+        try {
+            reader >> obj;
+            return true;
+        }
+        catch (std::ios_base::failure &e) {
+            // The data may run past the end of a mapping made before the
+            // file was last appended to; map it again once and retry.
+            if (nTry > 0)
+                throw;
+        }
+    }
+}
+
+/** Append the block stored at nBlockPos of blk<nFile>.dat to ssRet exactly
+    as it is on disk, using the size recorded in front of it, without
+    unserializing it. Returns false if it can't be read or the record in
+    front of it doesn't look right. */
+bool ReadRawBlockFromFile(unsigned int nFile, unsigned int nBlockPos, CDataStream& ssRet);
+
+#endif // BITCOIN_BLOCKFILE_H
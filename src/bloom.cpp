@@ -0,0 +1,89 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bloom.h"
+
+#include "hash.h"
+#include "util.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#define LN2SQUARED 0.4804530139182014246671025263266649717305529515945455
+#define LN2 0.6931471805599453094172321214581765680755001343602552
+
+using namespace std;
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElementsIn, double nFPRate)
+{
+    nElements = max(nElementsIn, 1U);
+    nInsertions = 0;
+
+    // Both generations are checked, so each gets half the false positives.
+    // The optimal size for n elements at rate p is -n*ln(p)/ln(2)^2 bits,
+    // using size/n*ln(2) hash functions.
+    double dBits = -1 / LN2SQUARED * nElements * log(nFPRate / 2);
+    nBits = max((unsigned int)ceil(dBits / 64) * 64, 64U);
+    nHashFuncs = min(max((unsigned int)(nBits * LN2 / nElements + 0.5), 1U), 50U);
+
+    vCurrent.resize(nBits / 64);
+    vPrevious.resize(nBits / 64);
+
+    k0 = GetRand(numeric_limits<uint64_t>::max());
+    k1 = GetRand(numeric_limits<uint64_t>::max());
+}
+
+// One SipHash gives the two hashes the bit positions are made from, as
+// h1 + i*h2 (Kirsch and Mitzenmacher). Mixing the type into the key keeps
+// a block and a transaction with the same hash apart.
+void CRollingBloomFilter::GetHashes(const CInv& inv, uint32_t& h1, uint32_t& h2) const
+{
+    uint64_t h = SipHashUint256(k0 ^ (uint64_t)inv.type, k1, inv.hash);
+    h1 = (uint32_t)h;
+    h2 = (uint32_t)(h >> 32) | 1;
+}
+
+void CRollingBloomFilter::insert(const CInv& inv)
+{
+    if (nInsertions == nElements)
+    {
+        vPrevious.swap(vCurrent);
+        fill(vCurrent.begin(), vCurrent.end(), 0);
+        nInsertions = 0;
+    }
+
+    uint32_t h1, h2;
+    GetHashes(inv, h1, h2);
+    for (unsigned int i = 0; i < nHashFuncs; i++)
+    {
+        unsigned int nBit = (uint32_t)(h1 + i * h2) % nBits;
+        vCurrent[nBit >> 6] |= (uint64_t)1 << (nBit & 63);
+    }
+    nInsertions++;
+}
+
+bool CRollingBloomFilter::contains(const CInv& inv) const
+{
+    uint32_t h1, h2;
+    GetHashes(inv, h1, h2);
+
+    bool fCurrent = true, fPrevious = true;
+    for (unsigned int i = 0; i < nHashFuncs && (fCurrent || fPrevious); i++)
+    {
+        unsigned int nBit = (uint32_t)(h1 + i * h2) % nBits;
+        uint64_t nMask = (uint64_t)1 << (nBit & 63);
+        fCurrent = fCurrent && (vCurrent[nBit >> 6] & nMask);
+        fPrevious = fPrevious && (vPrevious[nBit >> 6] & nMask);
+    }
+    return fCurrent || fPrevious;
+}
+
+void CRollingBloomFilter::clear()
+{
+    fill(vCurrent.begin(), vCurrent.end(), 0);
+    fill(vPrevious.begin(), vPrevious.end(), 0);
+    nInsertions = 0;
+}
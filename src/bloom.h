@@ -0,0 +1,45 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_BLOOM_H
+#define BITCOIN_BLOOM_H
+
+#include "protocol.h"
+
+#include <stdint.h>
+#include <vector>
+
+/*
+ * CRollingBloomFilter remembers which inventory a peer already has, in a
+ * fixed amount of memory and without allocating per entry. Inserts go into
+ * the current generation of the filter; once that holds nElements it becomes
+ * the previous generation and the older one is cleared. So at least the last
+ * nElements inserted are always found, and up to twice that many.
+ *
+ * contains() can report inventory that was never inserted, at about nFPRate.
+ * The hash key is random per filter, so a peer can't pick inventory that
+ * collides for everyone.
+ */
+class CRollingBloomFilter
+{
+private:
+    std::vector<uint64_t> vCurrent;
+    std::vector<uint64_t> vPrevious;
+    unsigned int nBits;
+    unsigned int nHashFuncs;
+    unsigned int nElements;
+    unsigned int nInsertions; // into the current generation
+    uint64_t k0, k1;
+
+    void GetHashes(const CInv& inv, uint32_t& h1, uint32_t& h2) const;
+
+public:
+    CRollingBloomFilter(unsigned int nElementsIn, double nFPRate);
+
+    void insert(const CInv& inv);
+    bool contains(const CInv& inv) const;
+    void clear();
+};
+
+#endif /* BITCOIN_BLOOM_H */
@@ -0,0 +1,296 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coins.h"
+
+#include "init.h"
+#include "txdb.h"
+#include "ui_interface.h"
+#include "util.h"
+
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+CCoinsViewCache* pcoinsTip = NULL;
+static CCoinsViewDB* pcoinsdbview = NULL;
+static size_t nCoinsCacheSize = DEFAULT_COINS_CACHE << 20;
+
+// Approximate heap usage of one cache entry: the map node, its tree links
+// and the script bytes.
+static size_t EntryUsage(const CCoin& coin)
+{
+    return sizeof(CCoinsMap::value_type) + 4 * sizeof(void*) + coin.txout.scriptPubKey.capacity();
+}
+
+bool CCoinsViewDB::GetCoin(const COutPoint& outpoint, CCoin& coin)
+{
+    CTxDB txdb("r");
+    return txdb.ReadCoin(outpoint, coin);
+}
+
+uint256 CCoinsViewDB::GetBestBlock()
+{
+    CTxDB txdb("r");
+    uint256 hashBlock = 0;
+    txdb.ReadCoinsBestBlock(hashBlock);
+    return hashBlock;
+}
+
+bool CCoinsViewDB::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+{
+    CTxDB txdb;
+    bool fOk = txdb.WriteCoins(mapCoins, hashBlock);
+    mapCoins.clear();
+    return fOk;
+}
+
+CCoinsViewCache::CCoinsViewCache(CCoinsView* baseIn) : base(baseIn), hashBlock(0), nCachedUsage(0)
+{
+}
+
+CCoinsMap::iterator CCoinsViewCache::FetchCoin(const COutPoint& outpoint)
+{
+    CCoinsMap::iterator it = cacheCoins.find(outpoint);
+    if (it != cacheCoins.end())
+        return it;
+    CCoin coin;
+    if (!base->GetCoin(outpoint, coin))
+        return cacheCoins.end();
+    it = cacheCoins.insert(make_pair(outpoint, CCoinsCacheEntry())).first;
+    it->second.coin = coin;
+    nCachedUsage += EntryUsage(it->second.coin);
+    return it;
+}
+
+// Set the cached state of an outpoint without consulting the parent view
+void CCoinsViewCache::ModifyCoin(const COutPoint& outpoint, const CCoin& coin)
+{
+    CCoinsMap::iterator it = cacheCoins.find(outpoint);
+    if (it == cacheCoins.end())
+        it = cacheCoins.insert(make_pair(outpoint, CCoinsCacheEntry())).first;
+    else
+        nCachedUsage -= EntryUsage(it->second.coin);
+    it->second.coin = coin;
+    it->second.fDirty = true;
+    nCachedUsage += EntryUsage(it->second.coin);
+}
+
+bool CCoinsViewCache::GetCoin(const COutPoint& outpoint, CCoin& coin)
+{
+    const CCoin* pcoin = AccessCoin(outpoint);
+    if (!pcoin)
+        return false;
+    coin = *pcoin;
+    return true;
+}
+
+const CCoin* CCoinsViewCache::AccessCoin(const COutPoint& outpoint)
+{
+    CCoinsMap::iterator it = FetchCoin(outpoint);
+    if (it == cacheCoins.end() || it->second.coin.IsNull())
+        return NULL;
+    return &it->second.coin;
+}
+
+bool CCoinsViewCache::HaveCoin(const COutPoint& outpoint)
+{
+    return AccessCoin(outpoint) != NULL;
+}
+
+uint256 CCoinsViewCache::GetBestBlock()
+{
+    if (hashBlock == 0)
+        hashBlock = base->GetBestBlock();
+    return hashBlock;
+}
+
+void CCoinsViewCache::SetBestBlock(const uint256& hashBlockIn)
+{
+    hashBlock = hashBlockIn;
+}
+
+bool CCoinsViewCache::BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlockIn)
+{
+    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); ++it)
+        if (it->second.fDirty)
+            ModifyCoin(it->first, it->second.coin);
+    mapCoins.clear();
+    hashBlock = hashBlockIn;
+    return true;
+}
+
+bool CCoinsViewCache::HaveInputs(const CTransaction& tx)
+{
+    if (tx.IsCoinBase())
+        return true;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        if (!HaveCoin(txin.prevout))
+            return false;
+    return true;
+}
+
+bool CCoinsViewCache::UpdateCoins(const CTransaction& tx, int nHeight, vector<CCoin>& vUndo)
+{
+    if (!tx.IsCoinBase())
+    {
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            CCoinsMap::iterator it = FetchCoin(txin.prevout);
+            if (it == cacheCoins.end() || it->second.coin.IsNull())
+                return false;
+            vUndo.push_back(it->second.coin);
+            ModifyCoin(txin.prevout, CCoin());
+        }
+    }
+
+    uint256 hash = tx.GetHash();
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+        ModifyCoin(COutPoint(hash, i), CCoin(tx, i, nHeight));
+    return true;
+}
+
+bool CCoinsViewCache::UndoBlock(const CBlock& block, const vector<CCoin>& vUndo)
+{
+    unsigned int nUndo = vUndo.size();
+    for (int i = block.vtx.size() - 1; i >= 0; i--)
+    {
+        const CTransaction& tx = block.vtx[i];
+        uint256 hash = tx.GetHash();
+        for (unsigned int n = 0; n < tx.vout.size(); n++)
+            ModifyCoin(COutPoint(hash, n), CCoin());
+
+        if (tx.IsCoinBase())
+            continue;
+        for (int j = tx.vin.size() - 1; j >= 0; j--)
+        {
+            if (nUndo == 0)
+                return false;
+            ModifyCoin(tx.vin[j].prevout, vUndo[--nUndo]);
+        }
+    }
+    return nUndo == 0;
+}
+
+bool CCoinsViewCache::Flush()
+{
+    bool fOk = base->BatchWrite(cacheCoins, hashBlock);
+    cacheCoins.clear();
+    nCachedUsage = 0;
+    return fOk;
+}
+
+static void CloseCoinsIndex()
+{
+    delete pcoinsTip;
+    pcoinsTip = NULL;
+    delete pcoinsdbview;
+    pcoinsdbview = NULL;
+}
+
+bool LoadCoinsIndex()
+{
+    LOCK(cs_main);
+
+    nCoinsCacheSize = GetArg("-coinscache", DEFAULT_COINS_CACHE) << 20;
+    pcoinsdbview = new CCoinsViewDB();
+    pcoinsTip = new CCoinsViewCache(pcoinsdbview);
+
+    // Find where the coins database left off; it has to be on the best chain
+    // since only blocks from there can be replayed forward.
+    CBlockIndex* pindexCoins = NULL;
+    uint256 hashCoins = pcoinsTip->GetBestBlock();
+    BlockMap::iterator mi = mapBlockIndex.find(hashCoins);
+    if (mi != mapBlockIndex.end() && mi->second->IsInMainChain())
+        pindexCoins = mi->second;
+
+    if (pindexCoins == NULL)
+    {
+        if (hashCoins != 0)
+            LogPrintf("LoadCoinsIndex() : coins database at %s is not on the best chain, rebuilding\n", hashCoins.ToString());
+        if (!CTxDB().WipeCoins())
+        {
+            CloseCoinsIndex();
+            return error("LoadCoinsIndex() : failed to clear the coins database");
+        }
+        // The genesis block is never connected, so its outputs are not spendable
+        pindexCoins = pindexGenesisBlock;
+        pcoinsTip->SetBestBlock(pindexCoins->GetBlockHash());
+    }
+
+    if (pindexCoins != pindexBest)
+    {
+        uiInterface.InitMessage(_("Building coins index..."));
+        LogPrintf("LoadCoinsIndex() : replaying blocks %d to %d\n", pindexCoins->nHeight + 1, nBestHeight);
+    }
+
+    int64_t nStart = GetTimeMillis();
+    for (CBlockIndex* pindex = pindexCoins->pnext; pindex; pindex = pindex->pnext)
+    {
+        if (ShutdownRequested())
+            break;
+
+        CBlock block;
+        if (!block.ReadFromDisk(pindex))
+        {
+            CloseCoinsIndex();
+            return error("LoadCoinsIndex() : ReadFromDisk failed at height %d", pindex->nHeight);
+        }
+
+        vector<CCoin> vUndo;
+        BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        {
+            if (!pcoinsTip->UpdateCoins(tx, pindex->nHeight, vUndo))
+            {
+                CloseCoinsIndex();
+                return error("LoadCoinsIndex() : %s has missing inputs at height %d", tx.GetHash().ToString(), pindex->nHeight);
+            }
+        }
+        if (pindex->nHeight > nBestHeight - COINS_UNDO_DEPTH)
+            CTxDB().WriteCoinsUndo(pindex->GetBlockHash(), vUndo);
+        pcoinsTip->SetBestBlock(pindex->GetBlockHash());
+
+        if (pindex->nHeight % 10000 == 0)
+            LogPrintf("LoadCoinsIndex() : at height %d, %u cached coins\n", pindex->nHeight, pcoinsTip->GetCacheSize());
+        if (!FlushCoinsCache(false))
+        {
+            CloseCoinsIndex();
+            return false;
+        }
+    }
+
+    if (!FlushCoinsCache(true))
+    {
+        CloseCoinsIndex();
+        return false;
+    }
+    LogPrintf("LoadCoinsIndex() : coins database at %s (%dms)\n", pcoinsdbview->GetBestBlock().ToString(), GetTimeMillis() - nStart);
+    return true;
+}
+
+bool FlushCoinsCache(bool fForce)
+{
+    if (!pcoinsTip)
+        return true;
+    if (!fForce && pcoinsTip->DynamicMemoryUsage() < nCoinsCacheSize)
+        return true;
+
+    int64_t nStart = GetTimeMillis();
+    unsigned int nCoins = pcoinsTip->GetCacheSize();
+    if (!pcoinsTip->Flush())
+        return error("FlushCoinsCache() : failed to write coins database");
+    LogPrint("db", "FlushCoinsCache() : %u coins written in %dms\n", nCoins, GetTimeMillis() - nStart);
+    return true;
+}
+
+void AbandonCoinsIndex(CTxDB& txdb, const string& strReason)
+{
+    LogPrintf("AbandonCoinsIndex() : %s, coins database disabled until restart\n", strReason);
+    txdb.DropCoinsView();
+
+    // Without its marker the database is rebuilt from scratch at startup
+    CTxDB().EraseCoinsBestBlock();
+    CloseCoinsIndex();
+}
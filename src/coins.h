@@ -0,0 +1,177 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2014 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_COINS_H
+#define BITCOIN_COINS_H
+
+#include "main.h"
+
+#include <map>
+#include <vector>
+
+/** How many blocks back from the tip undo data for the coins database is kept.
+    Disconnecting a block older than this drops the coins database, which is
+    rebuilt from the block files on the next start. */
+static const int COINS_UNDO_DEPTH = 1000;
+
+/** Default for -coinscache, the memory in megabytes the in-memory coins cache
+    may use before it is written back to LevelDB. */
+static const unsigned int DEFAULT_COINS_CACHE = 32;
+
+/** An unspent transaction output together with the parts of the transaction
+    that created it that block validation needs: the height it was confirmed
+    at (for coinbase/coinstake maturity), the ppcoin transaction timestamp and
+    the coinbase/coinstake flags. This is what the coins database stores per
+    outpoint, so connecting an input does not read the previous transaction
+    back from the block files. */
+class CCoin
+{
+public:
+    CTxOut txout;
+    int nHeight;
+    unsigned int nTime;
+    bool fCoinBase;
+    bool fCoinStake;
+
+    CCoin()
+    {
+        SetNull();
+    }
+
+    CCoin(const CTransaction& tx, unsigned int n, int nHeightIn)
+    {
+        txout = tx.vout[n];
+        nHeight = nHeightIn;
+        nTime = tx.nTime;
+        fCoinBase = tx.IsCoinBase();
+        fCoinStake = tx.IsCoinStake();
+    }
+
+    void SetNull()
+    {
+        txout.SetNull();
+        nHeight = 0;
+        nTime = 0;
+        fCoinBase = false;
+        fCoinStake = false;
+    }
+
+    // A null coin marks a spent output in a cache
+    bool IsNull() const
+    {
+        return txout.IsNull();
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        unsigned int nCode = 0;
+        if (!fRead)
+            nCode = (unsigned int)nHeight * 4 + (fCoinBase ? 1 : 0) + (fCoinStake ? 2 : 0);
+        READWRITE(VARINT(nCode));
+        if (fRead)
+        {
+            CCoin* pthis = const_cast<CCoin*>(this);
+            pthis->nHeight = nCode >> 2;
+            pthis->fCoinBase = nCode & 1;
+            pthis->fCoinStake = (nCode & 2) != 0;
+        }
+        READWRITE(nTime);
+        CTxOutCompressor txoutc(REF(txout));
+        READWRITE(txoutc);
+    )
+};
+
+struct CCoinsCacheEntry
+{
+    CCoin coin;   // null when spent
+    bool fDirty;  // differs from the parent view
+
+    CCoinsCacheEntry() : fDirty(false) {}
+};
+
+typedef std::map<COutPoint, CCoinsCacheEntry> CCoinsMap;
+
+/** Abstract view on the set of unspent outputs of the best chain. */
+class CCoinsView
+{
+public:
+    // Retrieve the unspent output for an outpoint; false if it is spent or unknown
+    virtual bool GetCoin(const COutPoint& outpoint, CCoin& coin) = 0;
+
+    // Hash of the block this view is in step with
+    virtual uint256 GetBestBlock() = 0;
+
+    // Apply the dirty entries of a child cache and move the best block marker
+    virtual bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock) = 0;
+
+    virtual ~CCoinsView() {}
+};
+
+/** CCoinsView backed by the "coin" records in the transaction LevelDB. */
+class CCoinsViewDB : public CCoinsView
+{
+public:
+    bool GetCoin(const COutPoint& outpoint, CCoin& coin);
+    uint256 GetBestBlock();
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock);
+};
+
+/** Write-back cache on top of another CCoinsView. Nothing reaches the parent
+    until Flush() is called. */
+class CCoinsViewCache : public CCoinsView
+{
+protected:
+    CCoinsView* base;
+    uint256 hashBlock;
+    CCoinsMap cacheCoins;
+    size_t nCachedUsage;
+
+    CCoinsMap::iterator FetchCoin(const COutPoint& outpoint);
+    void ModifyCoin(const COutPoint& outpoint, const CCoin& coin);
+
+public:
+    CCoinsViewCache(CCoinsView* baseIn);
+
+    bool GetCoin(const COutPoint& outpoint, CCoin& coin);
+    uint256 GetBestBlock();
+    void SetBestBlock(const uint256& hashBlockIn);
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlockIn);
+
+    // Return a pointer to the cached unspent output, or NULL. Valid until the
+    // cache is next modified.
+    const CCoin* AccessCoin(const COutPoint& outpoint);
+    bool HaveCoin(const COutPoint& outpoint);
+
+    // True if every input of tx is an unspent output in this view
+    bool HaveInputs(const CTransaction& tx);
+
+    // Add the outputs of tx and spend its inputs, appending the spent coins
+    // to vUndo in input order. Returns false if an input is missing.
+    bool UpdateCoins(const CTransaction& tx, int nHeight, std::vector<CCoin>& vUndo);
+
+    // Reverse UpdateCoins for every transaction of a block, given the undo
+    // data that was collected when the block was connected
+    bool UndoBlock(const CBlock& block, const std::vector<CCoin>& vUndo);
+
+    // Push the modifications to the parent view and empty the cache
+    bool Flush();
+
+    unsigned int GetCacheSize() const { return cacheCoins.size(); }
+    size_t DynamicMemoryUsage() const { return nCachedUsage; }
+};
+
+/** The coins view on the best chain, NULL unless -coinsindex is enabled and
+    the coins database is in step with the block index */
+extern CCoinsViewCache* pcoinsTip;
+
+/** Open the coins database and bring it up to the current best block,
+    replaying blocks from disk where needed */
+bool LoadCoinsIndex();
+/** Write pcoinsTip back to disk if it outgrew -coinscache (or always, if fForce) */
+bool FlushCoinsCache(bool fForce);
+/** Stop using the coins database after it was found out of step; it is
+    rebuilt on the next start */
+void AbandonCoinsIndex(CTxDB& txdb, const std::string& strReason);
+
+#endif // BITCOIN_COINS_H
@@ -685,12 +685,14 @@ void CFundamentalnodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand,
             // should be at least not earlier than block when  tx got FUNDAMENTALNODE_MIN_CONFIRMATIONS
             uint256 hashBlock = 0;
             GetTransaction(vin.prevout.hash, tx, hashBlock/* , true */);
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+            BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
             if (mi != mapBlockIndex.end() && (*mi).second)
             {
                 CBlockIndex* pFNIndex = (*mi).second; // block for fn tx -> 1 confirmation
-                CBlockIndex* pConfIndex = FindBlockByHeight((pFNIndex->nHeight + FUNDAMENTALNODE_MIN_CONFIRMATIONS - 1));  // block where tx got FUNDAMENTALNODE_MIN_CONFIRMATIONS
-                if(pConfIndex->GetBlockTime() > sigTime)
+                // No cs_main here, so look the block up from the tip rather than in chainActive
+                CBlockIndex* pindexTip = pindexBest;
+                CBlockIndex* pConfIndex = pindexTip->GetAncestor(pFNIndex->nHeight + FUNDAMENTALNODE_MIN_CONFIRMATIONS - 1);  // block where tx got FUNDAMENTALNODE_MIN_CONFIRMATIONS
+                if(pConfIndex && pConfIndex->GetBlockTime() > sigTime)
                 {
                     LogPrintf("fne - Bad sigTime %d for Fundamentalnode %20s %105s (%i conf block is at %d)\n",
                               sigTime, addr.ToString(), vin.ToString(), FUNDAMENTALNODE_MIN_CONFIRMATIONS, pConfIndex->GetBlockTime());
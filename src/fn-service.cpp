@@ -19,6 +19,8 @@ using namespace std;
 using namespace boost;
 
 std::map<uint256, CFundamentalnodeScanningError> mapFundamentalnodeScanningErrors;
+// Guards mapFundamentalnodeScanningErrors, which new blocks add to as well
+CCriticalSection cs_mapFundamentalnodeScanningErrors;
 CFundamentalnodeScanning fnscan;
 CActiveFundamentalnode activeFundamentalnode;
 
@@ -51,10 +53,12 @@ void ProcessMessageFundamentalnodePOS(CNode* pfrom, std::string& strCommand, CDa
         CInv inv(MSG_FUNDAMENTALNODE_SCANNING_ERROR, fnse.GetHash());
         pfrom->AddInventoryKnown(inv);
 
-        if(mapFundamentalnodeScanningErrors.count(fnse.GetHash())){
-            return;
+        {
+            LOCK(cs_mapFundamentalnodeScanningErrors);
+            if(!mapFundamentalnodeScanningErrors.insert(make_pair(fnse.GetHash(), fnse)).second){
+                return;
+            }
         }
-        mapFundamentalnodeScanningErrors.insert(make_pair(fnse.GetHash(), fnse));
 
         if(!fnse.IsValid())
         {
@@ -113,6 +117,7 @@ void CFundamentalnodeScanning::CleanFundamentalnodeScanningErrors()
 {
     if(pindexBest == NULL) return;
 
+    LOCK(cs_mapFundamentalnodeScanningErrors);
     std::map<uint256, CFundamentalnodeScanningError>::iterator it = mapFundamentalnodeScanningErrors.begin();
 
     while(it != mapFundamentalnodeScanningErrors.end()) {
@@ -153,14 +158,20 @@ void CFundamentalnodeScanning::DoFundamentalnodePOSChecks()
         // we couldn't connect to the node, let's send a scanning error
         CFundamentalnodeScanningError fnse(activeFundamentalnode.vin, pfn->vin, SCANNING_ERROR_NO_RESPONSE, nBlockHeight);
         fnse.Sign();
-        mapFundamentalnodeScanningErrors.insert(make_pair(fnse.GetHash(), fnse));
+        {
+            LOCK(cs_mapFundamentalnodeScanningErrors);
+            mapFundamentalnodeScanningErrors.insert(make_pair(fnse.GetHash(), fnse));
+        }
         fnse.Relay();
     }
 
     // success
     CFundamentalnodeScanningError fnse(activeFundamentalnode.vin, pfn->vin, SCANNING_SUCCESS, nBlockHeight);
     fnse.Sign();
-    mapFundamentalnodeScanningErrors.insert(make_pair(fnse.GetHash(), fnse));
+    {
+        LOCK(cs_mapFundamentalnodeScanningErrors);
+        mapFundamentalnodeScanningErrors.insert(make_pair(fnse.GetHash(), fnse));
+    }
     fnse.Relay();
 }
 
@@ -233,8 +244,9 @@ void CFundamentalnodeScanningError::Relay()
 
     vector<CInv> vInv;
     vInv.push_back(inv);
+    CSendBufferPtr pmsg = MakeSendBuffer("inv", vInv);
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes){
-        pnode->PushMessage("inv", vInv);
+        pnode->PushSendBuffer(pmsg);
     }
 }
@@ -23,6 +23,7 @@ class CFundamentalnodeScanning;
 class CFundamentalnodeScanningError;
 
 extern map<uint256, CFundamentalnodeScanningError> mapFundamentalnodeScanningErrors;
+extern CCriticalSection cs_mapFundamentalnodeScanningErrors;
 extern CFundamentalnodeScanning fnscan;
 
 static const int MIN_FUNDAMENTALNODE_POS_PROTO_VERSION = 70075;
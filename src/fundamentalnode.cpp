@@ -20,7 +20,6 @@ map<uint256, CFundamentalnodePaymentWinner> mapSeenFundamentalnodeVotes;
 // keep track of the scanning errors I've seen
 map<uint256, int> mapSeenFundamentalnodeScanningErrors;
 // cache block hashes as we calculate them
-std::map<int64_t, uint256> mapCacheBlockHashes;
 
 void ProcessMessageFundamentalnodePayments(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 {
@@ -98,39 +97,24 @@ struct CompareValueOnly
 //Get the last hash that matches the modulus given. Processed in reverse order
 bool GetBlockHash(uint256& hash, int nBlockHeight)
 {
-    if (pindexBest == NULL) return false;
+    // pindexBest may move on while we look; stick to the one we started with
+    const CBlockIndex *pindexTip = pindexBest;
+    if (pindexTip == NULL || pindexTip->nHeight == 0) return false;
 
     if(nBlockHeight == 0)
-        nBlockHeight = pindexBest->nHeight;
+        nBlockHeight = pindexTip->nHeight;
 
-    if(mapCacheBlockHashes.count(nBlockHeight)){
-        hash = mapCacheBlockHashes[nBlockHeight];
-        return true;
-    }
-
-    const CBlockIndex *BlockLastSolved = pindexBest;
-    const CBlockIndex *BlockReading = pindexBest;
-
-    if (BlockLastSolved == NULL || BlockLastSolved->nHeight == 0 || pindexBest->nHeight+1 < nBlockHeight) return false;
-
-    int nBlocksAgo = 0;
-    if(nBlockHeight > 0) nBlocksAgo = (pindexBest->nHeight+1)-nBlockHeight;
-    assert(nBlocksAgo >= 0);
+    if (pindexTip->nHeight+1 < nBlockHeight) return false;
 
-    int n = 0;
-    for (unsigned int i = 1; BlockReading && BlockReading->nHeight > 0; i++) {
-        if(n >= nBlocksAgo){
-            hash = BlockReading->GetBlockHash();
-            mapCacheBlockHashes[nBlockHeight] = hash;
-            return true;
-        }
-        n++;
+    // The hash of block nBlockHeight-1; the tip for negative heights
+    int nHeight = nBlockHeight > 0 ? nBlockHeight - 1 : pindexTip->nHeight;
+    if (nHeight <= 0) return false;
 
-        if (BlockReading->pprev == NULL) { assert(BlockReading); break; }
-        BlockReading = BlockReading->pprev;
-    }
+    const CBlockIndex *pindex = pindexTip->GetAncestor(nHeight);
+    if (pindex == NULL) return false;
 
-    return false;
+    hash = pindex->GetBlockHash();
+    return true;
 }
 
 CFundamentalnode::CFundamentalnode()
@@ -521,9 +505,10 @@ void CFundamentalnodePayments::Relay(CFundamentalnodePaymentWinner& winner)
 
     vector<CInv> vInv;
     vInv.push_back(inv);
+    CSendBufferPtr pmsg = MakeSendBuffer("inv", vInv);
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes){
-        pnode->PushMessage("inv", vInv);
+        pnode->PushSendBuffer(pmsg);
     }
 }
 
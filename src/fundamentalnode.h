@@ -41,7 +41,7 @@ class CFundamentalnodePaymentWinner;
 
 extern CFundamentalnodePayments fundamentalnodePayments;
 extern map<uint256, CFundamentalnodePaymentWinner> mapSeenFundamentalnodeVotes;
-extern map<int64_t, uint256> mapCacheBlockHashes;
+extern CCriticalSection cs_fundamentalnodepayments;
 
 void ProcessMessageFundamentalnodePayments(CNode* pfrom, std::string& strCommand, CDataStream& vRecv);
 bool GetBlockHash(uint256& hash, int nBlockHeight);
@@ -0,0 +1,202 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "headerchain.h"
+#include "bignum.h"
+
+#include <algorithm>
+
+using namespace std;
+
+// Same as CBlockIndex::GetBlockTrust
+static uint256 GetHeaderTrust(unsigned int nBits)
+{
+    CBigNum bnTarget;
+    bnTarget.SetCompact(nBits);
+
+    if (bnTarget <= 0)
+        return 0;
+
+    return ((CBigNum(1)<<256) / (bnTarget+1)).getuint256();
+}
+
+const CHeaderIndex* CHeaderChain::Find(const uint256& hash) const
+{
+    map<uint256, CHeaderIndex>::const_iterator it = mapHeaders.find(hash);
+    if (it == mapHeaders.end())
+        return NULL;
+    return &it->second;
+}
+
+const CHeaderIndex* CHeaderChain::Add(const uint256& hash, const CBlock& header, int nHeightPrev, const uint256& nChainTrustPrev, bool fProofOfStake)
+{
+    CHeaderIndex& entry = mapHeaders[hash];
+    entry.hashPrev = header.hashPrevBlock;
+    entry.nHeight = nHeightPrev + 1;
+    entry.nTime = header.nTime;
+    entry.nBits = header.nBits;
+    entry.fProofOfStake = fProofOfStake;
+    entry.nChainTrust = nChainTrustPrev + GetHeaderTrust(header.nBits);
+    map<uint256, CHeaderIndex>::const_iterator itPrev = mapHeaders.find(header.hashPrevBlock);
+    entry.nUnservedUntil = (itPrev != mapHeaders.end() ? itPrev->second.nUnservedUntil : 0);
+
+    if (hashBest == 0 || entry.nChainTrust > nBestChainTrust)
+    {
+        hashBest = hash;
+        nBestChainTrust = entry.nChainTrust;
+    }
+    return &entry;
+}
+
+bool CHeaderChain::IsInBranch(const uint256& hash, const uint256& hashTip) const
+{
+    map<uint256, CHeaderIndex>::const_iterator it = mapHeaders.find(hash);
+    if (it == mapHeaders.end())
+        return false;
+    int nHeight = it->second.nHeight;
+
+    uint256 hashWalk = hashTip;
+    while ((it = mapHeaders.find(hashWalk)) != mapHeaders.end() && it->second.nHeight >= nHeight)
+    {
+        if (hashWalk == hash)
+            return true;
+        hashWalk = it->second.hashPrev;
+    }
+    return false;
+}
+
+void CHeaderChain::MarkUnserved(const uint256& hash, int64_t nUntil)
+{
+    set<uint256> setMark;
+    GetBranchAndDescendants(hash, setMark);
+    BOOST_FOREACH(const uint256& hashMark, setMark)
+    {
+        map<uint256, CHeaderIndex>::iterator it = mapHeaders.find(hashMark);
+        if (it != mapHeaders.end())
+            it->second.nUnservedUntil = nUntil;
+    }
+}
+
+bool CHeaderChain::IsUnserved(const uint256& hash, int64_t nNow) const
+{
+    map<uint256, CHeaderIndex>::const_iterator it = mapHeaders.find(hash);
+    return it != mapHeaders.end() && it->second.nUnservedUntil > nNow;
+}
+
+bool CHeaderChain::GetBranch(const uint256& hashTip, const uint256& hashStop, vector<uint256>& vBranchRet) const
+{
+    vBranchRet.clear();
+    bool fStopped = false;
+    uint256 hash = hashTip;
+    map<uint256, CHeaderIndex>::const_iterator it;
+    while ((it = mapHeaders.find(hash)) != mapHeaders.end())
+    {
+        if (hash == hashStop)
+        {
+            fStopped = true;
+            break;
+        }
+        vBranchRet.push_back(hash);
+        hash = it->second.hashPrev;
+    }
+    reverse(vBranchRet.begin(), vBranchRet.end());
+    return fStopped;
+}
+
+void CHeaderChain::Erase(const uint256& hash)
+{
+    mapHeaders.erase(hash);
+}
+
+static bool CompareByHeight(const pair<int, uint256>& a, const pair<int, uint256>& b)
+{
+    return a.first < b.first;
+}
+
+unsigned int CHeaderChain::Invalidate(const uint256& hash)
+{
+    return DropBranch(hash, true);
+}
+
+unsigned int CHeaderChain::Drop(const uint256& hash)
+{
+    return DropBranch(hash, false);
+}
+
+void CHeaderChain::GetBranchAndDescendants(const uint256& hash, set<uint256>& setRet)
+{
+    setRet.clear();
+    setRet.insert(hash);
+
+    // Parents come before their children in height order
+    vector<pair<int, uint256> > vByHeight;
+    vByHeight.reserve(mapHeaders.size());
+    for (map<uint256, CHeaderIndex>::const_iterator it = mapHeaders.begin(); it != mapHeaders.end(); ++it)
+        vByHeight.push_back(make_pair(it->second.nHeight, it->first));
+    sort(vByHeight.begin(), vByHeight.end(), CompareByHeight);
+    for (unsigned int i = 0; i < vByHeight.size(); i++)
+    {
+        const uint256& hashHeader = vByHeight[i].second;
+        if (setRet.count(mapHeaders[hashHeader].hashPrev))
+            setRet.insert(hashHeader);
+    }
+}
+
+unsigned int CHeaderChain::DropBranch(const uint256& hash, bool fInvalid)
+{
+    set<uint256> setDrop;
+    GetBranchAndDescendants(hash, setDrop);
+    if (fInvalid)
+        BOOST_FOREACH(const uint256& hashDrop, setDrop)
+            setInvalid.insert(hashDrop);
+
+    unsigned int nDropped = 0;
+    BOOST_FOREACH(const uint256& hashDrop, setDrop)
+        nDropped += mapHeaders.erase(hashDrop);
+
+    UpdateBest();
+    return nDropped;
+}
+
+unsigned int CHeaderChain::Prune(const vector<uint256>& vKeep)
+{
+    set<uint256> setKeep;
+    BOOST_FOREACH(const uint256& hashKeep, vKeep)
+    {
+        uint256 hash = hashKeep;
+        map<uint256, CHeaderIndex>::const_iterator it;
+        while ((it = mapHeaders.find(hash)) != mapHeaders.end() && setKeep.insert(hash).second)
+            hash = it->second.hashPrev;
+    }
+
+    unsigned int nDropped = 0;
+    for (map<uint256, CHeaderIndex>::iterator it = mapHeaders.begin(); it != mapHeaders.end(); )
+    {
+        if (!setKeep.count(it->first))
+        {
+            mapHeaders.erase(it++);
+            nDropped++;
+        }
+        else
+            ++it;
+    }
+
+    UpdateBest();
+    return nDropped;
+}
+
+void CHeaderChain::UpdateBest()
+{
+    hashBest = 0;
+    nBestChainTrust = 0;
+    for (map<uint256, CHeaderIndex>::const_iterator it = mapHeaders.begin(); it != mapHeaders.end(); ++it)
+    {
+        if (hashBest == 0 || it->second.nChainTrust > nBestChainTrust)
+        {
+            hashBest = it->first;
+            nBestChainTrust = it->second.nChainTrust;
+        }
+    }
+}
@@ -0,0 +1,105 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_HEADERCHAIN_H
+#define BITCOIN_HEADERCHAIN_H
+
+#include "main.h"
+#include "mruset.h"
+#include "uint256.h"
+
+#include <map>
+#include <set>
+#include <vector>
+
+/** A block header we don't have the block for yet */
+class CHeaderIndex
+{
+public:
+    uint256 hashPrev;
+    int nHeight;
+    unsigned int nTime;
+    unsigned int nBits;
+    bool fProofOfStake;
+    uint256 nChainTrust;
+    int64_t nUnservedUntil; // no peer served a block of this branch we asked for
+
+    CHeaderIndex() : hashPrev(0), nHeight(0), nTime(0), nBits(0), fProofOfStake(false), nChainTrust(0), nUnservedUntil(0) {}
+
+    int64_t GetBlockTime() const { return (int64_t)nTime; }
+};
+
+/*
+ * CHeaderChain holds the headers received ahead of their blocks during
+ * headers-first sync. A header's parent is either another header here or
+ * a block in mapBlockIndex; once a block is stored its header is erased,
+ * so walking back from any header ends where the blocks we have begin.
+ *
+ * Headers found to belong to an invalid block are dropped together with
+ * everything built on them, and the most recent of them remembered so they
+ * aren't taken again. Headers nobody builds on any more can be pruned.
+ * A branch whose blocks nobody delivered is marked unserved for a while,
+ * including headers added to it later.
+ *
+ * Not thread safe; main.cpp guards it with cs_main.
+ */
+class CHeaderChain
+{
+private:
+    std::map<uint256, CHeaderIndex> mapHeaders;
+    mruset<uint256> setInvalid;
+    uint256 hashBest;
+    uint256 nBestChainTrust;
+
+    void GetBranchAndDescendants(const uint256& hash, std::set<uint256>& setRet);
+    unsigned int DropBranch(const uint256& hash, bool fInvalid);
+    void UpdateBest();
+
+public:
+    CHeaderChain() : setInvalid(MAX_INVALID_HEADERS), hashBest(0), nBestChainTrust(0) {}
+
+    const CHeaderIndex* Find(const uint256& hash) const;
+
+    bool IsInvalid(const uint256& hash) const { return setInvalid.count(hash) > 0; }
+
+    // Add the header of block hash, whose parent is at nHeightPrev with
+    // nChainTrustPrev, and whose kind was worked out by the caller. Returns
+    // the new entry.
+    const CHeaderIndex* Add(const uint256& hash, const CBlock& header, int nHeightPrev, const uint256& nChainTrustPrev, bool fProofOfStake);
+
+    // The header with the most chain trust seen; it may have been erased
+    // since, once its block was stored
+    const uint256& GetBestHash() const { return hashBest; }
+    const uint256& GetBestChainTrust() const { return nBestChainTrust; }
+
+    // Whether hash is hashTip or one of its ancestors in the header chain
+    bool IsInBranch(const uint256& hash, const uint256& hashTip) const;
+
+    // Nobody delivered block hash: mark it and everything built on it as
+    // unserved until nUntil
+    void MarkUnserved(const uint256& hash, int64_t nUntil);
+    bool IsUnserved(const uint256& hash, int64_t nNow) const;
+
+    // Headers from hashTip back to, but not including, hashStop or the
+    // first block we have, oldest first. Returns true if hashStop was met.
+    bool GetBranch(const uint256& hashTip, const uint256& hashStop, std::vector<uint256>& vBranchRet) const;
+
+    // Block hash has been stored
+    void Erase(const uint256& hash);
+
+    // Block hash is invalid: drop its header and all headers built on it,
+    // and fall back to the best of what's left. Returns the number dropped.
+    unsigned int Invalidate(const uint256& hash);
+
+    // Same as Invalidate, but the headers may be taken again later
+    unsigned int Drop(const uint256& hash);
+
+    // Drop every header that isn't one of vKeep or an ancestor of one.
+    // Returns the number dropped.
+    unsigned int Prune(const std::vector<uint256>& vKeep);
+
+    unsigned long size() const { return mapHeaders.size(); }
+};
+
+#endif /* BITCOIN_HEADERCHAIN_H */
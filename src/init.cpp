@@ -6,7 +6,9 @@
 #include "init.h"
 #include "main.h"
 #include "chainparams.h"
+#include "coins.h"
 #include "txdb.h"
+#include "txmempool.h"
 #include "rpcserver.h"
 #include "net.h"
 #include "util.h"
@@ -108,12 +110,17 @@ void Shutdown()
 #endif
 	DumpFundamentalnodes();
     StopNode();
+    if (GetBoolArg("-persistmempool", true))
+        DumpMempool();
     {
         LOCK(cs_main);
 #ifdef ENABLE_WALLET
         if (pwalletMain)
             pwalletMain->SetBestChain(CBlockLocator(pindexBest));
 #endif
+        FlushCoinsCache(true);
+        if (pindexBest)
+            CTxDB().WriteBlockIndexSnapshot();
     }
 #ifdef ENABLE_WALLET
     if (pwalletMain)
@@ -175,6 +182,12 @@ std::string HelpMessage()
     strUsage += "  -datadir=<dir>         " + _("Specify data directory") + "\n";
     strUsage += "  -wallet=<dir>          " + _("Specify wallet file (within data directory)") + "\n";
     strUsage += "  -dbcache=<n>           " + _("Set database cache size in megabytes (default: 25)") + "\n";
+    strUsage += "  -coinsindex            " + _("Maintain a database of unspent outputs to speed up block validation (default: 0)") + "\n";
+    strUsage += "  -coinscache=<n>        " + strprintf(_("Set coins database cache size in megabytes (default: %u)"), DEFAULT_COINS_CACHE) + "\n";
+    strUsage += "  -maxsigcachesize=<n>   " + strprintf(_("Limit the signature cache to <n> megabytes, up to %u; larger values are read as an entry count (default: %u)"), MAX_MAX_SIG_CACHE_SIZE, DEFAULT_MAX_SIG_CACHE_SIZE) + "\n";
+    strUsage += "  -maxmempool=<n>        " + strprintf(_("Keep the transaction memory pool below <n> megabytes (default: %u)"), DEFAULT_MAX_MEMPOOL_SIZE) + "\n";
+    strUsage += "  -persistmempool        " + _("Save the transaction memory pool at shutdown and load it at startup (default: 1)") + "\n";
+    strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS) + "\n";
     strUsage += "  -dblogsize=<n>         " + _("Set database disk log size in megabytes (default: 100)") + "\n";
     strUsage += "  -timeout=<n>           " + _("Specify connection timeout in milliseconds (default: 5000)") + "\n";
     strUsage += "  -proxy=<ip:port>       " + _("Connect through SOCKS5 proxy") + "\n";
@@ -182,6 +195,7 @@ std::string HelpMessage()
     strUsage += "  -dns                   " + _("Allow DNS lookups for -addnode, -seednode and -connect") + "\n";
     strUsage += "  -port=<port>           " + _("Listen for connections on <port> (default: 15714 or testnet: 25714)") + "\n";
     strUsage += "  -maxconnections=<n>    " + _("Maintain at most <n> connections to peers (default: 125)") + "\n";
+    strUsage += "  -msghandthreads=<n>    " + strprintf(_("Set the number of threads handling peer messages (up to %d, 0 = one per core up to 4, default: %d)"), MAX_MSGHAND_THREADS, DEFAULT_MSGHAND_THREADS) + "\n";
     strUsage += "  -addnode=<ip>          " + _("Add a node to connect to and attempt to keep the connection open") + "\n";
     strUsage += "  -connect=<ip>          " + _("Connect only to the specified node(s)") + "\n";
     strUsage += "  -seednode=<ip>         " + _("Connect to a node to retrieve peer addresses, and disconnect") + "\n";
@@ -262,11 +276,15 @@ std::string HelpMessage()
     strUsage += "  -checklevel=<n>        " + _("How thorough the block verification is (0-6, default: 1)") + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000?.dat file") + "\n";
     strUsage += "  -maxorphanblocksmib=<n> " + strprintf(_("Keep at most <n> MiB of unconnectable blocks in memory (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS) + "\n";
+    strUsage += "  -blockservecachemib=<n> " + strprintf(_("Keep up to <n> MiB of recently sent blocks ready to send again (default: %u)"), DEFAULT_BLOCK_SERVE_CACHE) + "\n";
 
     strUsage += "\n" + _("Block creation options:") + "\n";
     strUsage += "  -blockminsize=<n>      "   + _("Set minimum block size in bytes (default: 0)") + "\n";
     strUsage += "  -blockmaxsize=<n>      "   + _("Set maximum block size in bytes (default: 250000)") + "\n";
     strUsage += "  -blockprioritysize=<n> "   + _("Set maximum size of high-priority/low-fee transactions in bytes (default: 27000)") + "\n";
+#ifdef ENABLE_WALLET
+    strUsage += "  -stakethreads=<n>      " + strprintf(_("Set the number of threads searching for stake kernels (up to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), MAX_STAKE_THREADS, DEFAULT_STAKE_THREADS) + "\n";
+#endif
 
     strUsage += "\n" + _("SSL options: (see the Bitcoin Wiki for SSL setup instructions)") + "\n";
     strUsage += "  -rpcssl                                  " + _("Use OpenSSL (https) for JSON-RPC connections") + "\n";
@@ -431,6 +449,15 @@ bool AppInit2(boost::thread_group& threadGroup)
         fServer = true;
     fPrintToConsole = GetBoolArg("-printtoconsole", false);
     fLogTimestamps = GetBoolArg("-logtimestamps", false);
+
+    // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
+    nScriptCheckThreads = GetArg("-par", DEFAULT_SCRIPTCHECK_THREADS);
+    if (nScriptCheckThreads <= 0)
+        nScriptCheckThreads += boost::thread::hardware_concurrency();
+    if (nScriptCheckThreads <= 1)
+        nScriptCheckThreads = 0;
+    else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
+        nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 #ifdef ENABLE_WALLET
     bool fDisableWallet = GetBoolArg("-disablewallet", false);
 #endif
@@ -497,6 +524,19 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     if (fDaemon)
         fprintf(stdout, "B3-Coin server starting\n");
+
+    if (nScriptCheckThreads) {
+        LogPrintf("Using %u threads for script verification\n", nScriptCheckThreads);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadScriptCheck);
+    }
+
+    // Transactions from peers are checked off the message handler thread
+    int nTxAdmissionThreads = std::max(nScriptCheckThreads, 1);
+    LogPrintf("Using %u threads for transaction admission\n", nTxAdmissionThreads);
+    for (int i=0; i<nTxAdmissionThreads; i++)
+        threadGroup.create_thread(&ThreadTxAdmission);
+
 	//TODO: Starts improvement
 	if (mapArgs.count("-fundamentalnodepaymentskey")) // fundamentalnode payments priv key
     {
@@ -653,6 +693,15 @@ bool AppInit2(boost::thread_group& threadGroup)
             return false;
         }
     }
+
+    // -stakethreads=0 means one thread per core
+    nStakeThreads = GetArg("-stakethreads", DEFAULT_STAKE_THREADS);
+    if (nStakeThreads <= 0)
+        nStakeThreads += boost::thread::hardware_concurrency();
+    if (nStakeThreads < 1)
+        nStakeThreads = 1;
+    else if (nStakeThreads > MAX_STAKE_THREADS)
+        nStakeThreads = MAX_STAKE_THREADS;
 #endif
 
     BOOST_FOREACH(string strDest, mapMultiArgs["-seednode"])
@@ -685,6 +734,19 @@ bool AppInit2(boost::thread_group& threadGroup)
     }
     LogPrintf(" block index %15dms\n", GetTimeMillis() - nStart);
 
+    if (GetBoolArg("-coinsindex", false))
+    {
+        nStart = GetTimeMillis();
+        if (!LoadCoinsIndex())
+            InitWarning(_("Warning: error loading the coins database, continuing without it."));
+        if (fRequestShutdown)
+        {
+            LogPrintf("Shutdown requested. Exiting.\n");
+            return false;
+        }
+        LogPrintf(" coins index %15dms\n", GetTimeMillis() - nStart);
+    }
+
     if (GetBoolArg("-printblockindex", false) || GetBoolArg("-printblocktree", false))
     {
         PrintBlockTree();
@@ -695,7 +757,7 @@ bool AppInit2(boost::thread_group& threadGroup)
     {
         string strMatch = mapArgs["-printblock"];
         int nFound = 0;
-        for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+        for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
         {
             uint256 hash = (*mi).first;
             if (strncmp(hash.ToString().c_str(), strMatch.c_str(), strMatch.size()) == 0)
@@ -259,34 +259,41 @@ static bool GetKernelStakeModifier(uint256 hashBlockFrom, uint64_t& nStakeModifi
 //   a proof-of-work situation.
 //
 
-static bool CheckStakeKernelHashV1(unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
+// Kernel hash of a stake input and the target it has to meet, given the
+// stake modifier for it
+static bool CheckStakeKernelHashV1(unsigned int nBits, uint64_t nStakeModifier, unsigned int nTimeBlockFrom, unsigned int nTxPrevOffset, unsigned int nTimeTxPrev, int64_t nValueIn, unsigned int nPrevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake)
 {
-    if (nTimeTx < txPrev.nTime)  // Transaction timestamp violation
-        return error("CheckStakeKernelHash() : nTime violation");
-
-    unsigned int nTimeBlockFrom = blockFrom.GetBlockTime();
-
     CBigNum bnTargetPerCoinDay;
     bnTargetPerCoinDay.SetCompact(nBits);
-    int64_t nValueIn = txPrev.vout[prevout.n].nValue;
 
-    uint256 hashBlockFrom = blockFrom.GetHash();
-
-    CBigNum bnCoinDayWeight = CBigNum(nValueIn) * GetWeight((int64_t)txPrev.nTime, (int64_t)nTimeTx) / COIN / (24 * 60 * 60);
+    CBigNum bnCoinDayWeight = CBigNum(nValueIn) * GetWeight((int64_t)nTimeTxPrev, (int64_t)nTimeTx) / COIN / (24 * 60 * 60);
     targetProofOfStake = (bnCoinDayWeight * bnTargetPerCoinDay).getuint256();
 
     // Calculate hash
     CDataStream ss(SER_GETHASH, 0);
+    ss << nStakeModifier;
+    ss << nTimeBlockFrom << nTxPrevOffset << nTimeTxPrev << nPrevout << nTimeTx;
+    hashProofOfStake = Hash(ss.begin(), ss.end());
+
+    // Now check if proof-of-stake hash meets target protocol
+    return CBigNum(hashProofOfStake) <= bnCoinDayWeight * bnTargetPerCoinDay;
+}
+
+static bool CheckStakeKernelHashV1(unsigned int nBits, const CBlock& blockFrom, unsigned int nTxPrevOffset, const CTransaction& txPrev, const COutPoint& prevout, unsigned int nTimeTx, uint256& hashProofOfStake, uint256& targetProofOfStake, bool fPrintProofOfStake)
+{
+    if (nTimeTx < txPrev.nTime)  // Transaction timestamp violation
+        return error("CheckStakeKernelHash() : nTime violation");
+
+    unsigned int nTimeBlockFrom = blockFrom.GetBlockTime();
+    uint256 hashBlockFrom = blockFrom.GetHash();
+
     uint64_t nStakeModifier = 0;
     int nStakeModifierHeight = 0;
     int64_t nStakeModifierTime = 0;
-
     if (!GetKernelStakeModifier(hashBlockFrom, nStakeModifier, nStakeModifierHeight, nStakeModifierTime, fPrintProofOfStake))
         return false;
-    ss << nStakeModifier;
 
-    ss << nTimeBlockFrom << nTxPrevOffset << txPrev.nTime << prevout.n << nTimeTx;
-    hashProofOfStake = Hash(ss.begin(), ss.end());
+    bool fMeetsTarget = CheckStakeKernelHashV1(nBits, nStakeModifier, nTimeBlockFrom, nTxPrevOffset, txPrev.nTime, txPrev.vout[prevout.n].nValue, prevout.n, nTimeTx, hashProofOfStake, targetProofOfStake);
     if (fPrintProofOfStake)
     {
         LogPrintf("CheckStakeKernelHash() : using modifier 0x%016x at height=%d timestamp=%s for block from height=%d timestamp=%s\n",
@@ -300,8 +307,7 @@ static bool CheckStakeKernelHashV1(unsigned int nBits, const CBlock& blockFrom,
             hashProofOfStake.ToString());
     }
 
-    // Now check if proof-of-stake hash meets target protocol
-    if (CBigNum(hashProofOfStake) > bnCoinDayWeight * bnTargetPerCoinDay)
+    if (!fMeetsTarget)
         return false;
     if (fDebug && !fPrintProofOfStake)
     {
@@ -426,27 +432,60 @@ bool CheckCoinStakeTimestamp(int nHeight, int64_t nTimeBlock, int64_t nTimeTx)
     return (nTimeBlock == nTimeTx);
 }
 
-bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint& prevout, int64_t* pBlockTime)
+bool GetStakeKernelInput(const COutPoint& prevout, CStakeKernelInput& kernelRet)
 {
-    uint256 hashProofOfStake, targetProofOfStake;
-
     CTxDB txdb("r");
     CTransaction txPrev;
     CTxIndex txindex;
     if (!txPrev.ReadFromDisk(txdb, prevout, txindex))
         return false;
+    if (prevout.n >= txPrev.vout.size())
+        return false;
 
     // Read block header
     CBlock block;
     if (!block.ReadFromDisk(txindex.pos.nFile, txindex.pos.nBlockPos, false))
         return false;
+    uint256 hashBlockFrom = block.GetHash();
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlockFrom);
+    if (mi == mapBlockIndex.end() || !mi->second->IsInMainChain())
+        return false;
 
-    int nDepth;
-    if (IsConfirmedInNPrevBlocks(txindex, pindexPrev, nStakeMinConfirmations - 1, nDepth))
+    uint64_t nStakeModifier = 0;
+    int nStakeModifierHeight = 0;
+    int64_t nStakeModifierTime = 0;
+    if (!GetKernelStakeModifier(hashBlockFrom, nStakeModifier, nStakeModifierHeight, nStakeModifierTime, false))
+        return false;
+
+    kernelRet.pindexFrom = mi->second;
+    kernelRet.nTxPrevOffset = txindex.pos.nTxPos - txindex.pos.nBlockPos;
+    kernelRet.nTimeTxPrev = txPrev.nTime;
+    kernelRet.nValueIn = txPrev.vout[prevout.n].nValue;
+    kernelRet.nStakeModifier = nStakeModifier;
+    return true;
+}
+
+bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint& prevout, int64_t* pBlockTime)
+{
+    CStakeKernelInput kernel;
+    if (!GetStakeKernelInput(prevout, kernel))
         return false;
 
     if (pBlockTime)
-        *pBlockTime = block.GetBlockTime();
+        *pBlockTime = kernel.pindexFrom->GetBlockTime();
+
+    return CheckKernel(pindexPrev, nBits, nTime, prevout, kernel);
+}
 
-    return CheckStakeKernelHash(pindexPrev, nBits, block, txindex.pos.nTxPos - txindex.pos.nBlockPos, txPrev, prevout, nTime, hashProofOfStake, targetProofOfStake);
+bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint& prevout, const CStakeKernelInput& kernel)
+{
+    // Min age requirement, as IsConfirmedInNPrevBlocks for a block in the main chain
+    if (pindexPrev->nHeight - kernel.pindexFrom->nHeight < nStakeMinConfirmations - 1)
+        return false;
+
+    if (nTime < kernel.nTimeTxPrev)  // Transaction timestamp violation
+        return false;
+
+    uint256 hashProofOfStake, targetProofOfStake;
+    return CheckStakeKernelHashV1(nBits, kernel.nStakeModifier, kernel.pindexFrom->GetBlockTime(), kernel.nTxPrevOffset, kernel.nTimeTxPrev, kernel.nValueIn, prevout.n, nTime, hashProofOfStake, targetProofOfStake);
 }
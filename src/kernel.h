@@ -36,9 +36,37 @@ bool CheckCoinStakeTimestamp(int nHeight, int64_t nTimeBlock, int64_t nTimeTx);
 // Get time weight using supplied timestamps
 int64_t GetWeight(int64_t nIntervalBeginning, int64_t nIntervalEnd);
 
+// The parts of the kernel hash of a stake input that are fixed once its
+// stake modifier is known, so a kernel search only has to hash
+class CStakeKernelInput
+{
+public:
+    const CBlockIndex* pindexFrom; // block containing txPrev
+    unsigned int nTxPrevOffset;
+    unsigned int nTimeTxPrev;
+    int64_t nValueIn;
+    uint64_t nStakeModifier;
+
+    CStakeKernelInput()
+    {
+        pindexFrom = NULL;
+        nTxPrevOffset = 0;
+        nTimeTxPrev = 0;
+        nValueIn = 0;
+        nStakeModifier = 0;
+    }
+};
+
+// Read the kernel inputs of prevout from disk
+// Fails if prevout is not in the main chain or its stake modifier is not known yet
+bool GetStakeKernelInput(const COutPoint& prevout, CStakeKernelInput& kernelRet);
+
 // Wrapper around CheckStakeKernelHash()
 // Also checks existence of kernel input and min age
 // Convenient for searching a kernel
 bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint& prevout, int64_t* pBlockTime = NULL);
 
+// Same, with the kernel inputs looked up already; no disk access
+bool CheckKernel(CBlockIndex* pindexPrev, unsigned int nBits, int64_t nTime, const COutPoint& prevout, const CStakeKernelInput& kernel);
+
 #endif // PPCOIN_KERNEL_H
@@ -10,6 +10,8 @@
 #include "alert.h"
 #include "chainparams.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
+#include "coins.h"
 #include "db.h"
 #include "init.h"
 
@@ -20,6 +22,10 @@
 #include "net.h"
 #include "txdb.h"
 #include "txmempool.h"
+#include "txorphanpool.h"
+#include "blockencodings.h"
+#include "headerchain.h"
+#include "blockcache.h"
 #include "ui_interface.h"
 
 using namespace std;
@@ -40,12 +46,14 @@ CCriticalSection cs_main;
 
 CTxMemPool mempool;
 
-map<uint256, CBlockIndex*> mapBlockIndex;
+BlockMap mapBlockIndex;
+CBlockIndexArena arenaBlockIndex;
 set<pair<COutPoint, unsigned int> > setStakeSeen;
 
 CBigNum bnProofOfStakeLimit(~uint256(0) >> 20);
 
 int nCoinbaseMaturity = 30;
+int nScriptCheckThreads = 0;
 int nStakeMinConfirmations = 10;
 unsigned int nStakeMinAge = 1* 60 * 60; // 12 hours
 unsigned int nModifierInterval = 15 * 60; // 15 minutes
@@ -58,6 +66,7 @@ uint256 nBestInvalidTrust = 0;
 
 uint256 hashBestChain = 0;
 CBlockIndex* pindexBest = NULL;
+CChain chainActive;
 int64_t nTimeBestReceived = 0;
 bool fImporting = false;
 bool fReindex = false;
@@ -74,8 +83,25 @@ multimap<uint256, COrphanBlock*> mapOrphanBlocksByPrev;
 set<pair<COutPoint, unsigned int> > setStakeSeenOrphan;
 size_t nOrphanBlocksSize = 0;
 
-map<uint256, CTransaction> mapOrphanTransactions;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+static CTxOrphanPool orphanpool(MAX_ORPHAN_POOL_SIZE, MAX_ORPHAN_POOL_PEER_SIZE);
+
+// Compact blocks waiting for the transactions we asked their peer for
+static map<NodeId, CPartialBlock> mapPartialBlocks;
+
+// Headers-first sync: the headers we have ahead of our blocks, the blocks
+// of the best chain a peer announced still to download, and who was asked
+// for what
+static CHeaderChain headerchain;
+static deque<uint256> vBlocksToDownload;
+static set<uint256> setBlocksToDownload;
+static uint256 hashDownloadTip = 0;
+static map<uint256, pair<NodeId, int64_t> > mapBlocksInFlight;
+static map<NodeId, int> mapPeerBlocksInFlight;
+
+// Blocks of the header chain that arrived before their parent
+static map<uint256, CBlock*> mapBlocksWaiting;
+static multimap<uint256, uint256> mapBlocksWaitingByPrev;
+static size_t nBlocksWaitingSize = 0;
 
 // Constant stuff for coinbase transactions we create:
 CScript COINBASE_FLAGS;
@@ -147,88 +173,44 @@ void ResendWalletTransactions(bool fForce) {
 // Registration of network node signals.
 //
 
+// Whatever the peer still owes us goes to the others
+void static ReleaseBlocksInFlight(NodeId nodeid)
+{
+    for (map<uint256, pair<NodeId, int64_t> >::iterator it = mapBlocksInFlight.begin(); it != mapBlocksInFlight.end(); )
+    {
+        if (it->second.first == nodeid)
+            mapBlocksInFlight.erase(it++);
+        else
+            ++it;
+    }
+    mapPeerBlocksInFlight.erase(nodeid);
+}
+
+void static FinalizeNode(NodeId nodeid)
+{
+    orphanpool.EraseForPeer(nodeid);
+
+    LOCK(cs_main);
+    mapPartialBlocks.erase(nodeid);
+    ReleaseBlocksInFlight(nodeid);
+}
+
 void RegisterNodeSignals(CNodeSignals& nodeSignals)
 {
     nodeSignals.ProcessMessages.connect(&ProcessMessages);
     nodeSignals.SendMessages.connect(&SendMessages);
+    nodeSignals.FinalizeNode.connect(&FinalizeNode);
 }
 
 void UnregisterNodeSignals(CNodeSignals& nodeSignals)
 {
     nodeSignals.ProcessMessages.disconnect(&ProcessMessages);
     nodeSignals.SendMessages.disconnect(&SendMessages);
+    nodeSignals.FinalizeNode.disconnect(&FinalizeNode);
 }
 
 
 
-//////////////////////////////////////////////////////////////////////////////
-//
-// mapOrphanTransactions
-//
-
-bool AddOrphanTx(const CTransaction& tx)
-{
-    uint256 hash = tx.GetHash();
-    if (mapOrphanTransactions.count(hash))
-        return false;
-
-    // Ignore big transactions, to avoid a
-    // send-big-orphans memory exhaustion attack. If a peer has a legitimate
-    // large transaction with a missing parent then we assume
-    // it will rebroadcast it later, after the parent transaction(s)
-    // have been mined or received.
-    // 10,000 orphans, each of which is at most 5,000 bytes big is
-    // at most 500 megabytes of orphans:
-
-    size_t nSize = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
-
-    if (nSize > 5000)
-    {
-        LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", nSize, hash.ToString());
-        return false;
-    }
-
-    mapOrphanTransactions[hash] = tx;
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
-
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u)\n", hash.ToString(),
-        mapOrphanTransactions.size());
-    return true;
-}
-
-void static EraseOrphanTx(uint256 hash)
-{
-    map<uint256, CTransaction>::iterator it = mapOrphanTransactions.find(hash);
-    if (it == mapOrphanTransactions.end())
-        return;
-    BOOST_FOREACH(const CTxIn& txin, it->second.vin)
-    {
-        map<uint256, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
-        if (itPrev == mapOrphanTransactionsByPrev.end())
-            continue;
-        itPrev->second.erase(hash);
-        if (itPrev->second.empty())
-            mapOrphanTransactionsByPrev.erase(itPrev);
-    }
-    mapOrphanTransactions.erase(it);
-}
-
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
-{
-    unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans)
-    {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, CTransaction>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
-        ++nEvicted;
-    }
-    return nEvicted;
-}
 
 
 
@@ -269,7 +251,7 @@ bool CTransaction::ReadFromDisk(COutPoint prevout)
     return ReadFromDisk(txdb, prevout, txindex);
 }
 
-bool IsStandardTx(const CTransaction& tx, string& reason)
+bool IsStandardTx(const CTransaction& tx, int nBlockHeight, string& reason)
 {
     if (tx.nVersion > CTransaction::CURRENT_VERSION || tx.nVersion < 1) {
         reason = "version";
@@ -288,12 +270,13 @@ bool IsStandardTx(const CTransaction& tx, string& reason)
     // is called within CBlock::AcceptBlock(), the height of the block *being*
     // evaluated is what is used. Thus if we want to know if a transaction can
     // be part of the *next* block, we need to call IsFinalTx() with one more
-    // than chainActive.Height().
+    // than chainActive.Height(). Callers pass that in as nBlockHeight, taken
+    // from the tip they are checking against, since they may not hold cs_main.
     //
     // Timestamps on the other hand don't get any special treatment, because we
     // can't know what timestamp the next block will have, and there aren't
     // timestamp applications where it matters.
-    if (!IsFinalTx(tx, nBestHeight + 1)) {
+    if (!IsFinalTx(tx, nBlockHeight)) {
         reason = "non-final";
         return false;
     }
@@ -368,12 +351,14 @@ bool IsStandardTx(const CTransaction& tx, string& reason)
 
 bool IsFinalTx(const CTransaction &tx, int nBlockHeight, int64_t nBlockTime)
 {
-    AssertLockHeld(cs_main);
     // Time based nLockTime implemented in 0.1.6
     if (tx.nLockTime == 0)
         return true;
     if (nBlockHeight == 0)
+    {
+        AssertLockHeld(cs_main);
         nBlockHeight = nBestHeight;
+    }
     if (nBlockTime == 0)
         nBlockTime = GetAdjustedTime();
     if ((int64_t)tx.nLockTime < ((int64_t)tx.nLockTime < LOCKTIME_THRESHOLD ? (int64_t)nBlockHeight : nBlockTime))
@@ -481,6 +466,23 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const MapPrevTx& inputs)
     return nSigOps;
 }
 
+unsigned int GetP2SHSigOpCount(const CTransaction& tx, CCoinsViewCache& view)
+{
+    if (tx.IsCoinBase())
+        return 0;
+
+    unsigned int nSigOps = 0;
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+    {
+        const CCoin* pcoin = view.AccessCoin(tx.vin[i].prevout);
+        if (!pcoin)
+            throw std::runtime_error("GetP2SHSigOpCount() : prevout not in coins view");
+        if (pcoin->txout.scriptPubKey.IsPayToScriptHash())
+            nSigOps += pcoin->txout.scriptPubKey.GetSigOpCount(tx.vin[i].scriptSig);
+    }
+    return nSigOps;
+}
+
 int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
 {
     AssertLockHeld(cs_main);
@@ -516,7 +518,7 @@ int CMerkleTx::SetMerkleBranch(const CBlock* pblock)
     vMerkleBranch = pblock->GetMerkleBranch(nIndex);
 
     // Is the tx in a block that's in the main chain
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -647,10 +649,15 @@ int64_t GetMinFee(const CTransaction& tx, unsigned int nBlockSize, enum GetMinFe
 }
 
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs)
+// Everything AcceptToMemoryPool checks before the transaction goes into
+// the pool, including the signatures. Doesn't need cs_main: the inputs
+// are read from the database and the pool as they are now, and checked
+// against pindexTip, the best block when the caller started. Inputs that
+// came from the pool are returned in setPoolInputsRet so the caller can
+// make sure they are still there when it inserts.
+static bool CheckMempoolAdmission(CTxMemPool& pool, CTransaction &tx, bool fLimitFree, bool* pfMissingInputs,
+                                  const CBlockIndex* pindexTip, CTxMemPoolEntry& entryRet, set<uint256>& setPoolInputsRet)
 {
-    AssertLockHeld(cs_main);
     if (pfMissingInputs)
         *pfMissingInputs = false;
 
@@ -667,7 +674,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
 
     // Rather not work on nonstandard transactions (unless -testnet)
     string reason;
-    if (!TestNet() && !IsStandardTx(tx, reason))
+    if (!TestNet() && !IsStandardTx(tx, pindexTip->nHeight + 1, reason))
         return error("AcceptToMemoryPool : nonstandard transaction: %s",
                      reason);
 
@@ -744,6 +751,14 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
                          hash.ToString(),
                          nFees, txMinFee);
 
+        // Once the pool has been full, new transactions have to pay more
+        // than what was last evicted
+        int64_t nMempoolMinFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000) * nSize / 1000;
+        if (fLimitFree && nFees < nMempoolMinFee)
+            return error("AcceptToMemoryPool : mempool min fee not met %s, %d < %d",
+                         hash.ToString(),
+                         nFees, nMempoolMinFee);
+
         // Continuously rate-limit free transactions
         // This mitigates 'penny-flooding' -- sending thousands of free transactions just to
         // be annoying or make others' transactions take longer to confirm.
@@ -778,7 +793,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
 
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false, STANDARD_SCRIPT_VERIFY_FLAGS))
+        if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexTip, false, false, STANDARD_SCRIPT_VERIFY_FLAGS))
         {
             return error("AcceptToMemoryPool : ConnectInputs failed %s", hash.ToString());
         }
@@ -792,23 +807,84 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
         // There is a similar check in CreateNewBlock() to prevent creating
         // invalid blocks, however allowing such transactions into the mempool
         // can be exploited as a DoS attack.
-        if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexBest, false, false, MANDATORY_SCRIPT_VERIFY_FLAGS))
+        if (!tx.ConnectInputs(txdb, mapInputs, mapUnused, CDiskTxPos(1,1,1), pindexTip, false, false, MANDATORY_SCRIPT_VERIFY_FLAGS))
         {
             return error("AcceptToMemoryPool: : BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s", hash.ToString());
         }
+
+        // Work out once what block assembly needs to know about the
+        // transaction, so CreateNewBlock doesn't have to fetch the inputs
+        // again. Inputs still in the pool don't count towards priority.
+        double dPriority = 0;
+        int64_t nValueInChain = 0;
+        int nHeight;
+        {
+            LOCK(cs_main); // mapBlockIndex
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            {
+                const CTxIndex& txindex = mapInputs[txin.prevout.hash].first;
+                if (txindex.pos == CDiskTxPos(1,1,1) || pool.exists(txin.prevout.hash))
+                {
+                    setPoolInputsRet.insert(txin.prevout.hash);
+                    continue;
+                }
+                int64_t nValue = mapInputs[txin.prevout.hash].second.vout[txin.prevout.n].nValue;
+                dPriority += (double)nValue * txindex.GetDepthInMainChain();
+                nValueInChain += nValue;
+            }
+            nHeight = nBestHeight;
+        }
+        dPriority /= nSize;
+
+        entryRet = CTxMemPoolEntry(tx, nFees, tx.GetValueIn(mapInputs), nValueInChain,
+                                   nSigOps, GetTime(), nHeight, dPriority);
     }
 
-    // Store transaction in memory
-    pool.addUnchecked(hash, tx);
+    return true;
+}
+
+// Put a transaction that passed CheckMempoolAdmission into the pool, if
+// nothing conflicting got there first
+static bool FinishMempoolAdmission(CTxMemPool& pool, CTransaction &tx, const CTxMemPoolEntry& entry)
+{
+    uint256 hash = tx.GetHash();
+    {
+        LOCK(pool.cs);
+        if (pool.mapTx.count(hash))
+            return false;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            if (pool.mapNextTx.count(txin.prevout))
+                return false;
+
+        // Store transaction in memory
+        pool.addUnchecked(hash, entry);
+
+        // Make room if the pool is over its limit; that may be this one
+        pool.TrimToSize(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+        if (!pool.exists(hash))
+            return error("AcceptToMemoryPool : mempool full, %s not accepted", hash.ToString());
+    }
 
     SyncWithWallets(tx, NULL);
 
     LogPrint("mempool", "AcceptToMemoryPool : accepted %s (poolsz %u)\n",
            hash.ToString(),
-           pool.mapTx.size());
+           pool.size());
     return true;
 }
 
+bool AcceptToMemoryPool(CTxMemPool& pool, CTransaction &tx, bool fLimitFree,
+                        bool* pfMissingInputs)
+{
+    AssertLockHeld(cs_main);
+
+    CTxMemPoolEntry entry;
+    set<uint256> setPoolInputs;
+    if (!CheckMempoolAdmission(pool, tx, fLimitFree, pfMissingInputs, pindexBest, entry, setPoolInputs))
+        return false;
+    return FinishMempoolAdmission(pool, tx, entry);
+}
+
 ///TODO: Start
 bool AcceptableFundamentalTxn(CTxMemPool& pool, CTransaction &tx, bool ignoreFees)
 {
@@ -922,7 +998,7 @@ int CMerkleTx::GetDepthInMainChainINTERNAL(CBlockIndex* &pindexRet) const
     AssertLockHeld(cs_main);
 
     // Find the block it claims to be in
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -998,7 +1074,7 @@ int CTxIndex::GetDepthInMainChain() const
     if (!block.ReadFromDisk(pos.nFile, pos.nBlockPos, false))
         return 0;
     // Find the block in the index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(block.GetHash());
+    BlockMap::iterator mi = mapBlockIndex.find(block.GetHash());
     if (mi == mapBlockIndex.end())
         return 0;
     CBlockIndex* pindex = (*mi).second;
@@ -1043,22 +1119,9 @@ bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock)
 // CBlock and CBlockIndex
 //
 
-static CBlockIndex* pblockindexFBBHLast;
 CBlockIndex* FindBlockByHeight(int nHeight)
 {
-    CBlockIndex *pblockindex;
-    if (nHeight < nBestHeight / 2)
-        pblockindex = pindexGenesisBlock;
-    else
-        pblockindex = pindexBest;
-    if (pblockindexFBBHLast && abs(nHeight - pblockindex->nHeight) > abs(nHeight - pblockindexFBBHLast->nHeight))
-        pblockindex = pblockindexFBBHLast;
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-    while (pblockindex->nHeight < nHeight)
-        pblockindex = pblockindex->pnext;
-    pblockindexFBBHLast = pblockindex;
-    return pblockindex;
+    return chainActive[nHeight];
 }
 
 bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
@@ -1075,21 +1138,6 @@ bool CBlock::ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions)
     return true;
 }
 
-uint256 static GetOrphanRoot(const uint256& hash)
-{
-    map<uint256, COrphanBlock*>::iterator it = mapOrphanBlocks.find(hash);
-    if (it == mapOrphanBlocks.end())
-        return hash;
-
-    // Work back to the first block in the orphan chain
-    do {
-        map<uint256, COrphanBlock*>::iterator it2 = mapOrphanBlocks.find(it->second->hashPrev);
-        if (it2 == mapOrphanBlocks.end())
-            return it->first;
-        it = it2;
-    } while(true);
-}
-
 // ppcoin: find block wanted by given orphan block
 uint256 WantedByOrphan(const COrphanBlock* pblockOrphan)
 {
@@ -1526,8 +1574,24 @@ int64_t CTransaction::GetValueIn(const MapPrevTx& inputs) const
 
 }
 
+int64_t CTransaction::GetValueIn(CCoinsViewCache& view) const
+{
+    if (IsCoinBase())
+        return 0;
+
+    int64_t nResult = 0;
+    for (unsigned int i = 0; i < vin.size(); i++)
+    {
+        const CCoin* pcoin = view.AccessCoin(vin[i].prevout);
+        if (!pcoin)
+            throw std::runtime_error("CTransaction::GetValueIn() : prevout not in coins view");
+        nResult += pcoin->txout.nValue;
+    }
+    return nResult;
+}
+
 bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags)
+    const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags, std::vector<CScriptCheck> *pvChecks)
 {
     // Take over previous transactions' spent pointers
     // fBlock is true when this is called from AcceptBlock when a new best-block is added to the blockchain
@@ -1536,7 +1600,6 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
     if (!IsCoinBase())
     {
         int64_t nValueIn = 0;
-        int64_t nFees = 0;
         for (unsigned int i = 0; i < vin.size(); i++)
         {
             COutPoint prevout = vin[i].prevout;
@@ -1589,28 +1652,11 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             // still computed and checked, and any change will be caught at the next checkpoint.
             if (!(fBlock && (nBestHeight < Checkpoints::GetTotalBlocksEstimate())))
             {
-                // Verify signature
-                if (!VerifySignature(txPrev, *this, i, flags, 0))
-                {
-                    if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
-                        // Check whether the failure was caused by a
-                        // non-mandatory script verification check, such as
-                        // non-null dummy arguments;
-                        // if so, don't trigger DoS protection to
-                        // avoid splitting the network between upgraded and
-                        // non-upgraded nodes.
-                        if (VerifySignature(txPrev, *this, i, flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, 0))
-                            return error("ConnectInputs() : %s non-mandatory VerifySignature failed", GetHash().ToString());
-                    }
-                    // Failures of other flags indicate a transaction that is
-                    // invalid in new blocks, e.g. a invalid P2SH. We DoS ban
-                    // such nodes as they are not following the protocol. That
-                    // said during an upgrade careful thought should be taken
-                    // as to the correct behavior - we may want to continue
-                    // peering with non-upgraded nodes even after a soft-fork
-                    // super-majority vote has passed.
-                    return DoS(100,error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString()));
-                }
+                // Verify signature, or leave it to the caller's check queue
+                if (pvChecks)
+                    pvChecks->push_back(CScriptCheck(txPrev.vout[prevout.n].scriptPubKey, *this, i, flags));
+                else if (!VerifyInputScript(txPrev.vout[prevout.n].scriptPubKey, i, flags))
+                    return false;
             }
 
             // Mark outpoints as spent
@@ -1623,37 +1669,168 @@ bool CTransaction::ConnectInputs(CTxDB& txdb, MapPrevTx inputs, map<uint256, CTx
             }
         }
 
-        if (!IsCoinStake())
+        if (!CheckValueIn(nValueIn))
+            return false;
+    }
+
+    return true;
+}
+
+bool CScriptCheck::operator()() const
+{
+    const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
+    if (!VerifyScript(scriptSig, scriptPubKey, *ptxTo, nIn, nFlags, 0))
+        return error("CScriptCheck() : %s VerifySignature failed", ptxTo->GetHash().ToString());
+    return true;
+}
+
+bool CTransaction::VerifyInputScript(const CScript& scriptPubKey, unsigned int nIn, unsigned int flags) const
+{
+    if (VerifyScript(vin[nIn].scriptSig, scriptPubKey, *this, nIn, flags, 0))
+        return true;
+
+    if (flags & STANDARD_NOT_MANDATORY_VERIFY_FLAGS) {
+        // Check whether the failure was caused by a
+        // non-mandatory script verification check, such as
+        // non-null dummy arguments;
+        // if so, don't trigger DoS protection to
+        // avoid splitting the network between upgraded and
+        // non-upgraded nodes.
+        if (VerifyScript(vin[nIn].scriptSig, scriptPubKey, *this, nIn, flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, 0))
+            return error("ConnectInputs() : %s non-mandatory VerifySignature failed", GetHash().ToString());
+    }
+    // Failures of other flags indicate a transaction that is
+    // invalid in new blocks, e.g. a invalid P2SH. We DoS ban
+    // such nodes as they are not following the protocol. That
+    // said during an upgrade careful thought should be taken
+    // as to the correct behavior - we may want to continue
+    // peering with non-upgraded nodes even after a soft-fork
+    // super-majority vote has passed.
+    return DoS(100,error("ConnectInputs() : %s VerifySignature failed", GetHash().ToString()));
+}
+
+bool CTransaction::CheckValueIn(int64_t nValueIn) const
+{
+    if (IsCoinStake())
+        return true;
+
+    if (nValueIn < GetValueOut())
+        return DoS(100, error("ConnectInputs() : %s value in < value out", GetHash().ToString()));
+
+    // Tally transaction fees
+    int64_t nTxFee = 0;
+
+    if((nValueIn - GetValueOut()) >= FUNDAMENTALNODEAMOUNT ){
+        nTxFee = nValueIn - FUNDAMENTALNODEAMOUNT - GetValueOut();
+        LogPrintf("ConnectInputs : Funamental Transaction\n");
+    } else{
+        nTxFee = nValueIn - GetValueOut();
+        LogPrintf("ConnectInputs : Not a Funamental Transaction\n");
+    }
+
+
+    //nValueIn - GetValueOut();
+    if (nTxFee < 0)
+        return DoS(100, error("ConnectInputs() : %s nTxFee < 0", GetHash().ToString()));
+
+    if (!MoneyRange(nTxFee))
+        return DoS(100, error("ConnectInputs() : nFees out of range"));
+    //TODO:
+    //insane fee check
+
+    return true;
+}
+
+bool CTransaction::FetchInputIndexes(CTxDB& txdb, const map<uint256, CTxIndex>& mapTestPool, MapPrevTx& inputsRet)
+{
+    if (IsCoinBase())
+        return true;
+
+    for (unsigned int i = 0; i < vin.size(); i++)
+    {
+        COutPoint prevout = vin[i].prevout;
+        if (inputsRet.count(prevout.hash))
+            continue; // Got it already
+
+        CTxIndex& txindex = inputsRet[prevout.hash].first;
+        if (mapTestPool.count(prevout.hash))
+            txindex = mapTestPool.find(prevout.hash)->second;
+        else if (!txdb.ReadTxIndex(prevout.hash, txindex))
+            return error("FetchInputs() : %s prev tx %s index entry not found", GetHash().ToString(),  prevout.hash.ToString());
+
+        if (prevout.n >= txindex.vSpent.size())
+            return DoS(100, error("FetchInputs() : %s prevout.n out of range %d %u prev tx %s", GetHash().ToString(), prevout.n, txindex.vSpent.size(), prevout.hash.ToString()));
+    }
+
+    return true;
+}
+
+bool CTransaction::ConnectInputs(CCoinsViewCache& view, MapPrevTx inputs, map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
+    const CBlockIndex* pindexBlock, unsigned int flags, std::vector<CScriptCheck> *pvChecks)
+{
+    // Same rules as ConnectInputs(txdb, ...) with fBlock set
+    if (IsCoinBase())
+        return true;
+
+    int64_t nValueIn = 0;
+    for (unsigned int i = 0; i < vin.size(); i++)
+    {
+        COutPoint prevout = vin[i].prevout;
+        assert(inputs.count(prevout.hash) > 0);
+        CTxIndex& txindex = inputs[prevout.hash].first;
+        const CCoin* pcoin = view.AccessCoin(prevout);
+        if (!pcoin)
+            return error("ConnectInputs() : %s prev output %s not in coins view", GetHash().ToString(), prevout.ToString());
+
+        if (prevout.n >= txindex.vSpent.size())
+            return DoS(100, error("ConnectInputs() : %s prevout.n out of range %d %u prev tx %s", GetHash().ToString(), prevout.n, txindex.vSpent.size(), prevout.hash.ToString()));
+
+        // If prev is coinbase or coinstake, check that it's matured
+        if (pcoin->fCoinBase || pcoin->fCoinStake)
         {
-            if (nValueIn < GetValueOut())
-                return DoS(100, error("ConnectInputs() : %s value in < value out", GetHash().ToString()));
-
-            // Tally transaction fees
-            int64_t nTxFee = 0;
-
-            if((nValueIn - GetValueOut()) >= FUNDAMENTALNODEAMOUNT ){
-                nTxFee = nValueIn - FUNDAMENTALNODEAMOUNT - GetValueOut();
-                LogPrintf("ConnectInputs : Funamental Transaction\n");
-            } else{
-                nTxFee = nValueIn - GetValueOut();
-                LogPrintf("ConnectInputs : Not a Funamental Transaction\n");
-            }
+            int nSpendDepth = pindexBlock->nHeight - pcoin->nHeight;
+            if (nSpendDepth < nCoinbaseMaturity)
+                return error("ConnectInputs() : tried to spend %s at depth %d", pcoin->fCoinBase ? "coinbase" : "coinstake", nSpendDepth);
+        }
+
+        // ppcoin: check transaction timestamp
+        if (pcoin->nTime > nTime)
+            return DoS(100, error("ConnectInputs() : transaction timestamp earlier than input transaction"));
 
+        if (pcoin->txout.IsEmpty())
+            return DoS(1, error("ConnectInputs() : special marker is not spendable"));
 
-            //nValueIn - GetValueOut();
-            if (nTxFee < 0)
-                return DoS(100, error("ConnectInputs() : %s nTxFee < 0", GetHash().ToString()));
+        // Check for negative or overflow input values
+        nValueIn += pcoin->txout.nValue;
+        if (!MoneyRange(pcoin->txout.nValue) || !MoneyRange(nValueIn))
+            return DoS(100, error("ConnectInputs() : txin values out of range"));
+    }
+    // Only if ALL inputs pass the cheap checks do we verify signatures
+    for (unsigned int i = 0; i < vin.size(); i++)
+    {
+        COutPoint prevout = vin[i].prevout;
+        CTxIndex& txindex = inputs[prevout.hash].first;
 
-            nFees += nTxFee;
-            if (!MoneyRange(nFees))
-                return DoS(100, error("ConnectInputs() : nFees out of range"));
-            //TODO:
-            //insane fee check
+        // Check for conflicts (double-spend)
+        if (!txindex.vSpent[prevout.n].IsNull())
+            return error("ConnectInputs() : %s prev tx already used at %s", GetHash().ToString(), txindex.vSpent[prevout.n].ToString());
 
+        // Skip ECDSA signature verification before the last blockchain checkpoint
+        if (!(nBestHeight < Checkpoints::GetTotalBlocksEstimate()))
+        {
+            const CScript& scriptPubKey = view.AccessCoin(prevout)->txout.scriptPubKey;
+            if (pvChecks)
+                pvChecks->push_back(CScriptCheck(scriptPubKey, *this, i, flags));
+            else if (!VerifyInputScript(scriptPubKey, i, flags))
+                return false;
         }
+
+        // Mark outpoints as spent
+        txindex.vSpent[prevout.n] = posThisTx;
+        mapTestPool[prevout.hash] = txindex;
     }
 
-    return true;
+    return CheckValueIn(nValueIn);
 }
 
 
@@ -1690,6 +1867,25 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
         if (!vtx[i].DisconnectInputs(txdb))
             return false;
 
+    // Restore the coins this block spent
+    CCoinsViewCache* pcoins = txdb.GetCoinsView();
+    if (pcoins)
+    {
+        uint256 hash = GetHash();
+        vector<CCoin> vUndo;
+        if (pcoins->GetBestBlock() != hash)
+            AbandonCoinsIndex(txdb, "coins database not at block being disconnected");
+        else if (!txdb.ReadCoinsUndo(hash, vUndo))
+            AbandonCoinsIndex(txdb, strprintf("no coins undo data for block %s", hash.ToString()));
+        else if (!pcoins->UndoBlock(*this, vUndo))
+            AbandonCoinsIndex(txdb, strprintf("coins undo data for block %s does not match", hash.ToString()));
+        else
+        {
+            pcoins->SetBestBlock(hashPrevBlock);
+            txdb.EraseCoinsUndo(hash);
+        }
+    }
+
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
     if (pindex->pprev)
@@ -1707,6 +1903,13 @@ bool CBlock::DisconnectBlock(CTxDB& txdb, CBlockIndex* pindex)
     return true;
 }
 
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
+
+void ThreadScriptCheck() {
+    RenameThread("b3coin-scriptch");
+    scriptcheckqueue.Thread();
+}
+
 bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
 {
     // Check it again in case a previous version let a bad block in, but skip BlockSig checking
@@ -1730,6 +1933,19 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
     else
         nTxPos = pindex->nBlockPos + ::GetSerializeSize(CBlock(), SER_DISK, CLIENT_VERSION) - (2 * GetSizeOfCompactSize(0)) + GetSizeOfCompactSize(vtx.size());
 
+    // Coins database view to keep in step, only when the block really gets connected
+    CCoinsViewCache* pcoins = fJustCheck ? NULL : txdb.GetCoinsView();
+    if (pcoins && pcoins->GetBestBlock() != hashPrevBlock)
+    {
+        AbandonCoinsIndex(txdb, "coins database not at previous block");
+        pcoins = NULL;
+    }
+    vector<CCoin> vCoinsUndo;
+
+    // Signature checks are handed to the script check threads, if there are
+    // any, and collected before anything is written
+    CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
+
     map<uint256, CTxIndex> mapQueuedChanges;
     int64_t nFees = 0;
     int64_t nValueIn = 0;
@@ -1773,18 +1989,29 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             nValueOut += tx.GetValueOut();
         else
         {
-            bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapQueuedChanges, true, false, mapInputs, fInvalid))
-                return false;
+            // Previous outputs come from the coins database when it has all
+            // of them; anything else takes the old path through the block files
+            bool fCoinsInputs = pcoins && pcoins->HaveInputs(tx);
+            if (fCoinsInputs)
+            {
+                if (!tx.FetchInputIndexes(txdb, mapQueuedChanges, mapInputs))
+                    return false;
+            }
+            else
+            {
+                bool fInvalid;
+                if (!tx.FetchInputs(txdb, mapQueuedChanges, true, false, mapInputs, fInvalid))
+                    return false;
+            }
 
             // Add in sigops done by pay-to-script-hash inputs;
             // this is to prevent a "rogue miner" from creating
             // an incredibly-expensive-to-validate block.
-            nSigOps += GetP2SHSigOpCount(tx, mapInputs);
+            nSigOps += fCoinsInputs ? GetP2SHSigOpCount(tx, *pcoins) : GetP2SHSigOpCount(tx, mapInputs);
             if (nSigOps > MAX_BLOCK_SIGOPS)
                 return DoS(100, error("ConnectBlock() : too many sigops"));
 
-            int64_t nTxValueIn = tx.GetValueIn(mapInputs);
+            int64_t nTxValueIn = fCoinsInputs ? tx.GetValueIn(*pcoins) : tx.GetValueIn(mapInputs);
             int64_t nTxValueOut = tx.GetValueOut();
 
             //check if burnt txn for fundamental node
@@ -1810,13 +2037,38 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             if (tx.IsCoinStake())
                 nStakeReward = nTxValueOut - nTxValueIn;
 
-            if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags))
-                return false;
+            vector<CScriptCheck> vChecks;
+            vector<CScriptCheck> *pvChecks = nScriptCheckThreads ? &vChecks : NULL;
+            if (fCoinsInputs)
+            {
+                if (!tx.ConnectInputs(*pcoins, mapInputs, mapQueuedChanges, posThisTx, pindex, flags, pvChecks))
+                    return false;
+            }
+            else
+            {
+                if (!tx.ConnectInputs(txdb, mapInputs, mapQueuedChanges, posThisTx, pindex, true, false, flags, pvChecks))
+                    return false;
+                // A valid spend of an output the coins database does not know
+                if (pcoins)
+                {
+                    AbandonCoinsIndex(txdb, strprintf("coins database is missing inputs of %s", hashTx.ToString()));
+                    pcoins = NULL;
+                }
+            }
+            control.Add(vChecks);
         }
 
         mapQueuedChanges[hashTx] = CTxIndex(posThisTx, tx.vout.size());
+        if (pcoins && !pcoins->UpdateCoins(tx, pindex->nHeight, vCoinsUndo))
+        {
+            AbandonCoinsIndex(txdb, strprintf("UpdateCoins failed for %s", hashTx.ToString()));
+            pcoins = NULL;
+        }
     }
 
+    if (!control.Wait())
+        return DoS(100, error("ConnectBlock() : script verification failed"));
+
     if (IsProofOfWork())
     {
         int64_t nReward = GetProofOfWorkReward(nFees, pindex->nHeight);
@@ -1855,6 +2107,18 @@ bool CBlock::ConnectBlock(CTxDB& txdb, CBlockIndex* pindex, bool fJustCheck)
             return error("ConnectBlock() : UpdateTxIndex failed");
     }
 
+    // Keep the spent coins around so the block can be disconnected again,
+    // and drop those of the block that fell out of the reorganisation window
+    if (pcoins)
+    {
+        if (!txdb.WriteCoinsUndo(pindex->GetBlockHash(), vCoinsUndo))
+            return error("ConnectBlock() : WriteCoinsUndo failed");
+        const CBlockIndex* pindexOld = pindex->GetAncestor(pindex->nHeight - COINS_UNDO_DEPTH);
+        if (pindexOld)
+            txdb.EraseCoinsUndo(pindexOld->GetBlockHash());
+        pcoins->SetBestBlock(pindex->GetBlockHash());
+    }
+
     // Update block index on disk without changing it in memory.
     // The memory index structure will be changed after the db commits.
     if (pindex->pprev)
@@ -1906,6 +2170,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
 
     // Disconnect shorter branch
     list<CTransaction> vResurrect;
+    vector<CTransaction> vDisconnected;
     BOOST_FOREACH(CBlockIndex* pindex, vDisconnect)
     {
         CBlock block;
@@ -1920,6 +2185,7 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
         BOOST_REVERSE_FOREACH(const CTransaction& tx, block.vtx)
             if (!(tx.IsCoinBase() || tx.IsCoinStake()) && pindex->nHeight > Checkpoints::GetTotalBlocksEstimate())
                 vResurrect.push_front(tx);
+        vDisconnected.insert(vDisconnected.end(), block.vtx.begin(), block.vtx.end());
     }
 
     // Connect longer branch
@@ -1956,15 +2222,33 @@ bool static Reorganize(CTxDB& txdb, CBlockIndex* pindexNew)
     BOOST_FOREACH(CBlockIndex* pindex, vConnect)
         if (pindex->pprev)
             pindex->pprev->pnext = pindex;
+    chainActive.SetTip(pindexNew);
 
     // Resurrect memory transactions that were in the disconnected branch
     BOOST_FOREACH(CTransaction& tx, vResurrect)
         AcceptToMemoryPool(mempool, tx, false, NULL);
 
     // Delete redundant memory transactions that are in the connected branch
-    BOOST_FOREACH(CTransaction& tx, vDelete) {
-        mempool.remove(tx);
-        mempool.removeConflicts(tx);
+    mempool.removeForBlock(vDelete);
+
+    // Memory transactions spending outputs that are gone with the
+    // disconnected branch (coinstakes, or transactions that couldn't be
+    // resurrected) can't be mined any more. Block assembly trusts the
+    // pool, so drop them here.
+    {
+        LOCK(mempool.cs);
+        BOOST_FOREACH(const CTransaction& tx, vDisconnected)
+        {
+            uint256 hash = tx.GetHash();
+            if (mempool.mapTx.count(hash) || txdb.ContainsTx(hash))
+                continue;
+            for (unsigned int i = 0; i < tx.vout.size(); i++)
+            {
+                map<COutPoint, CInPoint>::iterator it = mempool.mapNextTx.find(COutPoint(hash, i));
+                if (it != mempool.mapNextTx.end())
+                    mempool.remove(*it->second.ptx, true);
+            }
+        }
     }
 
     LogPrintf("REORGANIZE: done\n");
@@ -1990,10 +2274,10 @@ bool CBlock::SetBestChainInner(CTxDB& txdb, CBlockIndex *pindexNew)
 
     // Add to current best branch
     pindexNew->pprev->pnext = pindexNew;
+    chainActive.SetTip(pindexNew);
 
     // Delete redundant memory transactions
-    BOOST_FOREACH(CTransaction& tx, vtx)
-        mempool.remove(tx);
+    mempool.removeForBlock(vtx);
 
     return true;
 }
@@ -2011,6 +2295,7 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
         if (!txdb.TxnCommit())
             return error("SetBestChain() : TxnCommit failed");
         pindexGenesisBlock = pindexNew;
+        chainActive.SetTip(pindexNew);
     }
     else if (hashPrevBlock == hashBestChain)
     {
@@ -2071,10 +2356,21 @@ bool CBlock::SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew)
         g_signals.SetBestChain(locator);
     }
 
+    // Write the coins cache back if it grew too large
+    FlushCoinsCache(false);
+
+    // Refresh the block index snapshot now and then, so a restart after a
+    // crash does not have to read many entries from the database
+    static int64_t nLastBlockIndexSnapshot = GetTime();
+    if (GetTime() - nLastBlockIndexSnapshot > BLOCKINDEX_SNAPSHOT_INTERVAL)
+    {
+        nLastBlockIndexSnapshot = GetTime();
+        txdb.WriteBlockIndexSnapshot();
+    }
+
     // New best block
     hashBestChain = hash;
     pindexBest = pindexNew;
-    pblockindexFBBHLast = NULL;
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexNew->nChainTrust;
     nTimeBestReceived = GetTime();
@@ -2170,15 +2466,14 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
         return error("AddToBlockIndex() : %s already exists", hash.ToString());
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(nFile, nBlockPos, *this);
-    if (!pindexNew)
-        return error("AddToBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = arenaBlockIndex.New(CBlockIndex(nFile, nBlockPos, *this));
     pindexNew->phashBlock = &hash;
-    map<uint256, CBlockIndex*>::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator miPrev = mapBlockIndex.find(hashPrevBlock);
     if (miPrev != mapBlockIndex.end())
     {
         pindexNew->pprev = (*miPrev).second;
         pindexNew->nHeight = pindexNew->pprev->nHeight + 1;
+        pindexNew->BuildSkip();
     }
 
     // ppcoin: compute chain trust score
@@ -2200,10 +2495,11 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
     pindexNew->bnStakeModifierV2 = ComputeStakeModifierV2(pindexNew->pprev, IsProofOfWork() ? hash : vtx[1].vin[0].prevout.hash);
 
     // Add to mapBlockIndex
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
+    BlockMap::iterator mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     if (pindexNew->IsProofOfStake())
         setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
     pindexNew->phashBlock = &((*mi).first);
+    headerchain.Erase(hash);
 
     // Write to disk block index
     CTxDB txdb;
@@ -2232,7 +2528,7 @@ bool CBlock::AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const u
 
 
 
-bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) const
+bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig, bool fCheckPayment) const
 {
     // These are checks that are independent of context
     // that can be verified before saving an orphan block.
@@ -2297,19 +2593,63 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
     }*/
 
 
-   // ----------- fundamentalnode payments -----------
+    if (fCheckPayment && !CheckFundamentalnodePayment())
+        return false;
 
-    bool FundamentalnodePayments = false;
+    // Check transactions
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+    {
+        if (!tx.CheckTransaction())
+            return DoS(tx.nDoS, error("CheckBlock() : CheckTransaction failed"));
 
-    if(TestNet()){
-        if(GetBlockTime() > START_FUNDAMENTALNODE_PAYMENTS_TESTNET) FundamentalnodePayments = true;
-    } else {
-        if(GetBlockTime() > START_FUNDAMENTALNODE_PAYMENTS) FundamentalnodePayments = true;
+        // ppcoin: check transaction timestamp
+        if (GetBlockTime() < (int64_t)tx.nTime)
+            return DoS(50, error("CheckBlock() : block timestamp earlier than transaction timestamp"));
     }
 
-    if(!IsSporkActive(SPORK_1_FUNDAMENTALNODE_PAYMENTS_ENFORCEMENT)){
-        FundamentalnodePayments = true; // Bitsenddev
-        if(fDebug) LogPrintf("CheckBlock() : Fundamentalnode payment enforcement is off\n");
+    // Check for duplicate txids. This is caught by ConnectInputs(),
+    // but catching it earlier avoids a potential DoS attack:
+    set<uint256> uniqueTx;
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+    {
+        uniqueTx.insert(tx.GetHash());
+    }
+    if (uniqueTx.size() != vtx.size())
+        return DoS(100, error("CheckBlock() : duplicate transaction"));
+
+    unsigned int nSigOps = 0;
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+    {
+        nSigOps += GetLegacySigOpCount(tx);
+    }
+    if (nSigOps > MAX_BLOCK_SIGOPS)
+        return DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"));
+
+    // Check merkle root
+    if (fCheckMerkleRoot && hashMerkleRoot != BuildMerkleTree())
+        return DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"));
+
+
+    return true;
+}
+
+// Unlike the other checks in CheckBlock this one depends on the current best
+// block, and needs cs_main
+bool CBlock::CheckFundamentalnodePayment() const
+{
+   // ----------- fundamentalnode payments -----------
+
+    bool FundamentalnodePayments = false;
+
+    if(TestNet()){
+        if(GetBlockTime() > START_FUNDAMENTALNODE_PAYMENTS_TESTNET) FundamentalnodePayments = true;
+    } else {
+        if(GetBlockTime() > START_FUNDAMENTALNODE_PAYMENTS) FundamentalnodePayments = true;
+    }
+
+    if(!IsSporkActive(SPORK_1_FUNDAMENTALNODE_PAYMENTS_ENFORCEMENT)){
+        FundamentalnodePayments = true; // Bitsenddev
+        if(fDebug) LogPrintf("CheckBlock() : Fundamentalnode payment enforcement is off\n");
     }
 
     if(FundamentalnodePayments)
@@ -2386,42 +2726,6 @@ bool CBlock::CheckBlock(bool fCheckPOW, bool fCheckMerkleRoot, bool fCheckSig) c
         LogPrintf("CheckBlock() : skipping fundamentalnode payment checks\n");
     } ///TODO: ends
 
-
-
-    // Check transactions
-    BOOST_FOREACH(const CTransaction& tx, vtx)
-    {
-        if (!tx.CheckTransaction())
-            return DoS(tx.nDoS, error("CheckBlock() : CheckTransaction failed"));
-
-        // ppcoin: check transaction timestamp
-        if (GetBlockTime() < (int64_t)tx.nTime)
-            return DoS(50, error("CheckBlock() : block timestamp earlier than transaction timestamp"));
-    }
-
-    // Check for duplicate txids. This is caught by ConnectInputs(),
-    // but catching it earlier avoids a potential DoS attack:
-    set<uint256> uniqueTx;
-    BOOST_FOREACH(const CTransaction& tx, vtx)
-    {
-        uniqueTx.insert(tx.GetHash());
-    }
-    if (uniqueTx.size() != vtx.size())
-        return DoS(100, error("CheckBlock() : duplicate transaction"));
-
-    unsigned int nSigOps = 0;
-    BOOST_FOREACH(const CTransaction& tx, vtx)
-    {
-        nSigOps += GetLegacySigOpCount(tx);
-    }
-    if (nSigOps > MAX_BLOCK_SIGOPS)
-        return DoS(100, error("CheckBlock() : out-of-bounds SigOpCount"));
-
-    // Check merkle root
-    if (fCheckMerkleRoot && hashMerkleRoot != BuildMerkleTree())
-        return DoS(100, error("CheckBlock() : hashMerkleRoot mismatch"));
-
-
     return true;
 }
 
@@ -2438,7 +2742,7 @@ bool CBlock::AcceptBlock()
         return error("AcceptBlock() : block already in mapBlockIndex");
 
     // Get prev block index
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevBlock);
+    BlockMap::iterator mi = mapBlockIndex.find(hashPrevBlock);
     if (mi == mapBlockIndex.end())
         return DoS(10, error("AcceptBlock() : prev block not found"));
     CBlockIndex* pindexPrev = (*mi).second;
@@ -2553,15 +2857,532 @@ bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, uns
     return (nFound >= nRequired);
 }
 
-void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd)
+BlockHasher::BlockHasher()
+{
+    k0 = GetRand(std::numeric_limits<uint64_t>::max());
+    k1 = GetRand(std::numeric_limits<uint64_t>::max());
+}
+
+size_t BlockHasher::operator()(const uint256& hash) const
+{
+    uint64_t h = k0;
+    for (int i = 0; i < 4; i++)
+    {
+        h ^= hash.Get64(i);
+        h *= 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
+    }
+    return (size_t)(h ^ k1);
+}
+
+CBlockIndex* CBlockIndexArena::New(const CBlockIndex& index)
+{
+    if (nUsed == CHUNK_SIZE)
+    {
+        vChunks.push_back(new CBlockIndex[CHUNK_SIZE]);
+        nUsed = 0;
+    }
+    CBlockIndex* pindex = &vChunks.back()[nUsed++];
+    *pindex = index;
+    return pindex;
+}
+
+void CBlockIndexArena::Clear()
+{
+    BOOST_FOREACH(CBlockIndex* pchunk, vChunks)
+        delete[] pchunk;
+    vChunks.clear();
+    nUsed = CHUNK_SIZE;
+}
+
+/** Turn the lowest '1' bit in the binary representation of a number into a '0'. */
+int static inline InvertLowestOne(int n) { return n & (n - 1); }
+
+/** Compute what height to jump back to with the CBlockIndex::pskip pointer. */
+int static inline GetSkipHeight(int height) {
+    if (height < 2)
+        return 0;
+
+    // Determine which height to jump back to. Any number strictly lower than height is acceptable,
+    // but the following expression seems to perform well in simulations (max 110 steps to go back
+    // up to 2**18 blocks).
+    return (height & 1) ? InvertLowestOne(InvertLowestOne(height - 1)) + 1 : InvertLowestOne(height);
+}
+
+CBlockIndex* CBlockIndex::GetAncestor(int height)
+{
+    if (height > nHeight || height < 0)
+        return NULL;
+
+    CBlockIndex* pindexWalk = this;
+    int heightWalk = nHeight;
+    while (heightWalk > height) {
+        int heightSkip = GetSkipHeight(heightWalk);
+        int heightSkipPrev = GetSkipHeight(heightWalk - 1);
+        if (pindexWalk->pskip != NULL &&
+            (heightSkip == height ||
+             (heightSkip > height && !(heightSkipPrev < heightSkip - 2 &&
+                                       heightSkipPrev >= height)))) {
+            // Only follow pskip if pprev->pskip isn't better than pskip->pprev.
+            pindexWalk = pindexWalk->pskip;
+            heightWalk = heightSkip;
+        } else {
+            pindexWalk = pindexWalk->pprev;
+            heightWalk--;
+        }
+    }
+    return pindexWalk;
+}
+
+const CBlockIndex* CBlockIndex::GetAncestor(int height) const
+{
+    return const_cast<CBlockIndex*>(this)->GetAncestor(height);
+}
+
+void CBlockIndex::BuildSkip()
+{
+    if (pprev)
+        pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
+}
+
+void CChain::SetTip(CBlockIndex* pindex)
+{
+    if (pindex == NULL) {
+        vChain.clear();
+        return;
+    }
+    vChain.resize(pindex->nHeight + 1);
+    while (pindex && vChain[pindex->nHeight] != pindex) {
+        vChain[pindex->nHeight] = pindex;
+        pindex = pindex->pprev;
+    }
+}
+
+const CBlockIndex* CChain::FindFork(const CBlockIndex* pindex) const
+{
+    if (pindex == NULL)
+        return NULL;
+    if (pindex->nHeight > Height())
+        pindex = pindex->GetAncestor(Height());
+    while (pindex && !Contains(pindex))
+        pindex = pindex->pprev;
+    return pindex;
+}
+
+void static PushGetHeaders(CNode* pnode, const uint256& hashFrom)
+{
+    // The peer answers from the first hash it has in its main chain: the
+    // header we got to, or else our best block
+    CBlockLocator locator(pindexBest);
+    if (hashFrom != 0)
+        locator.PushFront(hashFrom);
+    pnode->PushMessage("getheaders", locator, uint256(0));
+}
+
+int64_t static GetHeaderMedianTimePast(const uint256& hash)
+{
+    vector<int64_t> vTimes;
+    uint256 hashWalk = hash;
+    const CHeaderIndex* pheader;
+    while (vTimes.size() < CBlockIndex::nMedianTimeSpan && (pheader = headerchain.Find(hashWalk)))
+    {
+        vTimes.push_back(pheader->GetBlockTime());
+        hashWalk = pheader->hashPrev;
+    }
+    BlockMap::iterator mi = mapBlockIndex.find(hashWalk);
+    for (CBlockIndex* pindex = (mi == mapBlockIndex.end() ? NULL : (*mi).second);
+         pindex && vTimes.size() < CBlockIndex::nMedianTimeSpan; pindex = pindex->pprev)
+        vTimes.push_back(pindex->GetBlockTime());
+    if (vTimes.empty())
+        return 0;
+
+    sort(vTimes.begin(), vTimes.end());
+    return vTimes[vTimes.size() / 2];
+}
+
+// Target required of a block of the given kind on top of hashPrev, which
+// may be a header we don't have the block for yet. The headers the retarget
+// looks at stand in for block indexes so GetNextTargetRequired can be used.
+unsigned int static GetNextTargetRequiredForHeader(const uint256& hashPrev, bool fProofOfStake)
+{
+    deque<CBlockIndex> vStandIn;
+    CBlockIndex* pindexLast = NULL;
+    CBlockIndex* pindexChild = NULL;
+    int nSameKind = 0;
+    uint256 hash = hashPrev;
+    const CHeaderIndex* pheader;
+    while ((pheader = headerchain.Find(hash)) != NULL)
+    {
+        vStandIn.push_back(CBlockIndex());
+        CBlockIndex* pindex = &vStandIn.back();
+        pindex->nHeight = pheader->nHeight;
+        pindex->nTime = pheader->nTime;
+        pindex->nBits = pheader->nBits;
+        if (pheader->fProofOfStake)
+            pindex->SetProofOfStake();
+        if (pindexChild)
+            pindexChild->pprev = pindex;
+        else
+            pindexLast = pindex;
+        pindexChild = pindex;
+
+        // Two of the kind and the one before the older of them is all the
+        // retarget needs
+        if (nSameKind == 2)
+            return GetNextTargetRequired(pindexLast, fProofOfStake);
+        if (pheader->fProofOfStake == fProofOfStake)
+            nSameKind++;
+        hash = pheader->hashPrev;
+    }
+
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    CBlockIndex* pindexBlock = mi == mapBlockIndex.end() ? NULL : (*mi).second;
+    if (!pindexChild)
+        return GetNextTargetRequired(pindexBlock, fProofOfStake);
+    pindexChild->pprev = pindexBlock;
+    return GetNextTargetRequired(pindexLast, fProofOfStake);
+}
+
+// Check a header received during headers-first sync and add it to the
+// header chain. Without its coinstake a proof-of-stake header can only be
+// checked for its place in the chain, its time and its target; the kernel
+// is checked once the block is in.
+bool static AcceptBlockHeader(const CBlock& header, const uint256& hash, int& nHeightRet)
+{
+    AssertLockHeld(cs_main);
+
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end())
+    {
+        nHeightRet = (*mi).second->nHeight;
+        return true;
+    }
+    const CHeaderIndex* pheader = headerchain.Find(hash);
+    if (pheader)
+    {
+        nHeightRet = pheader->nHeight;
+        return true;
+    }
+
+    if (headerchain.IsInvalid(hash) || headerchain.IsInvalid(header.hashPrevBlock))
+        return header.DoS(100, error("AcceptBlockHeader() : block %s is invalid", hash.ToString()));
+
+    if (header.nVersion > CBlock::CURRENT_VERSION)
+        return header.DoS(100, error("AcceptBlockHeader() : reject unknown block version %d", header.nVersion));
+
+    int nHeightPrev;
+    uint256 nChainTrustPrev;
+    const CHeaderIndex* pheaderPrev = headerchain.Find(header.hashPrevBlock);
+    if (pheaderPrev)
+    {
+        nHeightPrev = pheaderPrev->nHeight;
+        nChainTrustPrev = pheaderPrev->nChainTrust;
+    }
+    else
+    {
+        mi = mapBlockIndex.find(header.hashPrevBlock);
+        if (mi == mapBlockIndex.end())
+            return header.DoS(10, error("AcceptBlockHeader() : prev block %s not found", header.hashPrevBlock.ToString()));
+        nHeightPrev = (*mi).second->nHeight;
+        nChainTrustPrev = (*mi).second->nChainTrust;
+    }
+    int nHeight = nHeightPrev + 1;
+
+    // Past the last proof-of-work block every block is proof-of-stake. Up to
+    // it a header is taken for proof-of-work only if it carries the work the
+    // chain asks for there; anything else must have the proof-of-stake target.
+    bool fProofOfStake = true;
+    if (nHeight <= Params().LastPOWBlock() &&
+        header.nBits == GetNextTargetRequiredForHeader(header.hashPrevBlock, false) &&
+        CheckProofOfWork(header.GetPoWHash(), header.nBits))
+        fProofOfStake = false;
+    if (fProofOfStake && header.nBits != GetNextTargetRequiredForHeader(header.hashPrevBlock, true))
+        return header.DoS(100, error("AcceptBlockHeader() : incorrect target at height %d", nHeight));
+
+    if (header.GetBlockTime() > FutureDrift(GetAdjustedTime()))
+        return error("AcceptBlockHeader() : block timestamp too far in the future");
+    if (header.GetBlockTime() <= GetHeaderMedianTimePast(header.hashPrevBlock))
+        return header.DoS(20, error("AcceptBlockHeader() : block's timestamp is too early"));
+
+    if (!Checkpoints::CheckHardened(nHeight, hash))
+        return header.DoS(100, error("AcceptBlockHeader() : rejected by hardened checkpoint lock-in at %d", nHeight));
+
+    headerchain.Add(hash, header, nHeightPrev, nChainTrustPrev, fProofOfStake);
+    nHeightRet = nHeight;
+    return true;
+}
+
+// Chain trust of block or header hash, if we know it
+bool static GetKnownChainTrust(const uint256& hash, uint256& nChainTrustRet)
+{
+    const CHeaderIndex* pheader = headerchain.Find(hash);
+    if (pheader)
+    {
+        nChainTrustRet = pheader->nChainTrust;
+        return true;
+    }
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
+    if (mi == mapBlockIndex.end())
+        return false;
+    nChainTrustRet = (*mi).second->nChainTrust;
+    return true;
+}
+
+// pnode announced block hash; keep it if it is the best it has announced.
+// Returns true if it was.
+bool static UpdateBestKnownHeader(CNode* pnode, const uint256& hash)
+{
+    uint256 nChainTrust, nChainTrustBest;
+    if (!GetKnownChainTrust(hash, nChainTrust))
+        return false;
+    if (pnode->hashBestKnownHeader != 0 && GetKnownChainTrust(pnode->hashBestKnownHeader, nChainTrustBest) &&
+        nChainTrustBest >= nChainTrust)
+        return false;
+    pnode->hashBestKnownHeader = hash;
+    return true;
+}
+
+void static ClearBlocksToDownload()
+{
+    vBlocksToDownload.clear();
+    setBlocksToDownload.clear();
+    hashDownloadTip = 0;
+}
+
+// Queue the blocks we don't have of the best chain a peer has announced,
+// as long as it has more trust than our best chain. Headers don't prove
+// stake, so anyone can announce a chain with more trust than the real one.
+// The chains of peers that have been delivering blocks are preferred over
+// those of peers that haven't yet, and a branch whose blocks nobody
+// delivered isn't followed for a while, whoever announces it.
+void static UpdateBlocksToDownload()
+{
+    uint256 hashTarget = 0;
+    int64_t nNow = GetTime();
+    {
+        LOCK(cs_vNodes);
+        for (int nPass = 0; nPass < 2 && hashTarget == 0; nPass++)
+        {
+            uint256 nTargetTrust = nBestChainTrust;
+            BOOST_FOREACH(CNode* pnode, vNodes)
+            {
+                if (nPass == 0 && !pnode->fServedBlocks)
+                    continue;
+                if (pnode->nDownloadStalledUntil > nNow || headerchain.IsUnserved(pnode->hashBestKnownHeader, nNow))
+                    continue;
+                const CHeaderIndex* pheader = headerchain.Find(pnode->hashBestKnownHeader);
+                if (pheader && pheader->nChainTrust > nTargetTrust)
+                {
+                    hashTarget = pnode->hashBestKnownHeader;
+                    nTargetTrust = pheader->nChainTrust;
+                }
+            }
+        }
+    }
+    if (hashTarget == 0)
+    {
+        ClearBlocksToDownload();
+        return;
+    }
+    if (hashTarget == hashDownloadTip)
+        return;
+
+    // Usually the new headers just extend the queue
+    vector<uint256> vBranch;
+    if (!headerchain.GetBranch(hashTarget, hashDownloadTip, vBranch))
+        ClearBlocksToDownload();
+    vBlocksToDownload.insert(vBlocksToDownload.end(), vBranch.begin(), vBranch.end());
+    setBlocksToDownload.insert(vBranch.begin(), vBranch.end());
+    hashDownloadTip = hashTarget;
+}
+
+// Height up to which the queued blocks are ancestors of the best header
+// pnode announced, or -1 if none are. A peer on another branch is only
+// used where that branch meets the queue within the download window.
+int static GetAnnouncedDownloadHeight(CNode* pnode)
+{
+    uint256 hash = pnode->hashBestKnownHeader;
+    for (unsigned int i = 0; i <= BLOCK_DOWNLOAD_WINDOW; i++)
+    {
+        const CHeaderIndex* pheader = headerchain.Find(hash);
+        if (!pheader)
+            return -1;
+        if (setBlocksToDownload.count(hash))
+            return pheader->nHeight;
+        hash = pheader->hashPrev;
+    }
+    return -1;
+}
+
+void static EraseWaitingBlock(map<uint256, CBlock*>::iterator it)
+{
+    CBlock* pblock = it->second;
+    multimap<uint256, uint256>::iterator mi = mapBlocksWaitingByPrev.lower_bound(pblock->hashPrevBlock);
+    while (mi != mapBlocksWaitingByPrev.upper_bound(pblock->hashPrevBlock))
+    {
+        if (mi->second == it->first)
+            mapBlocksWaitingByPrev.erase(mi++);
+        else
+            ++mi;
+    }
+    nBlocksWaitingSize -= ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION);
+    delete pblock;
+    mapBlocksWaiting.erase(it);
+}
+
+// Headers have been dropped: forget the blocks downloaded for them and
+// work out what to download again
+void static HeadersDropped()
+{
+    for (map<uint256, CBlock*>::iterator it = mapBlocksWaiting.begin(); it != mapBlocksWaiting.end(); )
+    {
+        if (!headerchain.Find(it->first))
+            EraseWaitingBlock(it++);
+        else
+            ++it;
+    }
+
+    ClearBlocksToDownload();
+    UpdateBlocksToDownload();
+}
+
+// Block hash of the header chain failed validation: forget the headers
+// built on it and the blocks downloaded for them
+void static InvalidateHeader(const uint256& hash)
+{
+    if (!headerchain.Find(hash))
+        return;
+
+    unsigned int nDropped = headerchain.Invalidate(hash);
+    LogPrintf("InvalidateHeader() : block %s is invalid, dropped %u headers\n", hash.ToString(), nDropped);
+    HeadersDropped();
+}
+
+// Block hash of the header chain couldn't be stored for a reason other
+// than breaking the rules: forget it and what's built on it for now, so
+// it can be fetched again with its headers
+void static DropHeader(const uint256& hash)
+{
+    if (!headerchain.Find(hash))
+        return;
+
+    unsigned int nDropped = headerchain.Drop(hash);
+    LogPrint("net", "DropHeader() : block %s not stored, dropped %u headers\n", hash.ToString(), nDropped);
+    HeadersDropped();
+}
+
+// Keep the header chain to the branches connected peers announced
+void static PruneHeaders()
+{
+    vector<uint256> vKeep;
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            vKeep.push_back(pnode->hashBestKnownHeader);
+    }
+
+    unsigned int nDropped = headerchain.Prune(vKeep);
+    if (nDropped == 0)
+        return;
+    LogPrint("net", "PruneHeaders() : dropped %u headers, %u left\n", nDropped, headerchain.size());
+    HeadersDropped();
+}
+
+void static MarkBlockReceived(CNode* pfrom, const uint256& hash)
 {
-    // Filter out duplicate requests
-    if (pindexBegin == pnode->pindexLastGetBlocksBegin && hashEnd == pnode->hashLastGetBlocksEnd)
+    map<uint256, pair<NodeId, int64_t> >::iterator it = mapBlocksInFlight.find(hash);
+    if (it == mapBlocksInFlight.end())
         return;
-    pnode->pindexLastGetBlocksBegin = pindexBegin;
-    pnode->hashLastGetBlocksEnd = hashEnd;
+    if (it->second.first == pfrom->GetId())
+        pfrom->fServedBlocks = true;
+
+    map<NodeId, int>::iterator itPeer = mapPeerBlocksInFlight.find(it->second.first);
+    if (itPeer != mapPeerBlocksInFlight.end() && --itPeer->second <= 0)
+        mapPeerBlocksInFlight.erase(itPeer);
+    mapBlocksInFlight.erase(it);
+}
+
+// Ask pto for the next blocks in the download window that it announced
+// and nobody else has been asked for
+void static FindBlocksToDownload(CNode* pto, vector<CInv>& vGetData)
+{
+    NodeId nodeid = pto->GetId();
+    int64_t nNow = GetTime();
+    int nInFlight = 0;
+    map<NodeId, int>::iterator itPeer = mapPeerBlocksInFlight.find(nodeid);
+    if (itPeer != mapPeerBlocksInFlight.end())
+        nInFlight = itPeer->second;
+
+    // A peer sitting on a block holds up everything after it. It only gets
+    // asked for blocks of the chain it announced, so it is penalized, its
+    // requests go to the others, and for a while it isn't asked for more or
+    // followed. If nobody else announced the branch, the branch isn't
+    // followed for a while either, so another connection from the same peer
+    // can't announce it again and hold up the download once more.
+    if (nInFlight > 0)
+    {
+        for (map<uint256, pair<NodeId, int64_t> >::iterator it = mapBlocksInFlight.begin(); it != mapBlocksInFlight.end(); ++it)
+        {
+            if (it->second.first == nodeid && it->second.second < nNow - BLOCK_DOWNLOAD_TIMEOUT)
+            {
+                uint256 hash = it->first;
+                LogPrintf("peer=%d took too long to send block %s, asking other peers\n", nodeid, hash.ToString());
+                ReleaseBlocksInFlight(nodeid);
+                pto->nDownloadStalledUntil = nNow + BLOCK_DOWNLOAD_STALL_TIME;
+                pto->fServedBlocks = false;
+
+                bool fAnnounced = false;
+                {
+                    LOCK(cs_vNodes);
+                    BOOST_FOREACH(CNode* pnode, vNodes)
+                        if (!fAnnounced && pnode != pto && pnode->nDownloadStalledUntil <= nNow && headerchain.IsInBranch(hash, pnode->hashBestKnownHeader))
+                            fAnnounced = true;
+                }
+                if (!fAnnounced)
+                {
+                    LogPrintf("no other peer announced block %s, not following its branch for now\n", hash.ToString());
+                    headerchain.MarkUnserved(hash, nNow + BLOCK_DOWNLOAD_STALL_TIME);
+                }
+
+                UpdateBlocksToDownload();
+                pto->Misbehaving(BLOCK_DOWNLOAD_STALL_PENALTY);
+                return;
+            }
+        }
+    }
+    if (pto->nDownloadStalledUntil > nNow)
+        return;
+
+    while (!vBlocksToDownload.empty() && mapBlockIndex.count(vBlocksToDownload.front()))
+    {
+        setBlocksToDownload.erase(vBlocksToDownload.front());
+        vBlocksToDownload.pop_front();
+    }
+
+    int nAnnouncedHeight = GetAnnouncedDownloadHeight(pto);
+    if (nAnnouncedHeight < 0)
+        return;
+
+    for (unsigned int i = 0; i < vBlocksToDownload.size() && i < BLOCK_DOWNLOAD_WINDOW && nInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER; i++)
+    {
+        // The first missing block is asked for even when the ones after it
+        // are filling up memory
+        if (i > 0 && nBlocksWaitingSize >= MAX_BLOCKS_WAITING_SIZE)
+            break;
+
+        const uint256& hash = vBlocksToDownload[i];
+        if (mapBlocksInFlight.count(hash) || mapBlocksWaiting.count(hash) || mapBlockIndex.count(hash))
+            continue;
+        const CHeaderIndex* pheader = headerchain.Find(hash);
+        if (!pheader || pheader->nHeight > nAnnouncedHeight)
+            break;
 
-    pnode->PushMessage("getblocks", CBlockLocator(pindexBegin), hashEnd);
+        vGetData.push_back(CInv(MSG_BLOCK, hash));
+        mapBlocksInFlight[hash] = make_pair(nodeid, nNow);
+        nInFlight++;
+    }
+    if (nInFlight > 0)
+        mapPeerBlocksInFlight[nodeid] = nInFlight;
 }
 
 bool static IsCanonicalBlockSignature(CBlock* pblock, bool checkLowS)
@@ -2573,7 +3394,7 @@ bool static IsCanonicalBlockSignature(CBlock* pblock, bool checkLowS)
     return checkLowS ? IsLowDERSignature(pblock->vchBlockSig, false) : IsDERSignature(pblock->vchBlockSig, false);
 }
 
-bool ProcessBlock(CNode* pfrom, CBlock* pblock)
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool fCheckedBlock)
 {
     AssertLockHeld(cs_main);
 
@@ -2583,6 +3404,8 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
         return error("ProcessBlock() : already have block %d %s", mapBlockIndex[hash]->nHeight, hash.ToString());
     if (mapOrphanBlocks.count(hash))
         return error("ProcessBlock() : already have block (orphan) %s", hash.ToString());
+    if (mapBlocksWaiting.count(hash))
+        return error("ProcessBlock() : already have block (waiting for its parent) %s", hash.ToString());
 
     // ppcoin: check proof-of-stake
     // Limited duplicity on stake: prevents block flood attack
@@ -2621,13 +3444,23 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
             return error("ProcessBlock(): EnsureLowS failed");
     }
 
-    // Preliminary checks
-    if (!pblock->CheckBlock())
+    // Preliminary checks; the context free ones may have been done already
+    if (fCheckedBlock ? !pblock->CheckFundamentalnodePayment() : !pblock->CheckBlock())
         return error("ProcessBlock() : CheckBlock FAILED");
 
     // If we don't already have its previous block, shunt it off to holding area until we get it
     if (!mapBlockIndex.count(pblock->hashPrevBlock))
     {
+        // A block of the header chain downloaded ahead of its parent waits
+        // for it; the parent has been asked for already
+        if (headerchain.Find(hash))
+        {
+            mapBlocksWaiting[hash] = new CBlock(*pblock);
+            mapBlocksWaitingByPrev.insert(make_pair(pblock->hashPrevBlock, hash));
+            nBlocksWaitingSize += ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION);
+            return true;
+        }
+
         LogPrintf("ProcessBlock: ORPHAN BLOCK %lu, prev=%s\n", (unsigned long)mapOrphanBlocks.size(), pblock->hashPrevBlock.ToString());
 
         // Accept orphans as long as there is a node to request its parents from
@@ -2656,10 +3489,10 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
             if (pblock->IsProofOfStake())
                 setStakeSeenOrphan.insert(pblock->GetProofOfStake());
 
-            // Ask this guy to fill in what we're missing
-            PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(hash));
-            // ppcoin: getblocks may not obtain the ancestor block rejected
-            // earlier by duplicate-stake check so we ask for it again directly
+            // Ask this guy for the headers leading to it
+            PushGetHeaders(pfrom, headerchain.GetBestHash());
+            // ppcoin: the ancestor block may have been rejected earlier by
+            // the duplicate-stake check so we ask for it again directly
             if (!IsInitialBlockDownload())
                 pfrom->AskFor(CInv(MSG_BLOCK, WantedByOrphan(pblock2)));
         }
@@ -2668,7 +3501,15 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
 
     // Store to disk
     if (!pblock->AcceptBlock())
+    {
+        // Only breaking the rules marks the header invalid; a block that
+        // couldn't be checked or written may come again
+        if (pblock->nDoS > 0)
+            InvalidateHeader(hash);
+        else
+            DropHeader(hash);
         return error("ProcessBlock() : AcceptBlock FAILED");
+    }
 
     // Recursively process any orphan blocks that depended on this one
     vector<uint256> vWorkQueue;
@@ -2694,6 +3535,30 @@ bool ProcessBlock(CNode* pfrom, CBlock* pblock)
             delete mi->second;
         }
         mapOrphanBlocksByPrev.erase(hashPrev);
+
+        // And the downloaded blocks that were waiting for it
+        vector<uint256> vWaiting;
+        for (multimap<uint256, uint256>::iterator mi = mapBlocksWaitingByPrev.lower_bound(hashPrev);
+             mi != mapBlocksWaitingByPrev.upper_bound(hashPrev);
+             ++mi)
+            vWaiting.push_back(mi->second);
+        mapBlocksWaitingByPrev.erase(hashPrev);
+        BOOST_FOREACH(const uint256& hashWaiting, vWaiting)
+        {
+            map<uint256, CBlock*>::iterator it = mapBlocksWaiting.find(hashWaiting);
+            if (it == mapBlocksWaiting.end())
+                continue;
+            CBlock* pblockWaiting = it->second;
+            mapBlocksWaiting.erase(it);
+            nBlocksWaitingSize -= ::GetSerializeSize(*pblockWaiting, SER_NETWORK, PROTOCOL_VERSION);
+            if (pblockWaiting->AcceptBlock())
+                vWorkQueue.push_back(hashWaiting);
+            else if (pblockWaiting->nDoS > 0)
+                InvalidateHeader(hashWaiting);
+            else
+                DropHeader(hashWaiting);
+            delete pblockWaiting;
+        }
     }
 	
 	if(!fProMode){
@@ -2821,7 +3686,7 @@ bool CheckDiskSpace(uint64_t nAdditionalBytes)
     return true;
 }
 
-static filesystem::path BlockFilePath(unsigned int nFile)
+filesystem::path BlockFilePath(unsigned int nFile)
 {
     string strBlockFn = strprintf("blk%04u.dat", nFile);
     return GetDataDir() / strBlockFn;
@@ -2913,7 +3778,7 @@ void PrintBlockTree()
     AssertLockHeld(cs_main);
     // pre-compute tree structure
     map<CBlockIndex*, vector<CBlockIndex*> > mapNext;
-    for (map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
+    for (BlockMap::iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); ++mi)
     {
         CBlockIndex* pindex = (*mi).second;
         mapNext[pindex->pprev].push_back(pindex);
@@ -2981,65 +3846,307 @@ void PrintBlockTree()
     }
 }
 
-bool LoadExternalBlockFile(FILE* fileIn)
+/** Bounds on the blocks LoadExternalBlockFile holds between reading them
+    from the file and handing them to ProcessBlock */
+static const unsigned int MAX_IMPORT_BLOCKS_IN_FLIGHT = 256;
+static const unsigned int MAX_IMPORT_BYTES_IN_FLIGHT = 32 * 1000000;
+/** Size of the reads from the file being imported */
+static const unsigned int IMPORT_READ_SIZE = 1000000;
+
+// A block on its way through LoadExternalBlockFile
+struct CImportBlock
 {
-    int64_t nStart = GetTimeMillis();
+    unsigned int nSeq;        // position among the blocks of the file
+    unsigned int nSize;
+    std::vector<char> vch;    // serialized block, released once parsed
+    CBlock block;
+    bool fParsed;             // a worker is done with it
+    bool fChecked;            // deserialized and passed the context free checks
 
-    int nLoaded = 0;
+    CImportBlock() : nSeq(0), nSize(0), fParsed(false), fChecked(false) {}
+};
+
+/** Pipeline behind LoadExternalBlockFile. One thread scans the file for
+    blocks, a group of workers deserializes them and runs the checks of
+    CheckBlock that do not depend on the chain, and the calling thread hands
+    them to ProcessBlock in file order. Bounded by MAX_IMPORT_*_IN_FLIGHT.
+ */
+class CBlockImporter
+{
+private:
+    FILE* file;
+    int64_t nFileSize;
+
+    boost::mutex mutex;
+    boost::condition_variable condWork;  // workers wait for blocks to parse
+    boost::condition_variable condDone;  // the caller waits for the next block in order
+    boost::condition_variable condSpace; // the reader waits for blocks to leave
+    std::deque<CImportBlock*> queueParse;
+    std::map<unsigned int, CImportBlock*> mapInFlight;
+    unsigned int nBytesInFlight;
+    unsigned int nFound;
+    int64_t nBytesRead;
+    bool fEndOfFile;
+    bool fQuit;
+
+    bool Push(CImportBlock* pblock);
+    void ReadBlocks();
+    void ThreadRead();
+    void ThreadParse();
+
+public:
+    CBlockImporter(FILE* fileIn);
+    ~CBlockImporter();
+
+    // Import the file with nThreads parsing threads and return the number
+    // of blocks that were accepted
+    int Run(unsigned int nThreads);
+};
+
+CBlockImporter::CBlockImporter(FILE* fileIn) :
+    file(fileIn), nFileSize(0), nBytesInFlight(0), nFound(0), nBytesRead(0), fEndOfFile(false), fQuit(false)
+{
+    if (fseek(file, 0, SEEK_END) == 0)
+        nFileSize = ftell(file);
+    fseek(file, 0, SEEK_SET);
+}
+
+CBlockImporter::~CBlockImporter()
+{
+    // Whatever a worker still had is in mapInFlight as well
+    for (std::map<unsigned int, CImportBlock*>::iterator it = mapInFlight.begin(); it != mapInFlight.end(); ++it)
+        delete it->second;
+}
+
+// Queue a block for the workers, waiting for room first; false if the
+// import was abandoned
+bool CBlockImporter::Push(CImportBlock* pblock)
+{
+    boost::unique_lock<boost::mutex> lock(mutex);
+    while (!fQuit && !mapInFlight.empty() &&
+           (mapInFlight.size() >= MAX_IMPORT_BLOCKS_IN_FLIGHT || nBytesInFlight + pblock->nSize > MAX_IMPORT_BYTES_IN_FLIGHT))
+        condSpace.wait(lock);
+    if (fQuit)
+    {
+        delete pblock;
+        return false;
+    }
+    pblock->nSeq = nFound++;
+    nBytesInFlight += pblock->nSize;
+    mapInFlight[pblock->nSeq] = pblock;
+    queueParse.push_back(pblock);
+    condWork.notify_one();
+    return true;
+}
+
+// Find the blocks in the file: each one follows the message start and its
+// size. Anything in between is skipped.
+void CBlockImporter::ReadBlocks()
+{
+    std::vector<char> vBuf(IMPORT_READ_SIZE);
+    size_t nBegin = 0, nEnd = 0;
+    bool fEof = false;
+    while (true)
     {
+        char* pbuf = &vBuf[0];
+        size_t nMagic = nBegin;
+        while (nMagic + MESSAGE_START_SIZE <= nEnd && memcmp(pbuf + nMagic, Params().MessageStart(), MESSAGE_START_SIZE) != 0)
+        {
+            void* pfind = memchr(pbuf + nMagic + 1, Params().MessageStart()[0], nEnd - nMagic - 1);
+            nMagic = pfind ? (char*)pfind - pbuf : nEnd;
+        }
+
+        size_t nNeed = 0;
+        if (nMagic + MESSAGE_START_SIZE + sizeof(unsigned int) <= nEnd)
+        {
+            unsigned int nSize;
+            memcpy(&nSize, pbuf + nMagic + MESSAGE_START_SIZE, sizeof(nSize));
+            size_t nHeader = MESSAGE_START_SIZE + sizeof(nSize);
+            if (nSize == 0 || nSize > MAX_BLOCK_SIZE)
+            {
+                nBegin = nMagic + 1;
+                continue;
+            }
+            if (nMagic + nHeader + nSize <= nEnd)
+            {
+                CImportBlock* pblock = new CImportBlock();
+                pblock->nSize = nSize;
+                pblock->vch.assign(pbuf + nMagic + nHeader, pbuf + nMagic + nHeader + nSize);
+                nBegin = nMagic + nHeader + nSize;
+                if (!Push(pblock))
+                    return;
+                continue;
+            }
+            nNeed = nHeader + nSize;
+        }
+
+        // Out of data; keep what may be the start of the next block and read on
+        if (fEof)
+            return;
+        size_t nKeep = nEnd - nMagic;
+        memmove(pbuf, pbuf + nMagic, nKeep);
+        nBegin = 0;
+        nEnd = nKeep;
+        if (nNeed > vBuf.size())
+            vBuf.resize(nNeed);
+        size_t nRead = fread(&vBuf[nEnd], 1, vBuf.size() - nEnd, file);
+        if (nRead == 0)
+        {
+            if (ferror(file))
+                LogPrintf("LoadExternalBlockFile() : read error after %d bytes\n", nBytesRead);
+            fEof = true;
+        }
+        nEnd += nRead;
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            nBytesRead += nRead;
+        }
+        boost::this_thread::interruption_point();
+    }
+}
+
+void CBlockImporter::ThreadRead()
+{
+    try {
+        ReadBlocks();
+    }
+    catch (boost::thread_interrupted) {
+    }
+    catch (std::exception& e) {
+        PrintExceptionContinue(&e, "LoadExternalBlockFile()");
+    }
+
+    boost::lock_guard<boost::mutex> lock(mutex);
+    fEndOfFile = true;
+    condWork.notify_all();
+    condDone.notify_all();
+}
+
+void CBlockImporter::ThreadParse()
+{
+    while (true)
+    {
+        CImportBlock* pblock;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            while (queueParse.empty() && !fEndOfFile && !fQuit)
+                condWork.wait(lock);
+            if (fQuit || queueParse.empty())
+                return;
+            pblock = queueParse.front();
+            queueParse.pop_front();
+        }
+
         try {
-            CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
-            unsigned int nPos = 0;
-            while (nPos != (unsigned int)-1 && blkdat.good())
+            CSpanReader reader(&pblock->vch[0], &pblock->vch[0] + pblock->vch.size(), SER_DISK, CLIENT_VERSION);
+            reader >> pblock->block;
+            // The payment check needs the chain, ProcessBlock does it
+            pblock->fChecked = pblock->block.CheckBlock(true, true, true, false);
+        }
+        catch (std::exception& e) {
+            LogPrintf("LoadExternalBlockFile() : deserialize error in block %u of the file\n", pblock->nSeq);
+        }
+        std::vector<char>().swap(pblock->vch);
+
+        boost::lock_guard<boost::mutex> lock(mutex);
+        pblock->fParsed = true;
+        condDone.notify_one();
+    }
+}
+
+int CBlockImporter::Run(unsigned int nThreads)
+{
+    int64_t nStart = GetTimeMillis();
+    int64_t nLastReport = nStart;
+    int64_t nTimeWait = 0, nTimeProcess = 0;
+    unsigned int nNext = 0;
+    int nLoaded = 0;
+
+    boost::thread_group threads;
+    threads.create_thread(boost::bind(&CBlockImporter::ThreadRead, this));
+    for (unsigned int i = 0; i < nThreads; i++)
+        threads.create_thread(boost::bind(&CBlockImporter::ThreadParse, this));
+
+    try {
+        while (true)
+        {
+            CImportBlock* pblock = NULL;
+            int64_t nTimeStart = GetTimeMillis();
             {
-                boost::this_thread::interruption_point();
-                unsigned char pchData[65536];
-                do {
-                    fseek(blkdat, nPos, SEEK_SET);
-                    int nRead = fread(pchData, 1, sizeof(pchData), blkdat);
-                    if (nRead <= 8)
-                    {
-                        nPos = (unsigned int)-1;
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (true)
+                {
+                    std::map<unsigned int, CImportBlock*>::iterator it = mapInFlight.find(nNext);
+                    if (it == mapInFlight.end() && fEndOfFile)
                         break;
-                    }
-                    void* nFind = memchr(pchData, Params().MessageStart()[0], nRead+1-MESSAGE_START_SIZE);
-                    if (nFind)
+                    if (it != mapInFlight.end() && it->second->fParsed)
                     {
-                        if (memcmp(nFind, Params().MessageStart(), MESSAGE_START_SIZE)==0)
-                        {
-                            nPos += ((unsigned char*)nFind - pchData) + MESSAGE_START_SIZE;
-                            break;
-                        }
-                        nPos += ((unsigned char*)nFind - pchData) + 1;
+                        pblock = it->second;
+                        mapInFlight.erase(it);
+                        nBytesInFlight -= pblock->nSize;
+                        condSpace.notify_one();
+                        break;
                     }
-                    else
-                        nPos += sizeof(pchData) - MESSAGE_START_SIZE + 1;
-                    boost::this_thread::interruption_point();
-                } while(true);
-                if (nPos == (unsigned int)-1)
-                    break;
-                fseek(blkdat, nPos, SEEK_SET);
-                unsigned int nSize;
-                blkdat >> nSize;
-                if (nSize > 0 && nSize <= MAX_BLOCK_SIZE)
+                    condDone.wait(lock);
+                }
+            }
+            if (!pblock)
+                break;
+            nNext++;
+
+            int64_t nTimeParsed = GetTimeMillis();
+            nTimeWait += nTimeParsed - nTimeStart;
+            if (pblock->fChecked)
+            {
+                LOCK(cs_main);
+                if (ProcessBlock(NULL, &pblock->block, true))
+                    nLoaded++;
+            }
+            delete pblock;
+            nTimeProcess += GetTimeMillis() - nTimeParsed;
+
+            if (GetTimeMillis() - nLastReport >= 10000)
+            {
+                nLastReport = GetTimeMillis();
+                int64_t nRead;
                 {
-                    CBlock block;
-                    blkdat >> block;
-                    LOCK(cs_main);
-                    if (ProcessBlock(NULL,&block))
-                    {
-                        nLoaded++;
-                        nPos += 4 + nSize;
-                    }
+                    boost::lock_guard<boost::mutex> lock(mutex);
+                    nRead = nBytesRead;
                 }
+                double dElapsed = (nLastReport - nStart) / 1000.0;
+                LogPrintf("LoadExternalBlockFile() : %d blocks loaded, %.1f%% of the file read, %.1f blocks/s, %.2f MB/s\n",
+                    nLoaded, nFileSize > 0 ? 100.0 * nRead / nFileSize : 0.0, nNext / dElapsed, nRead / dElapsed / 1000000);
             }
+            boost::this_thread::interruption_point();
         }
-        catch (std::exception &e) {
-            LogPrintf("%s() : Deserialize or I/O error caught during load\n",
-                   __PRETTY_FUNCTION__);
+    }
+    catch (...) {
+        {
+            boost::lock_guard<boost::mutex> lock(mutex);
+            fQuit = true;
+            condWork.notify_all();
+            condSpace.notify_all();
         }
+        threads.interrupt_all();
+        threads.join_all();
+        throw;
+    }
+    threads.join_all();
+
+    LogPrintf("Loaded %i blocks from external file in %dms (%u found, %dms waiting for the reader and %u parsing threads, %dms in ProcessBlock)\n",
+        nLoaded, GetTimeMillis() - nStart, nNext, nTimeWait, nThreads, nTimeProcess);
+    return nLoaded;
+}
+
+bool LoadExternalBlockFile(FILE* fileIn)
+{
+    int nLoaded = 0;
+    {
+        // The file is closed when blkdat goes out of scope
+        CAutoFile blkdat(fileIn, SER_DISK, CLIENT_VERSION);
+        CBlockImporter importer(fileIn);
+        nLoaded = importer.Run(std::max(nScriptCheckThreads, 1));
     }
-    LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
     return nLoaded > 0;
 }
 
@@ -3060,6 +4167,7 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
 {
     RenameThread("b3coin-loadblk");
 
+    {
     CImportingNow imp;
 
     // -loadblock=
@@ -3079,6 +4187,141 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
             RenameOver(pathBootstrap, pathBootstrapOld);
         }
     }
+    }
+
+    // Transactions that were in the memory pool at the last shutdown. Not
+    // counted as importing, so blocks from peers are still processed.
+    if (GetBoolArg("-persistmempool", true))
+        LoadMempool();
+}
+
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+
+// Transactions from mempool.dat accepted per cs_main lock
+static const unsigned int MEMPOOL_LOAD_BATCH = 100;
+
+// Don't overwrite mempool.dat while part of it hasn't been loaded yet
+static bool fDumpMempoolLater = false;
+
+bool LoadMempool()
+{
+    int64_t nStart = GetTimeMillis();
+    boost::filesystem::path path = GetDataDir() / "mempool.dat";
+    FILE* file = fopen(path.string().c_str(), "rb");
+    CAutoFile filein = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!filein)
+    {
+        fDumpMempoolLater = true;
+        return false;
+    }
+
+    unsigned int nAccepted = 0, nFailed = 0, nAlreadyThere = 0;
+    try {
+        uint64_t nVersion;
+        filein >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION)
+        {
+            fDumpMempoolLater = true;
+            return error("LoadMempool() : unknown mempool.dat version %d", nVersion);
+        }
+
+        unsigned char pchMsgTmp[4];
+        filein >> FLATDATA(pchMsgTmp);
+        if (memcmp(pchMsgTmp, Params().MessageStart(), sizeof(pchMsgTmp)))
+        {
+            fDumpMempoolLater = true;
+            return error("LoadMempool() : invalid network magic number");
+        }
+
+        uint64_t nCount;
+        filein >> nCount;
+        while (nCount > 0)
+        {
+            // Read a batch without holding any lock, then put it through
+            // the usual checks
+            vector<CTransaction> vBatch;
+            for (; nCount > 0 && vBatch.size() < MEMPOOL_LOAD_BATCH; nCount--)
+            {
+                vBatch.push_back(CTransaction());
+                filein >> vBatch.back();
+            }
+
+            {
+                LOCK(cs_main);
+                BOOST_FOREACH(CTransaction& tx, vBatch)
+                {
+                    if (mempool.exists(tx.GetHash()))
+                        nAlreadyThere++;
+                    else if (AcceptToMemoryPool(mempool, tx, true, NULL))
+                        nAccepted++;
+                    else
+                        nFailed++;
+                }
+            }
+
+            if (ShutdownRequested())
+            {
+                LogPrintf("LoadMempool() : interrupted, %u transactions accepted\n", nAccepted);
+                return false;
+            }
+        }
+    }
+    catch (std::exception &e) {
+        fDumpMempoolLater = true;
+        return error("LoadMempool() : failed to deserialize mempool.dat: %s", e.what());
+    }
+
+    fDumpMempoolLater = true;
+    LogPrintf("Loaded %u transactions from mempool.dat (%u failed, %u already there)  %dms\n",
+              nAccepted, nFailed, nAlreadyThere, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool DumpMempool()
+{
+    if (!fDumpMempoolLater)
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+    boost::filesystem::path path = GetDataDir() / "mempool.dat";
+    boost::filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout = CAutoFile(file, SER_DISK, CLIENT_VERSION);
+    if (!fileout)
+        return error("DumpMempool() : failed to open %s", pathTmp.string());
+
+    uint64_t nCount = 0;
+    try {
+        LOCK(mempool.cs);
+
+        // Parents before children, so every transaction finds its inputs
+        // when the file is loaded
+        vector<pair<uint64_t, const CTransaction*> > vSorted;
+        vSorted.reserve(mempool.mapTx.size());
+        for (map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+            vSorted.push_back(make_pair((*mi).second.GetCountWithAncestors(), &(*mi).second.GetTx()));
+        sort(vSorted.begin(), vSorted.end());
+
+        nCount = vSorted.size();
+        fileout << MEMPOOL_DUMP_VERSION;
+        fileout << FLATDATA(Params().MessageStart());
+        fileout << nCount;
+        for (unsigned int i = 0; i < vSorted.size(); i++)
+            fileout << *vSorted[i].second;
+    }
+    catch (std::exception &e) {
+        fileout.fclose();
+        boost::filesystem::remove(pathTmp);
+        return error("DumpMempool() : I/O error: %s", e.what());
+    }
+    FileCommit(fileout);
+    fileout.fclose();
+
+    if (!RenameOver(pathTmp, path))
+        return error("DumpMempool() : rename-into-place failed");
+
+    LogPrintf("Dumped %u transactions to mempool.dat  %dms\n", nCount, GetTimeMillis() - nStart);
+    return true;
 }
 
 
@@ -3163,27 +4406,148 @@ bool static AlreadyHave(CTxDB& txdb, const CInv& inv)
         bool txInMap = false;
         txInMap = mempool.exists(inv.hash);
         return txInMap ||
-               mapOrphanTransactions.count(inv.hash) ||
+               orphanpool.HaveTx(inv.hash) ||
                txdb.ContainsTx(inv.hash);
         }
 
     case MSG_BLOCK:
+    case MSG_CMPCT_BLOCK:
         return mapBlockIndex.count(inv.hash) ||
-               mapOrphanBlocks.count(inv.hash);
+               mapOrphanBlocks.count(inv.hash) ||
+               mapBlocksWaiting.count(inv.hash);
 			   
 	case MSG_SPORK:
-        return mapSporks.count(inv.hash);
+        {
+            LOCK(cs_mapSporks);
+            return mapSporks.count(inv.hash);
+        }
     case MSG_FUNDAMENTALNODE_WINNER:
-        return mapSeenFundamentalnodeVotes.count(inv.hash);
+        {
+            LOCK(cs_fundamentalnodepayments);
+            return mapSeenFundamentalnodeVotes.count(inv.hash);
+        }
     case MSG_FUNDAMENTALNODE_SCANNING_ERROR:
-        return mapFundamentalnodeScanningErrors.count(inv.hash);
+        {
+            LOCK(cs_mapFundamentalnodeScanningErrors);
+            return mapFundamentalnodeScanningErrors.count(inv.hash);
+        }
+    }
+    // Don't know what it is, just say we already got one
+    return true;
+}
+
+
+
+
+// Blocks recently sent to peers, serialized and ready to send again
+static CBlockCache& GetBlockCache()
+{
+    static CBlockCache blockcache(GetArg("-blockservecachemib", DEFAULT_BLOCK_SERVE_CACHE) * ((size_t) 1 << 20));
+    return blockcache;
+}
+
+// Does the serialized block ssBlock have a signature we can send as it is?
+// The signature is the last thing in a block: nothing for proof-of-work
+// blocks, else a one byte length and a DER signature of that length, which
+// is found from the end rather than by unserializing the whole block.
+static bool HasLowSBlockSignature(const CBlockIndex* pindex, const CDataStream& ssBlock)
+{
+    unsigned int nSize = ssBlock.size();
+    if (pindex->IsProofOfWork())
+        return nSize > 0 && ssBlock[nSize - 1] == 0;
+
+    vector<unsigned char> vchSig;
+    for (unsigned int nLen = 8; nLen <= 72 && nLen < nSize; nLen++)
+    {
+        unsigned int nStart = nSize - nLen;
+        if ((unsigned char)ssBlock[nStart - 1] == nLen && (unsigned char)ssBlock[nStart] == 0x30 &&
+            (unsigned char)ssBlock[nStart + 1] == nLen - 2)
+        {
+            // Can't tell which one it is
+            if (!vchSig.empty())
+                return false;
+            vchSig.assign(ssBlock.begin() + nStart, ssBlock.end());
+        }
+    }
+    return !vchSig.empty() && IsLowDERSignature(vchSig, false);
+}
+
+// Get the "block" message for pindex: from the cache if it was sent
+// recently, else with the block copied straight out of the block file
+static bool GetBlockMessage(const CBlockIndex* pindex, CSendBufferPtr& pmsgRet)
+{
+    uint256 hash = pindex->GetBlockHash();
+    if (GetBlockCache().Get(hash, pmsgRet))
+        return true;
+
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    bool fRaw = ReadRawBlockFromFile(pindex->nFile, pindex->nBlockPos, ssBlock);
+    if (fRaw)
+    {
+        // Make sure it is the block we think it is
+        CDataStream ssHeader(SER_NETWORK | SER_BLOCKHEADERONLY, PROTOCOL_VERSION);
+        ssHeader << pindex->GetBlockHeader();
+        fRaw = ssBlock.size() > ssHeader.size() && memcmp(&ssHeader[0], &ssBlock[0], ssHeader.size()) == 0 &&
+               HasLowSBlockSignature(pindex, ssBlock);
+    }
+    if (!fRaw)
+    {
+        CBlock block;
+        if (!block.ReadFromDisk(pindex))
+            return false;
+
+        // previous versions could accept sigs with high s
+        if (!IsCanonicalBlockSignature(&block, true)) {
+            bool ret = EnsureLowS(block.vchBlockSig);
+            assert(ret);
+        }
+
+        ssBlock.clear();
+        ssBlock << block;
     }
-    // Don't know what it is, just say we already got one
+
+    pmsgRet = MakeSendBuffer("block", ssBlock);
+    GetBlockCache().Put(hash, pmsgRet);
     return true;
 }
 
+// The compact block last asked for, which is almost always the new tip that
+// every peer is asking for at once
+static CCriticalSection cs_cmpctblockLast;
+static uint256 hashCmpctblockLast = 0;
+static CSendBufferPtr pcmpctblockLast;
+
+// Get the "cmpctblock" message for pindex
+static bool GetCompactBlockMessage(const CBlockIndex* pindex, CSendBufferPtr& pmsgRet)
+{
+    uint256 hash = pindex->GetBlockHash();
+    {
+        LOCK(cs_cmpctblockLast);
+        if (hash == hashCmpctblockLast)
+        {
+            pmsgRet = pcmpctblockLast;
+            return true;
+        }
+    }
+
+    CBlock block;
+    if (!block.ReadFromDisk(pindex))
+        return false;
 
+    // previous versions could accept sigs with high s
+    if (!IsCanonicalBlockSignature(&block, true)) {
+        bool ret = EnsureLowS(block.vchBlockSig);
+        assert(ret);
+    }
 
+    pmsgRet = MakeSendBuffer("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+    {
+        LOCK(cs_cmpctblockLast);
+        hashCmpctblockLast = hash;
+        pcmpctblockLast = pmsgRet;
+    }
+    return true;
+}
 
 void static ProcessGetData(CNode* pfrom)
 {
@@ -3191,8 +4555,6 @@ void static ProcessGetData(CNode* pfrom)
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
-
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
@@ -3203,22 +4565,40 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
-                // Send block from disk
-                map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
-                if (mi != mapBlockIndex.end())
+                // Only the lookup needs cs_main. Block index entries are
+                // never freed, so the block is read from disk without it and
+                // a peer fetching big blocks doesn't hold up everyone else.
+                CBlockIndex* pindex = NULL;
+                int nBestHeightNow;
+                uint256 hashBestChainNow;
                 {
-                    CBlock block;
-                    block.ReadFromDisk((*mi).second);
+                    LOCK(cs_main);
+                    BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
+                    if (mi != mapBlockIndex.end())
+                        pindex = (*mi).second;
+                    nBestHeightNow = nBestHeight;
+                    hashBestChainNow = hashBestChain;
+                }
 
-                    // previous versions could accept sigs with high s
-                    if (!IsCanonicalBlockSignature(&block, true)) {
-                        bool ret = EnsureLowS(block.vchBlockSig);
-                        assert(ret);
+                // Send block from disk
+                if (pindex)
+                {
+                    // Anything but a recent block is unlikely to have its
+                    // transactions in the peer's memory pool
+                    // The same message buffer goes to every peer asking
+                    CSendBufferPtr pmsg;
+                    if (inv.type == MSG_CMPCT_BLOCK && pindex->nHeight >= nBestHeightNow - MAX_CMPCTBLOCK_DEPTH)
+                    {
+                        if (GetCompactBlockMessage(pindex, pmsg))
+                            pfrom->PushSendBuffer(pmsg);
+                    }
+                    else
+                    {
+                        if (GetBlockMessage(pindex, pmsg))
+                            pfrom->PushSendBuffer(pmsg);
                     }
-
-                    pfrom->PushMessage("block", block);
 
                     // Trigger them to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -3227,7 +4607,7 @@ void static ProcessGetData(CNode* pfrom)
                         // and we want it right after the last block so they don't
                         // wait for other stuff first.
                         vector<CInv> vInv;
-                        vInv.push_back(CInv(MSG_BLOCK, hashBestChain));
+                        vInv.push_back(CInv(MSG_BLOCK, hashBestChainNow));
                         pfrom->PushMessage("inv", vInv);
                         pfrom->hashContinue = 0;
                     }
@@ -3239,9 +4619,9 @@ void static ProcessGetData(CNode* pfrom)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    RelayMap::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushSendBuffer((*mi).second);
                         pushed = true;
                     }
                 }
@@ -3257,6 +4637,7 @@ void static ProcessGetData(CNode* pfrom)
                 }
 				
 				if (!pushed && inv.type == MSG_SPORK) {
+                    LOCK(cs_mapSporks);
                     if(mapSporks.count(inv.hash)){
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
@@ -3266,6 +4647,7 @@ void static ProcessGetData(CNode* pfrom)
                     }
                 }
                 if (!pushed && inv.type == MSG_FUNDAMENTALNODE_WINNER) {
+                    LOCK(cs_fundamentalnodepayments);
                     if(mapSeenFundamentalnodeVotes.count(inv.hash)){
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
@@ -3275,6 +4657,7 @@ void static ProcessGetData(CNode* pfrom)
                     }
                 }
                 if (!pushed && inv.type == MSG_FUNDAMENTALNODE_SCANNING_ERROR) {
+                    LOCK(cs_mapFundamentalnodeScanningErrors);
                     if(mapFundamentalnodeScanningErrors.count(inv.hash)){
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
@@ -3292,7 +4675,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             g_signals.Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK /* || inv.type == MSG_FILTERED_BLOCK */)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_CMPCT_BLOCK /* || inv.type == MSG_FILTERED_BLOCK */)
                 break;
         }
     }
@@ -3311,6 +4694,182 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+// Transactions from one peer waiting for the admission threads before we
+// stop reading more of its messages
+static const unsigned int MAX_PEER_TX_ADMISSION = 100;
+
+// Transactions received from peers, waiting to be checked and added to the
+// memory pool by the admission threads. Each one holds a reference on the
+// peer it came from.
+class CTxAdmissionQueue
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::deque<std::pair<CNode*, CTransaction> > queue;
+    std::map<CNode*, unsigned int> mapPending;
+
+public:
+    void Push(CNode* pfrom, const CTransaction& tx)
+    {
+        {
+            LOCK(cs_vNodes);
+            pfrom->AddRef();
+        }
+        boost::unique_lock<boost::mutex> lock(mutex);
+        queue.push_back(make_pair(pfrom, tx));
+        mapPending[pfrom]++;
+        cond.notify_one();
+    }
+
+    // Wait for the next transaction; a boost thread interruption point
+    void Pop(CNode*& pfrom, CTransaction& tx)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (queue.empty())
+            cond.wait(lock);
+        pfrom = queue.front().first;
+        tx = queue.front().second;
+        queue.pop_front();
+    }
+
+    void Done(CNode* pfrom)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            std::map<CNode*, unsigned int>::iterator it = mapPending.find(pfrom);
+            if (it != mapPending.end() && --it->second == 0)
+                mapPending.erase(it);
+        }
+        LOCK(cs_vNodes);
+        pfrom->Release();
+    }
+
+    unsigned int Pending(CNode* pfrom)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        std::map<CNode*, unsigned int>::const_iterator it = mapPending.find(pfrom);
+        return it == mapPending.end() ? 0 : it->second;
+    }
+};
+
+static CTxAdmissionQueue txAdmissionQueue;
+
+// Relay an accepted transaction and anything in the orphan pool it
+// unblocks, or keep it as an orphan
+static void ProcessAdmissionResult(CNode* pfrom, CTransaction& tx, bool fAccepted, bool fMissingInputs)
+{
+    AssertLockHeld(cs_main);
+    uint256 hash = tx.GetHash();
+
+    if (fAccepted)
+    {
+        RelayTransaction(tx, hash);
+        orphanpool.EraseTx(hash);
+
+        // Recursively process the orphans spending an output of a newly
+        // accepted transaction; no other orphan can have become valid
+        vector<CTransaction> vWorkQueue;
+        vWorkQueue.push_back(tx);
+        for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+        {
+            vector<uint256> vChildren;
+            orphanpool.GetChildren(vWorkQueue[i], vChildren);
+            BOOST_FOREACH(const uint256& orphanTxHash, vChildren)
+            {
+                CTransaction orphanTx;
+                if (!orphanpool.GetTx(orphanTxHash, orphanTx))
+                    continue;
+                bool fMissingInputs2 = false;
+
+                if (AcceptToMemoryPool(mempool, orphanTx, true, &fMissingInputs2))
+                {
+                    LogPrint("mempool", "   accepted orphan tx %s\n", orphanTxHash.ToString());
+                    RelayTransaction(orphanTx, orphanTxHash);
+                    orphanpool.EraseTx(orphanTxHash);
+                    vWorkQueue.push_back(orphanTx);
+                }
+                else if (!fMissingInputs2)
+                {
+                    // invalid or too-little-fee orphan
+                    orphanpool.EraseTx(orphanTxHash);
+                    LogPrint("mempool", "   removed orphan tx %s\n", orphanTxHash.ToString());
+                }
+            }
+        }
+    }
+    else if (fMissingInputs)
+        orphanpool.AddTx(tx, pfrom->GetId(), GetTime());
+    if (tx.nDoS) pfrom->Misbehaving(tx.nDoS);
+}
+
+// The expensive part of the checks, the inputs and signatures, runs
+// without cs_main so several transactions can be checked at once. If the
+// best block or the pool inputs changed in the meantime the transaction
+// goes through AcceptToMemoryPool again under the lock.
+static void AdmitTransaction(CNode* pfrom, CTransaction& tx)
+{
+    const CBlockIndex* pindexTip;
+    {
+        LOCK(cs_main);
+        pindexTip = pindexBest;
+    }
+
+    bool fMissingInputs = false;
+    CTxMemPoolEntry entry;
+    set<uint256> setPoolInputs;
+    bool fAccepted = CheckMempoolAdmission(mempool, tx, true, &fMissingInputs, pindexTip, entry, setPoolInputs);
+
+    LOCK(cs_main);
+    mapAlreadyAskedFor.erase(CInv(MSG_TX, tx.GetHash()));
+
+    bool fRecheck = (pindexTip != pindexBest);
+    if (fAccepted)
+    {
+        BOOST_FOREACH(const uint256& hashPrev, setPoolInputs)
+            if (!mempool.exists(hashPrev))
+                fRecheck = true;
+    }
+    else if (fMissingInputs)
+    {
+        // The missing parent may have arrived on another thread
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            if (mempool.exists(txin.prevout.hash))
+                fRecheck = true;
+    }
+
+    if ((fAccepted || fMissingInputs) && fRecheck)
+    {
+        tx.nDoS = 0;
+        fAccepted = AcceptToMemoryPool(mempool, tx, true, &fMissingInputs);
+    }
+    else if (fAccepted)
+        fAccepted = FinishMempoolAdmission(mempool, tx, entry);
+
+    ProcessAdmissionResult(pfrom, tx, fAccepted, fMissingInputs);
+}
+
+void ThreadTxAdmission()
+{
+    RenameThread("b3coin-txadmit");
+    while (true)
+    {
+        CNode* pfrom;
+        CTransaction tx;
+        txAdmissionQueue.Pop(pfrom, tx);
+        try
+        {
+            AdmitTransaction(pfrom, tx);
+        }
+        catch (std::exception& e) {
+            PrintExceptionContinue(&e, "ThreadTxAdmission()");
+        } catch (...) {
+            PrintExceptionContinue(NULL, "ThreadTxAdmission()");
+        }
+        txAdmissionQueue.Done(pfrom);
+    }
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     RandAddSeedPerfmon();
@@ -3514,15 +5073,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return error("message inv size() = %u", vInv.size());
         }
 
-        // find last block in inv vector
-        unsigned int nLastBlock = (unsigned int)(-1);
-        for (unsigned int nInv = 0; nInv < vInv.size(); nInv++) {
-            if (vInv[vInv.size() - 1 - nInv].type == MSG_BLOCK) {
-                nLastBlock = vInv.size() - 1 - nInv;
-                break;
-            }
-        }
-
         LOCK(cs_main);
         CTxDB txdb("r");
 
@@ -3536,18 +5086,27 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             bool fAlreadyHave = AlreadyHave(txdb, inv);
             LogPrint("net", "  got inventory: %s  %s\n", inv.ToString(), fAlreadyHave ? "have" : "new");
 
+            if (inv.type == MSG_BLOCK && UpdateBestKnownHeader(pfrom, inv.hash))
+                UpdateBlocksToDownload();
+
             if (!fAlreadyHave) {
-                if (!fImporting)
+                if (inv.type == MSG_BLOCK && IsInitialBlockDownload())
+                {
+                    // While syncing, blocks are fetched by their headers
+                    if (!fImporting && !headerchain.Find(inv.hash))
+                        PushGetHeaders(pfrom, headerchain.GetBestHash());
+                }
+                // Once synced, new blocks from peers that know how to are
+                // fetched as compact blocks
+                else if (inv.type == MSG_BLOCK && pfrom->nVersion >= COMPACT_BLOCKS_VERSION)
+                {
+                    if (!fImporting)
+                        pfrom->AskFor(CInv(MSG_CMPCT_BLOCK, inv.hash));
+                }
+                else if (!fImporting)
                     pfrom->AskFor(inv);
             } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
-                PushGetBlocks(pfrom, pindexBest, GetOrphanRoot(inv.hash));
-            } else if (nInv == nLastBlock) {
-                // In case we are on a very long side-chain, it is possible that we already have
-                // the last block in an inv bundle sent in response to getblocks. Try to detect
-                // this situation and push another getblocks to continue.
-                PushGetBlocks(pfrom, mapBlockIndex[inv.hash], uint256(0));
-                if (fDebug)
-                    LogPrintf("force request: %s\n", inv.ToString());
+                PushGetHeaders(pfrom, headerchain.GetBestHash());
             }
 
             // Track requests for our stuff
@@ -3624,7 +5183,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         if (locator.IsNull())
         {
             // If locator is null, return the hashStop block
-            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            BlockMap::iterator mi = mapBlockIndex.find(hashStop);
             if (mi == mapBlockIndex.end())
                 return true;
             pindex = (*mi).second;
@@ -3638,7 +5197,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         }
 
         vector<CBlock> vHeaders;
-        int nLimit = 2000;
+        int nLimit = MAX_HEADERS_RESULTS;
         LogPrint("net", "getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString());
         for (; pindex; pindex = pindex->pnext)
         {
@@ -3650,71 +5209,70 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
-    else if (strCommand == "tx")
+    else if (strCommand == "headers" && !fImporting && !fReindex)
     {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
-        CTransaction tx;
-        vRecv >> tx;
-
-        CInv inv(MSG_TX, tx.GetHash());
-        pfrom->AddInventoryKnown(inv);
+        vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+        {
+            pfrom->Misbehaving(20);
+            return error("message headers size() = %u", vHeaders.size());
+        }
 
         LOCK(cs_main);
 
-        bool fMissingInputs = false;
-
-        mapAlreadyAskedFor.erase(inv);
-
-        if (AcceptToMemoryPool(mempool, tx, true, &fMissingInputs))
+        // Room is made by pruning what no peer builds on; failing that the
+        // peer is asked again once the blocks have caught up
+        if (headerchain.size() + vHeaders.size() > MAX_HEADER_CHAIN_SIZE)
+            PruneHeaders();
+        if (headerchain.size() + vHeaders.size() > MAX_HEADER_CHAIN_SIZE)
         {
-            RelayTransaction(tx, inv.hash);
-            vWorkQueue.push_back(inv.hash);
-            vEraseQueue.push_back(inv.hash);
+            LogPrint("net", "header chain full, ignoring %u headers from peer=%d\n", vHeaders.size(), pfrom->GetId());
+            pfrom->fHeadersPaused = true;
+            return true;
+        }
 
-            // Recursively process any orphan transactions that depended on this one
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+        uint256 hashLast = 0;
+        int nHeightLast = -1;
+        BOOST_FOREACH(const CBlock& header, vHeaders)
+        {
+            if (hashLast != 0 && header.hashPrevBlock != hashLast)
             {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (set<uint256>::iterator mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
-                {
-                    const uint256& orphanTxHash = *mi;
-                    CTransaction& orphanTx = mapOrphanTransactions[orphanTxHash];
-                    bool fMissingInputs2 = false;
-
-                    if (AcceptToMemoryPool(mempool, orphanTx, true, &fMissingInputs2))
-                    {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanTxHash.ToString());
-                        RelayTransaction(orphanTx, orphanTxHash);
-                        vWorkQueue.push_back(orphanTxHash);
-                        vEraseQueue.push_back(orphanTxHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        // invalid or too-little-fee orphan
-                        vEraseQueue.push_back(orphanTxHash);
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanTxHash.ToString());
-                    }
-                }
+                pfrom->Misbehaving(20);
+                UpdateBlocksToDownload();
+                return error("headers : non-continuous headers from peer=%d", pfrom->GetId());
+            }
+            hashLast = header.GetHash();
+            if (!AcceptBlockHeader(header, hashLast, nHeightLast))
+            {
+                if (header.nDoS) pfrom->Misbehaving(header.nDoS);
+                UpdateBlocksToDownload();
+                return error("headers : bad header %s from peer=%d", hashLast.ToString(), pfrom->GetId());
             }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
         }
-        else if (fMissingInputs)
-        {
-            AddOrphanTx(tx);
+        if (hashLast != 0)
+            UpdateBestKnownHeader(pfrom, hashLast);
+        UpdateBlocksToDownload();
 
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
-            unsigned int nEvicted = LimitOrphanTxSize(MAX_ORPHAN_TRANSACTIONS);
-            if (nEvicted > 0)
-                LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
-        }
-        if (tx.nDoS) pfrom->Misbehaving(tx.nDoS);
+        LogPrint("net", "received %u headers up to height %d from peer=%d, %u blocks to download\n",
+                 vHeaders.size(), nHeightLast, pfrom->GetId(), vBlocksToDownload.size());
+
+        // A full message means the peer has more
+        if (vHeaders.size() == MAX_HEADERS_RESULTS)
+            PushGetHeaders(pfrom, hashLast);
+    }
+
+
+    else if (strCommand == "tx")
+    {
+        CTransaction tx;
+        vRecv >> tx;
+
+        CInv inv(MSG_TX, tx.GetHash());
+        pfrom->AddInventoryKnown(inv);
+
+        // Checked and added to the memory pool by the admission threads
+        txAdmissionQueue.Push(pfrom, tx);
     }
 
 
@@ -3731,12 +5289,154 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         LOCK(cs_main);
 
+        MarkBlockReceived(pfrom, hashBlock);
         if (ProcessBlock(pfrom, &block))
+        {
             mapAlreadyAskedFor.erase(inv);
+            mapAlreadyAskedFor.erase(CInv(MSG_CMPCT_BLOCK, hashBlock));
+        }
+        if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+    }
+
+
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex)
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+        uint256 hashBlock = cmpctblock.header.GetHash();
+
+        LogPrint("net", "received compact block %s (%u transactions, %u prefilled) from peer=%d\n",
+                 hashBlock.ToString(), cmpctblock.BlockTxCount(), cmpctblock.prefilledtxn.size(), pfrom->GetId());
+
+        CInv inv(MSG_BLOCK, hashBlock);
+        pfrom->AddInventoryKnown(inv);
+
+        LOCK(cs_main);
+
+        if (mapBlockIndex.count(hashBlock) || mapOrphanBlocks.count(hashBlock))
+        {
+            mapAlreadyAskedFor.erase(CInv(MSG_CMPCT_BLOCK, hashBlock));
+            return true;
+        }
+
+        CPartialBlock partial;
+        ReadStatus status = partial.Init(cmpctblock, mempool);
+        if (status == READ_STATUS_INVALID)
+        {
+            pfrom->Misbehaving(100);
+            return error("cmpctblock : invalid compact block %s from peer=%d", hashBlock.ToString(), pfrom->GetId());
+        }
+        if (status == READ_STATUS_FAILED)
+        {
+            vector<CInv> vGetData(1, inv);
+            pfrom->PushMessage("getdata", vGetData);
+            return true;
+        }
+
+        CBlockTransactionsRequest req;
+        req.blockhash = hashBlock;
+        partial.GetMissing(req.indexes);
+        if (req.indexes.empty())
+        {
+            CBlock block;
+            if (partial.FillBlock(block, vector<CTransaction>()) != READ_STATUS_OK)
+            {
+                // A short id matched the wrong transaction
+                vector<CInv> vGetData(1, inv);
+                pfrom->PushMessage("getdata", vGetData);
+                return true;
+            }
+            if (ProcessBlock(pfrom, &block))
+                mapAlreadyAskedFor.erase(CInv(MSG_CMPCT_BLOCK, hashBlock));
+            if (block.nDoS) pfrom->Misbehaving(block.nDoS);
+        }
+        else
+        {
+            LogPrint("net", "compact block %s: asking peer=%d for %u transactions\n", hashBlock.ToString(), pfrom->GetId(), req.indexes.size());
+            mapPartialBlocks[pfrom->GetId()] = partial;
+            pfrom->PushMessage("getblocktxn", req);
+        }
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex)
+    {
+        CBlockTransactions resp;
+        vRecv >> resp;
+
+        LOCK(cs_main);
+
+        map<NodeId, CPartialBlock>::iterator mi = mapPartialBlocks.find(pfrom->GetId());
+        if (mi == mapPartialBlocks.end() || mi->second.GetBlockHash() != resp.blockhash)
+        {
+            LogPrint("net", "blocktxn for %s from peer=%d that we didn't ask for\n", resp.blockhash.ToString(), pfrom->GetId());
+            return true;
+        }
+
+        CBlock block;
+        ReadStatus status = mi->second.FillBlock(block, resp.txn);
+        mapPartialBlocks.erase(mi);
+        if (status == READ_STATUS_INVALID)
+        {
+            pfrom->Misbehaving(100);
+            return error("blocktxn : wrong number of transactions for %s from peer=%d", resp.blockhash.ToString(), pfrom->GetId());
+        }
+        if (status == READ_STATUS_FAILED)
+        {
+            vector<CInv> vGetData(1, CInv(MSG_BLOCK, resp.blockhash));
+            pfrom->PushMessage("getdata", vGetData);
+            return true;
+        }
+
+        if (ProcessBlock(pfrom, &block))
+            mapAlreadyAskedFor.erase(CInv(MSG_CMPCT_BLOCK, resp.blockhash));
         if (block.nDoS) pfrom->Misbehaving(block.nDoS);
     }
 
 
+    else if (strCommand == "getblocktxn")
+    {
+        CBlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+
+        BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end())
+        {
+            LogPrint("net", "getblocktxn for unknown block %s from peer=%d\n", req.blockhash.ToString(), pfrom->GetId());
+            return true;
+        }
+
+        // Only recent blocks were sent compact; anything else gets the
+        // whole block
+        if ((*mi).second->nHeight < nBestHeight - MAX_CMPCTBLOCK_DEPTH)
+        {
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom);
+            return true;
+        }
+
+        CBlock block;
+        if (!block.ReadFromDisk((*mi).second))
+            return error("getblocktxn : unable to read block %s", req.blockhash.ToString());
+
+        CBlockTransactions resp;
+        resp.blockhash = req.blockhash;
+        resp.txn.reserve(req.indexes.size());
+        BOOST_FOREACH(unsigned int nIndex, req.indexes)
+        {
+            if (nIndex >= block.vtx.size())
+            {
+                pfrom->Misbehaving(100);
+                return error("getblocktxn : index %u out of range for %s from peer=%d", nIndex, req.blockhash.ToString(), pfrom->GetId());
+            }
+            resp.txn.push_back(block.vtx[nIndex]);
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
     // This asymmetric behavior for inbound and outbound connections was introduced
     // to prevent a fingerprinting attack: an attacker can send specific fake addresses
     // to users' AddrMan and later request them by sending getaddr messages. 
@@ -3746,7 +5446,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     {
         // Don't return addresses older than nCutOff timestamp
         int64_t nCutOff = GetTime() - (nNodeLifespan * 24 * 60 * 60);
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_vAddrToSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             if(addr.nTime > nCutOff)
@@ -3856,6 +5559,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         CAlert alert;
         vRecv >> alert;
 
+        // setKnown of every node is guarded by cs_mapAlerts
+        LOCK(cs_mapAlerts);
         uint256 alertHash = alert.GetHash();
         if (pfrom->setKnown.count(alertHash) == 0)
         {
@@ -3922,7 +5627,11 @@ bool ProcessMessages(CNode* pfrom)
     bool fOk = true;
 
     if (!pfrom->vRecvGetData.empty())
+    {
+        int64_t nStart = GetTimeMicros();
         ProcessGetData(pfrom);
+        pfrom->RecordProcessTime("getdata", GetTimeMicros() - nStart);
+    }
 
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return fOk;
@@ -3933,6 +5642,11 @@ bool ProcessMessages(CNode* pfrom)
         if (pfrom->nSendSize >= SendBufferSize())
             break;
 
+        // Leave the rest until the admission threads have caught up with
+        // the transactions this peer already sent
+        if (txAdmissionQueue.Pending(pfrom) >= MAX_PEER_TX_ADMISSION)
+            break;
+
         // get next message
         CNetMessage& msg = *it;
 
@@ -3981,6 +5695,7 @@ bool ProcessMessages(CNode* pfrom)
 
         // Process message
         bool fRet = false;
+        int64_t nStart = GetTimeMicros();
         try
         {
             fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
@@ -4011,6 +5726,7 @@ bool ProcessMessages(CNode* pfrom)
         } catch (...) {
             PrintExceptionContinue(NULL, "ProcessMessages()");
         }
+        pfrom->RecordProcessTime(strCommand, GetTimeMicros() - nStart);
 
         if (!fRet)
             LogPrintf("ProcessMessage(%s, %u bytes) FAILED\n", strCommand, nMessageSize);
@@ -4066,7 +5782,31 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Start block sync
         if (pto->fStartSync && !fImporting && !fReindex) {
             pto->fStartSync = false;
-            PushGetBlocks(pto, pindexBest, uint256(0));
+            PushGetHeaders(pto, headerchain.GetBestHash());
+        }
+
+        // Pick up the headers left out while the header chain was full
+        if (pto->fHeadersPaused && headerchain.size() < MAX_HEADER_CHAIN_SIZE / 2)
+        {
+            pto->fHeadersPaused = false;
+            PushGetHeaders(pto, headerchain.GetBestHash());
+        }
+
+        // Once the headers are about caught up, ask every peer for those
+        // from just below our best one. The answer tells us how far the
+        // peer is, so blocks can be fetched from it too.
+        if (!pto->fHeadersProbed && !pto->fClient && !fImporting && !fReindex)
+        {
+            const CHeaderIndex* pheaderBest = headerchain.Find(headerchain.GetBestHash());
+            int64_t nBestTime = pheaderBest ? pheaderBest->GetBlockTime() : pindexBest->GetBlockTime();
+            if (nBestTime > GetAdjustedTime() - 24 * 60 * 60)
+            {
+                pto->fHeadersProbed = true;
+                if (pheaderBest)
+                    PushGetHeaders(pto, pheaderBest->hashPrev);
+                else
+                    PushGetHeaders(pto, pindexBest->pprev ? pindexBest->pprev->GetBlockHash() : 0);
+            }
         }
 
         // Resend wallet transactions that haven't gotten in a block yet
@@ -4086,7 +5826,10 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             {
                 // Periodically clear setAddrKnown to allow refresh broadcasts
                 if (nLastRebroadcast)
+                {
+                    LOCK(pnode->cs_vAddrToSend);
                     pnode->setAddrKnown.clear();
+                }
 
                 // Rebroadcast our address
                 AdvertizeLocal(pnode);
@@ -4101,24 +5844,20 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         if (fSendTrickle)
         {
             vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
             {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second)
+                LOCK(pto->cs_vAddrToSend);
+                vAddr.reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
                 {
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
-                    {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
-                    }
+                    // returns true if wasn't already contained in the set
+                    if (pto->setAddrKnown.insert(addr).second)
+                        vAddr.push_back(addr);
                 }
+                pto->vAddrToSend.clear();
             }
-            pto->vAddrToSend.clear();
-            if (!vAddr.empty())
-                pto->PushMessage("addr", vAddr);
+            // receiver rejects addr messages larger than 1000
+            for (unsigned int i = 0; i < vAddr.size(); i += 1000)
+                pto->PushMessage("addr", vector<CAddress>(vAddr.begin() + i, vAddr.begin() + min(vAddr.size(), (size_t)i + 1000)));
         }
 
 
@@ -4133,19 +5872,16 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv))
                     continue;
 
                 // trickle out tx inv to protect privacy
                 if (inv.type == MSG_TX && !fSendTrickle)
                 {
                     // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt == 0)
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = inv.hash ^ hashSalt;
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((hashRand & 3) != 0);
+                    static uint64_t k0 = GetRand(std::numeric_limits<uint64_t>::max());
+                    static uint64_t k1 = GetRand(std::numeric_limits<uint64_t>::max());
+                    bool fTrickleWait = ((SipHashUint256(k0, k1, inv.hash) & 3) != 0);
 
                     if (fTrickleWait)
                     {
@@ -4154,15 +5890,12 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                pto->filterInventoryKnown.insert(inv);
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000)
                 {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
                 }
             }
             pto->vInventoryToSend = vInvWait;
@@ -4194,6 +5927,11 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             }
             pto->mapAskFor.erase(pto->mapAskFor.begin());
         }
+
+        // Blocks of the best header chain, spread over the peers that have them
+        if (!fImporting && !fReindex && !pto->fClient && !pto->fDisconnect)
+            FindBlocksToDownload(pto, vGetData);
+
         if (!vGetData.empty())
             pto->PushMessage("getdata", vGetData);
 
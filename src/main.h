@@ -7,8 +7,8 @@
 
 #include "core.h"
 #include "bignum.h"
+#include "blockfile.h"
 #include "sync.h"
-#include "txmempool.h"
 #include "net.h"
 #include "script.h"
 #include "scrypt.h"
@@ -16,14 +16,30 @@
 #include <limits>
 #include <list>
 
+#include <boost/unordered_map.hpp>
+
 class CBlock;
 class CBlockIndex;
+class CCoinsViewCache;
 class CInv;
 class CKeyItem;
 class CNode;
 class CReserveKey;
+class CTxMemPool;
 class CWallet;
 
+/** Hash function for the block index. Block hashes are mixed with a random
+    per-process salt, so nobody can pick hashes that land in the same bucket. */
+struct BlockHasher
+{
+    uint64_t k0, k1;
+
+    BlockHasher();
+    size_t operator()(const uint256& hash) const;
+};
+
+typedef boost::unordered_map<uint256, CBlockIndex*, BlockHasher> BlockMap;
+
 /** The maximum allowed size for a serialized block, in bytes (network rule) */
 static const unsigned int MAX_BLOCK_SIZE = 5000000;
 /** The maximum size for mined blocks */
@@ -36,12 +52,43 @@ static const unsigned int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE/100;
 static const unsigned int MAX_P2SH_SIGOPS = 15;
 /** The maximum number of sigops we're willing to relay/mine in a single tx */
 static const unsigned int MAX_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
-/** The maximum number of orphan transactions kept in memory */
-static const unsigned int MAX_ORPHAN_TRANSACTIONS = MAX_BLOCK_SIZE/100;
+/** The maximum total size of the orphan transactions kept in memory */
+static const unsigned int MAX_ORPHAN_POOL_SIZE = 5000000;
+/** The maximum total size of the orphan transactions kept from one peer */
+static const unsigned int MAX_ORPHAN_POOL_PEER_SIZE = MAX_ORPHAN_POOL_SIZE/10;
+/** Default for -maxmempool, maximum megabytes of memory the transaction memory pool may use */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
 /** Default for -maxorphanblocksmib, maximum number of memory to keep orphan blocks */
 static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS = 40;
+/** Default for -blockservecachemib, memory to keep recently sent blocks serialized in */
+static const unsigned int DEFAULT_BLOCK_SERVE_CACHE = 32;
+/** Maximum number of script-checking threads allowed */
+static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** -par default (number of script-checking threads, 0 = auto) */
+static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
 /** The maximum number of entries in an 'inv' protocol message */
 static const unsigned int MAX_INV_SZ = 50000;
+/** Blocks deeper than this below the best block are sent in full even when asked for as compact blocks */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** Number of headers sent in one "headers" message */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Headers kept ahead of our blocks; past this, headers no peer builds on are pruned and no more are taken */
+static const unsigned int MAX_HEADER_CHAIN_SIZE = 200000;
+/** Number of invalid block hashes remembered so their headers aren't taken again */
+static const unsigned int MAX_INVALID_HEADERS = 10000;
+/** Blocks requested from one peer at a time during headers-first sync */
+static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
+/** How far past the first block we are missing blocks are requested */
+static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Seconds a peer has to deliver a block we asked it for before the request goes to another peer */
+static const int64_t BLOCK_DOWNLOAD_TIMEOUT = 2 * 60;
+/** Seconds a peer that let a block request time out isn't asked for blocks or followed to its best header,
+    and a branch nobody else announced isn't followed */
+static const int64_t BLOCK_DOWNLOAD_STALL_TIME = 10 * 60;
+/** Misbehavior score of a peer that didn't deliver a block of the branch it announced */
+static const int BLOCK_DOWNLOAD_STALL_PENALTY = 20;
+/** Bytes of downloaded blocks waiting for their parent past which only the first missing block is requested */
+static const unsigned int MAX_BLOCKS_WAITING_SIZE = 32 * 1000000;
 /** Fees smaller than this (in satoshi) are considered zero fee (for transaction creation) */
 static const int64_t MIN_TX_FEE = 0.1 * COIN;
 /** Fees smaller than this (in satoshi) are considered zero fee (for relaying) */
@@ -67,7 +114,7 @@ inline int64_t FutureDriftPOW(int64_t nTime) { return nTime + 100000;}
 extern CScript COINBASE_FLAGS;
 extern CCriticalSection cs_main;
 extern CTxMemPool mempool;
-extern std::map<uint256, CBlockIndex*> mapBlockIndex;
+extern BlockMap mapBlockIndex;
 extern std::set<std::pair<COutPoint, unsigned int> > setStakeSeen;
 extern CBlockIndex* pindexGenesisBlock;
 extern int nStakeMinConfirmations;
@@ -89,6 +136,7 @@ extern bool fReindex;
 struct COrphanBlock;
 extern std::map<uint256, COrphanBlock*> mapOrphanBlocks;
 extern bool fHaveGUI;
+extern int nScriptCheckThreads;
 
 // Settings
 extern bool fUseFastIndex;
@@ -98,6 +146,7 @@ extern unsigned int nDerivationMethodIndex;
 static const uint64_t nMinDiskSpace = 52428800;
 
 class CReserveKey;
+class CScriptCheck;
 class CTxDB;
 class CTxIndex;
 class CWalletInterface;
@@ -118,18 +167,27 @@ void RegisterNodeSignals(CNodeSignals& nodeSignals);
 /** Unregister a network node */
 void UnregisterNodeSignals(CNodeSignals& nodeSignals);
 
-void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd);
 
-bool ProcessBlock(CNode* pfrom, CBlock* pblock);
+bool ProcessBlock(CNode* pfrom, CBlock* pblock, bool fCheckedBlock = false);
 bool CheckDiskSpace(uint64_t nAdditionalBytes=0);
+boost::filesystem::path BlockFilePath(unsigned int nFile);
 FILE* OpenBlockFile(unsigned int nFile, unsigned int nBlockPos, const char* pszMode="rb");
 FILE* AppendBlockFile(unsigned int& nFileRet);
 bool LoadBlockIndex(bool fAllowNew=true);
 void PrintBlockTree();
+/** Block of the best chain at the given height; requires cs_main */
 CBlockIndex* FindBlockByHeight(int nHeight);
 bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 void ThreadImport(std::vector<boost::filesystem::path> vImportFiles);
+/** Load the transactions saved in mempool.dat into the memory pool */
+bool LoadMempool();
+/** Save the memory pool to mempool.dat */
+bool DumpMempool();
+/** Run an instance of the script checking thread */
+void ThreadScriptCheck();
+/** Run an instance of the transaction admission thread */
+void ThreadTxAdmission();
 
 bool CheckProofOfWork(uint256 hash, unsigned int nBits);
 unsigned int GetNextTargetRequired(const CBlockIndex* pindexLast, bool fProofOfStake);
@@ -312,6 +370,18 @@ public:
 
     bool ReadFromDisk(CDiskTxPos pos, FILE** pfileRet=NULL)
     {
+        if (!pfileRet)
+        {
+            // Read straight out of the mapped block file if possible
+            try {
+                if (ReadFromBlockFile(pos.nFile, pos.nTxPos, *this, SER_DISK))
+                    return true;
+            }
+            catch (std::exception &e) {
+                return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
+            }
+        }
+
         CAutoFile filein = CAutoFile(OpenBlockFile(pos.nFile, 0, pfileRet ? "rb+" : "rb"), SER_DISK, CLIENT_VERSION);
         if (!filein)
             return error("CTransaction::ReadFromDisk() : OpenBlockFile failed");
@@ -397,15 +467,33 @@ public:
         @param[in] pindexBlock
         @param[in] fBlock	true if called from ConnectBlock
         @param[in] fMiner	true if called from CreateNewBlock
+        @param[out] pvChecks	if not NULL, script checks are pushed onto it instead of being performed inline
         @return Returns true if all checks succeed
      */
     bool ConnectInputs(CTxDB& txdb, MapPrevTx inputs,
                        std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
-                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS);
+                       const CBlockIndex* pindexBlock, bool fBlock, bool fMiner, unsigned int flags = STANDARD_SCRIPT_VERIFY_FLAGS,
+                       std::vector<CScriptCheck> *pvChecks = NULL);
+
+    /** Coins database counterparts of FetchInputs/ConnectInputs for a transaction
+        in a block being connected, used when view.HaveInputs(*this). The previous
+        outputs are taken from the view instead of being read from the block
+        files, so only the CTxIndex half of the inputs entries is filled in.
+     */
+    bool FetchInputIndexes(CTxDB& txdb, const std::map<uint256, CTxIndex>& mapTestPool, MapPrevTx& inputsRet);
+    bool ConnectInputs(CCoinsViewCache& view, MapPrevTx inputs,
+                       std::map<uint256, CTxIndex>& mapTestPool, const CDiskTxPos& posThisTx,
+                       const CBlockIndex* pindexBlock, unsigned int flags, std::vector<CScriptCheck> *pvChecks = NULL);
+    int64_t GetValueIn(CCoinsViewCache& view) const;
+
     bool CheckTransaction() const;
     bool GetCoinAge(CTxDB& txdb, const CBlockIndex* pindexPrev, uint64_t& nCoinAge) const;
 
     const CTxOut& GetOutputFor(const CTxIn& input, const MapPrevTx& inputs) const;
+
+private:
+    bool VerifyInputScript(const CScript& scriptPubKey, unsigned int nIn, unsigned int flags) const;
+    bool CheckValueIn(int64_t nValueIn) const;
 };
 
 /** wrapper for CTxOut that provides a more compact serialization */
@@ -443,11 +531,38 @@ unsigned int GetLegacySigOpCount(const CTransaction& tx);
     @see CTransaction::FetchInputs
  */
 unsigned int GetP2SHSigOpCount(const CTransaction& tx, const MapPrevTx& mapInputs);
+unsigned int GetP2SHSigOpCount(const CTransaction& tx, CCoinsViewCache& view);
 
 /** Check for standard transaction types
+    @param[in] nBlockHeight	Height of the block the transaction would go in, for the finality check
     @return True if all outputs (scriptPubKeys) use only standard transaction forms
 */
-bool IsStandardTx(const CTransaction& tx, std::string& reason);
+bool IsStandardTx(const CTransaction& tx, int nBlockHeight, std::string& reason);
+
+/** Closure representing one script verification.
+    Note that this stores references to the spending transaction */
+class CScriptCheck
+{
+private:
+    CScript scriptPubKey;
+    const CTransaction *ptxTo;
+    unsigned int nIn;
+    unsigned int nFlags;
+
+public:
+    CScriptCheck() : ptxTo(0), nIn(0), nFlags(0) {}
+    CScriptCheck(const CScript& scriptPubKeyIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn) :
+        scriptPubKey(scriptPubKeyIn), ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn) {}
+
+    bool operator()() const;
+
+    void swap(CScriptCheck &check) {
+        scriptPubKey.swap(check.scriptPubKey);
+        std::swap(ptxTo, check.ptxTo);
+        std::swap(nIn, check.nIn);
+        std::swap(nFlags, check.nFlags);
+    }
+};
 
 bool IsFinalTx(const CTransaction &tx, int nBlockHeight = 0, int64_t nBlockTime = 0);
 
@@ -787,16 +902,17 @@ public:
     {
         SetNull();
 
-        // Open history file to read
-        CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), SER_DISK, CLIENT_VERSION);
-        if (!filein)
-            return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
-        if (!fReadTransactions)
-            filein.nType |= SER_BLOCKHEADERONLY;
-
-        // Read block
+        // Read block, from the mapped block file if possible
+        int nType = SER_DISK | (fReadTransactions ? 0 : SER_BLOCKHEADERONLY);
         try {
-            filein >> *this;
+            if (!ReadFromBlockFile(nFile, nBlockPos, *this, nType))
+            {
+                // Open history file to read
+                CAutoFile filein = CAutoFile(OpenBlockFile(nFile, nBlockPos, "rb"), nType, CLIENT_VERSION);
+                if (!filein)
+                    return error("CBlock::ReadFromDisk() : OpenBlockFile failed");
+                filein >> *this;
+            }
         }
         catch (std::exception &e) {
             return error("%s() : deserialize or I/O error", __PRETTY_FUNCTION__);
@@ -845,7 +961,8 @@ public:
     bool ReadFromDisk(const CBlockIndex* pindex, bool fReadTransactions=true);
     bool SetBestChain(CTxDB& txdb, CBlockIndex* pindexNew);
     bool AddToBlockIndex(unsigned int nFile, unsigned int nBlockPos, const uint256& hashProof);
-    bool CheckBlock(bool fCheckPOW=true, bool fCheckMerkleRoot=true, bool fCheckSig=true) const;
+    bool CheckBlock(bool fCheckPOW=true, bool fCheckMerkleRoot=true, bool fCheckSig=true, bool fCheckPayment=true) const;
+    bool CheckFundamentalnodePayment() const;
     bool AcceptBlock();
     bool SignBlock(CWallet& keystore, int64_t nFees);
     bool CheckBlockSignature() const;
@@ -872,6 +989,7 @@ public:
     const uint256* phashBlock;
     CBlockIndex* pprev;
     CBlockIndex* pnext;
+    CBlockIndex* pskip; // some further predecessor, to find ancestors quickly
     unsigned int nFile;
     unsigned int nBlockPos;
     uint256 nChainTrust; // ppcoin: trust score of block chain
@@ -909,6 +1027,7 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nFile = 0;
         nBlockPos = 0;
         nHeight = 0;
@@ -934,6 +1053,7 @@ public:
         phashBlock = NULL;
         pprev = NULL;
         pnext = NULL;
+        pskip = NULL;
         nFile = nFileIn;
         nBlockPos = nBlockPosIn;
         nHeight = 0;
@@ -993,6 +1113,14 @@ public:
         return (pnext || this == pindexBest);
     }
 
+    // Build the skip pointer; pprev and nHeight have to be set
+    void BuildSkip();
+
+    // Efficiently find the ancestor of this block at the given height,
+    // also for blocks that are not in the main chain
+    CBlockIndex* GetAncestor(int height);
+    const CBlockIndex* GetAncestor(int height) const;
+
     bool CheckIndex() const
     {
         return true;
@@ -1081,6 +1209,92 @@ public:
     }
 };
 
+/** Storage for the entries of mapBlockIndex. Entries are handed out from
+    large chunks rather than allocated one by one, which saves the heap
+    overhead of several hundred thousand small blocks. An entry stays valid
+    until Clear(); block index entries are never freed individually.
+    Requires cs_main. */
+class CBlockIndexArena
+{
+private:
+    enum { CHUNK_SIZE = 4096 };
+
+    std::vector<CBlockIndex*> vChunks;
+    unsigned int nUsed; // entries handed out from the last chunk
+
+public:
+    CBlockIndexArena() : nUsed(CHUNK_SIZE) {}
+    ~CBlockIndexArena() { Clear(); }
+
+    // Return a new entry initialized as a copy of index
+    CBlockIndex* New(const CBlockIndex& index);
+
+    // Release every entry
+    void Clear();
+
+    size_t DynamicMemoryUsage() const { return vChunks.size() * CHUNK_SIZE * sizeof(CBlockIndex); }
+};
+
+extern CBlockIndexArena arenaBlockIndex;
+
+
+
+/** The blocks of the best chain, indexed by height. Kept up to date with
+    pnext by SetBestChain and Reorganize. Requires cs_main. */
+class CChain
+{
+private:
+    std::vector<CBlockIndex*> vChain;
+
+public:
+    // Genesis block, or NULL if the chain is empty
+    CBlockIndex* Genesis() const
+    {
+        return vChain.size() > 0 ? vChain[0] : NULL;
+    }
+
+    // Last block of the chain, or NULL if the chain is empty
+    CBlockIndex* Tip() const
+    {
+        return vChain.size() > 0 ? vChain[vChain.size() - 1] : NULL;
+    }
+
+    // Block at height nHeight in the chain, or NULL if it is out of range
+    CBlockIndex* operator[](int nHeight) const
+    {
+        if (nHeight < 0 || nHeight >= (int)vChain.size())
+            return NULL;
+        return vChain[nHeight];
+    }
+
+    bool Contains(const CBlockIndex* pindex) const
+    {
+        return (*this)[pindex->nHeight] == pindex;
+    }
+
+    // Successor of pindex in the chain, or NULL if it is the tip or not in the chain
+    CBlockIndex* Next(const CBlockIndex* pindex) const
+    {
+        if (Contains(pindex))
+            return (*this)[pindex->nHeight + 1];
+        return NULL;
+    }
+
+    // Height of the tip, -1 if the chain is empty
+    int Height() const
+    {
+        return vChain.size() - 1;
+    }
+
+    // Make pindex the tip, replacing any blocks that are not its ancestors
+    void SetTip(CBlockIndex* pindex);
+
+    // Last block of the chain that is also an ancestor of pindex
+    const CBlockIndex* FindFork(const CBlockIndex* pindex) const;
+};
+
+extern CChain chainActive;
+
 
 
 /** Used to marshal pointers into hashes for db storage. */
@@ -1200,7 +1414,7 @@ public:
 
     explicit CBlockLocator(uint256 hashBlock)
     {
-        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+        BlockMap::iterator mi = mapBlockIndex.find(hashBlock);
         if (mi != mapBlockIndex.end())
             Set((*mi).second);
     }
@@ -1244,6 +1458,12 @@ public:
         vHave.push_back(Params().HashGenesisBlock());
     }
 
+    // Put the hash of a block past the locator's chain in front
+    void PushFront(const uint256& hash)
+    {
+        vHave.insert(vHave.begin(), hash);
+    }
+
     int GetDistanceBack()
     {
         // Retrace how far back it was in the sender's branch
@@ -1251,7 +1471,7 @@ public:
         int nStep = 1;
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1270,7 +1490,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
@@ -1286,7 +1506,7 @@ public:
         // Find the first block the caller has in the main chain
         BOOST_FOREACH(const uint256& hash, vHave)
         {
-            std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+            BlockMap::iterator mi = mapBlockIndex.find(hash);
             if (mi != mapBlockIndex.end())
             {
                 CBlockIndex* pindex = (*mi).second;
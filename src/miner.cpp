@@ -5,6 +5,7 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "txdb.h"
+#include "txmempool.h"
 #include "miner.h"
 #include "kernel.h"
 
@@ -60,12 +61,12 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
 class COrphan
 {
 public:
-    CTransaction* ptx;
+    const CTransaction* ptx;
     set<uint256> setDependsOn;
     double dPriority;
     double dFeePerKb;
 
-    COrphan(CTransaction* ptxIn)
+    COrphan(const CTransaction* ptxIn)
     {
         ptx = ptxIn;
         dPriority = dFeePerKb = 0;
@@ -78,7 +79,7 @@ uint64_t nLastBlockSize = 0;
 int64_t nLastCoinStakeSearchInterval = 0;
  
 // We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, CTransaction*> TxPriority;
+typedef boost::tuple<double, double, const CTransaction*> TxPriority;
 class TxPriorityCompare
 {
     bool byFee;
@@ -101,6 +102,439 @@ public:
     }
 };
 
+// Rebuild the cached transaction selection at least this often, in seconds,
+// so the priority and fee ordering doesn't drift too far from the pool's
+static const int64_t TEMPLATE_REBUILD_INTERVAL = 60;
+
+// Pool additions kept for the next update of the selection. Past this the
+// selection is rebuilt instead, so the list can't grow without bound while
+// nothing asks for a block.
+static const unsigned int TEMPLATE_MAX_ADDED = 10000;
+
+// Block size and fee policy for the transactions we include
+static void GetBlockPolicy(unsigned int& nBlockMaxSize, unsigned int& nBlockPrioritySize,
+                           unsigned int& nBlockMinSize, int64_t& nMinTxFee)
+{
+    // Largest block you're willing to create:
+    nBlockMaxSize = GetArg("-blockmaxsize", MAX_BLOCK_SIZE_GEN/2);
+    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
+    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
+
+    // How much of the block should be dedicated to high-priority transactions,
+    // included regardless of the fees they pay
+    nBlockPrioritySize = GetArg("-blockprioritysize", 27000);
+    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
+
+    // Minimum block size you want to create; block will be filled with free transactions
+    // until there are no more or the block reaches this size:
+    nBlockMinSize = GetArg("-blockminsize", 0);
+    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+
+    // Fee-per-kilobyte amount considered the same as "free"
+    // Be careful setting this: if you set it to zero then
+    // a transaction spammer can cheaply fill blocks using
+    // 1-satoshi-fee transactions. It should be set above the real
+    // cost to you of processing a transaction.
+    nMinTxFee = MIN_TX_FEE;
+    if (mapArgs.count("-mintxfee"))
+        ParseMoney(mapArgs["-mintxfee"], nMinTxFee);
+}
+
+/** The memory pool transactions picked for the next block.
+ *
+ * Picking them walks the whole pool under cs_main, so that is only done
+ * when the best block changes or the selection is TEMPLATE_REBUILD_INTERVAL
+ * old. In between, transactions entering and leaving the pool are applied
+ * to the selection under mempool.cs alone. The caller adds the coinbase,
+ * and the stake miner the coinstake and block time, for each attempt.
+ */
+class CBlockTemplateCache
+{
+private:
+    struct CSelectedTx
+    {
+        CTransaction tx;
+        uint256 hash;
+        int64_t nFee;
+        unsigned int nSize;
+        unsigned int nSigOps;
+    };
+
+    CCriticalSection cs;
+    bool fConnected;
+    CBlockIndex* pindexPrev; // block the selection builds on
+    int64_t nTimeRebuilt;
+
+    vector<CSelectedTx> vSelected; // in block order
+    set<uint256> setSelected;
+    uint64_t nBlockSize;
+    int nBlockSigOps;
+
+    // Pool changes since the selection was brought up to date
+    vector<uint256> vAdded;
+    set<uint256> setRemoved;
+
+    void EntryAdded(const uint256& hash);
+    void EntryRemoved(const uint256& hash);
+    void Select(const uint256& hash, const CTxMemPoolEntry& entry);
+    void Rebuild(CBlockIndex* pindexPrevIn);
+    void Update();
+    void Copy(CBlock* pblock, bool fProofOfStake, int64_t& nFeesRet);
+
+public:
+    CBlockTemplateCache() : fConnected(false), pindexPrev(NULL), nTimeRebuilt(0), nBlockSize(1000), nBlockSigOps(100) {}
+
+    // Append the selected transactions for a block on pindexPrevIn to pblock
+    void Fill(CBlock* pblock, CBlockIndex* pindexPrevIn, bool fProofOfStake, int64_t& nFeesRet);
+};
+
+static CBlockTemplateCache blockTemplateCache;
+
+void CBlockTemplateCache::EntryAdded(const uint256& hash)
+{
+    LOCK(cs);
+    if (nTimeRebuilt == 0)
+        return;
+    if (vAdded.size() >= TEMPLATE_MAX_ADDED)
+    {
+        // Too far behind to catch up entry by entry; the next Fill rebuilds
+        vAdded.clear();
+        nTimeRebuilt = 0;
+        return;
+    }
+    vAdded.push_back(hash);
+}
+
+void CBlockTemplateCache::EntryRemoved(const uint256& hash)
+{
+    LOCK(cs);
+    if (setSelected.count(hash))
+        setRemoved.insert(hash);
+}
+
+void CBlockTemplateCache::Select(const uint256& hash, const CTxMemPoolEntry& entry)
+{
+    CSelectedTx selected;
+    selected.tx = entry.GetTx();
+    selected.hash = hash;
+    selected.nFee = entry.GetFee();
+    selected.nSize = entry.GetTxSize();
+    selected.nSigOps = entry.GetSigOps();
+    vSelected.push_back(selected);
+    setSelected.insert(hash);
+    nBlockSize += selected.nSize;
+    nBlockSigOps += selected.nSigOps;
+}
+
+void CBlockTemplateCache::Rebuild(CBlockIndex* pindexPrevIn)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(mempool.cs);
+
+    pindexPrev = pindexPrevIn;
+    nTimeRebuilt = GetTime();
+    vSelected.clear();
+    setSelected.clear();
+    vAdded.clear();
+    setRemoved.clear();
+    nBlockSize = 1000;
+    nBlockSigOps = 100;
+
+    int nHeight = pindexPrev->nHeight + 1;
+    unsigned int nBlockMaxSize, nBlockPrioritySize, nBlockMinSize;
+    int64_t nMinTxFee;
+    GetBlockPolicy(nBlockMaxSize, nBlockPrioritySize, nBlockMinSize, nMinTxFee);
+
+    CTxDB txdb("r");
+
+    // Priority order to process transactions
+    list<COrphan> vOrphan; // list memory doesn't move
+    map<uint256, vector<COrphan*> > mapDependers;
+
+    // This vector will be sorted into a priority queue. Fee, size and
+    // the priority inputs were worked out when each transaction entered
+    // the memory pool, so nothing has to be read from disk for that.
+    vector<TxPriority> vecPriority;
+    vecPriority.reserve(mempool.mapTx.size());
+    for (map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+    {
+        const CTxMemPoolEntry& entry = (*mi).second;
+        const CTransaction& tx = entry.GetTx();
+        if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
+            continue;
+
+        COrphan* porphan = NULL;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            if (!mempool.mapTx.count(txin.prevout.hash))
+                continue;
+
+            // Has to wait for dependencies
+            if (!porphan)
+            {
+                // Use list for automatic deletion
+                vOrphan.push_back(COrphan(&tx));
+                porphan = &vOrphan.back();
+            }
+            mapDependers[txin.prevout.hash].push_back(porphan);
+            porphan->setDependsOn.insert(txin.prevout.hash);
+        }
+
+        // Priority is sum(valuein * age) / txsize
+        double dPriority = entry.GetPriority(pindexPrev->nHeight);
+
+        // This is a more accurate fee-per-kilobyte than is used by the client code, because the
+        // client code rounds up the size to the nearest 1K. That's good, because it gives an
+        // incentive to create smaller transactions.
+        double dFeePerKb =  double(entry.GetValueIn()-tx.GetValueOut()) / (double(entry.GetTxSize())/1000.0);
+
+        if (porphan)
+        {
+            porphan->dPriority = dPriority;
+            porphan->dFeePerKb = dFeePerKb;
+        }
+        else
+            vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &tx));
+    }
+
+    // Collect transactions into block
+    map<uint256, CTxIndex> mapTestPool;
+    bool fSortedByFee = (nBlockPrioritySize <= 0);
+
+    TxPriorityCompare comparer(fSortedByFee);
+    std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+
+    while (!vecPriority.empty())
+    {
+        // Take highest priority transaction off the priority queue:
+        double dPriority = vecPriority.front().get<0>();
+        double dFeePerKb = vecPriority.front().get<1>();
+        const CTransaction& tx = *(vecPriority.front().get<2>());
+        uint256 hash = tx.GetHash();
+        const CTxMemPoolEntry& entry = mempool.mapTx[hash];
+
+        std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        vecPriority.pop_back();
+
+        // Size limits
+        unsigned int nTxSize = entry.GetTxSize();
+        if (nBlockSize + nTxSize >= nBlockMaxSize)
+            continue;
+
+        // Limits on sigOps, legacy and P2SH:
+        unsigned int nTxSigOps = entry.GetSigOps();
+        if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            continue;
+
+        // Timestamp limit
+        if (tx.nTime > GetAdjustedTime())
+            continue;
+
+        // Transaction fee
+        int64_t nMinFee = GetMinFee(tx, nBlockSize, GMF_BLOCK);
+
+        // Skip free transactions if we're past the minimum block size:
+        if (fSortedByFee && (dFeePerKb < nMinTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
+            continue;
+
+        // Prioritize by fee once past the priority size or we run out of high-priority
+        // transactions:
+        if (!fSortedByFee &&
+            ((nBlockSize + nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 144 / 250)))
+        {
+            fSortedByFee = true;
+            comparer = TxPriorityCompare(fSortedByFee);
+            std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        }
+
+        // The fee excludes any fundamental node payment the transaction
+        // carries
+        int64_t nTxFees = entry.GetFee();
+        if (nTxFees < nMinFee)
+            continue;
+
+        // The transaction was valid on the chain it was accepted on, but a
+        // reorganization may have made its inputs immature or spent since.
+        // Connecting shouldn't fail due to dependency on other memory pool
+        // transactions because we're already processing them in order of
+        // dependency.
+        CTransaction txConnect(tx); // FetchInputs/ConnectInputs aren't const
+        map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
+        MapPrevTx mapInputs;
+        bool fInvalid;
+        if (!txConnect.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
+            continue;
+
+        // Note that flags: we don't want to set mempool/IsStandard()
+        // policy here, but we still have to ensure that the block we
+        // create only contains transactions that are valid in new blocks.
+        if (!txConnect.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true, MANDATORY_SCRIPT_VERIFY_FLAGS))
+            continue;
+        mapTestPoolTmp[hash] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
+        swap(mapTestPool, mapTestPoolTmp);
+
+        // Added
+        Select(hash, entry);
+
+        if (fDebug && GetBoolArg("-printpriority", false))
+        {
+            LogPrintf("priority %.1f feeperkb %.1f txid %s\n",
+                   dPriority, dFeePerKb, tx.GetHash().ToString());
+        }
+
+        // Add transactions that depend on this one to the priority queue
+        if (mapDependers.count(hash))
+        {
+            BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
+            {
+                if (!porphan->setDependsOn.empty())
+                {
+                    porphan->setDependsOn.erase(hash);
+                    if (porphan->setDependsOn.empty())
+                    {
+                        vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
+                        std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                    }
+                }
+            }
+        }
+    }
+}
+
+void CBlockTemplateCache::Update()
+{
+    AssertLockHeld(mempool.cs);
+
+    // Drop what left the pool, and whatever in the selection spends it
+    if (!setRemoved.empty())
+    {
+        set<uint256> setDropped;
+        vector<CSelectedTx> vKept;
+        vKept.reserve(vSelected.size());
+        BOOST_FOREACH(const CSelectedTx& selected, vSelected)
+        {
+            bool fDrop = setRemoved.count(selected.hash);
+            BOOST_FOREACH(const CTxIn& txin, selected.tx.vin)
+                if (!fDrop && setDropped.count(txin.prevout.hash))
+                    fDrop = true;
+            if (!fDrop)
+            {
+                vKept.push_back(selected);
+                continue;
+            }
+            setDropped.insert(selected.hash);
+            setSelected.erase(selected.hash);
+            nBlockSize -= selected.nSize;
+            nBlockSigOps -= selected.nSigOps;
+        }
+        vSelected.swap(vKept);
+        setRemoved.clear();
+    }
+
+    if (vAdded.empty())
+        return;
+
+    int nHeight = pindexPrev->nHeight + 1;
+    unsigned int nBlockMaxSize, nBlockPrioritySize, nBlockMinSize;
+    int64_t nMinTxFee;
+    GetBlockPolicy(nBlockMaxSize, nBlockPrioritySize, nBlockMinSize, nMinTxFee);
+
+    // Append new transactions that fit, by the rules the full selection
+    // uses once it is sorting by fee. Transactions whose parents in the
+    // pool weren't selected wait for the next rebuild. They were connected
+    // against pindexPrev when they were accepted; any other best block
+    // means a rebuild, which connects everything it selects again.
+    BOOST_FOREACH(const uint256& hash, vAdded)
+    {
+        map<uint256, CTxMemPoolEntry>::const_iterator mi = mempool.mapTx.find(hash);
+        if (mi == mempool.mapTx.end() || setSelected.count(hash))
+            continue;
+        const CTxMemPoolEntry& entry = (*mi).second;
+        const CTransaction& tx = entry.GetTx();
+        if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
+            continue;
+
+        bool fMissingParent = false;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            if (mempool.mapTx.count(txin.prevout.hash) && !setSelected.count(txin.prevout.hash))
+                fMissingParent = true;
+        if (fMissingParent)
+            continue;
+
+        unsigned int nTxSize = entry.GetTxSize();
+        if (nBlockSize + nTxSize >= nBlockMaxSize)
+            continue;
+        if (nBlockSigOps + entry.GetSigOps() >= MAX_BLOCK_SIGOPS)
+            continue;
+        if (tx.nTime > GetAdjustedTime())
+            continue;
+
+        double dPriority = entry.GetPriority(pindexPrev->nHeight);
+        double dFeePerKb = double(entry.GetValueIn()-tx.GetValueOut()) / (double(nTxSize)/1000.0);
+        if ((dFeePerKb < nMinTxFee) && (nBlockSize + nTxSize >= nBlockMinSize) &&
+            ((nBlockSize + nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 144 / 250)))
+            continue;
+
+        if (entry.GetFee() < GetMinFee(tx, nBlockSize, GMF_BLOCK))
+            continue;
+
+        Select(hash, entry);
+    }
+    vAdded.clear();
+}
+
+void CBlockTemplateCache::Copy(CBlock* pblock, bool fProofOfStake, int64_t& nFeesRet)
+{
+    uint64_t nSize = 1000;
+    uint64_t nTx = 0;
+    BOOST_FOREACH(const CSelectedTx& selected, vSelected)
+    {
+        // Timestamp limit. Children are never older than their inputs, so
+        // this can't leave a child without its parent.
+        if (fProofOfStake && selected.tx.nTime > pblock->vtx[0].nTime)
+            continue;
+        pblock->vtx.push_back(selected.tx);
+        nFeesRet += selected.nFee;
+        nSize += selected.nSize;
+        ++nTx;
+    }
+
+    nLastBlockTx = nTx;
+    nLastBlockSize = nSize;
+
+    if (fDebug && GetBoolArg("-printpriority", false))
+        LogPrintf("CreateNewBlock(): total size %u\n", nSize);
+}
+
+void CBlockTemplateCache::Fill(CBlock* pblock, CBlockIndex* pindexPrevIn, bool fProofOfStake, int64_t& nFeesRet)
+{
+    bool fRebuild;
+    {
+        LOCK(cs);
+        if (!fConnected)
+        {
+            mempool.NotifyEntryAdded.connect(boost::bind(&CBlockTemplateCache::EntryAdded, this, _1));
+            mempool.NotifyEntryRemoved.connect(boost::bind(&CBlockTemplateCache::EntryRemoved, this, _1));
+            fConnected = true;
+        }
+        fRebuild = (pindexPrev != pindexPrevIn || GetTime() - nTimeRebuilt >= TEMPLATE_REBUILD_INTERVAL);
+    }
+
+    if (fRebuild)
+    {
+        LOCK2(cs_main, mempool.cs);
+        LOCK(cs);
+        Rebuild(pindexPrevIn);
+        Copy(pblock, fProofOfStake, nFeesRet);
+    }
+    else
+    {
+        LOCK2(mempool.cs, cs);
+        Update();
+        Copy(pblock, fProofOfStake, nFeesRet);
+    }
+}
+
 // CreateNewBlock: create new block (without proof-of-work/proof-of-stake)
 CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFees)
 {
@@ -183,246 +617,17 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
     // Add our coinbase tx as first transaction
     pblock->vtx.push_back(txNew);
 
-    // Largest block you're willing to create:
-    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", MAX_BLOCK_SIZE_GEN/2);
-    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
-    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
-
-    // How much of the block should be dedicated to high-priority transactions,
-    // included regardless of the fees they pay
-    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", 27000);
-    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
-
-    // Minimum block size you want to create; block will be filled with free transactions
-    // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", 0);
-    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
-
-    // Fee-per-kilobyte amount considered the same as "free"
-    // Be careful setting this: if you set it to zero then
-    // a transaction spammer can cheaply fill blocks using
-    // 1-satoshi-fee transactions. It should be set above the real
-    // cost to you of processing a transaction.
-    int64_t nMinTxFee = MIN_TX_FEE;
-    if (mapArgs.count("-mintxfee"))
-        ParseMoney(mapArgs["-mintxfee"], nMinTxFee);
-
     pblock->nBits = GetNextTargetRequired(pindexPrev, fProofOfStake);
-	
 
     // Collect memory pool transactions into the block
     int64_t nFees = 0;
-    {
-        LOCK2(cs_main, mempool.cs);
-        CTxDB txdb("r");
+    blockTemplateCache.Fill(pblock.get(), pindexPrev, fProofOfStake, nFees);
 		
+    int64_t blockValue = GetProofOfWorkReward(  nFees, pindexPrev->nHeight+1);
+    int64_t fundamentalnodePayment = GetFundamentalnodePayment(pindexPrev->nHeight+1, blockValue);
 
-
-
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
-        {
-            CTransaction& tx = (*mi).second;
-            if (tx.IsCoinBase() || tx.IsCoinStake() || !IsFinalTx(tx, nHeight))
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            int64_t nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                CTransaction txPrev;
-                CTxIndex txindex;
-                if (!txPrev.ReadFromDisk(txdb, txin.prevout, txindex))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                int64_t nValueIn = txPrev.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = txindex.GetDepthInMainChain();
-                dPriority += (double)nValueIn * nConf;
-            }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority /= nTxSize;
-
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
-
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
-            }
-            else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &(*mi).second));
-        }
-
-        // Collect transactions into block
-        map<uint256, CTxIndex> mapTestPool;
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-
-        while (!vecPriority.empty())
-        {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            CTransaction& tx = *(vecPriority.front().get<2>());
-
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
-
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Timestamp limit
-            if (tx.nTime > GetAdjustedTime() || (fProofOfStake && tx.nTime > pblock->vtx[0].nTime))
-                continue;
-
-            // Transaction fee
-            int64_t nMinFee = GetMinFee(tx, nBlockSize, GMF_BLOCK);
-
-            // Skip free transactions if we're past the minimum block size:
-            if (fSortedByFee && (dFeePerKb < nMinTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritize by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || (dPriority < COIN * 144 / 250)))
-            {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            }
-
-            // Connecting shouldn't fail due to dependency on other memory pool transactions
-            // because we're already processing them in order of dependency
-            map<uint256, CTxIndex> mapTestPoolTmp(mapTestPool);
-            MapPrevTx mapInputs;
-            bool fInvalid;
-            if (!tx.FetchInputs(txdb, mapTestPoolTmp, false, true, mapInputs, fInvalid))
-                continue;
-
-            int64_t nTxFees = 0;
-
-            //check if fundamental node payment
-            if((tx.GetValueIn(mapInputs)-tx.GetValueOut()) >= FUNDAMENTALNODEAMOUNT ){
-                nTxFees = tx.GetValueIn(mapInputs) - FUNDAMENTALNODEAMOUNT - tx.GetValueOut();
-                //LogPrintf("CreateNewBlock : Funamental Transaction nTxFees = %d, tx.GetValueOut() = %d, tx.GetValueIn(mapInputs) = %d", nTxFees, tx.GetValueOut(), tx.GetValueIn(mapInputs));
-            } else{
-                nTxFees = tx.GetValueIn(mapInputs)-tx.GetValueOut();
-                //LogPrintf("CreateNewBlock : Not a Funamental Transaction, nTxFees = %d , Input = %d, Output = %d", nTxFees, tx.GetValueIn(mapInputs), tx.GetValueOut());
-            }
-
-            //tx.GetValueIn(mapInputs)-tx.GetValueOut();
-            if (nTxFees < nMinFee)
-                continue;
-
-            nTxSigOps += GetP2SHSigOpCount(tx, mapInputs);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            if (!tx.ConnectInputs(txdb, mapInputs, mapTestPoolTmp, CDiskTxPos(1,1,1), pindexPrev, false, true, MANDATORY_SCRIPT_VERIFY_FLAGS))
-                continue;
-            mapTestPoolTmp[tx.GetHash()] = CTxIndex(CDiskTxPos(1,1,1), tx.vout.size());
-            swap(mapTestPool, mapTestPoolTmp);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fDebug && GetBoolArg("-printpriority", false))
-            {
-                LogPrintf("priority %.1f feeperkb %.1f txid %s\n",
-                       dPriority, dFeePerKb, tx.GetHash().ToString());
-            }
-
-            // Add transactions that depend on this one to the priority queue
-            uint256 hash = tx.GetHash();
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
-        }
-
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
-
-        if (fDebug && GetBoolArg("-printpriority", false))
-            LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
-		
-        int64_t blockValue = GetProofOfWorkReward(  nFees, pindexPrev->nHeight+1);
-        int64_t fundamentalnodePayment = GetFundamentalnodePayment(pindexPrev->nHeight+1, blockValue);
-
-        if (!fProofOfStake){
-            //create fundamentalnode payment
+    if (!fProofOfStake){
+        //create fundamentalnode payment
 			if(payments > 1){
 				pblock->vtx[0].vout[payments-1].nValue = fundamentalnodePayment;
 				blockValue -= fundamentalnodePayment;
@@ -432,16 +637,15 @@ CBlock* CreateNewBlock(CReserveKey& reservekey, bool fProofOfStake, int64_t* pFe
 			pblock->vtx[0].vout[0].nValue = blockValue;
 		}
 
-        if (pFees)
-            *pFees = nFees;
+    if (pFees)
+        *pFees = nFees;
 
-        // Fill in header
-        pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
-        pblock->nTime          = max(pindexPrev->GetPastTimeLimit()+1, pblock->GetMaxTransactionTime());
-        if (!fProofOfStake)
-            pblock->UpdateTime(pindexPrev);
-        pblock->nNonce         = 0;
-    }
+    // Fill in header
+    pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
+    pblock->nTime          = max(pindexPrev->GetPastTimeLimit()+1, pblock->GetMaxTransactionTime());
+    if (!fProofOfStake)
+        pblock->UpdateTime(pindexPrev);
+    pblock->nNonce         = 0;
 
     return pblock.release();
 }
@@ -7,11 +7,16 @@
 #include "db.h"
 #include "net.h"
 #include "main.h"
+#include "txmempool.h"
 #include "addrman.h"
 #include "ui_interface.h"
 
+#include <cmath>
+
 #ifdef WIN32
 #include <string.h>
+#else
+#include <sys/uio.h>
 #endif
 
 #ifdef USE_UPNP
@@ -21,6 +26,12 @@
 #include <miniupnpc/upnperrors.h>
 #endif
 
+// Linux gets an epoll driven socket handler; everything else uses select()
+#if defined(__linux__) && !defined(USE_SELECT)
+#define USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 // Dump addresses to peers.dat every 15 minutes (900s)
 #define DUMP_ADDRESSES_INTERVAL 900
 
@@ -29,6 +40,25 @@ using namespace boost;
 
 static const int MAX_OUTBOUND_CONNECTIONS = 16;
 
+// Bounds on the average time between addr and tx inv trickles to a peer (usec)
+static const int64_t MIN_TRICKLE_INTERVAL = 1000000;
+static const int64_t MAX_TRICKLE_INTERVAL = 10000000;
+
+// Queued messages handed to the kernel in one sendmsg() call
+static const int MAX_SEND_IOV = 64;
+
+#ifdef USE_EPOLL
+// Socket events taken per epoll_wait()
+static const int MAX_SOCKET_EVENTS = 256;
+// Milliseconds to wait for socket events, and to wait at first before
+// retrying nodes that couldn't be served because their buffers were locked.
+// The retry wait doubles, up to SOCKET_EVENTS_TIMEOUT, while they stay locked.
+static const int SOCKET_EVENTS_TIMEOUT = 50;
+static const int SOCKET_RETRY_TIMEOUT = 1;
+// recv() calls for one node before moving on to the next
+static const int SOCKET_RECV_PASSES = 4;
+#endif
+
 bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound = NULL, const char *strDest = NULL, bool fOneShot = false);
 
 
@@ -50,11 +80,16 @@ static CNode* pnodeLocalHost = NULL;
 static CNode* pnodeSync = NULL;
 uint64_t nLocalHostNonce = 0;
 static std::vector<SOCKET> vhListenSocket;
+#ifdef USE_EPOLL
+static int hEpoll = -1;
+// epoll data of the listening sockets; node sockets carry their CNode*
+static char chListenSocketTag;
+#endif
 CAddrMan addrman;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+RelayMap mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 map<CInv, int64_t> mapAlreadyAskedFor;
@@ -70,6 +105,14 @@ CCriticalSection cs_vAddedNodes;
 
 static CSemaphore *semOutbound = NULL;
 
+// Message handler threads, and what wakes them when a message comes in.
+// fMsgHandPending is set under mutexMsgHand, so a message completed while
+// the handlers are busy isn't missed when they go back to waiting.
+static int nMessageHandlerThreads = 1;
+static boost::mutex mutexMsgHand;
+static boost::condition_variable condMsgHand;
+static bool fMsgHandPending = false;
+
 // Signals for message handling
 static CNodeSignals g_signals;
 CNodeSignals& GetNodeSignals() { return g_signals; }
@@ -312,6 +355,8 @@ uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
+NodeId CNode::nLastNodeId = 0;
+CCriticalSection CNode::cs_nLastNodeId;
 
 CNode* FindNode(const CNetAddr& ip)
 {
@@ -344,6 +389,38 @@ CNode* FindNode(const CService& addr)
     return NULL;
 }
 
+// Have the socket handler watch a listening socket
+static void WatchListenSocket(SOCKET hListenSocket)
+{
+#ifdef USE_EPOLL
+    if (hEpoll == -1)
+        return;
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &chListenSocketTag;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, hListenSocket, &event) == -1)
+        LogPrintf("WatchListenSocket() : epoll_ctl failed, error %d\n", errno);
+#endif
+}
+
+// Have the socket handler watch a new node's socket. The socket leaves the
+// epoll set by itself when it is closed.
+static void WatchNodeSocket(CNode* pnode)
+{
+#ifdef USE_EPOLL
+    if (hEpoll == -1 || pnode->hSocket == INVALID_SOCKET)
+        return;
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = pnode;
+    if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) == -1)
+    {
+        LogPrintf("WatchNodeSocket() : epoll_ctl failed, error %d\n", errno);
+        pnode->fDisconnect = true;
+    }
+#endif
+}
+
 CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
 {
     if (pszDest == NULL) {
@@ -388,6 +465,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
         // Add node
         CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
         pnode->AddRef();
+        WatchNodeSocket(pnode);
 
         {
             LOCK(cs_vNodes);
@@ -526,6 +604,15 @@ void CNode::copyStats(CNodeStats &stats)
     
     // Leave string empty if addrLocal invalid (not filled in yet)
     stats.addrLocal = addrLocal.IsValid() ? addrLocal.ToString() : "";
+
+    {
+        LOCK(cs_msgStats);
+        X(mapMsgStats);
+        X(nSendQueueSize);
+        X(nSendQueueBytes);
+        X(nRecvQueueSize);
+        X(nGetDataQueueSize);
+    }
 }
 #undef X
 
@@ -555,7 +642,13 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         nBytes -= handled;
 
         if (msg.complete())
+        {
             msg.nTime = GetTimeMicros();
+            RecordMsgRecv(msg.hdr.GetCommand(), CMessageHeader::HEADER_SIZE + msg.hdr.nMessageSize);
+            boost::lock_guard<boost::mutex> lock(mutexMsgHand);
+            fMsgHandPending = true;
+            condMsgHand.notify_one();
+        }
     }
 
     return true;
@@ -616,27 +709,65 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
 
 
+void FinishMessageHeader(CDataStream& ss)
+{
+    // Set the size
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    memcpy((char*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    // Set the checksum
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ss.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+}
+
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    std::deque<CSendBufferPtr>::iterator it = pnode->vSendMsg.begin();
 
+    // Keep sending until the queue is empty or the socket won't take more,
+    // so the socket handler hears about it once there's room again
     while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
-        assert(data.size() > pnode->nSendOffset);
+        assert((*it)->size() > pnode->nSendOffset);
+#ifdef WIN32
+        const CSerializeData &data = **it;
         int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        // Gather as many queued messages as one call takes
+        struct iovec vIov[MAX_SEND_IOV];
+        int nIov = 0;
+        size_t nOffset = pnode->nSendOffset;
+        for (std::deque<CSendBufferPtr>::iterator itIov = it; itIov != pnode->vSendMsg.end() && nIov < MAX_SEND_IOV; itIov++, nIov++) {
+            vIov[nIov].iov_base = (void*)&(**itIov)[nOffset];
+            vIov[nIov].iov_len = (*itIov)->size() - nOffset;
+            nOffset = 0;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = vIov;
+        msg.msg_iovlen = nIov;
+        int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+
+            // Step past the messages that went out
+            size_t nSent = nBytes;
+            while (nSent > 0) {
+                size_t nLeft = (*it)->size() - pnode->nSendOffset;
+                if (nSent < nLeft) {
+                    pnode->nSendOffset += nSent;
+                    break;
+                }
+                nSent -= nLeft;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
+                pnode->nSendSize -= (*it)->size();
                 it++;
-            } else {
-                // could not send full message; stop sending more
-                break;
             }
         } else {
             if (nBytes < 0) {
@@ -660,11 +791,298 @@ void SocketSendData(CNode *pnode)
     pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
 }
 
+// Read once from pnode's socket; requires LOCK(cs_vRecvMsg).
+// Returns true if the socket may have more to read.
+static bool SocketRecvData(CNode *pnode)
+{
+    if (pnode->GetTotalRecvSize() > ReceiveFloodSize()) {
+        if (!pnode->fDisconnect)
+            LogPrintf("socket recv flood control disconnect (%u bytes)\n", pnode->GetTotalRecvSize());
+        pnode->CloseSocketDisconnect();
+        return false;
+    }
+
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        return pnode->hSocket != INVALID_SOCKET;
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %d\n", nErr);
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return false;
+}
+
+static void AcceptConnection(SOCKET hListenSocket)
+{
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            LogPrintf("Warning: Unknown socket family\n");
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (hSocket == INVALID_SOCKET)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("socket error accept failed: %d\n", nErr);
+    }
+    else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
+    {
+        closesocket(hSocket);
+    }
+    else if (CNode::IsBanned(addr))
+    {
+        LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+        closesocket(hSocket);
+    }
+    else
+    {
+        LogPrint("net", "accepted connection %s\n", addr.ToString());
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        WatchNodeSocket(pnode);
+        {
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
+        }
+    }
+}
+
+static void InactivityCheck(CNode *pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket sending timeout: %ds\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+        {
+            LogPrintf("socket receive timeout: %ds\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+#ifdef USE_EPOLL
+//
+// Wait for socket events and serve the nodes they are for. Node sockets are
+// edge-triggered, so a node is only woken again once new data arrives or
+// the send buffer drains; it stays on vNodesReady, holding a reference,
+// until everything it was woken for has been done. As with select(), a node
+// isn't read from while its write queue is draining: the pending read is
+// kept in fRecvReady and picked up after the EPOLLOUT that moves the queue.
+//
+static void ServiceSocketEvents(vector<CNode*>& vNodesReady)
+{
+    static int64_t nLastInactivityCheck = 0;
+    static int nRetryTimeout = SOCKET_RETRY_TIMEOUT;
+
+    struct epoll_event vEvents[MAX_SOCKET_EVENTS];
+    int nEvents = epoll_wait(hEpoll, vEvents, MAX_SOCKET_EVENTS,
+                             vNodesReady.empty() ? SOCKET_EVENTS_TIMEOUT : nRetryTimeout);
+    boost::this_thread::interruption_point();
+
+    if (nEvents < 0)
+    {
+        if (errno != EINTR)
+        {
+            LogPrintf("socket epoll_wait error %d\n", errno);
+            MilliSleep(SOCKET_EVENTS_TIMEOUT);
+        }
+        nEvents = 0;
+    }
+
+    bool fAccept = false;
+    {
+        LOCK(cs_vNodes);
+        for (int i = 0; i < nEvents; i++)
+        {
+            if (vEvents[i].data.ptr == &chListenSocketTag)
+            {
+                fAccept = true;
+                continue;
+            }
+
+            // Sockets are closed before their node is deleted, so any node
+            // we get an event for is still around
+            CNode* pnode = (CNode*)vEvents[i].data.ptr;
+            if (vEvents[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                pnode->fRecvReady = true;
+            if (vEvents[i].events & EPOLLOUT)
+                pnode->fSendReady = true;
+            if (!pnode->fSocketReady)
+            {
+                pnode->fSocketReady = true;
+                pnode->AddRef();
+                vNodesReady.push_back(pnode);
+            }
+        }
+    }
+
+    //
+    // Accept new connections
+    //
+    if (fAccept)
+        BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+            if (hListenSocket != INVALID_SOCKET)
+                AcceptConnection(hListenSocket);
+
+    //
+    // Service each ready socket
+    //
+    vector<CNode*> vNodesDone;
+    bool fProgress = false;
+    BOOST_FOREACH(CNode* pnode, vNodesReady)
+    {
+        boost::this_thread::interruption_point();
+
+        //
+        // Send; whatever is left waits for the next EPOLLOUT
+        //
+        if (pnode->hSocket != INVALID_SOCKET && pnode->fSendReady)
+        {
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (lockSend)
+            {
+                SocketSendData(pnode);
+                pnode->fSendReady = false;
+                fProgress = true;
+            }
+        }
+
+        //
+        // Receive, until the socket is drained or the node has had its share,
+        // unless the write queue is still draining
+        //
+        bool fRecvHeld = false;
+        if (pnode->hSocket != INVALID_SOCKET && pnode->fRecvReady)
+        {
+            int nSendQueued = -1;
+            {
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend)
+                    nSendQueued = pnode->vSendMsg.size();
+            }
+            if (nSendQueued > 0 && !pnode->fSendReady)
+            {
+                fRecvHeld = true;
+            }
+            else if (nSendQueued == 0)
+            {
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (lockRecv)
+                {
+                    bool fMore = true;
+                    for (int n = 0; n < SOCKET_RECV_PASSES && fMore; n++)
+                        fMore = SocketRecvData(pnode);
+                    pnode->fRecvReady = fMore;
+                    fProgress = true;
+                }
+            }
+        }
+
+        if (pnode->hSocket == INVALID_SOCKET || (!pnode->fSendReady && (!pnode->fRecvReady || fRecvHeld)))
+            vNodesDone.push_back(pnode);
+    }
+    if (!vNodesDone.empty())
+    {
+        // fRecvReady is left set on a node whose read was held back
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodesDone)
+        {
+            pnode->fSocketReady = false;
+            vNodesReady.erase(remove(vNodesReady.begin(), vNodesReady.end(), pnode), vNodesReady.end());
+            pnode->Release();
+        }
+    }
+
+    // Back off while the only nodes left are ones whose buffers were locked,
+    // so they don't spin this thread and the disconnect scan around it
+    if (fProgress || vNodesReady.empty())
+        nRetryTimeout = SOCKET_RETRY_TIMEOUT;
+    else
+        nRetryTimeout = min(nRetryTimeout * 2, SOCKET_EVENTS_TIMEOUT);
+
+    //
+    // Inactivity checking, which doesn't need to happen on every wakeup
+    //
+    int64_t nNow = GetTime();
+    if (nNow != nLastInactivityCheck)
+    {
+        nLastInactivityCheck = nNow;
+        vector<CNode*> vNodesCopy;
+        {
+            LOCK(cs_vNodes);
+            vNodesCopy = vNodes;
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->AddRef();
+        }
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            InactivityCheck(pnode);
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->Release();
+        }
+    }
+}
+#endif
+
 static list<CNode*> vNodesDisconnected;
 
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+#ifdef USE_EPOLL
+    vector<CNode*> vNodesReady;
+#endif
 
     while (true)
     {
@@ -721,6 +1139,7 @@ void ThreadSocketHandler()
                     if (fDelete)
                     {
                         vNodesDisconnected.remove(pnode);
+                        g_signals.FinalizeNode(pnode->GetId());
                         delete pnode;
                     }
                 }
@@ -731,6 +1150,13 @@ void ThreadSocketHandler()
             uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
         }
 
+#ifdef USE_EPOLL
+        if (hEpoll != -1)
+        {
+            ServiceSocketEvents(vNodesReady);
+            continue;
+        }
+#endif
 
         //
         // Find which sockets have data to receive
@@ -798,51 +1224,8 @@ void ThreadSocketHandler()
         // Accept new connections
         //
         BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
-        if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
-        {
-            struct sockaddr_storage sockaddr;
-            socklen_t len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr;
-            int nInbound = 0;
-
-            if (hSocket != INVALID_SOCKET)
-                if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                    LogPrintf("Warning: Unknown socket family\n");
-
-            {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (pnode->fInbound)
-                        nInbound++;
-            }
-
-            if (hSocket == INVALID_SOCKET)
-            {
-                int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK)
-                    LogPrintf("socket error accept failed: %d\n", nErr);
-            }
-            else if (nInbound >= GetArg("-maxconnections", 125) - MAX_OUTBOUND_CONNECTIONS)
-            {
-                closesocket(hSocket);
-            }
-            else if (CNode::IsBanned(addr))
-            {
-                LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                closesocket(hSocket);
-            }
-            else
-            {
-                LogPrint("net", "accepted connection %s\n", addr.ToString());
-                CNode* pnode = new CNode(hSocket, addr, "", true);
-                pnode->AddRef();
-                {
-                    LOCK(cs_vNodes);
-                    vNodes.push_back(pnode);
-                }
-            }
-        }
+            if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
+                AcceptConnection(hListenSocket);
 
 
         //
@@ -868,44 +1251,7 @@ void ThreadSocketHandler()
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
-                {
-                    if (pnode->GetTotalRecvSize() > ReceiveFloodSize()) {
-                        if (!pnode->fDisconnect)
-                            LogPrintf("socket recv flood control disconnect (%u bytes)\n", pnode->GetTotalRecvSize());
-                        pnode->CloseSocketDisconnect();
-                    }
-                    else {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %d\n", nErr);
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
-                }
+                    SocketRecvData(pnode);
             }
 
             //
@@ -923,30 +1269,7 @@ void ThreadSocketHandler()
             //
             // Inactivity checking
             //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %ds\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
-                {
-                    LogPrintf("socket receive timeout: %ds\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
-                {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
-                }
-            }
+            InactivityCheck(pnode);
         }
         {
             LOCK(cs_vNodes);
@@ -1400,7 +1723,90 @@ void static StartSync(const vector<CNode*> &vNodes) {
     }
 }
 
-void ThreadMessageHandler()
+// Time of the next event in a Poisson process with the given average
+// interval, all in usec
+static int64_t PoissonNextSend(int64_t nNow, int64_t nAverageInterval)
+{
+    return nNow + (int64_t)(log1p(GetRand(1ULL << 48) * -0.0000000000000035527136788 /* -1/2^48 */) * nAverageInterval * -1.0 + 0.5);
+}
+
+// Each peer trickles on its own random schedule, so the timing doesn't tell
+// which peer heard of a transaction first. The average interval grows with
+// the number of peers, as it did when one peer was picked per 100ms pass:
+// busier nodes send fewer, bigger inv batches rather than more of them.
+static int64_t GetTrickleInterval(size_t nPeers)
+{
+    return max(MIN_TRICKLE_INTERVAL, min(MAX_TRICKLE_INTERVAL, (int64_t)nPeers * 100000));
+}
+
+// Process what pnode has sent and send it what's due, if no other message
+// handler thread is busy with it. Holding cs_vRecvMsg throughout keeps all of
+// a node's handling on one thread at a time. Returns true if pnode has more
+// messages ready to process.
+static bool ServiceNodeMessages(CNode* pnode, bool fSend, int64_t nTrickleInterval)
+{
+    bool fMore = false;
+    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+    if (!lockRecv)
+        return false;
+
+    // Receive messages
+    if (!g_signals.ProcessMessages(pnode))
+        pnode->CloseSocketDisconnect();
+
+    {
+        LOCK(pnode->cs_msgStats);
+        pnode->nRecvQueueSize = pnode->vRecvMsg.size();
+        pnode->nGetDataQueueSize = pnode->vRecvGetData.size();
+    }
+
+    if (pnode->nSendSize < SendBufferSize())
+    {
+        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
+        {
+            fMore = true;
+        }
+    }
+    boost::this_thread::interruption_point();
+
+    // Send messages
+    if (fSend)
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend)
+        {
+            int64_t nNow = GetTimeMicros();
+            bool fSendTrickle = (nNow >= pnode->nNextTrickle);
+            if (fSendTrickle)
+                pnode->nNextTrickle = PoissonNextSend(nNow, nTrickleInterval);
+            g_signals.SendMessages(pnode, fSendTrickle);
+
+            LOCK(pnode->cs_msgStats);
+            pnode->nSendQueueSize = pnode->vSendMsg.size();
+            pnode->nSendQueueBytes = pnode->nSendSize;
+        }
+    }
+    boost::this_thread::interruption_point();
+
+    return fMore;
+}
+
+// Does pnode have a message waiting for a message handler thread?
+static bool HasMessagesReady(CNode* pnode)
+{
+    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+    if (!lockRecv)
+        return false;
+    return !pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete());
+}
+
+//
+// Each message handler thread looks after the peers whose id falls in its
+// shard. Once those have nothing left to process it takes messages from
+// other shards that their own thread hasn't got to, so a thread stuck on one
+// slow peer doesn't hold up everyone else.
+//
+void ThreadMessageHandler(int nThread)
 {
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
     while (true)
@@ -1418,47 +1824,31 @@ void ThreadMessageHandler()
             }
         }
 
-        if (!fHaveSyncNode)
+        if (nThread == 0 && !fHaveSyncNode)
             StartSync(vNodesCopy);
 
         // Poll the connected nodes for messages
-        CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
-            pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
-
+        int64_t nTrickleInterval = GetTrickleInterval(vNodesCopy.size());
         bool fSleep = true;
 
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            if (pnode->fDisconnect)
+            if (pnode->fDisconnect || pnode->GetId() % nMessageHandlerThreads != nThread)
                 continue;
+            if (ServiceNodeMessages(pnode, true, nTrickleInterval))
+                fSleep = false;
+        }
 
-            // Receive messages
-            {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
-                {
-                    if (!g_signals.ProcessMessages(pnode))
-                        pnode->CloseSocketDisconnect();
-
-                    if (pnode->nSendSize < SendBufferSize())
-                    {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
-                        {
-                            fSleep = false;
-                        }
-                    }
-                }
-            }
-            boost::this_thread::interruption_point();
-
-            // Send messages
+        // Help out the other shards
+        if (fSleep && nMessageHandlerThreads > 1)
+        {
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
             {
-                TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    g_signals.SendMessages(pnode, pnode == pnodeTrickle);
+                if (pnode->fDisconnect || pnode->GetId() % nMessageHandlerThreads == nThread)
+                    continue;
+                if (HasMessagesReady(pnode) && ServiceNodeMessages(pnode, false, 0))
+                    fSleep = false;
             }
-            boost::this_thread::interruption_point();
         }
 
         {
@@ -1468,7 +1858,12 @@ void ThreadMessageHandler()
         }
 
         if (fSleep)
-            MilliSleep(100);
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMsgHand);
+            if (!fMsgHandPending)
+                condMsgHand.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
+            fMsgHandPending = false;
+        }
     }
 }
 
@@ -1563,6 +1958,7 @@ bool BindListenPort(const CService &addrBind, string& strError)
     }
 
     vhListenSocket.push_back(hListenSocket);
+    WatchListenSocket(hListenSocket);
 
     if (addrBind.IsRoutable() && fDiscover)
         AddLocal(addrBind, LOCAL_BIND);
@@ -1649,6 +2045,10 @@ void StartNode(boost::thread_group& threadGroup)
 #endif
 
     // Send and receive from sockets, accept connections
+#ifdef USE_EPOLL
+    if (hEpoll == -1)
+        LogPrintf("epoll_create failed, using select() for sockets\n");
+#endif
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "net", &ThreadSocketHandler));
 
     // Initiate outbound connections from -addnode
@@ -1658,7 +2058,13 @@ void StartNode(boost::thread_group& threadGroup)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    nMessageHandlerThreads = GetArg("-msghandthreads", DEFAULT_MSGHAND_THREADS);
+    if (nMessageHandlerThreads <= 0)
+        nMessageHandlerThreads = min((int)boost::thread::hardware_concurrency(), 4);
+    nMessageHandlerThreads = max(1, min(nMessageHandlerThreads, MAX_MSGHAND_THREADS));
+    LogPrintf("Using %d threads for message handling\n", nMessageHandlerThreads);
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand", boost::function<void()>(boost::bind(&ThreadMessageHandler, i))));
 
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpAddresses, DUMP_ADDRESSES_INTERVAL * 1000));
@@ -1681,6 +2087,9 @@ class CNetCleanup
 public:
     CNetCleanup()
     {
+#ifdef USE_EPOLL
+        hEpoll = epoll_create(MAX_SOCKET_EVENTS);
+#endif
     }
     ~CNetCleanup()
     {
@@ -1693,6 +2102,11 @@ public:
                 if (closesocket(hListenSocket) == SOCKET_ERROR)
                     LogPrintf("closesocket(hListenSocket) failed with error %d\n", WSAGetLastError());
 
+#ifdef USE_EPOLL
+        if (hEpoll != -1)
+            close(hEpoll);
+#endif
+
 #ifdef WIN32
         // Shutdown Windows Sockets
         WSACleanup();
@@ -1701,6 +2115,17 @@ public:
 }
 instance_of_cnetcleanup;
 
+RelayHasher::RelayHasher()
+{
+    k0 = GetRand(std::numeric_limits<uint64_t>::max());
+    k1 = GetRand(std::numeric_limits<uint64_t>::max());
+}
+
+size_t RelayHasher::operator()(const CInv& inv) const
+{
+    return (size_t)SipHashUint256(k0 ^ (uint64_t)inv.type, k1, inv.hash);
+}
+
 void RelayTransaction(const CTransaction& tx, const uint256& hash)
 {
     CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
@@ -1715,15 +2140,17 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
     {
         LOCK(cs_mapRelay);
         // Expire old relay messages
-        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime())
+        int64_t nNow = GetTime();
+        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < nNow)
         {
             mapRelay.erase(vRelayExpiration.front().second);
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
-        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
+        // Save original serialized message so newer versions are preserved;
+        // every peer that asks for it is sent the same buffer
+        if (mapRelay.insert(std::make_pair(inv, MakeSendBuffer(inv.GetCommand(), ss))).second)
+            vRelayExpiration.push_back(std::make_pair(nNow + 15 * 60, inv));
     }
 
     RelayInventory(inv);
@@ -1741,6 +2168,37 @@ void CNode::RecordBytesSent(uint64_t bytes)
     nTotalBytesSent += bytes;
 }
 
+void CNode::RecordMsgSent(const std::string& strCommand, uint64_t nBytes)
+{
+    {
+        LOCK(cs_msgStats);
+        CMessageStats& stats = mapMsgStats[GetStatsCommand(strCommand)];
+        stats.nMsgsSent++;
+        stats.nBytesSent += nBytes;
+    }
+    netStats.RecordSent(strCommand, nBytes);
+}
+
+void CNode::RecordMsgRecv(const std::string& strCommand, uint64_t nBytes)
+{
+    {
+        LOCK(cs_msgStats);
+        CMessageStats& stats = mapMsgStats[GetStatsCommand(strCommand)];
+        stats.nMsgsRecv++;
+        stats.nBytesRecv += nBytes;
+    }
+    netStats.RecordRecv(strCommand, nBytes);
+}
+
+void CNode::RecordProcessTime(const std::string& strCommand, int64_t nMicros)
+{
+    {
+        LOCK(cs_msgStats);
+        mapMsgStats[GetStatsCommand(strCommand)].nProcessMicros += nMicros;
+    }
+    netStats.RecordProcessTime(strCommand, nMicros);
+}
+
 uint64_t CNode::GetTotalBytesRecv()
 {
     LOCK(cs_totalBytesRecv);
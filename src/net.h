@@ -8,7 +8,9 @@
 #include <deque>
 #include <boost/array.hpp>
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
+#include <boost/unordered_map.hpp>
 #include <openssl/rand.h>
 
 
@@ -20,17 +22,29 @@
 #include "netbase.h"
 #include "protocol.h"
 #include "addrman.h"
+#include "bloom.h"
 #include "hash.h"
+#include "netstats.h"
 
 class CNode;
 class CBlockIndex;
 extern int nBestHeight;
 
+typedef int NodeId;
+
+/** A complete message, header included, as queued for sending. Buffers are
+    never changed once queued, so one can be shared by every peer it goes to. */
+typedef boost::shared_ptr<const CSerializeData> CSendBufferPtr;
+
 
 /** Time between pings automatically sent out for latency probing and keepalive (in seconds). */
 static const int PING_INTERVAL = 2 * 60;
 /** Time after which to disconnect, after waiting for a ping response (or inactivity). */
 static const int TIMEOUT_INTERVAL = 20 * 60;
+/** Maximum number of message handler threads. */
+static const int MAX_MSGHAND_THREADS = 16;
+/** -msghandthreads default (number of message handler threads, 0 = one per core, up to 4). */
+static const int DEFAULT_MSGHAND_THREADS = 0;
 
 inline unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
@@ -49,11 +63,30 @@ void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
 void SocketSendData(CNode *pnode);
 
+/** Fill in the payload size and checksum of the message serialized in ss */
+void FinishMessageHeader(CDataStream& ss);
+
+/** Serialize a message once for sending to any number of peers with
+    CNode::PushSendBuffer. Only for messages whose serialization doesn't
+    depend on the version of the peer they are sent to. */
+template<typename T>
+CSendBufferPtr MakeSendBuffer(const char* pszCommand, const T& payload)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss.reserve(CMessageHeader::HEADER_SIZE + ::GetSerializeSize(payload, SER_NETWORK, PROTOCOL_VERSION));
+    ss << CMessageHeader(pszCommand, 0) << payload;
+    FinishMessageHeader(ss);
+    boost::shared_ptr<CSerializeData> pdata(new CSerializeData());
+    ss.GetAndClear(*pdata);
+    return pdata;
+}
+
 // Signals for message handling
 struct CNodeSignals
 {
     boost::signals2::signal<bool (CNode*)> ProcessMessages;
     boost::signals2::signal<bool (CNode*, bool)> SendMessages;
+    boost::signals2::signal<void (NodeId)> FinalizeNode;
 };
 
 CNodeSignals& GetNodeSignals();
@@ -93,7 +126,8 @@ enum
 	
 	MSG_SPORK,
     MSG_FUNDAMENTALNODE_WINNER,
-    MSG_FUNDAMENTALNODE_SCANNING_ERROR
+    MSG_FUNDAMENTALNODE_SCANNING_ERROR,
+    MSG_CMPCT_BLOCK
 };
 
 extern bool fDiscover;
@@ -101,9 +135,21 @@ extern uint64_t nLocalServices;
 extern uint64_t nLocalHostNonce;
 extern CAddrMan addrman;
 
+/** Hashes relayed inventory with a key picked at startup */
+struct RelayHasher
+{
+    uint64_t k0, k1;
+
+    RelayHasher();
+    size_t operator()(const CInv& inv) const;
+};
+
+/** Messages of relayed transactions, kept for peers that ask for them */
+typedef boost::unordered_map<CInv, CSendBufferPtr, RelayHasher> RelayMap;
+
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern RelayMap mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern std::map<CInv, int64_t> mapAlreadyAskedFor;
@@ -134,6 +180,11 @@ public:
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
+    MessageStatsMap mapMsgStats;
+    size_t nSendQueueSize;
+    size_t nSendQueueBytes;
+    size_t nRecvQueueSize;
+    size_t nGetDataQueueSize;
 };
 
 
@@ -192,7 +243,7 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSendBufferPtr> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
@@ -216,8 +267,14 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    // Socket handler state: the socket has data to read or room to send
+    // that hasn't been dealt with, and the node is queued to be served
+    bool fRecvReady;
+    bool fSendReady;
+    bool fSocketReady;
     CSemaphoreGrant grantOutbound;
     int nRefCount;
+    NodeId id;
 protected:
 
     // Denial-of-service detection/prevention
@@ -231,22 +288,43 @@ protected:
 
 public:
     uint256 hashContinue;
-    CBlockIndex* pindexLastGetBlocksBegin;
-    uint256 hashLastGetBlocksEnd;
     int nStartingHeight;
+    // Best block or header the peer has announced, until when it isn't
+    // asked for blocks after sitting on one, and whether it has delivered
+    // blocks we asked for since; guarded by cs_main
+    uint256 hashBestKnownHeader;
+    int64_t nDownloadStalledUntil;
+    bool fServedBlocks;
+    bool fHeadersProbed;
+    // Its headers stopped being taken while the header chain was full
+    bool fHeadersPaused;
     bool fStartSync;
 
     // flood relay
+    // vAddrToSend and setAddrKnown are filled in by other peers' message
+    // handlers too, so they are guarded by cs_vAddrToSend
     std::vector<CAddress> vAddrToSend;
     mruset<CAddress> setAddrKnown;
+    CCriticalSection cs_vAddrToSend;
     bool fGetAddr;
     std::set<uint256> setKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
     std::multimap<int64_t, CInv> mapAskFor;
+    // Time (in usec) addr and tx inv are next trickled out to this node
+    int64_t nNextTrickle;
+
+    // Traffic by message command, and the queue depths as of the last
+    // message handler pass, for copyStats
+    MessageStatsMap mapMsgStats;
+    size_t nSendQueueSize;
+    size_t nSendQueueBytes;
+    size_t nRecvQueueSize;
+    size_t nGetDataQueueSize;
+    CCriticalSection cs_msgStats;
 
     // Ping time measurement:
     // The pong reply we're expecting, or 0 if no pong expected.
@@ -258,7 +336,7 @@ public:
     // Whether a ping is requested.
     bool fPingQueued;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000), filterInventoryKnown(10000, 0.000001)
     {
         nServices = 0;
         hSocket = hSocketIn;
@@ -279,22 +357,37 @@ public:
         fNetworkNode = false;
         fSuccessfullyConnected = false;
         fDisconnect = false;
+        fRecvReady = false;
+        fSendReady = false;
+        fSocketReady = false;
         nRefCount = 0;
         nSendSize = 0;
         nSendOffset = 0;
         hashContinue = 0;
-        pindexLastGetBlocksBegin = 0;
-        hashLastGetBlocksEnd = 0;
         nStartingHeight = -1;
+        hashBestKnownHeader = 0;
+        nDownloadStalledUntil = 0;
+        fServedBlocks = false;
+        fHeadersProbed = false;
+        fHeadersPaused = false;
         fStartSync = false;
         fGetAddr = false;
         nMisbehavior = 0;
-        setInventoryKnown.max_size(SendBufferSize() / 1000);
+        nNextTrickle = 0;
+        nSendQueueSize = 0;
+        nSendQueueBytes = 0;
+        nRecvQueueSize = 0;
+        nGetDataQueueSize = 0;
         nPingNonceSent = 0;
         nPingUsecStart = 0;
         nPingUsecTime = 0;
         fPingQueued = false;
 
+        {
+            LOCK(cs_nLastNodeId);
+            id = nLastNodeId++;
+        }
+
         // Be shy and don't send version until we hear
         if (hSocket != INVALID_SOCKET && !fInbound)
             PushVersion();
@@ -316,12 +409,19 @@ private:
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
 
+    static NodeId nLastNodeId;
+    static CCriticalSection cs_nLastNodeId;
+
     CNode(const CNode&);
     void operator=(const CNode&);
 
 public:
 
 
+    NodeId GetId() const {
+        return id;
+    }
+
     int GetRefCount()
     {
         assert(nRefCount >= 0);
@@ -363,6 +463,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_vAddrToSend);
         setAddrKnown.insert(addr);
     }
 
@@ -371,6 +472,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_vAddrToSend);
         if (addr.IsValid() && !setAddrKnown.count(addr))
             vAddrToSend.push_back(addr);
     }
@@ -380,7 +482,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv);
         }
     }
 
@@ -388,7 +490,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv))
                 vInventoryToSend.push_back(inv);
         }
     }
@@ -446,30 +548,46 @@ public:
         if (ssSend.size() == 0)
             return;
 
-        // Set the size
-        unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-        memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+        FinishMessageHeader(ssSend);
+        LogPrint("net", "(%d bytes)\n", ssSend.size() - CMessageHeader::HEADER_SIZE);
 
-        // Set the checksum
-        uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-        memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+        boost::shared_ptr<CSerializeData> pdata(new CSerializeData());
+        ssSend.GetAndClear(*pdata);
+        QueueSendBuffer(pdata);
 
-        LogPrint("net", "(%d bytes)\n", nSize);
+        LEAVE_CRITICAL_SECTION(cs_vSend);
+    }
 
-        std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-        ssSend.GetAndClear(*it);
-        nSendSize += (*it).size();
+    // Queue a message made with MakeSendBuffer. The buffer is shared, not
+    // copied.
+    void PushSendBuffer(const CSendBufferPtr& pmsg)
+    {
+        LOCK(cs_vSend);
+        LogPrint("net", "sending: %s (%d bytes, shared)\n", GetSendBufferCommand(*pmsg), pmsg->size() - CMessageHeader::HEADER_SIZE);
+        QueueSendBuffer(pmsg);
+    }
+
+private:
+    // requires LOCK(cs_vSend)
+    void QueueSendBuffer(const CSendBufferPtr& pmsg)
+    {
+        RecordMsgSent(GetSendBufferCommand(*pmsg), pmsg->size());
+        vSendMsg.push_back(pmsg);
+        nSendSize += pmsg->size();
 
         // If write queue empty, attempt "optimistic write"
-        if (it == vSendMsg.begin())
+        if (vSendMsg.size() == 1)
             SocketSendData(this);
+    }
 
-        LEAVE_CRITICAL_SECTION(cs_vSend);
+    static std::string GetSendBufferCommand(const CSerializeData& msg)
+    {
+        const char* pchCommand = &msg[MESSAGE_START_SIZE];
+        return std::string(pchCommand, std::find(pchCommand, pchCommand + CMessageHeader::COMMAND_SIZE, '\0'));
     }
 
+public:
+
     void PushVersion();
 
 
@@ -723,6 +841,11 @@ public:
     static void RecordBytesRecv(uint64_t bytes);
     static void RecordBytesSent(uint64_t bytes);
 
+    // Per-command stats of this node, also added to netStats
+    void RecordMsgSent(const std::string& strCommand, uint64_t nBytes);
+    void RecordMsgRecv(const std::string& strCommand, uint64_t nBytes);
+    void RecordProcessTime(const std::string& strCommand, int64_t nMicros);
+
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
 };
@@ -0,0 +1,92 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "netstats.h"
+
+#include <set>
+
+using namespace std;
+
+CNetStats netStats;
+
+// Commands counted under their own name, by where they are handled or sent;
+// keep in step with the message handlers
+static const char* ppszStatsCommands[] = {
+    // main.cpp ProcessMessage, and notfound sent from getdata
+    "addr", "alert", "block", "blocktxn", "cmpctblock", "getaddr",
+    "getblocks", "getblocktxn", "getdata", "getheaders", "headers", "inv",
+    "mempool", "notfound", "ping", "pong", "tx", "verack", "version",
+    // fn-manager.cpp, fundamentalnode.cpp and fn-service.cpp; fnl is only sent
+    "fne", "fneg", "fnep", "fnget", "fnl", "fnse", "fnw", "fvote",
+    // spork.cpp
+    "getsporks", "spork",
+    // transaction lock requests, which other nodes send; see the TODO in
+    // CWalletTx::RelayWalletTransaction
+    "txlreq",
+};
+
+const string& GetStatsCommand(const string& strCommand)
+{
+    static const set<string> setCommands(ppszStatsCommands, ppszStatsCommands + sizeof(ppszStatsCommands) / sizeof(ppszStatsCommands[0]));
+    static const string strOther = "*other*";
+
+    set<string>::const_iterator it = setCommands.find(strCommand);
+    return it != setCommands.end() ? *it : strOther;
+}
+
+CTimeHistogram::CTimeHistogram()
+{
+    for (int i = 0; i < BUCKETS; i++)
+        vCount[i] = 0;
+    nCount = 0;
+    nMaxMicros = 0;
+}
+
+void CTimeHistogram::Add(int64_t nMicros)
+{
+    if (nMicros < 0)
+        nMicros = 0;
+
+    int nBucket = 0;
+    while (nBucket < BUCKETS - 1 && nMicros >= ((int64_t)2 << nBucket))
+        nBucket++;
+
+    vCount[nBucket]++;
+    nCount++;
+    if (nMicros > nMaxMicros)
+        nMaxMicros = nMicros;
+}
+
+void CNetStats::RecordSent(const string& strCommand, uint64_t nBytes)
+{
+    LOCK(cs);
+    CMessageStats& stats = mapMsgStats[GetStatsCommand(strCommand)];
+    stats.nMsgsSent++;
+    stats.nBytesSent += nBytes;
+}
+
+void CNetStats::RecordRecv(const string& strCommand, uint64_t nBytes)
+{
+    LOCK(cs);
+    CMessageStats& stats = mapMsgStats[GetStatsCommand(strCommand)];
+    stats.nMsgsRecv++;
+    stats.nBytesRecv += nBytes;
+}
+
+void CNetStats::RecordProcessTime(const string& strCommand, int64_t nMicros)
+{
+    const string& strStatsCommand = GetStatsCommand(strCommand);
+
+    LOCK(cs);
+    mapMsgStats[strStatsCommand].nProcessMicros += nMicros;
+    mapProcessTime[strStatsCommand].Add(nMicros);
+}
+
+void CNetStats::GetStats(MessageStatsMap& mapMsgStatsRet, TimeHistogramMap& mapProcessTimeRet) const
+{
+    LOCK(cs);
+    mapMsgStatsRet = mapMsgStats;
+    mapProcessTimeRet = mapProcessTime;
+}
@@ -0,0 +1,69 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_NETSTATS_H
+#define BITCOIN_NETSTATS_H
+
+#include "sync.h"
+
+#include <map>
+#include <stdint.h>
+#include <string>
+
+/** Traffic and handling time of one message command */
+class CMessageStats
+{
+public:
+    uint64_t nMsgsSent;
+    uint64_t nBytesSent;
+    uint64_t nMsgsRecv;
+    uint64_t nBytesRecv;
+    int64_t nProcessMicros;
+
+    CMessageStats() : nMsgsSent(0), nBytesSent(0), nMsgsRecv(0), nBytesRecv(0), nProcessMicros(0) {}
+};
+
+typedef std::map<std::string, CMessageStats> MessageStatsMap;
+
+/** Histogram of durations in power of two buckets of microseconds */
+class CTimeHistogram
+{
+public:
+    static const int BUCKETS = 24;
+
+    // Bucket i counts durations under 2^(i+1) usec that didn't fit the one
+    // before; the last bucket takes everything longer
+    uint64_t vCount[BUCKETS];
+    uint64_t nCount;
+    int64_t nMaxMicros;
+
+    CTimeHistogram();
+    void Add(int64_t nMicros);
+};
+
+typedef std::map<std::string, CTimeHistogram> TimeHistogramMap;
+
+/** Command a message's statistics are kept under. Commands we don't know
+ *  share one entry, so peers can't make the maps grow. */
+const std::string& GetStatsCommand(const std::string& strCommand);
+
+/** Message statistics of all peers, connected or not, since startup */
+class CNetStats
+{
+private:
+    mutable CCriticalSection cs;
+    MessageStatsMap mapMsgStats;
+    TimeHistogramMap mapProcessTime;
+
+public:
+    void RecordSent(const std::string& strCommand, uint64_t nBytes);
+    void RecordRecv(const std::string& strCommand, uint64_t nBytes);
+    void RecordProcessTime(const std::string& strCommand, int64_t nMicros);
+
+    void GetStats(MessageStatsMap& mapMsgStatsRet, TimeHistogramMap& mapProcessTimeRet) const;
+};
+
+extern CNetStats netStats;
+
+#endif /* BITCOIN_NETSTATS_H */
@@ -16,11 +16,11 @@ static const char* ppszTypeName[] =
     "ERROR",
     "tx",
     "block",
-    "filtered block",
-    "tx lock request",
-    "tx lock vote",
     "spork",
     "fundamentalnode winner",
+    "fundamentalnode scanning error",
+    "compact block",
+    "unknown",
     "unknown",
     "unknown",
     "unknown",
@@ -134,6 +134,11 @@ bool operator<(const CInv& a, const CInv& b)
     return (a.type < b.type || (a.type == b.type && a.hash < b.hash));
 }
 
+bool operator==(const CInv& a, const CInv& b)
+{
+    return (a.type == b.type && a.hash == b.hash);
+}
+
 bool CInv::IsKnownType() const
 {
     return (type >= 1 && type < (int)ARRAYLEN(ppszTypeName));
@@ -5,6 +5,7 @@
 
 #include "rpcserver.h"
 #include "main.h"
+#include "txmempool.h"
 #include "kernel.h"
 #include "checkpoints.h"
 
@@ -213,6 +214,25 @@ Value getrawmempool(const Array& params, bool fHelp)
     return a;
 }
 
+Value getmempoolinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getmempoolinfo\n"
+            "Returns details on the transaction memory pool: number of transactions,\n"
+            "their total size, the memory used, the limit and the current minimum fee per kB.");
+
+    size_t nMaxMempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+
+    Object obj;
+    obj.push_back(Pair("size",          (uint64_t)mempool.size()));
+    obj.push_back(Pair("bytes",         (uint64_t)mempool.GetTotalTxSize()));
+    obj.push_back(Pair("usage",         (uint64_t)mempool.DynamicMemoryUsage()));
+    obj.push_back(Pair("maxmempool",    (uint64_t)nMaxMempool));
+    obj.push_back(Pair("mempoolminfee", ValueFromAmount(max(mempool.GetMinFee(nMaxMempool), MIN_RELAY_TX_FEE))));
+    return obj;
+}
+
 Value getblockhash(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -224,7 +244,7 @@ Value getblockhash(const Array& params, bool fHelp)
     if (nHeight < 0 || nHeight > nBestHeight)
         throw runtime_error("Block number out of range.");
 
-    CBlockIndex* pblockindex = FindBlockByHeight(nHeight);
+    CBlockIndex* pblockindex = chainActive[nHeight];
     return pblockindex->phashBlock->GetHex();
 }
 
@@ -262,18 +282,32 @@ Value getblockbynumber(const Array& params, bool fHelp)
         throw runtime_error("Block number out of range.");
 
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hashBestChain];
-    while (pblockindex->nHeight > nHeight)
-        pblockindex = pblockindex->pprev;
-
-    uint256 hash = *pblockindex->phashBlock;
-
-    pblockindex = mapBlockIndex[hash];
+    CBlockIndex* pblockindex = chainActive[nHeight];
     block.ReadFromDisk(pblockindex, true);
 
     return blockToJSON(block, pblockindex, params.size() > 1 ? params[1].get_bool() : false);
 }
 
+Value getsigcacheinfo(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getsigcacheinfo\n"
+            "Returns the counters of the signature cache.");
+
+    uint64_t nHits, nMisses, nInserts;
+    size_t nSlots;
+    GetSignatureCacheStats(nHits, nMisses, nInserts, nSlots);
+
+    Object obj;
+    obj.push_back(Pair("hits",      (uint64_t)nHits));
+    obj.push_back(Pair("misses",    (uint64_t)nMisses));
+    obj.push_back(Pair("inserts",   (uint64_t)nInserts));
+    obj.push_back(Pair("slots",     (uint64_t)nSlots));
+    obj.push_back(Pair("hitrate",   nHits + nMisses > 0 ? (double)nHits / (nHits + nMisses) : 0.0));
+    return obj;
+}
+
 // ppcoin: get information of sync-checkpoint
 Value getcheckpoint(const Array& params, bool fHelp)
 {
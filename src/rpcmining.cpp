@@ -9,6 +9,7 @@
 #include "main.h"
 #include "db.h"
 #include "txdb.h"
+#include "txmempool.h"
 #include "init.h"
 #include "miner.h"
 #include "kernel.h"
@@ -119,6 +119,7 @@ public:
 Value spork(const Array& params, bool fHelp)
 {
     if(params.size() == 1 && params[0].get_str() == "show"){
+        LOCK(cs_mapSporks);
         std::map<int, CSporkMessage>::iterator it = mapSporksActive.begin();
 
         Object ret;
@@ -48,6 +48,39 @@ Value ping(const Array& params, bool fHelp)
     return Value::null;
 }
 
+static Object MessageStatsToJSON(const CMessageStats& stats)
+{
+    Object obj;
+    obj.push_back(Pair("msgssent", (int64_t)stats.nMsgsSent));
+    obj.push_back(Pair("bytessent", (int64_t)stats.nBytesSent));
+    obj.push_back(Pair("msgsrecv", (int64_t)stats.nMsgsRecv));
+    obj.push_back(Pair("bytesrecv", (int64_t)stats.nBytesRecv));
+    obj.push_back(Pair("processtime", (double)stats.nProcessMicros / 1e6));
+    return obj;
+}
+
+static Object TimeHistogramToJSON(const CTimeHistogram& histogram)
+{
+    Object obj;
+    obj.push_back(Pair("count", (int64_t)histogram.nCount));
+    obj.push_back(Pair("max", (double)histogram.nMaxMicros / 1e6));
+
+    // Only the buckets used, each with the time (in usec) it counts up to
+    Array buckets;
+    for (int i = 0; i < CTimeHistogram::BUCKETS; i++)
+    {
+        if (histogram.vCount[i] == 0)
+            continue;
+        Object bucket;
+        if (i < CTimeHistogram::BUCKETS - 1)
+            bucket.push_back(Pair("below", (int64_t)2 << i));
+        bucket.push_back(Pair("count", (int64_t)histogram.vCount[i]));
+        buckets.push_back(bucket);
+    }
+    obj.push_back(Pair("histogram", buckets));
+    return obj;
+}
+
 static void CopyNodeStats(std::vector<CNodeStats>& vstats)
 {
     vstats.clear();
@@ -95,6 +128,15 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("startingheight", stats.nStartingHeight));
         obj.push_back(Pair("banscore", stats.nMisbehavior));
         obj.push_back(Pair("syncnode", stats.fSyncNode));
+        obj.push_back(Pair("sendqueue", (int64_t)stats.nSendQueueSize));
+        obj.push_back(Pair("sendqueuebytes", (int64_t)stats.nSendQueueBytes));
+        obj.push_back(Pair("recvqueue", (int64_t)stats.nRecvQueueSize));
+        obj.push_back(Pair("getdataqueue", (int64_t)stats.nGetDataQueueSize));
+
+        Object commands;
+        BOOST_FOREACH(const PAIRTYPE(string, CMessageStats)& item, stats.mapMsgStats)
+            commands.push_back(Pair(item.first, MessageStatsToJSON(item.second)));
+        obj.push_back(Pair("commands", commands));
 
         ret.push_back(obj);
     }
@@ -236,6 +278,8 @@ Value getaddednodeinfo(const Array& params, bool fHelp)
     return ret;
 }
 
+extern CCriticalSection cs_mapAlerts;
+
 // ppcoin: send alert.  
 // There is a known deadlock situation with ThreadMessageHandler
 // ThreadMessageHandler: holds cs_vSend and acquiring cs_main in SendMessages()
@@ -280,9 +324,10 @@ Value sendalert(const Array& params, bool fHelp)
     if(!alert.ProcessAlert()) 
         throw runtime_error(
             "Failed to process alert.\n");
-    // Relay alert
+    // Relay alert; setKnown of every node is guarded by cs_mapAlerts, which
+    // is taken before cs_vNodes as in the alert message handler
     {
-        LOCK(cs_vNodes);
+        LOCK2(cs_mapAlerts, cs_vNodes);
         BOOST_FOREACH(CNode* pnode, vNodes)
             alert.RelayTo(pnode);
     }
@@ -313,3 +358,52 @@ Value getnettotals(const Array& params, bool fHelp)
     obj.push_back(Pair("timemillis", GetTimeMillis()));
     return obj;
 }
+
+Value getnetstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getnetstats\n"
+            "Returns traffic and processing time by message command, of all peers since startup,\n"
+            "and the send and receive queues of the connected peers.\n"
+            "Processing times are in seconds; histogram buckets count messages that took\n"
+            "less than \"below\" microseconds but longer than the bucket before.");
+
+    MessageStatsMap mapMsgStats;
+    TimeHistogramMap mapProcessTime;
+    netStats.GetStats(mapMsgStats, mapProcessTime);
+
+    vector<CNodeStats> vstats;
+    CopyNodeStats(vstats);
+
+    Object obj;
+    obj.push_back(Pair("totalbytesrecv", CNode::GetTotalBytesRecv()));
+    obj.push_back(Pair("totalbytessent", CNode::GetTotalBytesSent()));
+    obj.push_back(Pair("timemillis", GetTimeMillis()));
+
+    Object commands;
+    BOOST_FOREACH(const PAIRTYPE(string, CMessageStats)& item, mapMsgStats)
+    {
+        Object command = MessageStatsToJSON(item.second);
+        TimeHistogramMap::const_iterator mi = mapProcessTime.find(item.first);
+        if (mi != mapProcessTime.end())
+            command.push_back(Pair("processing", TimeHistogramToJSON(mi->second)));
+        commands.push_back(Pair(item.first, command));
+    }
+    obj.push_back(Pair("commands", commands));
+
+    uint64_t nSendQueueSize = 0, nSendQueueBytes = 0, nRecvQueueSize = 0, nGetDataQueueSize = 0;
+    BOOST_FOREACH(const CNodeStats& stats, vstats)
+    {
+        nSendQueueSize += stats.nSendQueueSize;
+        nSendQueueBytes += stats.nSendQueueBytes;
+        nRecvQueueSize += stats.nRecvQueueSize;
+        nGetDataQueueSize += stats.nGetDataQueueSize;
+    }
+    obj.push_back(Pair("connections", (int)vstats.size()));
+    obj.push_back(Pair("sendqueue", (int64_t)nSendQueueSize));
+    obj.push_back(Pair("sendqueuebytes", (int64_t)nSendQueueBytes));
+    obj.push_back(Pair("recvqueue", (int64_t)nRecvQueueSize));
+    obj.push_back(Pair("getdataqueue", (int64_t)nGetDataQueueSize));
+    return obj;
+}
@@ -4,8 +4,6 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include <boost/foreach.hpp>
-#include <boost/tuple/tuple.hpp>
-#include <boost/tuple/tuple_comparison.hpp>
 
 using namespace std;
 using namespace boost;
@@ -1338,62 +1336,193 @@ uint256 SignatureHash(CScript scriptCode, const CTransaction& txTo, unsigned int
 // twice for every transaction (once when accepted into memory pool, and
 // again when accepted into the block chain)
 
-class CSignatureCache
+CSignatureCache::CSignatureCache(size_t nBytes) :
+    nGeneration(1), nGenerationInserts(0), nMaxDepth(0), threadStats(KeepThreadStats), nInserts(0)
 {
-private:
-     // sigdata_type is (signature hash, signature, public key):
-    typedef boost::tuple<uint256, std::vector<unsigned char>, CPubKey> sigdata_type;
-    std::set< sigdata_type> setValid;
-    boost::shared_mutex cs_sigcache;
+    salt = GetRandHash();
+    size_t nSlots = nBytes / (sizeof(uint256) + 1);
+    vTable.resize(nSlots);
+    vGeneration.resize(nSlots, 0);
+
+    // Displacement chains longer than log2 of the table size are very
+    // unlikely to end in a free slot
+    while (((size_t)1 << nMaxDepth) < nSlots)
+        nMaxDepth++;
+}
 
-public:
-    bool
-    Get(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+CSignatureCache::~CSignatureCache()
+{
+    BOOST_FOREACH(CThreadStats* pstats, vThreadStats)
+        delete pstats;
+}
+
+CSignatureCache::CThreadStats& CSignatureCache::GetThreadStats()
+{
+    CThreadStats* pstats = threadStats.get();
+    if (!pstats)
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        pstats = new CThreadStats();
+        threadStats.reset(pstats);
+        boost::lock_guard<boost::mutex> lock(cs_stats);
+        vThreadStats.push_back(pstats);
+    }
+    return *pstats;
+}
 
-        sigdata_type k(hash, vchSig, pubKey);
-        std::set<sigdata_type>::iterator mi = setValid.find(k);
-        if (mi != setValid.end())
-            return true;
+uint256 CSignatureCache::ComputeEntry(const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const
+{
+    // The salt keeps others from choosing signatures that compete for the
+    // same slots
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << salt << hash << vchSig << pubKey;
+    return ss.GetHash();
+}
+
+void CSignatureCache::GetSlots(const uint256& entry, size_t* pSlots) const
+{
+    for (int i = 0; i < WAYS; i++)
+        pSlots[i] = entry.Get64(i) % vTable.size();
+}
+
+bool CSignatureCache::IsFree(size_t nSlot) const
+{
+    unsigned char nPrevGeneration = (nGeneration == 1 ? 255 : nGeneration - 1);
+    return vGeneration[nSlot] != nGeneration && vGeneration[nSlot] != nPrevGeneration;
+}
+
+bool CSignatureCache::Get(const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+{
+    if (vTable.empty())
         return false;
+
+    uint256 entry = ComputeEntry(hash, vchSig, pubKey);
+    size_t vSlots[WAYS];
+    GetSlots(entry, vSlots);
+
+    // Entries of old generations may be overwritten, but as long as they are
+    // there they are still valid signatures
+    bool fFound = false;
+    {
+        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+        for (int i = 0; i < WAYS && !fFound; i++)
+            fFound = (vGeneration[vSlots[i]] != 0 && vTable[vSlots[i]] == entry);
     }
 
-    void Set(const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+    CThreadStats& stats = GetThreadStats();
+    boost::lock_guard<boost::mutex> lock(stats.cs);
+    if (fFound)
+        stats.nHits++;
+    else
+        stats.nMisses++;
+    return fFound;
+}
+
+void CSignatureCache::Set(const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey)
+{
+    if (vTable.empty())
+        return;
+
+    uint256 entry = ComputeEntry(hash, vchSig, pubKey);
+    size_t vSlots[WAYS];
+    GetSlots(entry, vSlots);
+
+    boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+    nInserts++;
+
+    // Start a new generation once the current one has filled a quarter of the
+    // table. The two live generations then take at most half of the slots,
+    // so an insert nearly always finds a free candidate slot right away.
+    if (nGenerationInserts >= vTable.size() / 4)
     {
-        // DoS prevention: limit cache size to less than 10MB
-        // (~200 bytes per cache entry times 50,000 entries)
-        // Since there are a maximum of 20,000 signature operations per block
-        // 50,000 is a reasonable default.
-        int64_t nMaxCacheSize = GetArg("-maxsigcachesize", 50000);
-        if (nMaxCacheSize <= 0) return;
+        nGeneration = (nGeneration == 255 ? 1 : nGeneration + 1);
+        nGenerationInserts = 0;
+    }
+    nGenerationInserts++;
 
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
+    for (int i = 0; i < WAYS; i++)
+    {
+        if (vGeneration[vSlots[i]] != 0 && vTable[vSlots[i]] == entry)
+        {
+            vGeneration[vSlots[i]] = nGeneration;
+            return;
+        }
+    }
 
-        while (static_cast<int64_t>(setValid.size()) > nMaxCacheSize)
+    unsigned char nEntryGeneration = nGeneration;
+    size_t nLastSlot = vSlots[WAYS - 1];
+    for (unsigned int nDepth = 0; nDepth <= nMaxDepth; nDepth++)
+    {
+        for (int i = 0; i < WAYS; i++)
         {
-            // Evict a random entry. Random because that helps
-            // foil would-be DoS attackers who might try to pre-generate
-            // and re-use a set of valid signatures just-slightly-greater
-            // than our cache size.
-            uint256 randomHash = GetRandHash();
-            std::vector<unsigned char> unused;
-            std::set<sigdata_type>::iterator it =
-                setValid.lower_bound(sigdata_type(randomHash, unused, unused));
-            if (it == setValid.end())
-                it = setValid.begin();
-            setValid.erase(*it);
+            if (IsFree(vSlots[i]))
+            {
+                vTable[vSlots[i]] = entry;
+                vGeneration[vSlots[i]] = nEntryGeneration;
+                return;
+            }
         }
 
-        sigdata_type k(hash, vchSig, pubKey);
-        setValid.insert(k);
+        // Every candidate slot is taken: move into the one after the slot
+        // this entry was pushed out of, and find a place for its occupant
+        int nNext = 0;
+        for (int i = 0; i < WAYS; i++)
+            if (vSlots[i] == nLastSlot)
+                nNext = (i + 1) % WAYS;
+        nLastSlot = vSlots[nNext];
+        std::swap(entry, vTable[nLastSlot]);
+        std::swap(nEntryGeneration, vGeneration[nLastSlot]);
+        GetSlots(entry, vSlots);
     }
-};
+    // Out of attempts, the entry that was pushed out last is dropped
+}
+
+void CSignatureCache::GetStats(uint64_t& nHitsRet, uint64_t& nMissesRet, uint64_t& nInsertsRet, size_t& nSlotsRet)
+{
+    nHitsRet = 0;
+    nMissesRet = 0;
+    {
+        boost::lock_guard<boost::mutex> lock(cs_stats);
+        BOOST_FOREACH(CThreadStats* pstats, vThreadStats)
+        {
+            boost::lock_guard<boost::mutex> lockThread(pstats->cs);
+            nHitsRet += pstats->nHits;
+            nMissesRet += pstats->nMisses;
+        }
+    }
+    boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
+    nInsertsRet = nInserts;
+    nSlotsRet = vTable.size();
+}
+
+// -maxsigcachesize used to count entries; values too large to be megabytes
+// still do, at the size of an entry in the table
+static size_t GetSignatureCacheBytes()
+{
+    int64_t nSize = std::max(GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE), (int64_t)0);
+    if (nSize <= (int64_t)MAX_MAX_SIG_CACHE_SIZE)
+        return (size_t)nSize << 20;
+
+    int64_t nMaxBytes = (int64_t)MAX_MAX_SIG_CACHE_SIZE << 20;
+    int64_t nBytes = std::min(nSize, nMaxBytes) * (int64_t)(sizeof(uint256) + 1);
+    LogPrintf("-maxsigcachesize=%d taken as a number of entries\n", nSize);
+    return (size_t)std::min(nBytes, nMaxBytes);
+}
+
+static CSignatureCache& SignatureCache()
+{
+    static CSignatureCache signatureCache(GetSignatureCacheBytes());
+    return signatureCache;
+}
+
+void GetSignatureCacheStats(uint64_t& nHits, uint64_t& nMisses, uint64_t& nInserts, size_t& nSlots)
+{
+    SignatureCache().GetStats(nHits, nMisses, nInserts, nSlots);
+}
 
 bool CheckSig(vector<unsigned char> vchSig, const vector<unsigned char> &vchPubKey, const CScript &scriptCode,
               const CTransaction& txTo, unsigned int nIn, int nHashType, int flags)
 {
-    static CSignatureCache signatureCache;
+    CSignatureCache& signatureCache = SignatureCache();
 
     CPubKey pubkey(vchPubKey);
     if (!pubkey.IsValid())
@@ -12,6 +12,9 @@
 #include <stdint.h>
 
 #include <boost/foreach.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/tss.hpp>
 #include <boost/variant.hpp>
 
 #include "keystore.h"
@@ -709,6 +712,70 @@ public:
 };
 
 
+/** Default for -maxsigcachesize, the memory used by the signature cache in megabytes */
+static const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE = 8;
+/** Upper bound for -maxsigcachesize; larger values are taken as a number of entries, as the option used to be */
+static const unsigned int MAX_MAX_SIG_CACHE_SIZE = 256;
+
+/** Cache of signatures that were found valid, so the ECDSA check does not
+ * have to be repeated when a transaction from the memory pool shows up in a
+ * block.
+ *
+ * An entry is a salted hash of (signature hash, signature, public key) in a
+ * fixed size table. Every entry has four candidate slots taken from its own
+ * bits, and an insert moves entries between their slots (cuckoo hashing)
+ * until one lands in a free slot. Entries belong to the generation they were
+ * inserted in; once two newer generations exist their slots count as free.
+ * Lookups only take a shared lock, and count hits and misses per thread.
+ */
+class CSignatureCache
+{
+private:
+    enum { WAYS = 4 };
+
+    uint256 salt;
+    std::vector<uint256> vTable;
+    std::vector<unsigned char> vGeneration; // per slot, 0 if empty
+    unsigned char nGeneration;
+    size_t nGenerationInserts; // inserts since nGeneration started
+    unsigned int nMaxDepth;    // displacements tried before an entry is dropped
+    boost::shared_mutex cs_sigcache;
+
+    // Hits and misses of one thread, under a lock only GetStats contends for
+    struct CThreadStats
+    {
+        boost::mutex cs;
+        uint64_t nHits;
+        uint64_t nMisses;
+
+        CThreadStats() : nHits(0), nMisses(0) {}
+    };
+    boost::thread_specific_ptr<CThreadStats> threadStats;
+    boost::mutex cs_stats;
+    std::vector<CThreadStats*> vThreadStats; // owned, kept after their thread ends
+    uint64_t nInserts;
+
+    CThreadStats& GetThreadStats();
+    static void KeepThreadStats(CThreadStats* pstats) {}
+
+    uint256 ComputeEntry(const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey) const;
+    void GetSlots(const uint256& entry, size_t* pSlots) const;
+    bool IsFree(size_t nSlot) const;
+
+public:
+    // Cache of about nBytes bytes; a size of 0 disables it
+    CSignatureCache(size_t nBytes);
+    ~CSignatureCache();
+
+    bool Get(const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey);
+    void Set(const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubKey);
+
+    void GetStats(uint64_t& nHitsRet, uint64_t& nMissesRet, uint64_t& nInsertsRet, size_t& nSlotsRet);
+};
+
+/** Counters of the signature cache used by CheckSig */
+void GetSignatureCacheStats(uint64_t& nHits, uint64_t& nMisses, uint64_t& nInserts, size_t& nSlots);
+
 bool IsDERSignature(const valtype &vchSig, bool haveHashType = true);
 bool IsLowDERSignature(const valtype &vchSig, bool haveHashType = true);
 bool IsCompressedOrUncompressedPubKey(const valtype &vchPubKey);
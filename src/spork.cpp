@@ -23,6 +23,8 @@ CSporkManager sporkManager;
 
 std::map<uint256, CSporkMessage> mapSporks;
 std::map<int, CSporkMessage> mapSporksActive;
+// Guards mapSporks and mapSporksActive, which block validation reads too
+CCriticalSection cs_mapSporks;
 
 
 void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
@@ -39,25 +41,28 @@ void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
         if(pindexBest == NULL) return;
 
         uint256 hash = spork.GetHash();
-        if(mapSporksActive.count(spork.nSporkID)) {
-            if(mapSporksActive[spork.nSporkID].nTimeSigned >= spork.nTimeSigned){
-                if(fDebug) LogPrintf("spork - seen %s block %d \n", hash.ToString().c_str(), pindexBest->nHeight);
-                return;
-            } else {
-                if(fDebug) LogPrintf("spork - got updated spork %s block %d \n", hash.ToString().c_str(), pindexBest->nHeight);
+        {
+            LOCK(cs_mapSporks);
+            if(mapSporksActive.count(spork.nSporkID)) {
+                if(mapSporksActive[spork.nSporkID].nTimeSigned >= spork.nTimeSigned){
+                    if(fDebug) LogPrintf("spork - seen %s block %d \n", hash.ToString().c_str(), pindexBest->nHeight);
+                    return;
+                } else {
+                    if(fDebug) LogPrintf("spork - got updated spork %s block %d \n", hash.ToString().c_str(), pindexBest->nHeight);
+                }
             }
-        }
 
-        LogPrintf("spork - new %s ID %d Time %d bestHeight %d\n", hash.ToString().c_str(), spork.nSporkID, spork.nValue, pindexBest->nHeight);
+            LogPrintf("spork - new %s ID %d Time %d bestHeight %d\n", hash.ToString().c_str(), spork.nSporkID, spork.nValue, pindexBest->nHeight);
 
-        if(!sporkManager.CheckSignature(spork)){
-            LogPrintf("spork - invalid signature\n");
-            pfrom->Misbehaving( 100);
-            return;
-        }
+            if(!sporkManager.CheckSignature(spork)){
+                LogPrintf("spork - invalid signature\n");
+                pfrom->Misbehaving( 100);
+                return;
+            }
 
-        mapSporks[hash] = spork;
-        mapSporksActive[spork.nSporkID] = spork;
+            mapSporks[hash] = spork;
+            mapSporksActive[spork.nSporkID] = spork;
+        }
         sporkManager.Relay(spork);
 
         //does a task if needed
@@ -65,6 +70,7 @@ void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
     }
     if (strCommand == "getsporks")
     {
+        LOCK(cs_mapSporks);
         std::map<int, CSporkMessage>::iterator it = mapSporksActive.begin();
 
         while(it != mapSporksActive.end()) {
@@ -78,6 +84,7 @@ void ProcessSpork(CNode* pfrom, std::string& strCommand, CDataStream& vRecv)
 // grab the spork, otherwise say it's off
 bool IsSporkActive(int nSporkID)
 {
+    LOCK(cs_mapSporks);
     int64_t r = 0;
 
     if(mapSporksActive.count(nSporkID)){
@@ -97,6 +104,7 @@ bool IsSporkActive(int nSporkID)
 // grab the value of the spork on the network, or the default
 int GetSporkValue(int nSporkID)
 {
+    LOCK(cs_mapSporks);
     int r = 0;
 
     if(mapSporksActive.count(nSporkID)){
@@ -169,6 +177,7 @@ bool CSporkManager::UpdateSpork(int nSporkID, int64_t nValue)
 
     if(Sign(msg)){
         Relay(msg);
+        LOCK(cs_mapSporks);
         mapSporks[msg.GetHash()] = msg;
         mapSporksActive[nSporkID] = msg;
         return true;
@@ -183,9 +192,10 @@ void CSporkManager::Relay(CSporkMessage& msg)
 
     vector<CInv> vInv;
     vInv.push_back(inv);
+    CSendBufferPtr pmsg = MakeSendBuffer("inv", vInv);
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes){
-        pnode->PushMessage("inv", vInv);
+        pnode->PushSendBuffer(pmsg);
     }
 }
 
@@ -0,0 +1,56 @@
+#include <boost/test/unit_test.hpp>
+
+#include "blockcache.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(blockcache_tests)
+
+static CSendBufferPtr MakeBlockData(size_t nSize)
+{
+    return CSendBufferPtr(new CSerializeData(nSize));
+}
+
+BOOST_AUTO_TEST_CASE(blockcache_lru)
+{
+    CBlockCache cache(1000);
+    CSendBufferPtr pdata;
+    BOOST_CHECK(!cache.Get(1, pdata));
+
+    cache.Put(1, MakeBlockData(400));
+    cache.Put(2, MakeBlockData(400));
+    BOOST_CHECK_EQUAL(cache.size(), 2U);
+    BOOST_CHECK_EQUAL(cache.GetTotalSize(), 800U);
+
+    // Using block 1 makes block 2 the one to go
+    BOOST_CHECK(cache.Get(1, pdata));
+    BOOST_CHECK_EQUAL(pdata->size(), 400U);
+    cache.Put(3, MakeBlockData(400));
+    BOOST_CHECK(cache.Get(1, pdata));
+    BOOST_CHECK(!cache.Get(2, pdata));
+    BOOST_CHECK(cache.Get(3, pdata));
+    BOOST_CHECK_EQUAL(cache.GetTotalSize(), 800U);
+
+    // Evicted blocks stay valid for whoever holds them
+    CSendBufferPtr pdataHeld;
+    BOOST_CHECK(cache.Get(1, pdataHeld));
+    cache.Put(4, MakeBlockData(1000));
+    BOOST_CHECK_EQUAL(cache.size(), 1U);
+    BOOST_CHECK_EQUAL(pdataHeld->size(), 400U);
+}
+
+BOOST_AUTO_TEST_CASE(blockcache_too_big)
+{
+    CBlockCache cache(1000);
+    cache.Put(1, MakeBlockData(500));
+    cache.Put(2, MakeBlockData(1001));
+    CSendBufferPtr pdata;
+    BOOST_CHECK(!cache.Get(2, pdata));
+    BOOST_CHECK(cache.Get(1, pdata));
+
+    // Adding a block again changes nothing
+    cache.Put(1, MakeBlockData(100));
+    BOOST_CHECK_EQUAL(cache.GetTotalSize(), 500U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,112 @@
+#include <boost/test/unit_test.hpp>
+
+#include "blockencodings.h"
+#include "main.h"
+#include "txmempool.h"
+
+#include <vector>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(blockencodings_tests)
+
+static CBlock BuildBlock()
+{
+    CBlock block;
+    block.nTime = 1400000000;
+    block.nBits = 0x1e0fffff;
+    block.vtx.resize(4);
+    block.vtx[0].vin.resize(1);
+    block.vtx[0].vin[0].prevout.SetNull();
+    block.vtx[0].vin[0].scriptSig = CScript() << OP_0 << OP_0;
+    block.vtx[0].vout.resize(1);
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+    {
+        block.vtx[i].vin.resize(1);
+        block.vtx[i].vin[0].prevout = COutPoint(block.vtx[i - 1].GetHash(), 0);
+        block.vtx[i].vin[0].scriptSig = CScript() << OP_11;
+        block.vtx[i].vout.resize(1);
+        block.vtx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        block.vtx[i].vout[0].nValue = i * CENT;
+    }
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+static void AddToPool(CTxMemPool& pool, const CTransaction& tx)
+{
+    pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 1000, 0, 0, 1, 100, 1, 0));
+}
+
+BOOST_AUTO_TEST_CASE(blockencodings_serialize)
+{
+    CBlock block = BuildBlock();
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    BOOST_CHECK_EQUAL(cmpctblock.prefilledtxn.size(), 1U);
+    BOOST_CHECK_EQUAL(cmpctblock.shorttxids.size(), 3U);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << cmpctblock;
+    CBlockHeaderAndShortTxIDs cmpctblockRead;
+    ss >> cmpctblockRead;
+
+    // The receiver derives the same short ids from the header and nonce
+    BOOST_CHECK(cmpctblockRead.header.GetHash() == block.GetHash());
+    BOOST_CHECK(cmpctblockRead.shorttxids == cmpctblock.shorttxids);
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+    {
+        uint64_t nShortID = cmpctblockRead.GetShortID(block.vtx[i].GetHash());
+        BOOST_CHECK(nShortID == cmpctblock.shorttxids[i - 1]);
+        BOOST_CHECK(nShortID <= 0xffffffffffffULL);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(blockencodings_rebuild)
+{
+    CBlock block = BuildBlock();
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+
+    // The pool has all but the third transaction
+    CTxMemPool pool;
+    AddToPool(pool, block.vtx[1]);
+    AddToPool(pool, block.vtx[3]);
+
+    CPartialBlock partial;
+    BOOST_CHECK(partial.Init(cmpctblock, pool) == READ_STATUS_OK);
+    BOOST_CHECK(partial.GetBlockHash() == block.GetHash());
+    vector<unsigned int> vMissing;
+    partial.GetMissing(vMissing);
+    BOOST_CHECK_EQUAL(vMissing.size(), 1U);
+    BOOST_CHECK_EQUAL(vMissing[0], 2U);
+
+    CBlock blockRebuilt;
+    BOOST_CHECK(partial.FillBlock(blockRebuilt, vector<CTransaction>()) == READ_STATUS_INVALID);
+    BOOST_CHECK(partial.FillBlock(blockRebuilt, vector<CTransaction>(1, block.vtx[1])) == READ_STATUS_FAILED);
+    BOOST_CHECK(partial.FillBlock(blockRebuilt, vector<CTransaction>(1, block.vtx[2])) == READ_STATUS_OK);
+    BOOST_CHECK(blockRebuilt.GetHash() == block.GetHash());
+    BOOST_CHECK(blockRebuilt.BuildMerkleTree() == block.hashMerkleRoot);
+}
+
+BOOST_AUTO_TEST_CASE(blockencodings_invalid)
+{
+    CBlock block = BuildBlock();
+    CTxMemPool pool;
+
+    // Prefilled transactions out of range or out of order
+    CBlockHeaderAndShortTxIDs cmpctblock(block);
+    cmpctblock.prefilledtxn[0].nIndex = block.vtx.size();
+    CPartialBlock partial;
+    BOOST_CHECK(partial.Init(cmpctblock, pool) == READ_STATUS_INVALID);
+
+    cmpctblock = CBlockHeaderAndShortTxIDs(block);
+    cmpctblock.prefilledtxn.push_back(cmpctblock.prefilledtxn[0]);
+    cmpctblock.shorttxids.pop_back();
+    BOOST_CHECK(partial.Init(cmpctblock, pool) == READ_STATUS_INVALID);
+
+    // Two transactions with the same short id can't be told apart
+    cmpctblock = CBlockHeaderAndShortTxIDs(block);
+    cmpctblock.shorttxids[1] = cmpctblock.shorttxids[0];
+    BOOST_CHECK(partial.Init(cmpctblock, pool) == READ_STATUS_FAILED);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
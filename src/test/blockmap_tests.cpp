@@ -0,0 +1,57 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "util.h"
+
+#include <vector>
+
+BOOST_AUTO_TEST_SUITE(blockmap_tests)
+
+BOOST_AUTO_TEST_CASE(blockhasher_salt)
+{
+    BlockHasher hasher1, hasher2;
+    uint256 hash = GetRandHash();
+
+    // Stable for one hasher, different between salts
+    BOOST_CHECK_EQUAL(hasher1(hash), hasher1(hash));
+    BOOST_CHECK(hasher1(hash) != hasher2(hash));
+    BOOST_CHECK(hasher1(hash) != hasher1(hash ^ 1));
+
+    BlockMap map;
+    std::vector<uint256> vHash;
+    for (int i = 0; i < 1000; i++)
+    {
+        vHash.push_back(i);
+        map[vHash.back()] = NULL;
+    }
+    BOOST_CHECK_EQUAL(map.size(), 1000U);
+    for (int i = 0; i < 1000; i++)
+        BOOST_CHECK(map.count(vHash[i]));
+    BOOST_CHECK(!map.count(uint256(1000)));
+}
+
+BOOST_AUTO_TEST_CASE(blockindex_arena)
+{
+    CBlockIndexArena arena;
+    std::vector<CBlockIndex*> vIndex;
+    for (int i = 0; i < 10000; i++)
+    {
+        CBlockIndex index;
+        index.nHeight = i;
+        index.pprev = i ? vIndex.back() : NULL;
+        vIndex.push_back(arena.New(index));
+    }
+
+    // Entries keep their address and contents as more are added
+    for (int i = 0; i < 10000; i++)
+    {
+        BOOST_CHECK_EQUAL(vIndex[i]->nHeight, i);
+        BOOST_CHECK(vIndex[i]->pprev == (i ? vIndex[i - 1] : NULL));
+    }
+    BOOST_CHECK(arena.DynamicMemoryUsage() >= 10000 * sizeof(CBlockIndex));
+
+    arena.Clear();
+    BOOST_CHECK_EQUAL(arena.DynamicMemoryUsage(), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,61 @@
+#include <boost/test/unit_test.hpp>
+
+#include "bloom.h"
+#include "net.h"
+#include "util.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(bloom_tests)
+
+static CInv RandomInv(int type = MSG_TX)
+{
+    return CInv(type, GetRandHash());
+}
+
+BOOST_AUTO_TEST_CASE(rollingbloom)
+{
+    CRollingBloomFilter filter(100, 0.01);
+    vector<CInv> vInv;
+    for (int i = 0; i < 100; i++)
+    {
+        vInv.push_back(RandomInv());
+        filter.insert(vInv.back());
+    }
+    BOOST_FOREACH(const CInv& inv, vInv)
+        BOOST_CHECK(filter.contains(inv));
+
+    // A block with the same hash is different inventory
+    int nFound = 0;
+    BOOST_FOREACH(const CInv& inv, vInv)
+        if (filter.contains(CInv(MSG_BLOCK, inv.hash)))
+            nFound++;
+    BOOST_CHECK(nFound < 10);
+
+    // The last 100 are always remembered, the oldest are forgotten
+    vector<CInv> vInvNew;
+    for (int i = 0; i < 199; i++)
+    {
+        vInvNew.push_back(RandomInv());
+        filter.insert(vInvNew.back());
+    }
+    for (int i = 99; i < 199; i++)
+        BOOST_CHECK(filter.contains(vInvNew[i]));
+    nFound = 0;
+    BOOST_FOREACH(const CInv& inv, vInv)
+        if (filter.contains(inv))
+            nFound++;
+    BOOST_CHECK(nFound < 10);
+
+    // False positive rate is about what was asked for
+    nFound = 0;
+    for (int i = 0; i < 10000; i++)
+        if (filter.contains(RandomInv()))
+            nFound++;
+    BOOST_CHECK(nFound < 300);
+
+    filter.clear();
+    BOOST_CHECK(!filter.contains(vInvNew.back()));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
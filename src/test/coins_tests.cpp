@@ -0,0 +1,137 @@
+#include <boost/test/unit_test.hpp>
+
+#include "coins.h"
+#include "util.h"
+
+using namespace std;
+
+// Coins view kept entirely in memory, standing in for the LevelDB one
+class CCoinsViewTest : public CCoinsView
+{
+public:
+    map<COutPoint, CCoin> mapCoins;
+    uint256 hashBestBlock;
+
+    bool GetCoin(const COutPoint& outpoint, CCoin& coin)
+    {
+        map<COutPoint, CCoin>::iterator it = mapCoins.find(outpoint);
+        if (it == mapCoins.end())
+            return false;
+        coin = it->second;
+        return true;
+    }
+
+    uint256 GetBestBlock() { return hashBestBlock; }
+
+    bool BatchWrite(CCoinsMap& mapCoinsIn, const uint256& hashBlock)
+    {
+        for (CCoinsMap::iterator it = mapCoinsIn.begin(); it != mapCoinsIn.end(); ++it)
+        {
+            if (!it->second.fDirty)
+                continue;
+            if (it->second.coin.IsNull())
+                mapCoins.erase(it->first);
+            else
+                mapCoins[it->first] = it->second.coin;
+        }
+        mapCoinsIn.clear();
+        hashBestBlock = hashBlock;
+        return true;
+    }
+};
+
+static CTransaction MakeTx(const COutPoint& prevout, int64_t nValue)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vout.resize(2);
+    tx.vout[0].nValue = nValue;
+    tx.vout[0].scriptPubKey << OP_TRUE;
+    tx.vout[1].nValue = 1;
+    tx.vout[1].scriptPubKey << OP_TRUE << OP_DROP;
+    return tx;
+}
+
+BOOST_AUTO_TEST_SUITE(coins_tests)
+
+BOOST_AUTO_TEST_CASE(coin_serialize)
+{
+    CTransaction tx = MakeTx(COutPoint(GetRandHash(), 0), 12345678);
+    CCoin coin(tx, 0, 314159);
+    coin.fCoinStake = true;
+
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << coin;
+    CCoin coin2;
+    ss >> coin2;
+    BOOST_CHECK(coin2.txout == coin.txout);
+    BOOST_CHECK_EQUAL(coin2.nHeight, 314159);
+    BOOST_CHECK_EQUAL(coin2.nTime, tx.nTime);
+    BOOST_CHECK(!coin2.fCoinBase);
+    BOOST_CHECK(coin2.fCoinStake);
+}
+
+BOOST_AUTO_TEST_CASE(coins_cache_connect_undo)
+{
+    CCoinsViewTest base;
+    COutPoint prevout(GetRandHash(), 3);
+    CTransaction txPrev = MakeTx(COutPoint(GetRandHash(), 0), 500);
+    base.mapCoins[prevout] = CCoin(txPrev, 0, 10);
+    base.hashBestBlock = GetRandHash();
+
+    CCoinsViewCache tip(&base);
+    BOOST_CHECK(tip.GetBestBlock() == base.hashBestBlock);
+
+    CBlock block;
+    block.vtx.push_back(MakeTx(prevout, 400));
+    block.vtx.push_back(MakeTx(COutPoint(block.vtx[0].GetHash(), 1), 1));
+    uint256 hash0 = block.vtx[0].GetHash();
+    uint256 hash1 = block.vtx[1].GetHash();
+
+    // Connect in a child cache, as ConnectBlock does within a db transaction
+    vector<CCoin> vUndo;
+    {
+        CCoinsViewCache view(&tip);
+        BOOST_CHECK(view.HaveInputs(block.vtx[0]));
+        BOOST_CHECK(view.UpdateCoins(block.vtx[0], 11, vUndo));
+        BOOST_CHECK(view.HaveInputs(block.vtx[1]));
+        BOOST_CHECK(view.UpdateCoins(block.vtx[1], 11, vUndo));
+
+        // Spent outputs cannot be spent again
+        vector<CCoin> vUnused;
+        BOOST_CHECK(!view.HaveInputs(block.vtx[0]));
+        BOOST_CHECK(!view.UpdateCoins(block.vtx[0], 11, vUnused));
+        view.SetBestBlock(block.GetHash());
+
+        // Nothing is visible below until the child is flushed
+        BOOST_CHECK(tip.HaveCoin(prevout));
+        BOOST_CHECK(view.Flush());
+    }
+    BOOST_CHECK_EQUAL(vUndo.size(), 2U);
+    BOOST_CHECK_EQUAL(vUndo[0].nHeight, 10);
+    BOOST_CHECK(!tip.HaveCoin(prevout));
+    BOOST_CHECK(!tip.HaveCoin(COutPoint(hash0, 1)));
+    BOOST_CHECK(tip.HaveCoin(COutPoint(hash0, 0)));
+    BOOST_CHECK(tip.HaveCoin(COutPoint(hash1, 0)));
+    BOOST_CHECK(tip.GetBestBlock() == block.GetHash());
+    BOOST_CHECK(tip.DynamicMemoryUsage() > 0);
+
+    BOOST_CHECK(tip.Flush());
+    BOOST_CHECK_EQUAL(tip.GetCacheSize(), 0U);
+    BOOST_CHECK_EQUAL(base.mapCoins.size(), 3U);
+    BOOST_CHECK(base.hashBestBlock == block.GetHash());
+
+    // Disconnecting restores exactly the original set
+    BOOST_CHECK(tip.UndoBlock(block, vUndo));
+    BOOST_CHECK(tip.Flush());
+    BOOST_CHECK_EQUAL(base.mapCoins.size(), 1U);
+    BOOST_CHECK(base.mapCoins.count(prevout));
+    BOOST_CHECK_EQUAL(base.mapCoins[prevout].txout.nValue, 500);
+
+    // Undo data of the wrong size is rejected
+    vUndo.pop_back();
+    BOOST_CHECK(!tip.UndoBlock(block, vUndo));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
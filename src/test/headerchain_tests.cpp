@@ -0,0 +1,136 @@
+#include <boost/test/unit_test.hpp>
+
+#include "headerchain.h"
+#include "main.h"
+
+#include <vector>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(headerchain_tests)
+
+// Add a header on top of hashPrev, which is a header already in the chain
+// or, for hashPrev 0, a block we have at height 0 with no trust
+static uint256 AddHeader(CHeaderChain& chain, const uint256& hashPrev, unsigned int nBits)
+{
+    CBlock header;
+    header.hashPrevBlock = hashPrev;
+    header.nBits = nBits;
+    uint256 hash = GetRandHash();
+
+    const CHeaderIndex* pheaderPrev = chain.Find(hashPrev);
+    if (pheaderPrev)
+        chain.Add(hash, header, pheaderPrev->nHeight, pheaderPrev->nChainTrust, true);
+    else
+        chain.Add(hash, header, 0, 0, true);
+    return hash;
+}
+
+BOOST_AUTO_TEST_CASE(headerchain_branch)
+{
+    CHeaderChain chain;
+    vector<uint256> vMain;
+    uint256 hash = 0;
+    for (int i = 0; i < 5; i++)
+        vMain.push_back(hash = AddHeader(chain, hash, 0x1e0fffff));
+    BOOST_CHECK(chain.GetBestHash() == vMain.back());
+    BOOST_CHECK_EQUAL(chain.Find(vMain.back())->nHeight, 5);
+
+    vector<uint256> vBranch;
+    BOOST_CHECK(!chain.GetBranch(vMain.back(), 0, vBranch));
+    BOOST_CHECK(vBranch == vMain);
+
+    // Only what follows hashStop
+    BOOST_CHECK(chain.GetBranch(vMain.back(), vMain[2], vBranch));
+    BOOST_CHECK_EQUAL(vBranch.size(), 2U);
+    BOOST_CHECK(vBranch[0] == vMain[3]);
+
+    // Stored blocks end the branch
+    chain.Erase(vMain[0]);
+    chain.Erase(vMain[1]);
+    BOOST_CHECK(!chain.GetBranch(vMain.back(), 0, vBranch));
+    BOOST_CHECK_EQUAL(vBranch.size(), 3U);
+    BOOST_CHECK(vBranch[0] == vMain[2]);
+
+    // A shorter branch with a harder target has more trust
+    uint256 hashFork = AddHeader(chain, vMain[2], 0x1c0fffff);
+    BOOST_CHECK(chain.GetBestHash() == hashFork);
+    BOOST_CHECK(chain.GetBestChainTrust() == chain.Find(hashFork)->nChainTrust);
+}
+
+BOOST_AUTO_TEST_CASE(headerchain_invalidate)
+{
+    CHeaderChain chain;
+    uint256 hashRoot = AddHeader(chain, 0, 0x1e0fffff);
+    uint256 hashBad = AddHeader(chain, hashRoot, 0x1d0fffff);
+    uint256 hashBadChild = AddHeader(chain, hashBad, 0x1d0fffff);
+    AddHeader(chain, hashBadChild, 0x1d0fffff);
+    uint256 hashGood = AddHeader(chain, hashRoot, 0x1e0fffff);
+    BOOST_CHECK_EQUAL(chain.size(), 5U);
+
+    BOOST_CHECK_EQUAL(chain.Invalidate(hashBad), 3U);
+    BOOST_CHECK_EQUAL(chain.size(), 2U);
+    BOOST_CHECK(chain.IsInvalid(hashBad));
+    BOOST_CHECK(chain.IsInvalid(hashBadChild));
+    BOOST_CHECK(!chain.IsInvalid(hashGood));
+    BOOST_CHECK(chain.GetBestHash() == hashGood);
+
+    // Dropped headers may come again
+    uint256 hashDrop = AddHeader(chain, hashGood, 0x1e0fffff);
+    BOOST_CHECK_EQUAL(chain.Drop(hashDrop), 1U);
+    BOOST_CHECK(chain.Find(hashDrop) == NULL);
+    BOOST_CHECK(!chain.IsInvalid(hashDrop));
+    BOOST_CHECK(chain.GetBestHash() == hashGood);
+}
+
+BOOST_AUTO_TEST_CASE(headerchain_prune)
+{
+    CHeaderChain chain;
+    uint256 hashRoot = AddHeader(chain, 0, 0x1e0fffff);
+    uint256 hashKeep = AddHeader(chain, AddHeader(chain, hashRoot, 0x1e0fffff), 0x1e0fffff);
+    uint256 hashStale = AddHeader(chain, AddHeader(chain, hashRoot, 0x1d0fffff), 0x1d0fffff);
+    BOOST_CHECK(chain.GetBestHash() == hashStale);
+    BOOST_CHECK_EQUAL(chain.size(), 5U);
+
+    // Only the kept tips and their ancestors stay
+    vector<uint256> vKeep;
+    vKeep.push_back(hashKeep);
+    vKeep.push_back(0);
+    BOOST_CHECK_EQUAL(chain.Prune(vKeep), 2U);
+    BOOST_CHECK_EQUAL(chain.size(), 3U);
+    BOOST_CHECK(chain.Find(hashRoot) != NULL);
+    BOOST_CHECK(chain.Find(hashStale) == NULL);
+    BOOST_CHECK(!chain.IsInvalid(hashStale));
+    BOOST_CHECK(chain.GetBestHash() == hashKeep);
+
+    // Keeping everything drops nothing
+    BOOST_CHECK_EQUAL(chain.Prune(vKeep), 0U);
+    BOOST_CHECK_EQUAL(chain.size(), 3U);
+}
+
+BOOST_AUTO_TEST_CASE(headerchain_unserved)
+{
+    CHeaderChain chain;
+    uint256 hashRoot = AddHeader(chain, 0, 0x1e0fffff);
+    uint256 hashStuck = AddHeader(chain, hashRoot, 0x1e0fffff);
+    uint256 hashTip = AddHeader(chain, hashStuck, 0x1e0fffff);
+    uint256 hashOther = AddHeader(chain, hashRoot, 0x1e0fffff);
+
+    BOOST_CHECK(chain.IsInBranch(hashStuck, hashTip));
+    BOOST_CHECK(chain.IsInBranch(hashTip, hashTip));
+    BOOST_CHECK(!chain.IsInBranch(hashStuck, hashOther));
+    BOOST_CHECK(!chain.IsInBranch(hashTip, hashStuck));
+
+    // The branch from the unserved block on is skipped until the mark runs
+    // out, including headers announced on top of it later
+    chain.MarkUnserved(hashStuck, 1000);
+    uint256 hashLater = AddHeader(chain, hashTip, 0x1e0fffff);
+    BOOST_CHECK(chain.IsUnserved(hashStuck, 999));
+    BOOST_CHECK(chain.IsUnserved(hashTip, 999));
+    BOOST_CHECK(chain.IsUnserved(hashLater, 999));
+    BOOST_CHECK(!chain.IsUnserved(hashLater, 1000));
+    BOOST_CHECK(!chain.IsUnserved(hashRoot, 999));
+    BOOST_CHECK(!chain.IsUnserved(hashOther, 999));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
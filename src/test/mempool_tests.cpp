@@ -0,0 +1,124 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txmempool.h"
+
+#include <vector>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(mempool_tests)
+
+static CTransaction MakeTx(const uint256& hashPrev, unsigned int nOut)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(hashPrev, 0);
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vout.resize(nOut);
+    for (unsigned int i = 0; i < nOut; i++)
+    {
+        tx.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        tx.vout[i].nValue = 10 * CENT;
+    }
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(mempool_aggregates)
+{
+    CTxMemPool pool;
+
+    // A chain of three: parent -> child -> grandchild
+    CTransaction txParent = MakeTx(GetRandHash(), 2);
+    CTransaction txChild = MakeTx(txParent.GetHash(), 1);
+    CTransaction txGrandChild = MakeTx(txChild.GetHash(), 1);
+
+    pool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 1000, 0, 0, 1, 100, 1, 0));
+    pool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 2000, 0, 0, 1, 200, 1, 0));
+    pool.addUnchecked(txGrandChild.GetHash(), CTxMemPoolEntry(txGrandChild, 3000, 0, 0, 1, 300, 1, 0));
+
+    const CTxMemPoolEntry& parent = pool.mapTx[txParent.GetHash()];
+    const CTxMemPoolEntry& child = pool.mapTx[txChild.GetHash()];
+    const CTxMemPoolEntry& grandchild = pool.mapTx[txGrandChild.GetHash()];
+    BOOST_CHECK_EQUAL(parent.GetCountWithDescendants(), 3U);
+    BOOST_CHECK_EQUAL(parent.GetFeesWithDescendants(), 6000);
+    BOOST_CHECK_EQUAL(parent.GetSizeWithDescendants(), parent.GetTxSize() + child.GetTxSize() + grandchild.GetTxSize());
+    BOOST_CHECK_EQUAL(child.GetCountWithAncestors(), 2U);
+    BOOST_CHECK_EQUAL(grandchild.GetCountWithAncestors(), 3U);
+    BOOST_CHECK_EQUAL(grandchild.GetFeesWithAncestors(), 6000);
+
+    // Both indices hold every transaction, oldest and lowest score first
+    BOOST_CHECK_EQUAL(pool.setByTime.size(), 3U);
+    BOOST_CHECK(pool.setByTime.begin()->second == txParent.GetHash());
+    BOOST_CHECK_EQUAL(pool.setByDescendantScore.size(), 3U);
+    BOOST_CHECK(pool.setByDescendantScore.begin()->second == txParent.GetHash());
+
+    // Taking the middle one out takes its descendants along
+    pool.remove(txChild, true);
+    BOOST_CHECK_EQUAL(pool.size(), 1U);
+    BOOST_CHECK_EQUAL(parent.GetCountWithDescendants(), 1U);
+    BOOST_CHECK_EQUAL(parent.GetFeesWithDescendants(), 1000);
+    BOOST_CHECK_EQUAL(pool.mapNextTx.size(), 1U);
+    BOOST_CHECK_EQUAL(pool.setByDescendantScore.size(), 1U);
+    BOOST_CHECK_EQUAL(pool.setByTime.size(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_parent_readded)
+{
+    CTxMemPool pool;
+
+    // A child in the pool whose parent comes back later, as happens when
+    // a block is disconnected
+    CTransaction txParent = MakeTx(GetRandHash(), 1);
+    CTransaction txChild = MakeTx(txParent.GetHash(), 1);
+    pool.addUnchecked(txChild.GetHash(), CTxMemPoolEntry(txChild, 2000, 0, 0, 1, 100, 1, 0));
+    pool.addUnchecked(txParent.GetHash(), CTxMemPoolEntry(txParent, 1000, 0, 0, 1, 200, 1, 0));
+
+    const CTxMemPoolEntry& parent = pool.mapTx[txParent.GetHash()];
+    const CTxMemPoolEntry& child = pool.mapTx[txChild.GetHash()];
+    BOOST_CHECK_EQUAL(parent.GetCountWithDescendants(), 2U);
+    BOOST_CHECK_EQUAL(parent.GetFeesWithDescendants(), 3000);
+    BOOST_CHECK_EQUAL(child.GetCountWithAncestors(), 2U);
+
+    // The parent's score includes the better paying child
+    BOOST_CHECK(parent.GetDescendantScore() > parent.GetFeeRate());
+
+    // Confirming the parent leaves the child on its own
+    pool.remove(txParent);
+    BOOST_CHECK_EQUAL(pool.size(), 1U);
+    BOOST_CHECK_EQUAL(child.GetCountWithAncestors(), 1U);
+    BOOST_CHECK_EQUAL(child.GetFeesWithAncestors(), 2000);
+}
+
+BOOST_AUTO_TEST_CASE(mempool_trim)
+{
+    CTxMemPool pool;
+
+    // The cheap parent is carried by its child, so the package scores
+    // above txLow
+    CTransaction txLow = MakeTx(GetRandHash(), 1);
+    CTransaction txHigh = MakeTx(GetRandHash(), 1);
+    CTransaction txHighChild = MakeTx(txHigh.GetHash(), 1);
+    pool.addUnchecked(txLow.GetHash(), CTxMemPoolEntry(txLow, 2000, 0, 0, 1, 100, 1, 0));
+    pool.addUnchecked(txHigh.GetHash(), CTxMemPoolEntry(txHigh, 1000, 0, 0, 1, 100, 1, 0));
+    pool.addUnchecked(txHighChild.GetHash(), CTxMemPoolEntry(txHighChild, 9000, 0, 0, 1, 100, 1, 0));
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), pool.mapTx[txLow.GetHash()].GetTxSize() * 3);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1000000), 0);
+
+    // Going one byte over evicts the cheapest package and raises the
+    // minimum fee above what it paid
+    size_t nUsage = pool.DynamicMemoryUsage();
+    pool.TrimToSize(nUsage - 1);
+    BOOST_CHECK_EQUAL(pool.size(), 2U);
+    BOOST_CHECK(!pool.exists(txLow.GetHash()));
+    BOOST_CHECK(pool.DynamicMemoryUsage() < nUsage);
+    BOOST_CHECK(pool.GetMinFee(nUsage) > MIN_RELAY_TX_FEE);
+
+    // A package goes as a whole
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1);
+    BOOST_CHECK_EQUAL(pool.size(), 0U);
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), 0U);
+    BOOST_CHECK_EQUAL(pool.GetTotalTxSize(), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
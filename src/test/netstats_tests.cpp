@@ -0,0 +1,58 @@
+#include <boost/test/unit_test.hpp>
+
+#include "netstats.h"
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(netstats_tests)
+
+BOOST_AUTO_TEST_CASE(netstats_histogram)
+{
+    CTimeHistogram histogram;
+    histogram.Add(0);
+    histogram.Add(1);
+    histogram.Add(2);
+    histogram.Add(1000);
+    histogram.Add(1023);
+    histogram.Add(1024);
+    histogram.Add((int64_t)1 << 40);
+
+    BOOST_CHECK_EQUAL(histogram.vCount[0], 2U);
+    BOOST_CHECK_EQUAL(histogram.vCount[1], 1U);
+    BOOST_CHECK_EQUAL(histogram.vCount[9], 2U);
+    BOOST_CHECK_EQUAL(histogram.vCount[10], 1U);
+    BOOST_CHECK_EQUAL(histogram.vCount[CTimeHistogram::BUCKETS - 1], 1U);
+    BOOST_CHECK_EQUAL(histogram.nCount, 7U);
+    BOOST_CHECK_EQUAL(histogram.nMaxMicros, (int64_t)1 << 40);
+}
+
+BOOST_AUTO_TEST_CASE(netstats_commands)
+{
+    BOOST_CHECK_EQUAL(GetStatsCommand("tx"), "tx");
+    BOOST_CHECK_EQUAL(GetStatsCommand("spork"), "spork");
+    BOOST_CHECK_EQUAL(GetStatsCommand("txlreq"), "txlreq");
+    BOOST_CHECK_EQUAL(GetStatsCommand("nonsense"), GetStatsCommand("junk"));
+
+    CNetStats stats;
+    stats.RecordRecv("tx", 300);
+    stats.RecordRecv("tx", 200);
+    stats.RecordSent("inv", 61);
+    stats.RecordRecv("nonsense", 10);
+    stats.RecordRecv("junk", 20);
+    stats.RecordProcessTime("tx", 150);
+
+    MessageStatsMap mapMsgStats;
+    TimeHistogramMap mapProcessTime;
+    stats.GetStats(mapMsgStats, mapProcessTime);
+
+    BOOST_CHECK_EQUAL(mapMsgStats.size(), 3U);
+    BOOST_CHECK_EQUAL(mapMsgStats["tx"].nMsgsRecv, 2U);
+    BOOST_CHECK_EQUAL(mapMsgStats["tx"].nBytesRecv, 500U);
+    BOOST_CHECK_EQUAL(mapMsgStats["tx"].nProcessMicros, 150);
+    BOOST_CHECK_EQUAL(mapMsgStats["inv"].nMsgsSent, 1U);
+    BOOST_CHECK_EQUAL(mapMsgStats[GetStatsCommand("junk")].nBytesRecv, 30U);
+    BOOST_CHECK_EQUAL(mapProcessTime.size(), 1U);
+    BOOST_CHECK_EQUAL(mapProcessTime["tx"].nCount, 1U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
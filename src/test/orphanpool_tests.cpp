@@ -0,0 +1,95 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "txorphanpool.h"
+
+#include <vector>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(orphanpool_tests)
+
+static CTransaction MakeOrphan(const uint256& hashPrev, unsigned int nPrevOut)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(hashPrev, nPrevOut);
+    tx.vin[0].scriptSig = CScript() << OP_11;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx.vout[0].nValue = 10 * CENT;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(orphanpool_children)
+{
+    CTxOrphanPool pool(100000, 10000);
+
+    CTransaction txParent;
+    txParent.vout.resize(2);
+    uint256 hashParent = txParent.GetHash();
+
+    CTransaction txFirst = MakeOrphan(hashParent, 0);
+    CTransaction txSecond = MakeOrphan(hashParent, 1);
+    CTransaction txOther = MakeOrphan(hashParent, 2);
+    BOOST_CHECK(pool.AddTx(txFirst, 1, 0));
+    BOOST_CHECK(pool.AddTx(txSecond, 1, 0));
+    BOOST_CHECK(pool.AddTx(txOther, 2, 0));
+    BOOST_CHECK(!pool.AddTx(txFirst, 2, 0));
+    BOOST_CHECK_EQUAL(pool.size(), 3U);
+
+    // Only the orphans spending an output the parent has
+    vector<uint256> vChildren;
+    pool.GetChildren(txParent, vChildren);
+    BOOST_CHECK_EQUAL(vChildren.size(), 2U);
+    BOOST_CHECK(find(vChildren.begin(), vChildren.end(), txOther.GetHash()) == vChildren.end());
+
+    pool.EraseTx(txFirst.GetHash());
+    vChildren.clear();
+    pool.GetChildren(txParent, vChildren);
+    BOOST_CHECK_EQUAL(vChildren.size(), 1U);
+    BOOST_CHECK(vChildren[0] == txSecond.GetHash());
+
+    BOOST_CHECK_EQUAL(pool.EraseForPeer(1), 1U);
+    BOOST_CHECK_EQUAL(pool.GetPeerSize(1), 0U);
+    BOOST_CHECK_EQUAL(pool.size(), 1U);
+}
+
+BOOST_AUTO_TEST_CASE(orphanpool_limits)
+{
+    CTransaction txSample = MakeOrphan(uint256(0), 0);
+    unsigned int nTxSize = ::GetSerializeSize(txSample, SER_NETWORK, PROTOCOL_VERSION);
+
+    // Room for ten orphans, four of them from any one peer
+    CTxOrphanPool pool(nTxSize * 10, nTxSize * 4);
+
+    // A flooding peer only replaces its own oldest
+    vector<CTransaction> vFlood;
+    for (int i = 0; i < 6; i++)
+    {
+        vFlood.push_back(MakeOrphan(GetRandHash(), 0));
+        BOOST_CHECK(pool.AddTx(vFlood.back(), 1, i));
+    }
+    BOOST_CHECK_EQUAL(pool.GetPeerSize(1), nTxSize * 4);
+    BOOST_CHECK(!pool.HaveTx(vFlood[0].GetHash()));
+    BOOST_CHECK(!pool.HaveTx(vFlood[1].GetHash()));
+    BOOST_CHECK(pool.HaveTx(vFlood[2].GetHash()));
+
+    // Once the pool is full the peer using the most gives way
+    for (int nPeer = 2; nPeer <= 4; nPeer++)
+        for (int i = 0; i < 2; i++)
+            BOOST_CHECK(pool.AddTx(MakeOrphan(GetRandHash(), 0), nPeer, 10));
+    BOOST_CHECK_EQUAL(pool.GetTotalSize(), nTxSize * 10);
+    BOOST_CHECK(pool.AddTx(MakeOrphan(GetRandHash(), 0), 5, 10));
+    BOOST_CHECK_EQUAL(pool.GetTotalSize(), nTxSize * 10);
+    BOOST_CHECK_EQUAL(pool.GetPeerSize(1), nTxSize * 3);
+    BOOST_CHECK(!pool.HaveTx(vFlood[2].GetHash()));
+
+    // Everything is forgotten once it expires
+    BOOST_CHECK_EQUAL(pool.EraseExpired(10 + CTxOrphanPool::ORPHAN_TX_EXPIRE_TIME - 1), 3U);
+    BOOST_CHECK_EQUAL(pool.EraseExpired(10 + CTxOrphanPool::ORPHAN_TX_EXPIRE_TIME), 7U);
+    BOOST_CHECK_EQUAL(pool.size(), 0U);
+    BOOST_CHECK_EQUAL(pool.GetTotalSize(), 0U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -42,4 +42,27 @@ BOOST_AUTO_TEST_CASE(varints)
 
 }
 
+BOOST_AUTO_TEST_CASE(spanreader)
+{
+    CDataStream ss(SER_DISK, 0);
+    ss << VARINT(300) << std::string("abc") << (uint32_t)7;
+    std::vector<char> vch(ss.begin(), ss.end());
+
+    CSpanReader reader(&vch[0], &vch[0] + vch.size(), SER_DISK, 0);
+    int n;
+    std::string str;
+    uint32_t u;
+    reader >> VARINT(n) >> str >> u;
+    BOOST_CHECK_EQUAL(n, 300);
+    BOOST_CHECK_EQUAL(str, "abc");
+    BOOST_CHECK_EQUAL(u, 7U);
+    BOOST_CHECK(reader.empty());
+    BOOST_CHECK_EQUAL(reader.tell(), vch.size());
+
+    // Reading past the end throws rather than running off the buffer
+    CSpanReader truncated(&vch[0], &vch[0] + vch.size() - 1, SER_DISK, 0);
+    truncated >> VARINT(n) >> str;
+    BOOST_CHECK_THROW(truncated >> u, std::ios_base::failure);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
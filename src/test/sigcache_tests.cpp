@@ -0,0 +1,61 @@
+#include <boost/test/unit_test.hpp>
+
+#include "key.h"
+#include "script.h"
+#include "util.h"
+
+#include <vector>
+
+using namespace std;
+
+BOOST_AUTO_TEST_SUITE(sigcache_tests)
+
+BOOST_AUTO_TEST_CASE(sigcache_get_set)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CPubKey pubkey = key.GetPubKey();
+
+    CSignatureCache cache(1 << 16);
+    vector<uint256> vHash;
+    vector<unsigned char> vchSig(72, 0x30);
+    for (int i = 0; i < 20000; i++)
+    {
+        vHash.push_back(GetRandHash());
+        cache.Set(vHash.back(), vchSig, pubkey);
+    }
+
+    // The most recent generation is always kept
+    for (int i = 19900; i < 20000; i++)
+        BOOST_CHECK(cache.Get(vHash[i], vchSig, pubkey));
+
+    // Anything that differs in sighash, signature or key misses
+    BOOST_CHECK(!cache.Get(GetRandHash(), vchSig, pubkey));
+    vector<unsigned char> vchSig2(vchSig);
+    vchSig2[10] ^= 1;
+    BOOST_CHECK(!cache.Get(vHash.back(), vchSig2, pubkey));
+    CKey key2;
+    key2.MakeNewKey(true);
+    BOOST_CHECK(!cache.Get(vHash.back(), vchSig, key2.GetPubKey()));
+
+    uint64_t nHits, nMisses, nInserts;
+    size_t nSlots;
+    cache.GetStats(nHits, nMisses, nInserts, nSlots);
+    BOOST_CHECK_EQUAL(nHits, 100U);
+    BOOST_CHECK_EQUAL(nMisses, 3U);
+    BOOST_CHECK_EQUAL(nInserts, 20000U);
+    BOOST_CHECK_EQUAL(nSlots, (size_t)(1 << 16) / 33);
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_disabled)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    CSignatureCache cache(0);
+    vector<unsigned char> vchSig(72, 0x30);
+    uint256 hash = GetRandHash();
+    cache.Set(hash, vchSig, key.GetPubKey());
+    BOOST_CHECK(!cache.Get(hash, vchSig, key.GetPubKey()));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
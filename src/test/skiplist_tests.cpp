@@ -0,0 +1,97 @@
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "util.h"
+
+#include <vector>
+
+#define SKIPLIST_LENGTH 300000
+
+BOOST_AUTO_TEST_SUITE(skiplist_tests)
+
+BOOST_AUTO_TEST_CASE(skiplist_test)
+{
+    std::vector<CBlockIndex> vIndex(SKIPLIST_LENGTH);
+
+    for (int i=0; i<SKIPLIST_LENGTH; i++) {
+        vIndex[i].nHeight = i;
+        vIndex[i].pprev = (i == 0) ? NULL : &vIndex[i - 1];
+        vIndex[i].BuildSkip();
+    }
+
+    for (int i=0; i<SKIPLIST_LENGTH; i++) {
+        if (i > 0) {
+            BOOST_CHECK(vIndex[i].pskip == &vIndex[vIndex[i].pskip->nHeight]);
+            BOOST_CHECK(vIndex[i].pskip->nHeight < i);
+        } else {
+            BOOST_CHECK(vIndex[i].pskip == NULL);
+        }
+    }
+
+    for (int i=0; i < 1000; i++) {
+        int from = insecure_rand() % (SKIPLIST_LENGTH - 1);
+        int to = insecure_rand() % (from + 1);
+
+        BOOST_CHECK(vIndex[SKIPLIST_LENGTH - 1].GetAncestor(from) == &vIndex[from]);
+        BOOST_CHECK(vIndex[from].GetAncestor(to) == &vIndex[to]);
+        BOOST_CHECK(vIndex[from].GetAncestor(0) == &vIndex[0]);
+    }
+    BOOST_CHECK(vIndex[10].GetAncestor(11) == NULL);
+    BOOST_CHECK(vIndex[10].GetAncestor(-1) == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(chain_test)
+{
+    std::vector<uint256> vHashMain(1000);
+    std::vector<CBlockIndex> vBlocksMain(1000);
+    for (unsigned int i=0; i<vBlocksMain.size(); i++) {
+        vHashMain[i] = i; // Set the hash equal to the height, so we can quickly check the distances.
+        vBlocksMain[i].nHeight = i;
+        vBlocksMain[i].pprev = i ? &vBlocksMain[i - 1] : NULL;
+        vBlocksMain[i].phashBlock = &vHashMain[i];
+        vBlocksMain[i].BuildSkip();
+    }
+
+    // Build a branch that splits off at block 499
+    std::vector<uint256> vHashSide(500);
+    std::vector<CBlockIndex> vBlocksSide(500);
+    for (unsigned int i=0; i<vBlocksSide.size(); i++) {
+        vHashSide[i] = i + 50000 + (uint256(1) << 128);
+        vBlocksSide[i].nHeight = i + 500;
+        vBlocksSide[i].pprev = i ? &vBlocksSide[i - 1] : &vBlocksMain[499];
+        vBlocksSide[i].phashBlock = &vHashSide[i];
+        vBlocksSide[i].BuildSkip();
+    }
+
+    CChain chain;
+    BOOST_CHECK(chain.Tip() == NULL);
+    BOOST_CHECK_EQUAL(chain.Height(), -1);
+
+    chain.SetTip(&vBlocksMain.back());
+    BOOST_CHECK(chain.Genesis() == &vBlocksMain[0]);
+    BOOST_CHECK(chain.Tip() == &vBlocksMain.back());
+    BOOST_CHECK_EQUAL(chain.Height(), 999);
+    for (int i=0; i<1000; i++)
+        BOOST_CHECK(chain[i] == &vBlocksMain[i]);
+    BOOST_CHECK(chain[1000] == NULL);
+    BOOST_CHECK(chain.Next(&vBlocksMain[10]) == &vBlocksMain[11]);
+    BOOST_CHECK(chain.Next(&vBlocksMain.back()) == NULL);
+
+    // Side chains resolve through the skip list
+    BOOST_CHECK(vBlocksSide.back().GetAncestor(499) == &vBlocksMain[499]);
+    BOOST_CHECK(vBlocksSide.back().GetAncestor(700) == &vBlocksSide[200]);
+    BOOST_CHECK(!chain.Contains(&vBlocksSide[0]));
+    BOOST_CHECK(chain.Next(&vBlocksSide[0]) == NULL);
+    BOOST_CHECK(chain.FindFork(&vBlocksSide.back()) == &vBlocksMain[499]);
+
+    // Reorganizing to the side branch replaces the blocks above the fork
+    chain.SetTip(&vBlocksSide[100]);
+    BOOST_CHECK_EQUAL(chain.Height(), 600);
+    BOOST_CHECK(chain[499] == &vBlocksMain[499]);
+    BOOST_CHECK(chain[500] == &vBlocksSide[0]);
+    BOOST_CHECK(chain.Tip() == &vBlocksSide[100]);
+    BOOST_CHECK(!chain.Contains(&vBlocksMain[500]));
+    BOOST_CHECK(chain.FindFork(&vBlocksMain.back()) == &vBlocksMain[499]);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
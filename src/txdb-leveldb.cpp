@@ -74,6 +74,7 @@ CTxDB::CTxDB(const char* pszMode)
 {
     assert(pszMode);
     activeBatch = NULL;
+    activeCoins = NULL;
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
 
     if (txdb) {
@@ -135,12 +136,15 @@ void CTxDB::Close()
     options.block_cache = NULL;
     delete activeBatch;
     activeBatch = NULL;
+    DropCoinsView();
 }
 
 bool CTxDB::TxnBegin()
 {
-    assert(!activeBatch);
+    assert(!activeBatch && !activeCoins);
     activeBatch = new leveldb::WriteBatch();
+    if (pcoinsTip)
+        activeCoins = new CCoinsViewCache(pcoinsTip);
     return true;
 }
 
@@ -152,8 +156,15 @@ bool CTxDB::TxnCommit()
     activeBatch = NULL;
     if (!status.ok()) {
         LogPrintf("LevelDB batch commit failure: %s\n", status.ToString());
+        DropCoinsView();
         return false;
     }
+    // The block index is on disk now; move the coins changes into the
+    // in-memory tip. They reach disk when the tip cache is flushed.
+    if (activeCoins) {
+        activeCoins->Flush();
+        DropCoinsView();
+    }
     return true;
 }
 
@@ -259,7 +270,11 @@ bool CTxDB::ReadDiskTx(COutPoint outpoint, CTransaction& tx)
 
 bool CTxDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
 {
-    return Write(make_pair(string("blockindex"), blockindex.GetBlockHash()), blockindex);
+    // Remember the entry as changed since the last block index snapshot
+    uint256 hash = blockindex.GetBlockHash();
+    if (!Write(make_pair(string("blockindexdirty"), hash), blockindex.nHeight))
+        return false;
+    return Write(make_pair(string("blockindex"), hash), blockindex);
 }
 
 bool CTxDB::ReadHashBestChain(uint256& hashBestChain)
@@ -282,26 +297,161 @@ bool CTxDB::WriteBestInvalidTrust(CBigNum bnBestInvalidTrust)
     return Write(string("bnBestInvalidTrust"), bnBestInvalidTrust);
 }
 
+bool CTxDB::ReadCoin(const COutPoint& outpoint, CCoin& coin)
+{
+    return Read(make_pair(string("coin"), outpoint), coin);
+}
+
+bool CTxDB::WriteCoins(const CCoinsMap& mapCoins, const uint256& hashBlock)
+{
+    // One batch, so the best block marker always describes the records
+    assert(!activeBatch);
+    activeBatch = new leveldb::WriteBatch();
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); ++it)
+    {
+        if (!it->second.fDirty)
+            continue;
+        if (it->second.coin.IsNull())
+            Erase(make_pair(string("coin"), it->first));
+        else
+            Write(make_pair(string("coin"), it->first), it->second.coin);
+    }
+    Write(string("coinsbest"), hashBlock);
+    return TxnCommit();
+}
+
+bool CTxDB::ReadCoinsBestBlock(uint256& hashBlock)
+{
+    return Read(string("coinsbest"), hashBlock);
+}
+
+bool CTxDB::EraseCoinsBestBlock()
+{
+    return Erase(string("coinsbest"));
+}
+
+bool CTxDB::ReadCoinsUndo(const uint256& hashBlock, vector<CCoin>& vUndo)
+{
+    return Read(make_pair(string("coinundo"), hashBlock), vUndo);
+}
+
+bool CTxDB::WriteCoinsUndo(const uint256& hashBlock, const vector<CCoin>& vUndo)
+{
+    return Write(make_pair(string("coinundo"), hashBlock), vUndo);
+}
+
+bool CTxDB::EraseCoinsUndo(const uint256& hashBlock)
+{
+    return Erase(make_pair(string("coinundo"), hashBlock));
+}
+
+bool CTxDB::ErasePrefix(const string& strPrefix)
+{
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << strPrefix;
+    iterator->Seek(ssStartKey.str());
+
+    leveldb::WriteBatch batch;
+    unsigned int nBatch = 0;
+    leveldb::Status status;
+    while (iterator->Valid())
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.write(iterator->key().data(), iterator->key().size());
+        string strType;
+        ssKey >> strType;
+        if (strType != strPrefix)
+            break;
+        batch.Delete(iterator->key());
+        if (++nBatch == 100000)
+        {
+            status = pdb->Write(leveldb::WriteOptions(), &batch);
+            if (!status.ok())
+                break;
+            batch.Clear();
+            nBatch = 0;
+        }
+        iterator->Next();
+    }
+    delete iterator;
+    if (status.ok())
+        status = pdb->Write(leveldb::WriteOptions(), &batch);
+    if (!status.ok()) {
+        LogPrintf("LevelDB write failure: %s\n", status.ToString());
+        return false;
+    }
+    return true;
+}
+
+bool CTxDB::WipeCoins()
+{
+    if (!EraseCoinsBestBlock())
+        return false;
+    return ErasePrefix("coin") && ErasePrefix("coinundo");
+}
+
 static CBlockIndex *InsertBlockIndex(uint256 hash)
 {
     if (hash == 0)
         return NULL;
 
     // Return existing
-    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    BlockMap::iterator mi = mapBlockIndex.find(hash);
     if (mi != mapBlockIndex.end())
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = arenaBlockIndex.New(CBlockIndex());
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
     return pindexNew;
 }
 
+// Copy the fields of a block index entry that are stored on disk; the links
+// to other entries and the chain trust are left alone
+static void CopyBlockIndexFields(CBlockIndex* pindex, const CBlockIndex& from)
+{
+    pindex->nFile          = from.nFile;
+    pindex->nBlockPos      = from.nBlockPos;
+    pindex->nHeight        = from.nHeight;
+    pindex->nMint          = from.nMint;
+    pindex->nMoneySupply   = from.nMoneySupply;
+    pindex->nFlags         = from.nFlags;
+    pindex->nStakeModifier = from.nStakeModifier;
+    pindex->bnStakeModifierV2 = from.bnStakeModifierV2;
+    pindex->prevoutStake   = from.prevoutStake;
+    pindex->nStakeTime     = from.nStakeTime;
+    pindex->hashProof      = from.hashProof;
+    pindex->nVersion       = from.nVersion;
+    pindex->hashMerkleRoot = from.hashMerkleRoot;
+    pindex->nTime          = from.nTime;
+    pindex->nBits          = from.nBits;
+    pindex->nNonce         = from.nNonce;
+}
+
+// Bookkeeping for a block index entry that was just loaded
+static void LoadedBlockIndex(CBlockIndex* pindex)
+{
+    // Watch for genesis block
+    if (pindexGenesisBlock == NULL && pindex->GetBlockHash() == Params().HashGenesisBlock())
+        pindexGenesisBlock = pindex;
+
+    // NovaCoin: build setStakeSeen
+    if (pindex->IsProofOfStake())
+        setStakeSeen.insert(make_pair(pindex->prevoutStake, pindex->nStakeTime));
+}
+
+// Forget a partially loaded block index
+static void UnloadBlockIndex()
+{
+    mapBlockIndex.clear();
+    arenaBlockIndex.Clear();
+    setStakeSeen.clear();
+    pindexGenesisBlock = NULL;
+}
+
 bool CTxDB::LoadBlockIndex()
 {
     if (mapBlockIndex.size() > 0) {
@@ -309,86 +459,23 @@ bool CTxDB::LoadBlockIndex()
         // from BDB.
         return true;
     }
-    // The block index is an in-memory structure that maps hashes to on-disk
-    // locations where the contents of the block can be found. Here, we scan it
-    // out of the DB and into mapBlockIndex.
-    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
-    // Seek to start key.
-    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
-    ssStartKey << make_pair(string("blockindex"), uint256(0));
-    iterator->Seek(ssStartKey.str());
-    // Now read each entry.
-    while (iterator->Valid())
-    {
-        boost::this_thread::interruption_point();
-        // Unpack keys and values.
-        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-        ssKey.write(iterator->key().data(), iterator->key().size());
-        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-        ssValue.write(iterator->value().data(), iterator->value().size());
-        string strType;
-        ssKey >> strType;
-        // Did we reach the end of the data to read?
-        if (strType != "blockindex")
-            break;
-        CDiskBlockIndex diskindex;
-        ssValue >> diskindex;
-
-        uint256 blockHash = diskindex.GetBlockHash();
-
-        // Construct block index object
-        CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
-        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-        pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
-        pindexNew->nFile          = diskindex.nFile;
-        pindexNew->nBlockPos      = diskindex.nBlockPos;
-        pindexNew->nHeight        = diskindex.nHeight;
-        pindexNew->nMint          = diskindex.nMint;
-        pindexNew->nMoneySupply   = diskindex.nMoneySupply;
-        pindexNew->nFlags         = diskindex.nFlags;
-        pindexNew->nStakeModifier = diskindex.nStakeModifier;
-        pindexNew->bnStakeModifierV2 = diskindex.bnStakeModifierV2;
-        pindexNew->prevoutStake   = diskindex.prevoutStake;
-        pindexNew->nStakeTime     = diskindex.nStakeTime;
-        pindexNew->hashProof      = diskindex.hashProof;
-        pindexNew->nVersion       = diskindex.nVersion;
-        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-        pindexNew->nTime          = diskindex.nTime;
-        pindexNew->nBits          = diskindex.nBits;
-        pindexNew->nNonce         = diskindex.nNonce;
-
-        // Watch for genesis block
-        if (pindexGenesisBlock == NULL && blockHash == Params().HashGenesisBlock())
-            pindexGenesisBlock = pindexNew;
-
-        if (!pindexNew->CheckIndex()) {
-            delete iterator;
-            return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
-        }
 
-        // NovaCoin: build setStakeSeen
-        if (pindexNew->IsProofOfStake())
-            setStakeSeen.insert(make_pair(pindexNew->prevoutStake, pindexNew->nStakeTime));
-
-        iterator->Next();
-    }
-    delete iterator;
+    // Start from the snapshot if it is there and in step with the database,
+    // otherwise scan every entry
+    bool fSnapshot = LoadBlockIndexSnapshot();
+    if (!fSnapshot && !LoadBlockIndexGuts())
+        return false;
 
     boost::this_thread::interruption_point();
 
-    // Calculate nChainTrust
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
-    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+    // A snapshot that passed its checks but still misses the best chain is
+    // not trusted; the full scan is slower but always current
+    if (fSnapshot && ReadHashBestChain(hashBestChain) && !mapBlockIndex.count(hashBestChain))
     {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
-    }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
-    {
-        CBlockIndex* pindex = item.second;
-        pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
+        LogPrintf("LoadBlockIndex() : hashBestChain not in the snapshot, rescanning\n");
+        UnloadBlockIndex();
+        if (!LoadBlockIndexGuts())
+            return false;
     }
 
     // Load hashBestChain pointer to end of best chain
@@ -401,6 +488,7 @@ bool CTxDB::LoadBlockIndex()
     if (!mapBlockIndex.count(hashBestChain))
         return error("CTxDB::LoadBlockIndex() : hashBestChain not found in the block index");
     pindexBest = mapBlockIndex[hashBestChain];
+    chainActive.SetTip(pindexBest);
     nBestHeight = pindexBest->nHeight;
     nBestChainTrust = pindexBest->nChainTrust;
 
@@ -543,3 +631,342 @@ bool CTxDB::LoadBlockIndex()
 
     return true;
 }
+
+bool CTxDB::LoadBlockIndexGuts()
+{
+    int64_t nStart = GetTimeMillis();
+
+    // The block index is an in-memory structure that maps hashes to on-disk
+    // locations where the contents of the block can be found. Here, we scan it
+    // out of the DB and into mapBlockIndex.
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    // Seek to start key.
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << make_pair(string("blockindex"), uint256(0));
+    iterator->Seek(ssStartKey.str());
+    // Now read each entry.
+    while (iterator->Valid())
+    {
+        boost::this_thread::interruption_point();
+        // Unpack keys and values.
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.write(iterator->key().data(), iterator->key().size());
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue.write(iterator->value().data(), iterator->value().size());
+        string strType;
+        ssKey >> strType;
+        // Did we reach the end of the data to read?
+        if (strType != "blockindex")
+            break;
+        CDiskBlockIndex diskindex;
+        ssValue >> diskindex;
+
+        uint256 blockHash = diskindex.GetBlockHash();
+
+        // Construct block index object
+        CBlockIndex* pindexNew    = InsertBlockIndex(blockHash);
+        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+        pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
+        CopyBlockIndexFields(pindexNew, diskindex);
+
+        if (!pindexNew->CheckIndex()) {
+            delete iterator;
+            return error("LoadBlockIndex() : CheckIndex failed at %d", pindexNew->nHeight);
+        }
+
+        LoadedBlockIndex(pindexNew);
+
+        iterator->Next();
+    }
+    delete iterator;
+
+    boost::this_thread::interruption_point();
+
+    // Calculate nChainTrust
+    vector<pair<int, CBlockIndex*> > vSortedByHeight;
+    vSortedByHeight.reserve(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+    {
+        CBlockIndex* pindex = item.second;
+        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+    }
+    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+    {
+        CBlockIndex* pindex = item.second;
+        pindex->nChainTrust = (pindex->pprev ? pindex->pprev->nChainTrust : 0) + pindex->GetBlockTrust();
+        pindex->BuildSkip();
+    }
+
+    LogPrintf("LoadBlockIndex() : scanned %u block index entries (%dms)\n", mapBlockIndex.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+static const int BLOCKINDEX_SNAPSHOT_VERSION = 2;
+
+static boost::filesystem::path BlockIndexSnapshotPath()
+{
+    return GetDataDir() / "blkindex.snapshot";
+}
+
+/** A block index entry as stored in the snapshot: the fields of its
+    "blockindex" record plus the chain trust, so nothing has to be
+    recomputed when loading. */
+class CBlockIndexSnapshotEntry
+{
+public:
+    uint256 hash;
+    uint256 hashPrev;
+    uint256 hashNext;
+    CBlockIndex index;
+
+    CBlockIndexSnapshotEntry()
+    {
+        hash = 0;
+        hashPrev = 0;
+        hashNext = 0;
+    }
+
+    explicit CBlockIndexSnapshotEntry(const CBlockIndex* pindex) : index(*pindex)
+    {
+        hash = pindex->GetBlockHash();
+        hashPrev = (pindex->pprev ? pindex->pprev->GetBlockHash() : 0);
+        hashNext = (pindex->pnext ? pindex->pnext->GetBlockHash() : 0);
+    }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hash);
+        READWRITE(hashPrev);
+        READWRITE(hashNext);
+        READWRITE(index.nFile);
+        READWRITE(index.nBlockPos);
+        READWRITE(index.nHeight);
+        READWRITE(index.nMint);
+        READWRITE(index.nMoneySupply);
+        READWRITE(index.nFlags);
+        READWRITE(index.nStakeModifier);
+        READWRITE(index.bnStakeModifierV2);
+        READWRITE(index.prevoutStake);
+        READWRITE(index.nStakeTime);
+        READWRITE(index.hashProof);
+        READWRITE(index.nVersion);
+        READWRITE(index.hashMerkleRoot);
+        READWRITE(index.nTime);
+        READWRITE(index.nBits);
+        READWRITE(index.nNonce);
+        READWRITE(index.nChainTrust);
+    )
+};
+
+// Load mapBlockIndex from the snapshot file, then apply the entries that
+// were written to the database after it was made. Fails, leaving
+// mapBlockIndex empty, if there is no snapshot that matches the database.
+bool CTxDB::LoadBlockIndexSnapshot()
+{
+    // Written together with the snapshot; a snapshot with another nonce is
+    // older or newer than the dirty entries in the database
+    uint256 nonceDB;
+    if (!Read(string("blockindexsnapshot"), nonceDB))
+        return false;
+    uint256 hashBestDB = 0;
+    ReadHashBestChain(hashBestDB);
+
+    int64_t nStart = GetTimeMillis();
+    boost::filesystem::path path = BlockIndexSnapshotPath();
+    FILE* file = fopen(path.string().c_str(), "rb");
+    if (!file)
+        return false;
+    vector<char> vch;
+    bool fRead = false;
+    if (fseek(file, 0, SEEK_END) == 0)
+    {
+        long nSize = ftell(file);
+        if (nSize > (long)sizeof(uint256) && fseek(file, 0, SEEK_SET) == 0)
+        {
+            vch.resize(nSize);
+            fRead = (fread(&vch[0], 1, vch.size(), file) == vch.size());
+        }
+    }
+    fclose(file);
+    if (!fRead)
+        return error("LoadBlockIndexSnapshot() : failed to read %s", path.string());
+
+    const char* pend = &vch[0] + vch.size() - sizeof(uint256);
+    uint256 hashChecksum;
+    memcpy(&hashChecksum, pend, sizeof(hashChecksum));
+    if (Hash(vch.begin(), vch.end() - sizeof(uint256)) != hashChecksum)
+        return error("LoadBlockIndexSnapshot() : checksum mismatch in %s", path.string());
+
+    unsigned int nEntries = 0;
+    uint256 nonce = 0;
+    uint256 hashBestSnapshot = 0;
+    try {
+        CSpanReader reader(&vch[0], pend, SER_DISK, CLIENT_VERSION);
+        int nSnapshotVersion;
+        reader >> nSnapshotVersion;
+        if (nSnapshotVersion == BLOCKINDEX_SNAPSHOT_VERSION)
+            reader >> nonce >> hashBestSnapshot >> nEntries;
+        if (nSnapshotVersion != BLOCKINDEX_SNAPSHOT_VERSION || nonce != nonceDB)
+        {
+            LogPrintf("LoadBlockIndexSnapshot() : %s is out of date\n", path.string());
+            return false;
+        }
+        // The snapshot holds the whole index, so the map does not have to
+        // rehash while it is read
+        mapBlockIndex.reserve(nEntries);
+
+        // Entries are sorted by height, so skip pointers can be built as we go
+        for (unsigned int i = 0; i < nEntries; i++)
+        {
+            if ((i & 0xffff) == 0)
+                boost::this_thread::interruption_point();
+            CBlockIndexSnapshotEntry entry;
+            reader >> entry;
+
+            CBlockIndex* pindexNew = InsertBlockIndex(entry.hash);
+            pindexNew->pprev       = InsertBlockIndex(entry.hashPrev);
+            pindexNew->pnext       = InsertBlockIndex(entry.hashNext);
+            CopyBlockIndexFields(pindexNew, entry.index);
+            pindexNew->nChainTrust = entry.index.nChainTrust;
+            pindexNew->BuildSkip();
+            LoadedBlockIndex(pindexNew);
+        }
+    }
+    catch (std::exception &e) {
+        UnloadBlockIndex();
+        return error("LoadBlockIndexSnapshot() : deserialize error in %s", path.string());
+    }
+
+    // Entries changed since the snapshot, in height order
+    vector<pair<int, uint256> > vDirty;
+    bool fBestDirty = false;
+    leveldb::Iterator *iterator = pdb->NewIterator(leveldb::ReadOptions());
+    CDataStream ssStartKey(SER_DISK, CLIENT_VERSION);
+    ssStartKey << string("blockindexdirty");
+    iterator->Seek(ssStartKey.str());
+    while (iterator->Valid())
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.write(iterator->key().data(), iterator->key().size());
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        ssValue.write(iterator->value().data(), iterator->value().size());
+        string strType;
+        ssKey >> strType;
+        if (strType != "blockindexdirty")
+            break;
+        uint256 hash;
+        int nHeight;
+        ssKey >> hash;
+        ssValue >> nHeight;
+        vDirty.push_back(make_pair(nHeight, hash));
+        if (hash == hashBestDB)
+            fBestDirty = true;
+        iterator->Next();
+    }
+    delete iterator;
+    sort(vDirty.begin(), vDirty.end());
+
+    // Every best chain this version connects is written with a dirty entry.
+    // A best chain that is neither the one in the snapshot nor dirty was
+    // connected by a version that does not keep the snapshot, so entries it
+    // changed (pnext links, new blocks) are not in the dirty list either.
+    if (hashBestDB != hashBestSnapshot && !fBestDirty)
+    {
+        UnloadBlockIndex();
+        LogPrintf("LoadBlockIndexSnapshot() : best chain %s is not in %s, rescanning\n", hashBestDB.ToString(), path.string());
+        return false;
+    }
+
+    BOOST_FOREACH(const PAIRTYPE(int, uint256)& item, vDirty)
+    {
+        CDiskBlockIndex diskindex;
+        if (!Read(make_pair(string("blockindex"), item.second), diskindex))
+        {
+            UnloadBlockIndex();
+            LogPrintf("LoadBlockIndexSnapshot() : block index entry %s missing, rescanning\n", item.second.ToString());
+            return false;
+        }
+
+        CBlockIndex* pindexNew    = InsertBlockIndex(item.second);
+        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+        pindexNew->pnext          = InsertBlockIndex(diskindex.hashNext);
+        CopyBlockIndexFields(pindexNew, diskindex);
+        pindexNew->nChainTrust = (pindexNew->pprev ? pindexNew->pprev->nChainTrust : 0) + pindexNew->GetBlockTrust();
+        pindexNew->BuildSkip();
+        LoadedBlockIndex(pindexNew);
+    }
+
+    LogPrintf("LoadBlockIndexSnapshot() : %u entries from snapshot, %u from database (%dms)\n",
+        nEntries, vDirty.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+static bool WriteSnapshotData(FILE* file, CHashWriter& hasher, CDataStream& ss)
+{
+    if (ss.empty())
+        return true;
+    hasher.write(&ss[0], ss.size());
+    bool fOk = (fwrite(&ss[0], 1, ss.size(), file) == ss.size());
+    ss.clear();
+    return fOk;
+}
+
+bool CTxDB::WriteBlockIndexSnapshot()
+{
+    assert(!activeBatch);
+    int64_t nStart = GetTimeMillis();
+
+    vector<pair<int, CBlockIndex*> > vSortedByHeight;
+    vSortedByHeight.reserve(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vSortedByHeight.push_back(make_pair(item.second->nHeight, item.second));
+    sort(vSortedByHeight.begin(), vSortedByHeight.end());
+
+    // Write to a temporary file first, the old snapshot stays usable until
+    // the new one is complete
+    boost::filesystem::path path = BlockIndexSnapshotPath();
+    boost::filesystem::path pathTmp = GetDataDir() / "blkindex.snapshot.new";
+    FILE* file = fopen(pathTmp.string().c_str(), "wb");
+    if (!file)
+        return error("WriteBlockIndexSnapshot() : failed to open %s", pathTmp.string());
+
+    // The best chain is kept so that one connected later by a version
+    // without dirty entries shows up as a mismatch on load
+    uint256 hashBestDB = 0;
+    ReadHashBestChain(hashBestDB);
+    uint256 nonce = GetRandHash();
+    CHashWriter hasher(SER_DISK, CLIENT_VERSION);
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << BLOCKINDEX_SNAPSHOT_VERSION << nonce << hashBestDB << (unsigned int)vSortedByHeight.size();
+    bool fOk = true;
+    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+    {
+        ss << CBlockIndexSnapshotEntry(item.second);
+        if (ss.size() >= (1 << 20) && !(fOk = WriteSnapshotData(file, hasher, ss)))
+            break;
+    }
+    if (fOk)
+        fOk = WriteSnapshotData(file, hasher, ss);
+    if (fOk)
+    {
+        uint256 hashChecksum = hasher.GetHash();
+        fOk = (fwrite(&hashChecksum, sizeof(hashChecksum), 1, file) == 1);
+    }
+    if (fOk)
+        FileCommit(file);
+    fclose(file);
+    if (!fOk || !RenameOver(pathTmp, path))
+    {
+        boost::filesystem::remove(pathTmp);
+        return error("WriteBlockIndexSnapshot() : failed to write %s", path.string());
+    }
+
+    // From here on the snapshot describes the database, apart from the
+    // entries marked dirty after this
+    if (!Write(string("blockindexsnapshot"), nonce) || !ErasePrefix("blockindexdirty"))
+        return error("WriteBlockIndexSnapshot() : failed to update the database");
+
+    LogPrint("db", "WriteBlockIndexSnapshot() : %u entries written (%dms)\n", vSortedByHeight.size(), GetTimeMillis() - nStart);
+    return true;
+}
@@ -7,6 +7,7 @@
 #define BITCOIN_LEVELDB_H
 
 #include "main.h"
+#include "coins.h"
 
 #include <map>
 #include <string>
@@ -15,6 +16,10 @@
 #include <leveldb/db.h>
 #include <leveldb/write_batch.h>
 
+/** How often the block index snapshot is rewritten while running, in seconds.
+    Entries changed since the last snapshot are read from LevelDB at startup. */
+static const int64_t BLOCKINDEX_SNAPSHOT_INTERVAL = 6 * 60 * 60;
+
 // Class that provides access to a LevelDB. Note that this class is frequently
 // instantiated on the stack and then destroyed again, so instantiation has to
 // be very cheap. Unfortunately that means, a CTxDB instance is actually just a
@@ -35,6 +40,7 @@ public:
         // Note that this is not the same as Close() because it deletes only
         // data scoped to this TxDB object.
         delete activeBatch;
+        delete activeCoins;
     }
 
     // Destroys the underlying shared global state accessed by this TxDB.
@@ -46,6 +52,9 @@ private:
     // A batch stores up writes and deletes for atomic application. When this
     // field is non-NULL, writes/deletes go there instead of directly to disk.
     leveldb::WriteBatch *activeBatch;
+    // Changes to the coins database made within the current transaction.
+    // Created on top of pcoinsTip by TxnBegin and merged into it on commit.
+    CCoinsViewCache *activeCoins;
     leveldb::Options options;
     bool fReadOnly;
     int nVersion;
@@ -169,9 +178,18 @@ public:
     {
         delete activeBatch;
         activeBatch = NULL;
+        DropCoinsView();
         return true;
     }
 
+    // Coins view for the current transaction, NULL if -coinsindex is off
+    CCoinsViewCache* GetCoinsView() { return activeCoins; }
+    void DropCoinsView()
+    {
+        delete activeCoins;
+        activeCoins = NULL;
+    }
+
     bool ReadVersion(int& nVersion)
     {
         nVersion = 0;
@@ -197,9 +215,20 @@ public:
     bool WriteHashBestChain(uint256 hashBestChain);
     bool ReadBestInvalidTrust(CBigNum& bnBestInvalidTrust);
     bool WriteBestInvalidTrust(CBigNum bnBestInvalidTrust);
+    bool ReadCoin(const COutPoint& outpoint, CCoin& coin);
+    bool WriteCoins(const CCoinsMap& mapCoins, const uint256& hashBlock);
+    bool ReadCoinsBestBlock(uint256& hashBlock);
+    bool EraseCoinsBestBlock();
+    bool ReadCoinsUndo(const uint256& hashBlock, std::vector<CCoin>& vUndo);
+    bool WriteCoinsUndo(const uint256& hashBlock, const std::vector<CCoin>& vUndo);
+    bool EraseCoinsUndo(const uint256& hashBlock);
+    bool WipeCoins();
     bool LoadBlockIndex();
+    bool WriteBlockIndexSnapshot();
 private:
     bool LoadBlockIndexGuts();
+    bool LoadBlockIndexSnapshot();
+    bool ErasePrefix(const std::string& strPrefix);
 };
 
 
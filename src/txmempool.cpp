@@ -9,8 +9,78 @@
 
 using namespace std;
 
-CTxMemPool::CTxMemPool()
+CTxMemPoolEntry::CTxMemPoolEntry() :
+    nFee(0), nValueIn(0), nValueInChain(0), nTxSize(0), nSigOps(0), nTime(0), nHeight(0), dPriority(0)
 {
+    ResetState();
+}
+
+CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& txIn, int64_t nFeeIn, int64_t nValueInIn, int64_t nValueInChainIn,
+                                 unsigned int nSigOpsIn, int64_t nTimeIn, int nHeightIn, double dPriorityIn) :
+    tx(txIn), nFee(nFeeIn), nValueIn(nValueInIn), nValueInChain(nValueInChainIn), nSigOps(nSigOpsIn),
+    nTime(nTimeIn), nHeight(nHeightIn), dPriority(dPriorityIn)
+{
+    nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+    ResetState();
+}
+
+double CTxMemPoolEntry::GetPriority(int nCurrentHeight) const
+{
+    return dPriority + (double)nValueInChain * (nCurrentHeight - nHeight) / nTxSize;
+}
+
+double CTxMemPoolEntry::GetFeeRate() const
+{
+    return (double)nFee * 1000 / nTxSize;
+}
+
+double CTxMemPoolEntry::GetDescendantScore() const
+{
+    return max(GetFeeRate(), (double)nFeesWithDescendants * 1000 / nSizeWithDescendants);
+}
+
+void CTxMemPoolEntry::UpdateAncestorState(int64_t nSizeDelta, int64_t nFeeDelta, int64_t nCountDelta)
+{
+    nSizeWithAncestors += nSizeDelta;
+    nFeesWithAncestors += nFeeDelta;
+    nCountWithAncestors += nCountDelta;
+}
+
+void CTxMemPoolEntry::UpdateDescendantState(int64_t nSizeDelta, int64_t nFeeDelta, int64_t nCountDelta)
+{
+    nSizeWithDescendants += nSizeDelta;
+    nFeesWithDescendants += nFeeDelta;
+    nCountWithDescendants += nCountDelta;
+}
+
+void CTxMemPoolEntry::ResetState()
+{
+    nCountWithAncestors = nCountWithDescendants = 1;
+    nSizeWithAncestors = nSizeWithDescendants = nTxSize;
+    nFeesWithAncestors = nFeesWithDescendants = nFee;
+}
+
+CTxMemPool::CTxMemPool() :
+    nTransactionsUpdated(0), nTotalTxSize(0), nCachedUsage(0),
+    dRollingMinimumFeeRate(0), nLastRollingFeeUpdate(0), fBlockSinceLastRollingFeeBump(false)
+{
+}
+
+// Approximate heap usage of one pool entry: its mapTx node, the two index
+// nodes, the mapNextTx node for each input and the transaction's own
+// vectors and scripts.
+size_t CTxMemPool::EntryUsage(const CTxMemPoolEntry& entry)
+{
+    const CTransaction& tx = entry.GetTx();
+    size_t nUsage = sizeof(std::map<uint256, CTxMemPoolEntry>::value_type) + 4 * sizeof(void*);
+    nUsage += sizeof(std::pair<double, uint256>) + sizeof(std::pair<int64_t, uint256>) + 8 * sizeof(void*);
+    nUsage += tx.vin.capacity() * sizeof(CTxIn) + tx.vout.capacity() * sizeof(CTxOut);
+    nUsage += tx.vin.size() * (sizeof(std::map<COutPoint, CInPoint>::value_type) + 4 * sizeof(void*));
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        nUsage += txin.scriptSig.capacity();
+    BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        nUsage += txout.scriptPubKey.capacity();
+    return nUsage;
 }
 
 unsigned int CTxMemPool::GetTransactionsUpdated() const
@@ -25,21 +95,192 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
     nTransactionsUpdated += n;
 }
 
-bool CTxMemPool::addUnchecked(const uint256& hash, CTransaction &tx)
+// All transactions in the pool that tx depends on, directly or not
+void CTxMemPool::CalculateAncestors(const CTransaction& tx, set<uint256>& setAncestors) const
+{
+    vector<uint256> vWork;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        vWork.push_back(txin.prevout.hash);
+    while (!vWork.empty())
+    {
+        uint256 hash = vWork.back();
+        vWork.pop_back();
+        map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.find(hash);
+        if (it == mapTx.end() || !setAncestors.insert(hash).second)
+            continue;
+        BOOST_FOREACH(const CTxIn& txin, it->second.GetTx().vin)
+            vWork.push_back(txin.prevout.hash);
+    }
+}
+
+// All transactions in the pool that depend on the one with this hash,
+// directly or not
+void CTxMemPool::CalculateDescendants(const uint256& hash, set<uint256>& setDescendants) const
+{
+    vector<uint256> vWork(1, hash);
+    while (!vWork.empty())
+    {
+        uint256 hashTx = vWork.back();
+        vWork.pop_back();
+        map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.find(hashTx);
+        if (it == mapTx.end())
+            continue;
+        for (unsigned int i = 0; i < it->second.GetTx().vout.size(); i++)
+        {
+            map<COutPoint, CInPoint>::const_iterator itNext = mapNextTx.find(COutPoint(hashTx, i));
+            if (itNext == mapNextTx.end())
+                continue;
+            uint256 hashChild = itNext->second.ptx->GetHash();
+            if (setDescendants.insert(hashChild).second)
+                vWork.push_back(hashChild);
+        }
+    }
+}
+
+// Change the descendant totals of an entry, keeping setByDescendantScore in order
+void CTxMemPool::UpdateDescendantState(map<uint256, CTxMemPoolEntry>::iterator it, int64_t nSizeDelta, int64_t nFeeDelta, int64_t nCountDelta)
+{
+    setByDescendantScore.erase(make_pair(it->second.GetDescendantScore(), it->first));
+    it->second.UpdateDescendantState(nSizeDelta, nFeeDelta, nCountDelta);
+    setByDescendantScore.insert(make_pair(it->second.GetDescendantScore(), it->first));
+}
+
+// Work out the ancestor and descendant totals of these entries from scratch.
+// Only needed when a transaction is added or removed between others that
+// stay in the pool, e.g. when a block is disconnected.
+void CTxMemPool::RecalculateState(const set<uint256>& setEntries)
+{
+    BOOST_FOREACH(const uint256& hash, setEntries)
+    {
+        map<uint256, CTxMemPoolEntry>::iterator it = mapTx.find(hash);
+        if (it == mapTx.end())
+            continue;
+        CTxMemPoolEntry& entry = it->second;
+
+        setByDescendantScore.erase(make_pair(entry.GetDescendantScore(), hash));
+        entry.ResetState();
+
+        set<uint256> setAncestors;
+        CalculateAncestors(entry.GetTx(), setAncestors);
+        BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+        {
+            const CTxMemPoolEntry& ancestor = mapTx[hashAncestor];
+            entry.UpdateAncestorState(ancestor.GetTxSize(), ancestor.GetFee(), 1);
+        }
+
+        set<uint256> setDescendants;
+        CalculateDescendants(hash, setDescendants);
+        BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+        {
+            const CTxMemPoolEntry& descendant = mapTx[hashDescendant];
+            entry.UpdateDescendantState(descendant.GetTxSize(), descendant.GetFee(), 1);
+        }
+        setByDescendantScore.insert(make_pair(entry.GetDescendantScore(), hash));
+    }
+}
+
+bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry)
 {
     // Add to memory pool without checking anything.
     // Used by main.cpp AcceptToMemoryPool(), which DOES do
     // all the appropriate checks.
     LOCK(cs);
     {
-        mapTx[hash] = tx;
+        map<uint256, CTxMemPoolEntry>::iterator it = mapTx.insert(make_pair(hash, entry)).first;
+        const CTransaction& tx = it->second.GetTx();
+        nTotalTxSize += entry.GetTxSize();
+        nCachedUsage += EntryUsage(it->second);
         for (unsigned int i = 0; i < tx.vin.size(); i++)
-            mapNextTx[tx.vin[i].prevout] = CInPoint(&mapTx[hash], i);
+            mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+        setByTime.insert(make_pair(entry.GetTime(), hash));
+
+        set<uint256> setAncestors;
+        CalculateAncestors(tx, setAncestors);
+        set<uint256> setDescendants;
+        CalculateDescendants(hash, setDescendants);
+
+        if (setDescendants.empty())
+        {
+            BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+            {
+                map<uint256, CTxMemPoolEntry>::iterator itAncestor = mapTx.find(hashAncestor);
+                it->second.UpdateAncestorState(itAncestor->second.GetTxSize(), itAncestor->second.GetFee(), 1);
+                UpdateDescendantState(itAncestor, entry.GetTxSize(), entry.GetFee(), 1);
+            }
+            setByDescendantScore.insert(make_pair(it->second.GetDescendantScore(), hash));
+        }
+        else
+        {
+            // Transactions from a disconnected block can have children in
+            // the pool already
+            setByDescendantScore.insert(make_pair(it->second.GetDescendantScore(), hash));
+            set<uint256> setUpdate(setAncestors);
+            setUpdate.insert(setDescendants.begin(), setDescendants.end());
+            setUpdate.insert(hash);
+            RecalculateState(setUpdate);
+        }
         nTransactionsUpdated++;
+        NotifyEntryAdded(hash);
     }
     return true;
 }
 
+// Remove a set of transactions and fix up the totals of what stays. The
+// set has to contain all descendants of its members that are to go.
+void CTxMemPool::RemoveStaged(const set<uint256>& setRemove)
+{
+    set<uint256> setRecalculate;
+    BOOST_FOREACH(const uint256& hash, setRemove)
+    {
+        const CTxMemPoolEntry& entry = mapTx[hash];
+
+        set<uint256> setAncestors;
+        CalculateAncestors(entry.GetTx(), setAncestors);
+        set<uint256> setDescendants;
+        CalculateDescendants(hash, setDescendants);
+
+        bool fAncestorsStay = false, fDescendantsStay = false;
+        BOOST_FOREACH(const uint256& hashAncestor, setAncestors)
+        {
+            if (setRemove.count(hashAncestor))
+                continue;
+            fAncestorsStay = true;
+            UpdateDescendantState(mapTx.find(hashAncestor), -(int64_t)entry.GetTxSize(), -entry.GetFee(), -1);
+        }
+        BOOST_FOREACH(const uint256& hashDescendant, setDescendants)
+        {
+            if (setRemove.count(hashDescendant))
+                continue;
+            fDescendantsStay = true;
+            mapTx[hashDescendant].UpdateAncestorState(-(int64_t)entry.GetTxSize(), -entry.GetFee(), -1);
+        }
+
+        // Taking a transaction out of the middle also separates the ones
+        // above it from the ones below
+        if (fAncestorsStay && fDescendantsStay)
+        {
+            setRecalculate.insert(setAncestors.begin(), setAncestors.end());
+            setRecalculate.insert(setDescendants.begin(), setDescendants.end());
+        }
+    }
+
+    BOOST_FOREACH(const uint256& hash, setRemove)
+    {
+        map<uint256, CTxMemPoolEntry>::iterator it = mapTx.find(hash);
+        BOOST_FOREACH(const CTxIn& txin, it->second.GetTx().vin)
+            mapNextTx.erase(txin.prevout);
+        setByDescendantScore.erase(make_pair(it->second.GetDescendantScore(), hash));
+        setByTime.erase(make_pair(it->second.GetTime(), hash));
+        nTotalTxSize -= it->second.GetTxSize();
+        nCachedUsage -= EntryUsage(it->second);
+        mapTx.erase(it);
+        nTransactionsUpdated++;
+        NotifyEntryRemoved(hash);
+    }
+
+    RecalculateState(setRecalculate);
+}
+
 bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
 {
     // Remove transaction from memory pool
@@ -48,17 +289,11 @@ bool CTxMemPool::remove(const CTransaction &tx, bool fRecursive)
         uint256 hash = tx.GetHash();
         if (mapTx.count(hash))
         {
-            if (fRecursive) {
-                for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
-                    if (it != mapNextTx.end())
-                        remove(*it->second.ptx, true);
-                }
-            }
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-                mapNextTx.erase(txin.prevout);
-            mapTx.erase(hash);
-            nTransactionsUpdated++;
+            set<uint256> setRemove;
+            setRemove.insert(hash);
+            if (fRecursive)
+                CalculateDescendants(hash, setRemove);
+            RemoveStaged(setRemove);
         }
     }
     return true;
@@ -79,11 +314,87 @@ bool CTxMemPool::removeConflicts(const CTransaction &tx)
     return true;
 }
 
+void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx)
+{
+    // Remove transactions a new best block confirmed or conflicts with
+    LOCK(cs);
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+    {
+        remove(tx);
+        removeConflicts(tx);
+    }
+    fBlockSinceLastRollingFeeBump = true;
+}
+
+void CTxMemPool::TrimToSize(size_t nSizeLimit)
+{
+    LOCK(cs);
+
+    unsigned int nEvicted = 0;
+    while (!mapTx.empty() && nCachedUsage > nSizeLimit)
+    {
+        // The worst package by descendant score goes first. Anything paying
+        // less than it did has to wait until the pool drains.
+        std::set<std::pair<double, uint256> >::iterator it = setByDescendantScore.begin();
+        double dRemovedRate = it->first + MIN_RELAY_TX_FEE;
+        if (dRemovedRate > dRollingMinimumFeeRate)
+        {
+            dRollingMinimumFeeRate = dRemovedRate;
+            nLastRollingFeeUpdate = GetTime();
+            fBlockSinceLastRollingFeeBump = false;
+        }
+
+        set<uint256> setRemove;
+        setRemove.insert(it->second);
+        CalculateDescendants(it->second, setRemove);
+        nEvicted += setRemove.size();
+        RemoveStaged(setRemove);
+    }
+
+    if (nEvicted)
+        LogPrint("mempool", "TrimToSize : evicted %u transactions, minimum fee now %d per kB\n",
+                 nEvicted, (int64_t)dRollingMinimumFeeRate);
+}
+
+int64_t CTxMemPool::GetMinFee(size_t nSizeLimit) const
+{
+    LOCK(cs);
+    if (!fBlockSinceLastRollingFeeBump || dRollingMinimumFeeRate == 0)
+        return (int64_t)dRollingMinimumFeeRate;
+
+    int64_t nNow = GetTime();
+    if (nNow > nLastRollingFeeUpdate + 10)
+    {
+        // Decay faster the emptier the pool is
+        double dHalfLife = ROLLING_FEE_HALFLIFE;
+        if (nCachedUsage < nSizeLimit / 4)
+            dHalfLife /= 4;
+        else if (nCachedUsage < nSizeLimit / 2)
+            dHalfLife /= 2;
+
+        dRollingMinimumFeeRate /= pow(2.0, (nNow - nLastRollingFeeUpdate) / dHalfLife);
+        nLastRollingFeeUpdate = nNow;
+
+        if (dRollingMinimumFeeRate < MIN_RELAY_TX_FEE / 2)
+        {
+            dRollingMinimumFeeRate = 0;
+            return 0;
+        }
+    }
+    return max((int64_t)dRollingMinimumFeeRate, MIN_RELAY_TX_FEE);
+}
+
 void CTxMemPool::clear()
 {
     LOCK(cs);
+    for (map<uint256, CTxMemPoolEntry>::iterator it = mapTx.begin(); it != mapTx.end(); ++it)
+        NotifyEntryRemoved(it->first);
     mapTx.clear();
     mapNextTx.clear();
+    setByDescendantScore.clear();
+    setByTime.clear();
+    nTotalTxSize = 0;
+    nCachedUsage = 0;
     ++nTransactionsUpdated;
 }
 
@@ -93,15 +404,15 @@ void CTxMemPool::queryHashes(std::vector<uint256>& vtxid)
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTransaction>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+    for (map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
         vtxid.push_back((*mi).first);
 }
 
 bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
 {
     LOCK(cs);
-    std::map<uint256, CTransaction>::const_iterator i = mapTx.find(hash);
+    std::map<uint256, CTxMemPoolEntry>::const_iterator i = mapTx.find(hash);
     if (i == mapTx.end()) return false;
-    result = i->second;
+    result = i->second.GetTx();
     return true;
 }
@@ -6,8 +6,81 @@
 #define BITCOIN_TXMEMPOOL_H
 
 #include "core.h"
+#include "main.h"
 #include "sync.h"
 
+#include <set>
+
+#include <boost/signals2/signal.hpp>
+
+/** A transaction in the memory pool, together with what block assembly
+ * and the pool itself need to know about it. Fee, size, priority inputs
+ * and sigops are worked out once by AcceptToMemoryPool, which has the
+ * inputs at hand; the ancestor and descendant totals are kept up to date
+ * by CTxMemPool as related transactions come and go.
+ */
+class CTxMemPoolEntry
+{
+private:
+    CTransaction tx;
+    int64_t nFee;           // fee going to the block creator
+    int64_t nValueIn;       // value of all inputs
+    int64_t nValueInChain;  // value of the inputs confirmed in the block chain
+    unsigned int nTxSize;
+    unsigned int nSigOps;   // legacy and P2SH
+    int64_t nTime;          // local time the transaction entered the pool
+    int nHeight;            // best height when it entered the pool
+    double dPriority;       // priority at nHeight
+
+    // The transaction together with its ancestors in the pool
+    uint64_t nCountWithAncestors;
+    uint64_t nSizeWithAncestors;
+    int64_t nFeesWithAncestors;
+
+    // The transaction together with its descendants in the pool
+    uint64_t nCountWithDescendants;
+    uint64_t nSizeWithDescendants;
+    int64_t nFeesWithDescendants;
+
+public:
+    CTxMemPoolEntry();
+    CTxMemPoolEntry(const CTransaction& txIn, int64_t nFeeIn, int64_t nValueInIn, int64_t nValueInChainIn,
+                    unsigned int nSigOpsIn, int64_t nTimeIn, int nHeightIn, double dPriorityIn);
+
+    const CTransaction& GetTx() const { return tx; }
+    int64_t GetFee() const { return nFee; }
+    int64_t GetValueIn() const { return nValueIn; }
+    unsigned int GetTxSize() const { return nTxSize; }
+    unsigned int GetSigOps() const { return nSigOps; }
+    int64_t GetTime() const { return nTime; }
+    int GetHeight() const { return nHeight; }
+
+    // Priority once the best chain is at nCurrentHeight; the confirmed
+    // inputs keep aging while the transaction waits
+    double GetPriority(int nCurrentHeight) const;
+
+    // Fee per 1000 bytes of the transaction alone
+    double GetFeeRate() const;
+
+    // Fee per 1000 bytes of the transaction and its descendants, or of the
+    // transaction alone if that is higher. The transactions with the lowest
+    // score are the least attractive to miners together with what depends
+    // on them.
+    double GetDescendantScore() const;
+
+    uint64_t GetCountWithAncestors() const { return nCountWithAncestors; }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    int64_t GetFeesWithAncestors() const { return nFeesWithAncestors; }
+    uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
+    uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    int64_t GetFeesWithDescendants() const { return nFeesWithDescendants; }
+
+    void UpdateAncestorState(int64_t nSizeDelta, int64_t nFeeDelta, int64_t nCountDelta);
+    void UpdateDescendantState(int64_t nSizeDelta, int64_t nFeeDelta, int64_t nCountDelta);
+    // Forget all ancestors and descendants
+    void ResetState();
+};
+
 /*
  * CTxMemPool stores valid-according-to-the-current-best-chain
  * transactions that may be included in the next block.
@@ -17,22 +90,51 @@
  * are added to the pool: if a new transaction double-spends
  * an input of a transaction in the pool, it is dropped,
  * as are non-standard transactions.
+ *
+ * Besides mapTx the pool keeps two ordered indices of the same
+ * transactions, by descendant score and by the time they entered.
  */
 class CTxMemPool
 {
 private:
     unsigned int nTransactionsUpdated;
+    uint64_t nTotalTxSize;      // serialized size of all transactions
+    size_t nCachedUsage;        // heap usage of mapTx, mapNextTx and the indices
+
+    // Fee per 1000 bytes a transaction needs to get in once the pool has
+    // been full. Raised when something is evicted and decays afterwards,
+    // but only once a block has been found since the last raise.
+    mutable double dRollingMinimumFeeRate;
+    mutable int64_t nLastRollingFeeUpdate;
+    mutable bool fBlockSinceLastRollingFeeBump;
+
+    void CalculateAncestors(const CTransaction& tx, std::set<uint256>& setAncestors) const;
+    void CalculateDescendants(const uint256& hash, std::set<uint256>& setDescendants) const;
+    void UpdateDescendantState(std::map<uint256, CTxMemPoolEntry>::iterator it, int64_t nSizeDelta, int64_t nFeeDelta, int64_t nCountDelta);
+    void RecalculateState(const std::set<uint256>& setEntries);
+    void RemoveStaged(const std::set<uint256>& setRemove);
+    static size_t EntryUsage(const CTxMemPoolEntry& entry);
 
 public:
+    // Half life of the rolling minimum fee, in seconds
+    static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12;
+
     mutable CCriticalSection cs;
-    std::map<uint256, CTransaction> mapTx;
+    std::map<uint256, CTxMemPoolEntry> mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
+    std::set<std::pair<double, uint256> > setByDescendantScore; // lowest score first
+    std::set<std::pair<int64_t, uint256> > setByTime;           // oldest first
+
+    // Called with cs held as transactions enter and leave the pool
+    boost::signals2::signal<void (const uint256& hash)> NotifyEntryAdded;
+    boost::signals2::signal<void (const uint256& hash)> NotifyEntryRemoved;
 
     CTxMemPool();
 
-    bool addUnchecked(const uint256& hash, CTransaction &tx);
+    bool addUnchecked(const uint256& hash, const CTxMemPoolEntry& entry);
     bool remove(const CTransaction &tx, bool fRecursive = false);
     bool removeConflicts(const CTransaction &tx);
+    void removeForBlock(const std::vector<CTransaction>& vtx);
     void clear();
     void queryHashes(std::vector<uint256>& vtxid);
     unsigned int GetTransactionsUpdated() const;
@@ -51,6 +153,26 @@ public:
     }
 
     bool lookup(uint256 hash, CTransaction& result) const;
+
+    uint64_t GetTotalTxSize() const
+    {
+        LOCK(cs);
+        return nTotalTxSize;
+    }
+
+    size_t DynamicMemoryUsage() const
+    {
+        LOCK(cs);
+        return nCachedUsage;
+    }
+
+    // Evict the transactions with the lowest descendant score, together
+    // with their descendants, until the pool uses at most nSizeLimit bytes
+    void TrimToSize(size_t nSizeLimit);
+
+    // The fee per 1000 bytes new transactions have to pay on top of the
+    // usual rules, 0 unless the pool has recently been full
+    int64_t GetMinFee(size_t nSizeLimit) const;
 };
 
 #endif /* BITCOIN_TXMEMPOOL_H */
@@ -0,0 +1,179 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txorphanpool.h"
+#include "util.h"
+
+#include <algorithm>
+
+using namespace std;
+
+CTxOrphanPool::CTxOrphanPool(size_t nMaxSizeIn, size_t nMaxPeerSizeIn) :
+    nTotalSize(0), nMaxSize(nMaxSizeIn), nMaxPeerSize(nMaxPeerSizeIn)
+{
+}
+
+void CTxOrphanPool::EraseTxInner(map<uint256, COrphanTx>::iterator it)
+{
+    const uint256& hash = it->first;
+    const COrphanTx& orphan = it->second;
+    BOOST_FOREACH(const CTxIn& txin, orphan.tx.vin)
+    {
+        map<COutPoint, set<uint256> >::iterator itPrev = mapOrphansByPrev.find(txin.prevout);
+        if (itPrev == mapOrphansByPrev.end())
+            continue;
+        itPrev->second.erase(hash);
+        if (itPrev->second.empty())
+            mapOrphansByPrev.erase(itPrev);
+    }
+
+    setByExpire.erase(make_pair(orphan.nTimeExpire, hash));
+    map<NodeId, set<pair<int64_t, uint256> > >::iterator itPeer = mapByPeer.find(orphan.fromPeer);
+    itPeer->second.erase(make_pair(orphan.nTimeExpire, hash));
+    if (itPeer->second.empty())
+    {
+        mapByPeer.erase(itPeer);
+        mapPeerSize.erase(orphan.fromPeer);
+    }
+    else
+        mapPeerSize[orphan.fromPeer] -= orphan.nTxSize;
+    nTotalSize -= orphan.nTxSize;
+
+    mapOrphans.erase(it);
+}
+
+// Evict peer's oldest orphans until it uses at most nSizeLimit bytes
+unsigned int CTxOrphanPool::EraseOldestForPeer(NodeId peer, size_t nSizeLimit)
+{
+    unsigned int nErased = 0;
+    while (mapByPeer.count(peer) && mapPeerSize[peer] > nSizeLimit)
+    {
+        EraseTxInner(mapOrphans.find(mapByPeer[peer].begin()->second));
+        nErased++;
+    }
+    return nErased;
+}
+
+bool CTxOrphanPool::AddTx(const CTransaction& tx, NodeId peer, int64_t nNow)
+{
+    uint256 hash = tx.GetHash();
+    unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+
+    LOCK(cs);
+    if (mapOrphans.count(hash))
+        return false;
+
+    // Ignore transactions that couldn't be relayed anyway, or that would
+    // take up a peer's whole share. If a peer has a legitimate large
+    // transaction with a missing parent then we assume it will rebroadcast
+    // it later, after the parent transaction(s) have been mined or received.
+    if (nTxSize > MAX_STANDARD_TX_SIZE || nTxSize > nMaxPeerSize || nTxSize > nMaxSize)
+    {
+        LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", nTxSize, hash.ToString());
+        return false;
+    }
+
+    unsigned int nEvicted = EraseExpired(nNow);
+
+    // A peer that sends too many orphans only pushes out its own
+    nEvicted += EraseOldestForPeer(peer, nMaxPeerSize - nTxSize);
+
+    // Then take from whoever is using the most until it fits
+    while (nTotalSize + nTxSize > nMaxSize)
+    {
+        map<NodeId, size_t>::const_iterator itBiggest = mapPeerSize.begin();
+        for (map<NodeId, size_t>::const_iterator mi = mapPeerSize.begin(); mi != mapPeerSize.end(); ++mi)
+            if (mi->second > itBiggest->second)
+                itBiggest = mi;
+        EraseTxInner(mapOrphans.find(mapByPeer[itBiggest->first].begin()->second));
+        nEvicted++;
+    }
+    if (nEvicted > 0)
+        LogPrint("mempool", "orphan pool full, removed %u tx\n", nEvicted);
+
+    COrphanTx& orphan = mapOrphans[hash];
+    orphan.tx = tx;
+    orphan.fromPeer = peer;
+    orphan.nTimeExpire = nNow + ORPHAN_TX_EXPIRE_TIME;
+    orphan.nTxSize = nTxSize;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        mapOrphansByPrev[txin.prevout].insert(hash);
+    setByExpire.insert(make_pair(orphan.nTimeExpire, hash));
+    mapByPeer[peer].insert(make_pair(orphan.nTimeExpire, hash));
+    mapPeerSize[peer] += nTxSize;
+    nTotalSize += nTxSize;
+
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u, %u bytes)\n", hash.ToString(),
+        mapOrphans.size(), nTotalSize);
+    return true;
+}
+
+bool CTxOrphanPool::HaveTx(const uint256& hash) const
+{
+    LOCK(cs);
+    return mapOrphans.count(hash) != 0;
+}
+
+bool CTxOrphanPool::GetTx(const uint256& hash, CTransaction& txRet) const
+{
+    LOCK(cs);
+    map<uint256, COrphanTx>::const_iterator it = mapOrphans.find(hash);
+    if (it == mapOrphans.end())
+        return false;
+    txRet = it->second.tx;
+    return true;
+}
+
+void CTxOrphanPool::EraseTx(const uint256& hash)
+{
+    LOCK(cs);
+    map<uint256, COrphanTx>::iterator it = mapOrphans.find(hash);
+    if (it != mapOrphans.end())
+        EraseTxInner(it);
+}
+
+unsigned int CTxOrphanPool::EraseForPeer(NodeId peer)
+{
+    LOCK(cs);
+    unsigned int nErased = EraseOldestForPeer(peer, 0);
+    if (nErased > 0)
+        LogPrint("mempool", "erased %u orphan tx from peer %d\n", nErased, peer);
+    return nErased;
+}
+
+unsigned int CTxOrphanPool::EraseExpired(int64_t nNow)
+{
+    LOCK(cs);
+    unsigned int nErased = 0;
+    while (!setByExpire.empty() && setByExpire.begin()->first <= nNow)
+    {
+        EraseTxInner(mapOrphans.find(setByExpire.begin()->second));
+        nErased++;
+    }
+    return nErased;
+}
+
+void CTxOrphanPool::GetChildren(const CTransaction& txParent, vector<uint256>& vChildrenRet) const
+{
+    uint256 hash = txParent.GetHash();
+
+    LOCK(cs);
+    for (unsigned int i = 0; i < txParent.vout.size(); i++)
+    {
+        map<COutPoint, set<uint256> >::const_iterator itPrev = mapOrphansByPrev.find(COutPoint(hash, i));
+        if (itPrev == mapOrphansByPrev.end())
+            continue;
+        BOOST_FOREACH(const uint256& hashChild, itPrev->second)
+            if (find(vChildrenRet.begin(), vChildrenRet.end(), hashChild) == vChildrenRet.end())
+                vChildrenRet.push_back(hashChild);
+    }
+}
+
+size_t CTxOrphanPool::GetPeerSize(NodeId peer) const
+{
+    LOCK(cs);
+    map<NodeId, size_t>::const_iterator it = mapPeerSize.find(peer);
+    return it == mapPeerSize.end() ? 0 : it->second;
+}
@@ -0,0 +1,87 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2013 The Bitcoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+#ifndef BITCOIN_TXORPHANPOOL_H
+#define BITCOIN_TXORPHANPOOL_H
+
+#include "core.h"
+#include "main.h"
+#include "net.h"
+#include "sync.h"
+
+#include <map>
+#include <set>
+#include <vector>
+
+/*
+ * CTxOrphanPool holds transactions whose inputs we don't know yet, until
+ * the parent arrives or they are given up on.
+ *
+ * The pool is limited by the serialized size of what it holds, both in
+ * total and per peer that sent it; the peer using the most is the one
+ * that loses an orphan when the total is over. Orphans are forgotten
+ * after a while and when the peer that sent them disconnects.
+ *
+ * Orphans are indexed by each outpoint they spend, so a new transaction
+ * only wakes up the orphans spending one of its outputs.
+ */
+class CTxOrphanPool
+{
+private:
+    struct COrphanTx
+    {
+        CTransaction tx;
+        NodeId fromPeer;
+        int64_t nTimeExpire;
+        unsigned int nTxSize;
+    };
+
+    mutable CCriticalSection cs;
+    std::map<uint256, COrphanTx> mapOrphans;
+    std::map<COutPoint, std::set<uint256> > mapOrphansByPrev;
+    std::set<std::pair<int64_t, uint256> > setByExpire;               // soonest first
+    std::map<NodeId, std::set<std::pair<int64_t, uint256> > > mapByPeer; // oldest first
+    std::map<NodeId, size_t> mapPeerSize;
+    size_t nTotalSize;
+    size_t nMaxSize;
+    size_t nMaxPeerSize;
+
+    void EraseTxInner(std::map<uint256, COrphanTx>::iterator it);
+    unsigned int EraseOldestForPeer(NodeId peer, size_t nSizeLimit);
+
+public:
+    // Seconds an orphan is kept waiting for its parents
+    static const int ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+
+    CTxOrphanPool(size_t nMaxSizeIn, size_t nMaxPeerSizeIn);
+
+    // Add an orphan received from peer, making room by evicting that
+    // peer's oldest and then the biggest user's. Returns false if it is
+    // already there or too big to keep.
+    bool AddTx(const CTransaction& tx, NodeId peer, int64_t nNow);
+    bool HaveTx(const uint256& hash) const;
+    bool GetTx(const uint256& hash, CTransaction& txRet) const;
+    void EraseTx(const uint256& hash);
+    unsigned int EraseForPeer(NodeId peer);
+    unsigned int EraseExpired(int64_t nNow);
+
+    // Orphans that spend one of txParent's outputs
+    void GetChildren(const CTransaction& txParent, std::vector<uint256>& vChildrenRet) const;
+
+    unsigned long size() const
+    {
+        LOCK(cs);
+        return mapOrphans.size();
+    }
+
+    size_t GetTotalSize() const
+    {
+        LOCK(cs);
+        return nTotalSize;
+    }
+
+    size_t GetPeerSize(NodeId peer) const;
+};
+
+#endif /* BITCOIN_TXORPHANPOOL_H */
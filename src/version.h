@@ -30,7 +30,7 @@ static const int DATABASE_VERSION = 70510;
 // network protocol versioning
 //
 
-static const int PROTOCOL_VERSION = 80001;
+static const int PROTOCOL_VERSION = 80002;
 
 // intial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -56,4 +56,7 @@ static const int MEMPOOL_GD_VERSION = 30000;
 static const int CANONICAL_BLOCK_SIG_VERSION = 80000;
 static const int CANONICAL_BLOCK_SIG_LOW_S_VERSION = 80000;
 
+// "cmpctblock", "getblocktxn" and "blocktxn" messages start with this version
+static const int COMPACT_BLOCKS_VERSION = 80002;
+
 #endif
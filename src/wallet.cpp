@@ -24,6 +24,7 @@ using namespace std;
 int64_t nTransactionFee = MIN_TX_FEE;
 int64_t nReserveBalance = 0;
 int64_t nMinimumInputValue = 0;
+int nStakeThreads = DEFAULT_STAKE_THREADS;
 
 static int64_t GetStakeCombineThreshold() { return 10 * COIN; }
 //static int64_t GetStakeCombineThreshold() { return 5000 * COIN; }
@@ -582,6 +583,15 @@ bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pbl
 }
 
 void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock, bool fConnect) {
+    {
+        LOCK(cs_wallet);
+        if (!fConnect)
+            mapStakeKernelInputs.clear();
+        else if (pblock && !mapStakeKernelInputs.empty())
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                mapStakeKernelInputs.erase(txin.prevout);
+    }
+
     if (!fConnect)
     {
         // wallets need to refund inputs when disconnecting coinstake
@@ -1638,6 +1648,121 @@ uint64_t CWallet::GetStakeWeight() const
     return nWeight;
 }
 
+/** Kernel search over a list of stake candidates, split over several
+    threads. Each candidate is tried at up to nTimes timestamps counting back
+    from nTimeStart. The result is the one a search of the candidates in
+    order would find: the first candidate with a kernel, at the latest
+    timestamp that meets the target. */
+class CStakeKernelSearch
+{
+private:
+    CBlockIndex* pindexPrev;
+    unsigned int nBits;
+    unsigned int nTimeStart;
+    unsigned int nTimes;
+    const vector<pair<COutPoint, CStakeKernelInput> >& vCandidates;
+
+    boost::mutex mutex;
+    unsigned int nNext;       // next candidate to hand out
+    unsigned int nFound;      // first candidate with a kernel so far, or vCandidates.size()
+    unsigned int nTimeFound;
+    bool fAbort;              // best block changed, or the search was interrupted
+
+    void Loop(bool fMaster)
+    {
+        while (true)
+        {
+            if (fMaster)
+                boost::this_thread::interruption_point();
+
+            unsigned int i;
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                // Candidates after one that has a kernel need not be tried
+                if (fAbort || nNext >= nFound)
+                    return;
+                i = nNext++;
+            }
+
+            const pair<COutPoint, CStakeKernelInput>& candidate = vCandidates[i];
+            for (unsigned int n = 0; n < nTimes; n++)
+            {
+                if (pindexPrev != pindexBest)
+                {
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    fAbort = true;
+                    return;
+                }
+                if (CheckKernel(pindexPrev, nBits, nTimeStart - n, candidate.first, candidate.second))
+                {
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    if (i < nFound)
+                    {
+                        nFound = i;
+                        nTimeFound = nTimeStart - n;
+                    }
+                    break;
+                }
+            }
+        }
+    }
+
+public:
+    CStakeKernelSearch(CBlockIndex* pindexPrevIn, unsigned int nBitsIn, unsigned int nTimeStartIn, unsigned int nTimesIn,
+                       const vector<pair<COutPoint, CStakeKernelInput> >& vCandidatesIn, unsigned int nStart) :
+        pindexPrev(pindexPrevIn), nBits(nBitsIn), nTimeStart(nTimeStartIn), nTimes(nTimesIn), vCandidates(vCandidatesIn),
+        nNext(nStart), nFound(vCandidatesIn.size()), nTimeFound(0), fAbort(false) {}
+
+    void Thread()
+    {
+        Loop(false);
+    }
+
+    // Search on the calling thread and nThreads-1 helpers. Returns false if
+    // no kernel was found or the best block changed.
+    bool Run(int nThreads, unsigned int& nFoundRet, unsigned int& nTimeFoundRet)
+    {
+        boost::thread_group threadGroup;
+        for (int i = 1; i < nThreads && i < (int)(vCandidates.size() - nNext); i++)
+            threadGroup.create_thread(boost::bind(&CStakeKernelSearch::Thread, this));
+        try {
+            Loop(true);
+        }
+        catch (...) {
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                fAbort = true;
+            }
+            threadGroup.join_all();
+            throw;
+        }
+        threadGroup.join_all();
+
+        if (fAbort || nFound >= vCandidates.size())
+            return false;
+        nFoundRet = nFound;
+        nTimeFoundRet = nTimeFound;
+        return true;
+    }
+};
+
+bool CWallet::GetStakeKernelInput(const COutPoint& prevout, CStakeKernelInput& kernelRet)
+{
+    LOCK(cs_wallet);
+    map<COutPoint, CStakeKernelInput>::iterator mi = mapStakeKernelInputs.find(prevout);
+    if (mi != mapStakeKernelInputs.end() && mi->second.pindexFrom->IsInMainChain())
+    {
+        kernelRet = mi->second;
+        return true;
+    }
+
+    // Not cached until the stake modifier for the coin is known
+    if (!::GetStakeKernelInput(prevout, kernelRet))
+        return false;
+    mapStakeKernelInputs[prevout] = kernelRet;
+    return true;
+}
+
 bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, int64_t nFees, CTransaction& txNew, CKey& key)
 {
     CBlockIndex* pindexPrev = pindexBest;
@@ -1670,81 +1795,89 @@ bool CWallet::CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int
     if (setCoins.empty())
         return false;
 
-    int64_t nCredit = 0;
-    CScript scriptPubKeyKernel;
-    CTxDB txdb("r");
+    // Look up the kernel inputs of the candidates, mostly from the cache
+    vector<pair<const CWalletTx*, unsigned int> > vCoins;
+    vector<pair<COutPoint, CStakeKernelInput> > vCandidates;
     BOOST_FOREACH(PAIRTYPE(const CWalletTx*, unsigned int) pcoin, setCoins)
     {
-        static int nMaxStakeSearchInterval = 60;
-        bool fKernelFound = false;
-        for (unsigned int n=0; n<min(nSearchInterval,(int64_t)nMaxStakeSearchInterval) && !fKernelFound && pindexPrev == pindexBest; n++)
-        {
-            boost::this_thread::interruption_point();
-            // Search backward in time from the given txNew timestamp 
-            // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
-            COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
-            int64_t nBlockTime;
-            if (CheckKernel(pindexPrev, nBits, txNew.nTime - n, prevoutStake, &nBlockTime))
-            {
-                // Found a kernel
-                LogPrint("coinstake", "CreateCoinStake : kernel found\n");
-                vector<valtype> vSolutions;
-                txnouttype whichType;
-                CScript scriptPubKeyOut;
-                scriptPubKeyKernel = pcoin.first->vout[pcoin.second].scriptPubKey;
-                if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
-                {
-                    LogPrint("coinstake", "CreateCoinStake : failed to parse kernel\n");
-                    break;
-                }
-                LogPrint("coinstake", "CreateCoinStake : parsed kernel type=%d\n", whichType);
-                if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
-                {
-                    LogPrint("coinstake", "CreateCoinStake : no support for kernel type=%d\n", whichType);
-                    break;  // only support pay to public key and pay to address
-                }
-                if (whichType == TX_PUBKEYHASH) // pay to address type
-                {
-                    // convert to pay to public key type
-                    if (!keystore.GetKey(uint160(vSolutions[0]), key))
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
-                    scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
-                }
-                if (whichType == TX_PUBKEY)
-                {
-                    valtype& vchPubKey = vSolutions[0];
-                    if (!keystore.GetKey(Hash160(vchPubKey), key))
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
-                        break;  // unable to find corresponding public key
-                    }
+        COutPoint prevoutStake = COutPoint(pcoin.first->GetHash(), pcoin.second);
+        CStakeKernelInput kernel;
+        if (!GetStakeKernelInput(prevoutStake, kernel))
+            continue;
+        vCoins.push_back(pcoin);
+        vCandidates.push_back(make_pair(prevoutStake, kernel));
+    }
 
-                    if (key.GetPubKey() != vchPubKey)
-                    {
-                        LogPrint("coinstake", "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
-                        break; // keys mismatch
-                    }
+    // Search backward in time from the given txNew timestamp
+    // Search nSearchInterval seconds back up to nMaxStakeSearchInterval
+    static int nMaxStakeSearchInterval = 60;
+    int64_t nTimes = min(nSearchInterval, (int64_t)nMaxStakeSearchInterval);
 
-                    scriptPubKeyOut = scriptPubKeyKernel;
-                }
+    int64_t nCredit = 0;
+    CScript scriptPubKeyKernel;
+    unsigned int nStart = 0;
+    while (nTimes > 0 && nCredit == 0 && nStart < vCandidates.size())
+    {
+        CStakeKernelSearch search(pindexPrev, nBits, txNew.nTime, nTimes, vCandidates, nStart);
+        unsigned int nFound, nTimeFound;
+        if (!search.Run(nStakeThreads, nFound, nTimeFound))
+            break;
 
-                txNew.nTime -= n;
-                txNew.vin.push_back(CTxIn(pcoin.first->GetHash(), pcoin.second));
-                nCredit += pcoin.first->vout[pcoin.second].nValue;
-                vwtxPrev.push_back(pcoin.first);
-                txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+        // Found a kernel; if it turns out unusable go on after it
+        nStart = nFound + 1;
+        const CWalletTx* pcoin = vCoins[nFound].first;
+        unsigned int nOut = vCoins[nFound].second;
+        LogPrint("coinstake", "CreateCoinStake : kernel found\n");
+        vector<valtype> vSolutions;
+        txnouttype whichType;
+        CScript scriptPubKeyOut;
+        scriptPubKeyKernel = pcoin->vout[nOut].scriptPubKey;
+        if (!Solver(scriptPubKeyKernel, whichType, vSolutions))
+        {
+            LogPrint("coinstake", "CreateCoinStake : failed to parse kernel\n");
+            continue;
+        }
+        LogPrint("coinstake", "CreateCoinStake : parsed kernel type=%d\n", whichType);
+        if (whichType != TX_PUBKEY && whichType != TX_PUBKEYHASH)
+        {
+            LogPrint("coinstake", "CreateCoinStake : no support for kernel type=%d\n", whichType);
+            continue;  // only support pay to public key and pay to address
+        }
+        if (whichType == TX_PUBKEYHASH) // pay to address type
+        {
+            // convert to pay to public key type
+            if (!keystore.GetKey(uint160(vSolutions[0]), key))
+            {
+                LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                continue;  // unable to find corresponding public key
+            }
+            scriptPubKeyOut << key.GetPubKey() << OP_CHECKSIG;
+        }
+        if (whichType == TX_PUBKEY)
+        {
+            valtype& vchPubKey = vSolutions[0];
+            if (!keystore.GetKey(Hash160(vchPubKey), key))
+            {
+                LogPrint("coinstake", "CreateCoinStake : failed to get key for kernel type=%d\n", whichType);
+                continue;  // unable to find corresponding public key
+            }
 
-                LogPrint("coinstake", "CreateCoinStake : added kernel type=%d\n", whichType);
-                fKernelFound = true;
-                break;
+            if (key.GetPubKey() != vchPubKey)
+            {
+                LogPrint("coinstake", "CreateCoinStake : invalid key for kernel type=%d\n", whichType);
+                continue; // keys mismatch
             }
+
+            scriptPubKeyOut = scriptPubKeyKernel;
         }
 
-        if (fKernelFound)
-            break; // if kernel is found stop searching
+        txNew.nTime = nTimeFound;
+        txNew.vin.push_back(CTxIn(pcoin->GetHash(), nOut));
+        nCredit += pcoin->vout[nOut].nValue;
+        vwtxPrev.push_back(pcoin);
+        txNew.vout.push_back(CTxOut(0, scriptPubKeyOut));
+
+        LogPrint("coinstake", "CreateCoinStake : added kernel type=%d\n", whichType);
     }
 
     if (nCredit == 0 || nCredit > nBalance - nReserveBalance)
@@ -2555,7 +2688,7 @@ void CWallet::GetKeyBirthTimes(std::map<CKeyID, int64_t> &mapKeyBirth) const {
     for (std::map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); it++) {
         // iterate over all wallet transactions...
         const CWalletTx &wtx = (*it).second;
-        std::map<uint256, CBlockIndex*>::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
+        BlockMap::const_iterator blit = mapBlockIndex.find(wtx.hashBlock);
         if (blit != mapBlockIndex.end() && blit->second->IsInMainChain()) {
             // ... which are already in a block
             int nHeight = blit->second->nHeight;
@@ -13,6 +13,7 @@
 #include <stdlib.h>
 
 #include "crypter.h"
+#include "kernel.h"
 #include "main.h"
 #include "key.h"
 #include "keystore.h"
@@ -20,10 +21,16 @@
 #include "ui_interface.h"
 #include "util.h"
 
+/** Maximum number of threads the stake miner searches for a kernel with */
+static const int MAX_STAKE_THREADS = 16;
+/** Default for -stakethreads */
+static const int DEFAULT_STAKE_THREADS = 1;
+
 // Settings
 extern int64_t nTransactionFee;
 extern int64_t nReserveBalance;
 extern int64_t nMinimumInputValue;
+extern int nStakeThreads;
 extern bool fWalletUnlockStakingOnly;
 extern bool fConfChange;
 
@@ -89,6 +96,11 @@ private:
     // the maximum wallet format version: memory-only variable that specifies to what version this wallet may be upgraded
     int nWalletMaxVersion;
 
+    // Kernel inputs of coins the stake miner has looked at, so the kernel
+    // search does not read them from disk again on every pass. Cleared when
+    // a block is disconnected.
+    std::map<COutPoint, CStakeKernelInput> mapStakeKernelInputs;
+
 public:
     /// Main wallet lock.
     /// This lock protects all the fields added by CWallet
@@ -216,6 +228,7 @@ public:
     bool CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey);
 
     uint64_t GetStakeWeight() const;
+    bool GetStakeKernelInput(const COutPoint& prevout, CStakeKernelInput& kernelRet);
     bool CreateCoinStake(const CKeyStore& keystore, unsigned int nBits, int64_t nSearchInterval, int64_t nFees, CTransaction& txNew, CKey& key);
 
     std::string SendMoney(CScript scriptPubKey, int64_t nValue, CWalletTx& wtxNew, bool fAskFee=false);